@@ -27,30 +27,72 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
+#include <time.h>
 #include <assert.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
 #include <arpa/inet.h>
+#include <sys/un.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <errno.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#endif
+#ifdef DNSSEC
+#include <dirent.h>
+#include <openssl/evp.h>
+#include <openssl/bn.h>
+#include <openssl/ecdsa.h>
+#include <openssl/core_names.h>
+#include <openssl/param_build.h>
+#endif
 
 #define UPDATE_INTERVAL 59
 #define LDAP_CONF "/etc/ldap.conf"
 #define OUTPUT_DATA 1
 #define OUTPUT_DB 2
+#define OUTPUT_RAW 4	/* with OUTPUT_DB, zone files in BIND's raw format */
+#define CHECK_REPORT 1
+#define CHECK_BLOCK 2	/* nothing is published while problems are found */
 #define MAXHOSTS 10
 #define DEF_SEARCHTIMEOUT 40
 #define DEF_RECLIMIT LDAP_NO_LIMIT
 #define MAX_DOMAIN_LEN 256
+#define FNV64_INIT 14695981039346656037ULL
+#define POLL_DEFAULT_MAX 3600
+#define MAX_SHARDS 64
+#define SIGN_VALIDITY 30	/* days */
 
-static char tinydns_textfile[256];
-static char tinydns_texttemp[256];
-static LDAP* ldap_con;
-static FILE* namedmaster;
-static FILE* namedzone;
-static FILE* tinyfile;
+/* Per refresh state is thread-local, so tenants (see -T) can run in parallel */
+static __thread char tinydns_textfile[256];
+static __thread char tinydns_texttemp[256];
+static __thread char tinydns_dir[256];
+static __thread LDAP* ldap_con;
+/* Each writer thread renders into its own files, see writer_thread() */
+static __thread FILE* namedmaster;
+static __thread FILE* namedzone;
+static __thread FILE* tinyfile;
+static __thread int render_verbose;
 static FILE* ldifout;
-static time_t time_now;
+static __thread time_t time_now;
+static __thread time_t sign_due;	/* when signatures made by this thread need renewing, with -K */
 static char* const* main_argv;
 static int main_argc;
 
@@ -76,7 +118,7 @@ static void die_ldap(int err)
 }
 
 
-static struct
+struct zonerecord
 {
 	char domainname[64];
 	char zonemaster[64];
@@ -89,14 +131,25 @@ static struct
 	char minimum[12];
 	char ttl[12];
 	char timestamp[20];
-	char location[2];
-} zone;
+	char location[3];
+};
+static __thread struct zonerecord zone;
 
-static struct
+#define LOC_PREFIX 48	/* longest member as written, an IPv6 prefix */
+
+struct locrecord
 {
 	char locname[3];
-	char member[256][16];
-} loc_rec;
+	char (*member)[LOC_PREFIX];
+};
+static __thread struct locrecord loc_rec;
+
+/* A DNSipaddr or DNScipaddr value, parsed once when it is read from LDAP */
+struct ipaddr
+{
+	unsigned char len;	/* 4 or 16, 0 if not set */
+	unsigned char addr[16];
+};
 
 struct resourcerecord
 {
@@ -104,13 +157,13 @@ struct resourcerecord
 	char dnsdomainname[MAX_DOMAIN_LEN];
 	char class[16];
 	char type[16];
-	char ipaddr[256][80];
-	char cipaddr[80];
+	struct ipaddr* ipaddr;
+	struct ipaddr cipaddr;
 	char cname[1024]; /* large enough to store DKIM entries, which by rfc5322 have an upper-limit of 998chars */
 	char ttl[12];
 	char timestamp[20];
 	char preference[12];
-	char location[2];
+	char location[3];
 #if defined DRAFT_RFC
 	char rr[1024];
 	char aliasedobjectname[256];
@@ -122,8 +175,64 @@ struct resourcerecord
 	char txt[256];
 };
 
+/*
+ * Decoded directory contents.  Every refresh cycle first reads LDAP into a
+ * dataset; the tinydns and BIND outputs as well as the built-in responder
+ * are all produced from it afterwards.  Owner and target names are kept as
+ * found in LDAP and only expanded against the zone name on output, so zones
+ * with several DNSzonename aliases are fetched once.
+ */
+struct dnsrecord
+{
+	struct dnsrecord* next;
+	struct dname* domainname;	/* NULL means the zone apex */
+	struct dname* cname;
+	char* txt;
+	char class[16];
+	char type[16];
+	struct ipaddr cipaddr;
+	char ttl[12];
+	char timestamp[20];
+	char preference[12];
+	char location[3];
+	int srvpriority;
+	int srvweight;
+	int srvport;
+	int ipaddresses;
+	struct ipaddr* ipaddr;	/* NULL without addresses */
+	char* dn;		/* kept with --check or -L only */
+};
+
+struct dnszone
+{
+	struct dnszone* next;
+	char* dn;
+	int zonenames;
+	char (*zonename)[64];
+	int shard;		/* value of the -S attribute, -1 if none */
+	struct zonerecord soa;
+	struct dnsrecord* records;
+	unsigned long long hash;	/* of the records as stored in a snapshot, 0 if unknown */
+	struct dnsrecord* synthesized;	/* PTRs made by -r, never stored or fed */
+	char ptrserial[12];	/* serial raised for them, empty if soa.serial stands */
+};
 
-static struct
+struct dnsloccode
+{
+	struct dnsloccode* next;
+	char* dn;		/* of the first entry of the location, NULL if loaded from a snapshot */
+	int members;
+	struct locrecord loc;
+};
+
+struct dataset
+{
+	struct dnsloccode* loccodes;
+	struct dnszone* zones;
+};
+
+
+struct config
 {
 	char searchbase[128];
 	char binddn[128];
@@ -140,10 +249,34 @@ static struct
 	int verbose;
 	char ldifname[128];
 	char exec_command[128];
+	char zone_command[128];
+	char listen[128];
+	char snapshot[128];
+	int pipeline;
+	char catalog[64];
+	char deltadir[128];
 	int use_tls[MAXHOSTS];
 	struct timeval searchtimeout;
 	int reclimit;
-} options;
+	char tenants[128];
+	char directory[128];
+	unsigned int poll_min;
+	unsigned int poll_max;
+	char control[108];
+	int shards;
+	char shard_attr[64];
+	char zone_include[512];
+	char zone_exclude[512];
+	char zone_predicate[256];
+	int normalize;
+	int reverse;
+	int check;
+	char leader[128];
+	char follow[128];
+	char signkeys[128];
+	unsigned int sign_validity;	/* seconds */
+};
+static __thread struct config options;
 
 
 static void die_exit(const char* message)
@@ -156,16 +289,257 @@ static void die_exit(const char* message)
 }
 
 
-static void set_datadir(void)
+static void* xcalloc(size_t nmemb, size_t size)
 {
-	char* ev = getenv("TINYDNSDIR");
-	if (!ev)
-		ev = getenv("LDAP2DNS_TINYDNSDIR");
+	void* p = calloc(nmemb, size);
+	if (!p && nmemb && size)
+		die_exit(NULL);
+	return p;
+}
+
+
+static char* xstrdup(const char* s)
+{
+	char* p = strdup(s);
+	if (!p)
+		die_exit(NULL);
+	return p;
+}
+
+
+/*
+ * An LDAP operation of a refresh failed.  A one-shot run exits; a daemon
+ * reports it and the refresh is abandoned, keeping what was published
+ * before, until the connection is made again for the next attempt.  The
+ * first error is kept in ldap_error meanwhile.
+ */
+static __thread int ldap_error;
+
+static void ldap_failed(int err)
+{
+	if (!options.is_daemon)
+		die_ldap(err);
+	fprintf(stderr, "[**] Warning: LDAP error: %s\n", ldap_err2string(err));
+	if (ldap_error==LDAP_SUCCESS)
+		ldap_error = err;
+}
+
+
+/*
+ * Threads working for a refresh inherit the configuration and the LDAP
+ * connection of the thread starting them, see the thread-local globals.
+ */
+struct threadstart
+{
+	void* (*start)(void*);
+	void* arg;
+	const struct config* options;
+	LDAP* ldap_con;
+	struct syncgroup* syncgroup;
+};
+
+static __thread struct syncgroup* syncgroup;
+static struct syncgroup* current_syncgroup(void);
+
+
+static void* thread_main(void* arg)
+{
+	struct threadstart ts = *(struct threadstart*)arg;
+
+	free(arg);
+	options = *ts.options;
+	ldap_con = ts.ldap_con;
+	syncgroup = ts.syncgroup;
+	return ts.start(ts.arg);
+}
+
+
+/* pthread_create() for threads which render, fetch or answer on our behalf */
+static int start_thread(pthread_t* thread, void* (*start)(void*), void* arg)
+{
+	struct threadstart* ts = xcalloc(1, sizeof(struct threadstart));
+	int err;
+
+	ts->start = start;
+	ts->arg = arg;
+	ts->options = &options;
+	ts->ldap_con = ldap_con;
+	ts->syncgroup = current_syncgroup();
+	if ((err = pthread_create(thread, NULL, thread_main, ts))!=0)
+		free(ts);
+	return err;
+}
+
+
+static unsigned long long fnv64(unsigned long long h, const void* data, size_t len)
+{
+	const unsigned char* p = data;
+
+	while (len--) {
+		h ^= *p++;
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+
+/*
+ * Name table.  The owner and target names of decoded records are interned:
+ * a name is its first label plus a pointer to the interned rest, so a
+ * suffix such as the zone name is stored once for all names below it, and
+ * equal names are the same object, to be compared by pointer and hashed by
+ * id.  Names are kept exactly as found in LDAP, relative or absolute (with a
+ * trailing dot), and only turned into text when a record is written.
+ * Every name counts its users and is dropped together with the last one.
+ */
+struct dname
+{
+	struct dname* hnext;
+	struct dname* parent;	/* NULL after the last label */
+	unsigned int id;
+	unsigned int hash;
+	unsigned int refs;
+	int absolute;
+	char label[1];
+};
+
+static struct
+{
+	pthread_mutex_t lock;
+	struct dname** buckets;
+	unsigned int nbuckets;
+	unsigned int count;
+	unsigned int nextid;
+} names = { PTHREAD_MUTEX_INITIALIZER };
+
+
+static unsigned int dname_hash(const struct dname* parent, const char* label, int len, int absolute)
+{
+	unsigned long long h = FNV64_INIT;
+	unsigned int id = parent ? parent->id : absolute;
+
+	h = fnv64(h, &id, sizeof(id));
+	return fnv64(h, label, len);
+}
+
+
+static void dname_grow(void)
+{
+	unsigned int nbuckets = names.nbuckets ? names.nbuckets*2 : 1024;
+	struct dname** buckets = xcalloc(nbuckets, sizeof(struct dname*));
+	struct dname* n;
+	unsigned int i;
+
+	for (i = 0; i<names.nbuckets; i++) {
+		while ( (n = names.buckets[i]) ) {
+			names.buckets[i] = n->hnext;
+			n->hnext = buckets[n->hash % nbuckets];
+			buckets[n->hash % nbuckets] = n;
+		}
+	}
+	free(names.buckets);
+	names.buckets = buckets;
+	names.nbuckets = nbuckets;
+}
+
+
+/* The interned name for text, held once for the caller; NULL stays NULL */
+static struct dname* dname_intern(const char* text)
+{
+	struct dname* parent = NULL;
+	struct dname* n;
+	const char* label;
+	const char* end;
+	unsigned int hash;
+	int absolute;
+	int len;
+
+	if (!text)
+		return NULL;
+	len = strlen(text);
+	absolute = len>0 && text[len-1]=='.';
+	end = text+len-absolute;
+	pthread_mutex_lock(&names.lock);
+	if (names.count>=names.nbuckets)
+		dname_grow();
+	/* from the last label to the first, so every label finds its parent */
+	do {
+		for (label = end; label>text && label[-1]!='.'; label--);
+		len = end-label;
+		hash = dname_hash(parent, label, len, absolute);
+		for (n = names.buckets[hash % names.nbuckets]; n; n = n->hnext)
+			if (n->hash==hash && n->parent==parent && n->absolute==absolute && !strncmp(n->label, label, len) && !n->label[len])
+				break;
+		if (n) {
+			/* it already holds its parent */
+			n->refs++;
+			if (parent)
+				parent->refs--;
+		} else {
+			if ( !(n = malloc(sizeof(struct dname)+len)) )
+				die_exit(NULL);
+			memcpy(n->label, label, len);
+			n->label[len] = '\0';
+			n->parent = parent;
+			n->absolute = absolute;
+			n->hash = hash;
+			n->id = ++names.nextid;
+			n->refs = 1;
+			n->hnext = names.buckets[hash % names.nbuckets];
+			names.buckets[hash % names.nbuckets] = n;
+			names.count++;
+		}
+		parent = n;
+		end = label-1;
+	} while (label>text);
+	pthread_mutex_unlock(&names.lock);
+	return n;
+}
+
+
+static void dname_release(struct dname* n)
+{
+	struct dname** p;
+	struct dname* parent;
+
+	pthread_mutex_lock(&names.lock);
+	for (; n && --n->refs==0; n = parent) {
+		for (p = &names.buckets[n->hash % names.nbuckets]; *p!=n; p = &(*p)->hnext);
+		*p = n->hnext;
+		parent = n->parent;
+		free(n);
+		names.count--;
+	}
+	pthread_mutex_unlock(&names.lock);
+}
+
+
+/* Put the text of name n together in buf, NULL for no name */
+static const char* dname_text(char* buf, size_t size, const struct dname* n)
+{
+	size_t len = 0;
+
+	if (!n)
+		return NULL;
+	buf[0] = '\0';
+	for (; n && len<size; n = n->parent)
+		len += snprintf(buf+len, size-len, "%s%s", n->label, n->parent ? "." : n->absolute ? "." : "");
+	return buf;
+}
+
+
+/* Locate the tinydns data file in dir, or in $TINYDNSDIR if dir is NULL */
+static void set_datadir(const char* dir)
+{
+	const char* ev = dir;
 	int len;
 
+	if (!ev && !(ev = getenv("TINYDNSDIR")))
+		ev = getenv("LDAP2DNS_TINYDNSDIR");
+
 	tinydns_textfile[0] = '\0';
 	tinydns_texttemp[0] = '\0';
-	if (ev && (len = strlen(ev))<240) {
+	if (ev && (len = strlen(ev))>0 && len<240) {
 		strncpy(tinydns_textfile, ev, 240);
 		strncpy(tinydns_texttemp, ev, 240);
 		if (ev[len-1]!='/') {
@@ -173,17 +547,57 @@ static void set_datadir(void)
 			tinydns_texttemp[len] = '/';
 		}
 	}
+	strcpy(tinydns_dir, tinydns_textfile[0] ? tinydns_textfile : ".");
 	strcat(tinydns_textfile, "data");
 	strcat(tinydns_texttemp, "data.temp");
 }
 
 
+/* Path of file name in the directory of tinydns shard i, see -S */
+static const char* shard_file(char* buf, size_t size, int i, const char* name)
+{
+	int len = strlen(tinydns_dir);
+
+	snprintf(buf, size, "%s%sshard%d/%s", tinydns_dir, len && tinydns_dir[len-1]=='/' ? "" : "/", i, name);
+	return buf;
+}
+
+
+static __thread unsigned char shard_changed[MAX_SHARDS];
+static int publish_shards(void);
+
+
+/* Move the finished data.temp over data, 0 if it could not be */
+static int publish_tinydns(void)
+{
+	int fd;
+
+	if (options.shards)
+		return publish_shards();
+	if (rename(tinydns_texttemp, tinydns_textfile)==-1) {
+		fprintf(stderr, "[**] Unable to move %s to %s\n", tinydns_texttemp, tinydns_textfile);
+		unlink(tinydns_texttemp);
+		return 0;
+	}
+	if ((fd = open(tinydns_dir, O_RDONLY))>=0) {
+		fsync(fd);
+		close(fd);
+	}
+	return 1;
+}
+
+
 static void print_usage(void)
 {
 	print_version();
 	printf("usage: ldap2dns[d] [-df] [-o tinydns|bind] [-h host] [-p port] [-H hostURI] \\\n");
 	printf("\t\t[-D binddn] [-w password] [-L[filename]] [-u numsecs] \\\n");
-	printf("\t\t[-b searchbase] [-v[v]] [-V] [-t timeout] [-M maxrecords]\n");
+	printf("\t\t[-b searchbase] [-v[v]] [-V] [-t timeout] [-M maxrecords] \\\n");
+	printf("\t\t[-l address[:port]] [-s snapshotfile] [-P depth] [-C catalogzone] \\\n");
+	printf("\t\t[-X deltadir] [-T tenantsfile] [-z min[:max]] [-c controlsocket] \\\n");
+	printf("\t\t[-S shards[:attribute]] [-I globs] [-x globs] [-F filter] [-N] [-r] \\\n");
+	printf("\t\t[-k[report|block]] [-R address] [-g address[,address...]] \\\n");
+	printf("\t\t[-K keydir[:days]]\n");
 	printf("\n");
 	printf(" *\tldap2dns formats DNS information from an LDAP server for tinydns or BIND\n");
 	printf(" *\tldap2dnsd runs backgrounded refreshing the data on regular intervals\n");
@@ -194,14 +608,38 @@ static void print_usage(void)
 	printf("  -b\t\tSearch base to use instead of default\n");
 	printf("  -o tinydns\tGenerate a tinydns compatible \"data\" file\n");
 	printf("  -o bind\t\tGenerate a BIND compatible zone files\n");
+	printf("  -o bind-raw\tGenerate BIND zone files in the raw format, which named loads without parsing\n");
+	printf("  -o tinydns,bind\tGenerate both, each on its own writer thread\n");
+	printf("  -S n[:attr]\tWith -o tinydns, split the data file into n shard<i> directories by\n");
+	printf("\t\tzone DN hash, or by the value of attribute attr of the zone\n");
+	printf("  -I glob,...\tOnly fetch zones with a DNSzonename matching one of the globs\n");
+	printf("  -x glob,...\tDo not fetch zones with a DNSzonename matching one of the globs\n");
+	printf("  -F filter\tOnly fetch zones also matching the LDAP filter, e.g. (DNSlocation=ex)\n");
+	printf("  -N\t\tSort records into DNSSEC canonical order and drop duplicates\n");
+	printf("  -r\t\tAdd a PTR to the reverse zones for every A and AAAA address without one\n");
+	printf("  -k[block]\tCheck CNAME, NS, MX, SRV and PTR consistency and report problems,\n");
+	printf("\t\twith block also publish nothing while any are found\n");
+	printf("  -K dir[:days]\tWith -o bind, DNSSEC sign the zones with the keys in dir; signatures are\n");
+	printf("\t\tvalid for days (default %d) and only redone for changed RRsets or near expiry\n", SIGN_VALIDITY);
+	printf("  -C zone\tWith -o bind, also write an RFC 9432 catalog zone listing all zones\n");
+	printf("  -X dir\t\tWrite nsupdate batches and IXFR style diffs of changed zones to dir\n");
 	printf("  -L [filename]\tPrint output in LDIF format for reimport\n");
 	printf("  -h host\tHostname of LDAP server, defaults to localhost\n");
 	printf("  -p port\tPort number to connect to LDAP server, defaults to %d\n", LDAP_PORT);
 	printf("  -H hostURI\tURI (ldap://hostname or ldaps://hostname of LDAP server\n");
 	printf("  -u numsecs\tUpdate DNS data after numsecs. Defaults to %d. Daemon mode only\n", UPDATE_INTERVAL);
 	printf("  -e \"exec-cmd\"\tCommand to execute after data is generated\n");
+	printf("  -E \"zone-cmd\"\tCommand to execute for each added or changed zone, %%zone%% is replaced\n");
 	printf("  -d\t\tRun as a daemon (same as if invoked as ldap2dnsd)\n");
 	printf("  -f\t\tIf running as a daemon stay in the foreground (do not fork)\n");
+	printf("  -l addr[:port]\tDaemon mode only: answer DNS queries on addr (UDP and TCP)\n");
+	printf("  -P depth\tPipeline LDAP reads with decoding, keeping depth record searches in flight\n");
+	printf("  -z min[:max]\tDaemon mode only: also poll each zone's DNSserial every min to max seconds\n");
+	printf("  -c path\tDaemon mode only: accept \"refresh\", \"refresh zone name\" and \"stats\" on a unix socket\n");
+	printf("  -R address\tDaemon mode only: serve the decoded data to followers on host:port or a unix socket\n");
+	printf("  -g address,...\tFetch the decoded data from the first leader that answers instead of LDAP\n");
+	printf("  -T file\tRefresh every \"searchbase directory [output]\" line of file in parallel\n");
+	printf("  -s file\tKeep a snapshot of the last generated data in file for fast restarts\n");
 	printf("  -v\t\trun in verbose mode, repeat for more verbosity\n");
 	printf("  -V\t\tprint version and exit\n");
 	printf("\n");
@@ -247,6 +685,151 @@ static void parse_hosts(char* buf)
         }
 }
 
+/* Output formats may be combined as a comma separated list, e.g. "tinydns,bind" */
+static unsigned int parse_output(const char* list)
+{
+	char buf[128];
+	char* name;
+	char* save;
+	unsigned int output = 0;
+
+	strncpy(buf, list, sizeof(buf));
+	buf[ sizeof(buf) -1 ] = '\0';
+	for (name = strtok_r(buf, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+		if (strcmp(name, "tinydns")==0)
+			output |= OUTPUT_DATA;
+		else if (strcmp(name, "bind")==0)
+			output |= OUTPUT_DB;
+		else if (strcmp(name, "bind-raw")==0)
+			output |= OUTPUT_DB|OUTPUT_RAW;
+		else if (strcmp(name, "data")==0)
+			// Backward compatibility
+			output |= OUTPUT_DATA;
+		else if (strcmp(name, "db")==0)
+			// Backward compatibility
+			output |= OUTPUT_DB;
+	}
+	return output;
+}
+
+/* -z min[:max], seconds between checks of a single zone */
+static void parse_poll(const char* arg)
+{
+	options.poll_max = POLL_DEFAULT_MAX;
+	if (sscanf(arg, "%u:%u", &options.poll_min, &options.poll_max)<1)
+		options.poll_min = 0;
+	if (options.poll_max<options.poll_min)
+		options.poll_max = options.poll_min;
+}
+
+/*
+ * Zone filters.  -I and -x take comma separated DNSzonename globs, which
+ * become substring assertions of the DNSzone search filter (RFC 4515), -F
+ * adds an arbitrary filter such as (DNSlocation=ex).  The directory then
+ * only returns the zones wanted here.
+ */
+static void add_zone_globs(char* list, size_t size, const char* globs, int exclude)
+{
+	char assertion[512];
+	size_t len;
+	const char* p;
+	const char* start;
+
+	for (p = globs; *p; ) {
+		start = p;
+		len = snprintf(assertion, sizeof(assertion), "%s(DNSzonename=", exclude ? "(!" : "");
+		for (; *p && *p!=','; p++) {
+			if (len>sizeof(assertion)-8)
+				break;
+			/* '*' stays a wildcard, the other special characters are escaped */
+			if (*p=='(' || *p==')' || *p=='\\')
+				len += sprintf(assertion+len, "\\%02x", (unsigned char)*p);
+			else if (!isspace((unsigned char)*p))
+				assertion[len++] = *p;
+		}
+		if (*p && *p!=',') {
+			/* the rest of the glob must not become a glob of its own */
+			fprintf(stderr, "[**] Warning: zone glob too long, ignoring %.*s\n", (int)strcspn(start, ","), start);
+			p += strcspn(p, ",");
+		} else {
+			snprintf(assertion+len, sizeof(assertion)-len, exclude ? "))" : ")");
+			if (strlen(list)+strlen(assertion)<size)
+				strcat(list, assertion);
+			else
+				fprintf(stderr, "[**] Warning: too many zone globs, ignoring %s\n", assertion);
+		}
+		while (*p==',')
+			p++;
+	}
+}
+
+static void set_zone_predicate(const char* filter)
+{
+	int depth = 0;
+	const char* p;
+
+	for (p = filter; *p && depth>=0; p++)
+		depth += *p=='(' ? 1 : *p==')' ? -1 : 0;
+	if (filter[0]!='(' || depth!=0) {
+		fprintf(stderr, "[!!]\tThe filter %s must be a parenthesized LDAP filter\n", filter);
+		exit(1);
+	}
+	strncpy(options.zone_predicate, filter, sizeof(options.zone_predicate));
+	options.zone_predicate[ sizeof(options.zone_predicate) -1 ] = '\0';
+}
+
+/* The filter for DNSzone entries, narrowed by -I, -x and -F */
+static const char* zone_filter(char* buf, size_t size)
+{
+	if (!options.zone_include[0] && !options.zone_exclude[0] && !options.zone_predicate[0])
+		return "objectclass=DNSzone";
+	snprintf(buf, size, "(&(objectclass=DNSzone)%s%s%s%s%s)",
+		options.zone_include[0] ? "(|" : "", options.zone_include, options.zone_include[0] ? ")" : "",
+		options.zone_exclude, options.zone_predicate);
+	return buf;
+}
+
+/* --check or --check=report only reports problems, --check=block also withholds the outputs */
+static int parse_check(const char* arg)
+{
+	if (!arg || !arg[0] || strcmp(arg, "report")==0)
+		return CHECK_REPORT;
+	if (strcmp(arg, "block")==0)
+		return CHECK_BLOCK;
+	fprintf(stderr, "[**] Warning: unknown check mode %s, only reporting problems\n", arg);
+	return CHECK_REPORT;
+}
+
+
+/* -S count[:attribute], tinydns output split into count shards */
+static void parse_shards(const char* arg)
+{
+	options.shard_attr[0] = '\0';
+	if (sscanf(arg, "%d:%63s", &options.shards, options.shard_attr)<1 || options.shards<=1)
+		options.shards = 0;
+	if (options.shards>MAX_SHARDS)
+		options.shards = MAX_SHARDS;
+}
+
+
+/* -K dir[:days], the key directory and how long signatures are valid */
+static void parse_sign(const char* arg)
+{
+	const char* days = strrchr(arg, ':');
+	size_t len = strlen(arg);
+
+	options.sign_validity = SIGN_VALIDITY*86400;
+	if (days && days[1] && strspn(days+1, "0123456789")==strlen(days+1)) {
+		len = days-arg;
+		if (atoi(days+1)>0)
+			options.sign_validity = atoi(days+1)*86400;
+	}
+	if (len>=sizeof(options.signkeys))
+		len = sizeof(options.signkeys)-1;
+	memcpy(options.signkeys, arg, len);
+	options.signkeys[len] = '\0';
+}
+
 static int parse_options()
 {
 	extern char* optarg;
@@ -282,6 +865,29 @@ static int parse_options()
 	options.verbose = 0;
 	options.ldifname[0] = '\0';
 	strcpy(options.exec_command, "");
+	strcpy(options.zone_command, "");
+	strcpy(options.listen, "");
+	strcpy(options.snapshot, "");
+	options.pipeline = 0;
+	strcpy(options.catalog, "");
+	strcpy(options.deltadir, "");
+	strcpy(options.tenants, "");
+	strcpy(options.directory, "");
+	options.poll_min = 0;
+	options.poll_max = POLL_DEFAULT_MAX;
+	strcpy(options.control, "");
+	options.shards = 0;
+	strcpy(options.shard_attr, "");
+	strcpy(options.zone_include, "");
+	strcpy(options.zone_exclude, "");
+	strcpy(options.zone_predicate, "");
+	options.normalize = 0;
+	options.reverse = 0;
+	options.check = 0;
+	strcpy(options.leader, "");
+	strcpy(options.follow, "");
+	strcpy(options.signkeys, "");
+	options.sign_validity = SIGN_VALIDITY*86400;
 
 	/* Attempt to parse the ldap.conf for system-wide valuse */
 	if (ldap_conf = fopen(LDAP_CONF, "r")) {
@@ -360,18 +966,8 @@ static int parse_options()
 	if (ev && sscanf(ev, "%d", &options.reclimit) != 1)
 		options.reclimit = DEF_RECLIMIT;
 	ev = getenv("LDAP2DNS_OUTPUT");
-	if (ev) {
-		if (strcmp(ev, "bind")==0)
-			options.output = OUTPUT_DB;
-		else if (strcmp(ev, "tinydns")==0)
-			options.output = OUTPUT_DATA;
-		else if (strcmp(ev, "db")==0)
-			// Backward compatibility
-			options.output = OUTPUT_DB;
-		else if (strcmp(ev, "data")==0)
-			// Backward compatibility
-			options.output = OUTPUT_DATA;
-	}
+	if (ev)
+		options.output = parse_output(ev);
 	ev = getenv("LDAP2DNS_VERBOSE");
 	if (ev && sscanf(ev, "%hd", (short *)&options.verbose) != 1)
 		options.verbose = 0;
@@ -380,6 +976,79 @@ static int parse_options()
 		strncpy(options.exec_command, ev, sizeof(options.exec_command));
 		options.exec_command[ sizeof( options.exec_command ) -1 ] = '\0';
 	}
+	ev = getenv("LDAP2DNS_ZONE_EXEC");
+	if (ev) {
+		strncpy(options.zone_command, ev, sizeof(options.zone_command));
+		options.zone_command[ sizeof( options.zone_command ) -1 ] = '\0';
+	}
+	ev = getenv("LDAP2DNS_LISTEN");
+	if (ev) {
+		strncpy(options.listen, ev, sizeof(options.listen));
+		options.listen[ sizeof( options.listen ) -1 ] = '\0';
+	}
+	ev = getenv("LDAP2DNS_CATALOG");
+	if (ev) {
+		strncpy(options.catalog, ev, sizeof(options.catalog));
+		options.catalog[ sizeof( options.catalog ) -1 ] = '\0';
+	}
+	ev = getenv("LDAP2DNS_DELTADIR");
+	if (ev) {
+		strncpy(options.deltadir, ev, sizeof(options.deltadir));
+		options.deltadir[ sizeof( options.deltadir ) -1 ] = '\0';
+	}
+	ev = getenv("LDAP2DNS_INCLUDE");
+	if (ev)
+		add_zone_globs(options.zone_include, sizeof(options.zone_include), ev, 0);
+	ev = getenv("LDAP2DNS_EXCLUDE");
+	if (ev)
+		add_zone_globs(options.zone_exclude, sizeof(options.zone_exclude), ev, 1);
+	ev = getenv("LDAP2DNS_FILTER");
+	if (ev)
+		set_zone_predicate(ev);
+	if (getenv("LDAP2DNS_NORMALIZE") != NULL)
+		options.normalize = 1;
+	if (getenv("LDAP2DNS_REVERSE") != NULL)
+		options.reverse = 1;
+	ev = getenv("LDAP2DNS_CHECK");
+	if (ev)
+		options.check = parse_check(ev);
+	ev = getenv("LDAP2DNS_LEADER");
+	if (ev) {
+		strncpy(options.leader, ev, sizeof(options.leader));
+		options.leader[ sizeof( options.leader ) -1 ] = '\0';
+	}
+	ev = getenv("LDAP2DNS_FOLLOW");
+	if (ev) {
+		strncpy(options.follow, ev, sizeof(options.follow));
+		options.follow[ sizeof( options.follow ) -1 ] = '\0';
+	}
+	ev = getenv("LDAP2DNS_SIGN");
+	if (ev)
+		parse_sign(ev);
+	ev = getenv("LDAP2DNS_SHARDS");
+	if (ev)
+		parse_shards(ev);
+	ev = getenv("LDAP2DNS_CONTROL");
+	if (ev) {
+		strncpy(options.control, ev, sizeof(options.control));
+		options.control[ sizeof( options.control ) -1 ] = '\0';
+	}
+	ev = getenv("LDAP2DNS_ZONE_POLL");
+	if (ev)
+		parse_poll(ev);
+	ev = getenv("LDAP2DNS_TENANTS");
+	if (ev) {
+		strncpy(options.tenants, ev, sizeof(options.tenants));
+		options.tenants[ sizeof( options.tenants ) -1 ] = '\0';
+	}
+	ev = getenv("LDAP2DNS_PIPELINE");
+	if (ev && sscanf(ev, "%d", &options.pipeline) != 1)
+		options.pipeline = 0;
+	ev = getenv("LDAP2DNS_SNAPSHOT");
+	if (ev) {
+		strncpy(options.snapshot, ev, sizeof(options.snapshot));
+		options.snapshot[ sizeof( options.snapshot ) -1 ] = '\0';
+	}
 	
 	/* Finally, parse command-line options */
 	while (1) {
@@ -398,16 +1067,35 @@ static int parse_options()
 			{"uri", 1, 0, 'H'},
 			{"update", 1, 0, 'u'},
 			{"exec", 1, 0, 'e'},
+			{"zone-exec", 1, 0, 'E'},
 			{"verbose", 0, 0, 'v'},
 			{"version", 0, 0, 'V'},
 			{"timeout", 1, 0, 't'},
 			{"maxrecords", 1, 0, 'M'},
 			{"daemonize", 0, 0, 'd'},
 			{"foreground", 0, 0, 'f'},
+			{"listen", 1, 0, 'l'},
+			{"snapshot", 1, 0, 's'},
+			{"pipeline", 1, 0, 'P'},
+			{"catalog", 1, 0, 'C'},
+			{"delta", 1, 0, 'X'},
+			{"tenants", 1, 0, 'T'},
+			{"zone-poll", 1, 0, 'z'},
+			{"control", 1, 0, 'c'},
+			{"shards", 1, 0, 'S'},
+			{"include", 1, 0, 'I'},
+			{"exclude", 1, 0, 'x'},
+			{"filter", 1, 0, 'F'},
+			{"normalize", 0, 0, 'N'},
+			{"reverse", 0, 0, 'r'},
+			{"check", 2, 0, 'k'},
+			{"leader", 1, 0, 'R'},
+			{"follow", 1, 0, 'g'},
+			{"sign", 1, 0, 'K'},
 			{0, 0, 0, 0}
 		};
 
-		c = getopt_long(main_argc, main_argv, "b:dD:e:fh:H:o:p:u:M:m:t:Vv::w:L::", long_options, &option_index);
+		c = getopt_long(main_argc, main_argv, "b:c:C:dD:e:E:fF:g:h:H:I:k::K:l:No:p:P:rR:s:S:T:u:M:m:t:Vv::w:x:X:z:L::", long_options, &option_index);
 
 		if (c == -1)
 			break;
@@ -450,17 +1138,7 @@ static int parse_options()
 			}
 			break;
 		case 'o':
-			options.output = 0;
-			if (strcmp(optarg, "tinydns")==0)
-				options.output = OUTPUT_DATA;
-			else if (strcmp(optarg, "bind")==0)
-				options.output = OUTPUT_DB;
-			else if (strcmp(optarg, "data")==0)
-				// Backward compatibility
-				options.output = OUTPUT_DATA;
-			else if (strcmp(optarg, "db")==0)
-				// Backward compatibility
-				options.output = OUTPUT_DB;
+			options.output = parse_output(optarg);
 			break;
 		case 'p':
 			if (sscanf(optarg, "%hd", &options.port[0])!=1)
@@ -484,6 +1162,10 @@ static int parse_options()
 			strncpy(options.exec_command, optarg, sizeof(options.exec_command));
 			options.exec_command[ sizeof( options.exec_command ) -1 ] = '\0';
 			break;
+		case 'E':
+			strncpy(options.zone_command, optarg, sizeof(options.zone_command));
+			options.zone_command[ sizeof( options.zone_command ) -1 ] = '\0';
+			break;
 		case 't':
 			if (sscanf(optarg, "%hd", (short *)&options.searchtimeout.tv_sec)!=1)
 				options.searchtimeout.tv_sec = DEF_SEARCHTIMEOUT;
@@ -498,6 +1180,69 @@ static int parse_options()
 		case 'f':
 			options.foreground = 1;
 			break;
+		case 'N':
+			options.normalize = 1;
+			break;
+		case 'r':
+			options.reverse = 1;
+			break;
+		case 'k':
+			options.check = parse_check(optarg);
+			break;
+		case 'l':
+			strncpy(options.listen, optarg, sizeof(options.listen));
+			options.listen[ sizeof( options.listen ) -1 ] = '\0';
+			break;
+		case 'R':
+			strncpy(options.leader, optarg, sizeof(options.leader));
+			options.leader[ sizeof( options.leader ) -1 ] = '\0';
+			break;
+		case 'g':
+			strncpy(options.follow, optarg, sizeof(options.follow));
+			options.follow[ sizeof( options.follow ) -1 ] = '\0';
+			break;
+		case 'K':
+			parse_sign(optarg);
+			break;
+		case 'C':
+			strncpy(options.catalog, optarg, sizeof(options.catalog));
+			options.catalog[ sizeof( options.catalog ) -1 ] = '\0';
+			break;
+		case 'X':
+			strncpy(options.deltadir, optarg, sizeof(options.deltadir));
+			options.deltadir[ sizeof( options.deltadir ) -1 ] = '\0';
+			break;
+		case 'S':
+			parse_shards(optarg);
+			break;
+		case 'I':
+			add_zone_globs(options.zone_include, sizeof(options.zone_include), optarg, 0);
+			break;
+		case 'x':
+			add_zone_globs(options.zone_exclude, sizeof(options.zone_exclude), optarg, 1);
+			break;
+		case 'F':
+			set_zone_predicate(optarg);
+			break;
+		case 'c':
+			strncpy(options.control, optarg, sizeof(options.control));
+			options.control[ sizeof( options.control ) -1 ] = '\0';
+			break;
+		case 'z':
+			parse_poll(optarg);
+			break;
+		case 'T':
+			strncpy(options.tenants, optarg, sizeof(options.tenants));
+			options.tenants[ sizeof( options.tenants ) -1 ] = '\0';
+			break;
+		case 'P':
+			if (sscanf(optarg, "%d", &options.pipeline)!=1)
+				options.pipeline = 0;
+			break;
+		case 's':
+			strncpy(options.snapshot, optarg, sizeof(options.snapshot));
+			options.snapshot[ sizeof( options.snapshot ) -1 ] = '\0';
+			break;
 		case '?':
 		default:
 			print_usage();
@@ -506,6 +1251,15 @@ static int parse_options()
 	}
 	if (options.is_daemon==1 && options.foreground==1)
 		options.is_daemon = 2; /* foreground daemon */
+	if (options.pipeline<0)
+		options.pipeline = 0;
+#if defined DRAFT_RFC
+	/* DNSaliasedobjectname is followed by a search from the decoder */
+	options.pipeline = 0;
+#endif
+	len = strlen(options.catalog);
+	if (len>0 && options.catalog[len-1]=='.')
+		options.catalog[len-1] = '\0';
 }
 
 
@@ -538,57 +1292,362 @@ static int expand_reverse(char target[64], const char* source)
 }
 
 
-static void write_rr(struct resourcerecord* rr, int ipdx, int znix)
+/*
+ * DNSipaddr and DNScipaddr values are parsed into binary once, when read
+ * from LDAP, and every output formats them from there.  An IPv4 address is
+ * four decimal octets of up to 255, an IPv6 address is RFC 4291 text with
+ * at most one "::" and optionally a dotted quad for its last 32 bits.  Blanks
+ * around the address are ignored, anything else makes the value invalid.
+ */
+
+/* Length of the dotted quad at the start of text, 0 if there is none */
+static int ipaddr_parse4(const char* text, unsigned char addr[4])
 {
-	char ip[4];
-	char buf[4];
-	char *tmp;
-	char *p;
-	int i;
-	int res;
-	unsigned char in6addr[sizeof(struct in6_addr)];
+	const char* p = text;
+	int n, v, digits;
 
-	if (strcasecmp(rr->class, "IN"))
-		return;
-	if (strcasecmp(rr->type, "NS")==0) {
-		if (tinyfile) {
-			if (znix==0) {
-				if (ipdx<=0 && rr->cipaddr[0]) {
-					fprintf(tinyfile, "&%s::%s:%s:%s:%s\n", rr->dnsdomainname, rr->cname, rr->ttl, rr->timestamp, rr->location);
-					if (rr->cname[0])
-						fprintf(tinyfile, "=%s:%s:%s:%s:%s\n", rr->cname, rr->cipaddr, rr->ttl, rr->timestamp, rr->location);
-					if (ipdx==0)
-						fprintf(tinyfile, "+%s:%s:%s:%s:%s\n", rr->cname, rr->ipaddr[0], rr->ttl, rr->timestamp, rr->location);
-				} else if (ipdx<0)
-					fprintf(tinyfile, "&%s::%s:%s:%s:%s\n", rr->dnsdomainname, rr->cname, rr->ttl, rr->timestamp, rr->location);
-				else if (ipdx==0)
-					fprintf(tinyfile, "&%s:%s:%s:%s:%s:%s\n", rr->dnsdomainname, rr->ipaddr[0], rr->cname, rr->ttl, rr->timestamp, rr->location);
-				else if (ipdx>0 && rr->cname[0])
-					fprintf(tinyfile, "+%s:%s:%s:%s:%s\n", rr->cname, rr->ipaddr[ipdx], rr->ttl, rr->timestamp, rr->location);
-			} else if (ipdx<=0) {
-				fprintf(tinyfile, "&%s::%s:%s:%s:%s\n", rr->dnsdomainname, rr->cname, rr->ttl, rr->timestamp, rr->location);
-			}
-		}
-		if (namedzone) {
-			fprintf(namedzone, "%s.\t%s\tIN NS\t%s.\n", rr->dnsdomainname, rr->ttl, rr->cname);
-			if (ipdx>=0)
-				fprintf(namedzone, "%s.\t%s\tIN A\t%s\n", rr->cname, rr->ttl, rr->ipaddr[ipdx]);
-		}
-	} else if (strcasecmp(rr->type, "MX")==0) {
-		if (tinyfile) {
-			if (znix==0) {
-				if (ipdx<=0 && rr->cipaddr[0]) {
-					fprintf(tinyfile, "@%s::%s:%s:%s:%s:%s\n", rr->dnsdomainname, rr->cname, rr->preference, rr->ttl, rr->timestamp, rr->location);
-					if (rr->cname[0])
-						fprintf(tinyfile, "=%s:%s:%s:%s:%s\n", rr->cname, rr->cipaddr, rr->ttl, rr->timestamp, rr->location);
-					if (ipdx==0)
-						fprintf(tinyfile, "+%s:%s:%s:%s:%s\n", rr->cname, rr->ipaddr[0], rr->ttl, rr->timestamp, rr->location);
-				} else if (ipdx<0)
+	for (n = 0; n<4; n++) {
+		if (n>0 && *p++!='.')
+			return 0;
+		for (v = 0, digits = 0; *p>='0' && *p<='9' && digits<3; digits++)
+			v = v*10 + *p++ - '0';
+		if (!digits || v>255)
+			return 0;
+		addr[n] = v;
+	}
+	if (*p>='0' && *p<='9')
+		return 0;
+	return p-text;
+}
+
+
+static int hexdigit(int c)
+{
+	if (c>='0' && c<='9')
+		return c-'0';
+	c |= 0x20;
+	return c>='a' && c<='f' ? c-'a'+10 : -1;
+}
+
+
+/* Length of the IPv6 address at the start of text, 0 if there is none */
+static int ipaddr_parse6(const char* text, unsigned char addr[16])
+{
+	const char* p = text;
+	const char* group;
+	int n = 0, gap = -1;
+	int v, d, digits;
+
+	if (p[0]==':') {
+		if (p[1]!=':')
+			return 0;
+		p += 2;
+		gap = 0;
+	}
+	while (n<16 && hexdigit(*p)>=0) {
+		group = p;
+		for (v = 0, digits = 0; digits<4 && (d = hexdigit(*p))>=0; digits++, p++)
+			v = v << 4 | d;
+		if (*p=='.') {
+			if (n>12 || !(d = ipaddr_parse4(group, addr+n)))
+				return 0;
+			p = group+d;
+			n += 4;
+			break;
+		}
+		if (hexdigit(*p)>=0)
+			return 0;
+		addr[n++] = v >> 8;
+		addr[n++] = v;
+		if (*p!=':')
+			break;
+		if (*++p==':') {
+			if (gap>=0)
+				return 0;
+			gap = n;
+			p++;
+		} else if (hexdigit(*p)<0)
+			return 0;
+	}
+	if (gap>=0) {
+		if (n==16)
+			return 0;
+		memmove(addr+16-(n-gap), addr+gap, n-gap);
+		memset(addr+gap, 0, 16-n);
+	} else if (n!=16)
+		return 0;
+	return p-text;
+}
+
+
+/* Parse text into a, returns 0 and leaves a unset if it is no address */
+static int ipaddr_parse(struct ipaddr* a, const char* text)
+{
+	const char* p = text;
+	int len;
+
+	while (*p==' ' || *p=='\t')
+		p++;
+	if ( (len = ipaddr_parse4(p, a->addr)) )
+		a->len = 4;
+	else if ( (len = ipaddr_parse6(p, a->addr)) )
+		a->len = 16;
+	for (p += len; *p==' ' || *p=='\t'; p++);
+	if (!len || *p) {
+		memset(a, 0, sizeof(*a));
+		return 0;
+	}
+	return 1;
+}
+
+
+static char* put_decimal(char* p, unsigned int v)
+{
+	if (v>=100)
+		*p++ = '0' + v/100;
+	if (v>=10)
+		*p++ = '0' + v/10%10;
+	*p++ = '0' + v%10;
+	return p;
+}
+
+
+/* Text of a, "" if it is unset; IPv6 is written as RFC 5952 recommends */
+static char* ipaddr_text(char buf[INET6_ADDRSTRLEN], const struct ipaddr* a)
+{
+	static const char hex[] = "0123456789abcdef";
+	char* p = buf;
+	int best = -1, bestrun = 1;
+	int i, run, groups, shift, v, sep;
+
+	if (a->len==4) {
+		for (i = 0; i<4; i++) {
+			if (i>0)
+				*p++ = '.';
+			p = put_decimal(p, a->addr[i]);
+		}
+	} else if (a->len==16) {
+		/* the longest run of two or more zero groups becomes "::" */
+		for (i = 0; i<8; i += run ? run : 1) {
+			for (run = 0; i+run<8 && !a->addr[2*(i+run)] && !a->addr[2*(i+run)+1]; run++);
+			if (run>bestrun) {
+				best = i;
+				bestrun = run;
+			}
+		}
+		/* IPv4-mapped addresses end in a dotted quad */
+		groups = best==0 && bestrun==5 && a->addr[10]==0xff && a->addr[11]==0xff ? 6 : 8;
+		for (i = 0, sep = 0; i<groups; i++) {
+			if (i==best) {
+				*p++ = ':';
+				*p++ = ':';
+				i += bestrun-1;
+				sep = 0;
+				continue;
+			}
+			if (sep)
+				*p++ = ':';
+			v = a->addr[2*i] << 8 | a->addr[2*i+1];
+			for (shift = 12; shift>0 && !(v >> shift); shift -= 4);
+			for (; shift>=0; shift -= 4)
+				*p++ = hex[v >> shift & 15];
+			sep = 1;
+		}
+		for (i = 12; groups==6 && i<16; i++) {
+			*p++ = i>12 ? '.' : ':';
+			p = put_decimal(p, a->addr[i]);
+		}
+	}
+	*p = '\0';
+	return buf;
+}
+
+
+/* Reverse lookup name of a, in-addr.arpa or ip6.int, without a trailing dot */
+static char* ipaddr_reverse(char buf[80], const struct ipaddr* a)
+{
+	static const char hex[] = "0123456789abcdef";
+	char* p = buf;
+	int i;
+
+	if (a->len==4) {
+		for (i = 3; i>=0; i--) {
+			p = put_decimal(p, a->addr[i]);
+			*p++ = '.';
+		}
+		strcpy(p, "in-addr.arpa");
+	} else {
+		for (i = a->len-1; i>=0; i--) {
+			*p++ = hex[a->addr[i] & 15];
+			*p++ = '.';
+			*p++ = hex[a->addr[i] >> 4];
+			*p++ = '.';
+		}
+		strcpy(p, "ip6.int");
+	}
+	return buf;
+}
+
+#ifdef ADDRBENCH
+/*
+ * "make addrbench" builds ldap2dns with this in place of main(): it times
+ * ipaddr_parse() against the inet_pton() and sscanf() it replaced, and
+ * ipaddr_text() against inet_ntop(), on a mix of IPv4, IPv6 and invalid
+ * values, and checks that all three agree on what is an address.
+ */
+static double bench_ns(const struct timespec* start, int count)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return ((end.tv_sec-start->tv_sec)*1e9 + end.tv_nsec-start->tv_nsec) / count;
+}
+
+
+static int addr_bench(int argc, char** argv)
+{
+	static const char* invalid[] = { "999.1.1.1", "1.2.3", "1.2.3.4.5", "256.0.0.1", "1.2.3.4x", "1::2::3",
+		"12345::1", "1:2:3:4:5:6:7:8:9", "::1.2.3", "fe80::1%eth0", ":1::", "", "10.0.0.-1" };
+	int count = argc>1 ? atoi(argv[1]) : 1000000;
+	char (*text)[INET6_ADDRSTRLEN] = xcalloc(count, sizeof(*text));
+	struct ipaddr* a = xcalloc(count, sizeof(*a));
+	unsigned char ref[16];
+	char buf[80];
+	unsigned int seed = 42;
+	unsigned int v;
+	volatile int sink = 0;
+	struct timespec start;
+	double tpton, tparse, tntop, ttext;
+	int i, k, valid, bad = 0, v6 = 0, wrong = 0;
+	int ip[4];
+
+	if (count<=0)
+		count = 1000000;
+	for (i = 0; i<count; i++) {
+		seed = seed*1103515245 + 12345;
+		v = seed >> 8;
+		if (v%100<5) {
+			strcpy(text[i], invalid[v%(sizeof(invalid)/sizeof(invalid[0]))]);
+			bad++;
+		} else if (v%100<60) {
+			snprintf(text[i], sizeof(text[i]), "%u.%u.%u.%u", 10 + v%3, seed >> 24, v >> 4 & 255, v & 255);
+		} else {
+			/* mostly zero groups, as in real prefixes, and now and then upper case */
+			for (k = 0; k<16; k++) {
+				seed = seed*1103515245 + 12345;
+				ref[k] = (k<4 || k>12 || (seed >> 28)==0) ? seed >> 16 : 0;
+			}
+			if (v%100<63)
+				memcpy(ref, "\0\0\0\0\0\0\0\0\0\0\xff\xff", 12);
+			inet_ntop(AF_INET6, ref, text[i], sizeof(text[i]));
+			for (k = 0; v%7==0 && text[i][k]; k++)
+				text[i][k] = toupper((unsigned char)text[i][k]);
+			v6++;
+		}
+	}
+	printf("%d values: %d IPv4, %d IPv6, %d invalid\n", count, count-v6-bad, v6, bad);
+
+	/* what read_rrset() did before: inet_pton(), sscanf() and a copy into 80 bytes */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i<count; i++) {
+		if (inet_pton(AF_INET6, text[i], ref)==1)
+			snprintf(buf, sizeof(buf), "%s", text[i]);
+		else if (sscanf(text[i], "%d.%d.%d.%d", &ip[0], &ip[1], &ip[2], &ip[3])==4)
+			snprintf(buf, sizeof(buf), "%d.%d.%d.%d", ip[0], ip[1], ip[2], ip[3]);
+		sink += buf[0];
+	}
+	tpton = bench_ns(&start, count);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i<count; i++)
+		sink += ipaddr_parse(&a[i], text[i]);
+	tparse = bench_ns(&start, count);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i<count; i++)
+		if (a[i].len)
+			sink += inet_ntop(a[i].len==4 ? AF_INET : AF_INET6, a[i].addr, buf, sizeof(buf))!=NULL;
+	tntop = bench_ns(&start, count);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i<count; i++)
+		sink += ipaddr_text(buf, &a[i])[0];
+	ttext = bench_ns(&start, count);
+	printf("parse:  inet_pton+sscanf %7.1f ns  ipaddr_parse %7.1f ns  %5.1fx\n", tpton, tparse, tpton/tparse);
+	printf("format: inet_ntop        %7.1f ns  ipaddr_text  %7.1f ns  %5.1fx\n", tntop, ttext, tntop/ttext);
+
+	/* inet_pton() is the reference, the text written must read back the same */
+	for (i = 0; i<count; i++) {
+		valid = inet_pton(AF_INET6, text[i], ref)==1 ? 16 : inet_pton(AF_INET, text[i], ref)==1 ? 4 : 0;
+		if (valid!=a[i].len || memcmp(ref, a[i].addr, valid)) {
+			printf("parsed differently: '%s'\n", text[i]);
+			wrong++;
+		} else if (valid && (inet_pton(valid==4 ? AF_INET : AF_INET6, ipaddr_text(buf, &a[i]), ref)!=1 || memcmp(ref, a[i].addr, valid))) {
+			printf("written as '%s': '%s'\n", buf, text[i]);
+			wrong++;
+		}
+	}
+	printf("%d differences\n", wrong);
+	free(text);
+	free(a);
+	return wrong>0;
+}
+#endif
+
+
+static void write_rr(struct resourcerecord* rr, int ipdx, int znix)
+{
+	char ip[4];
+	char buf[4];
+	char target[sizeof(rr->cname)];
+	char *tmp;
+	char *p;
+	int i;
+	char addr[INET6_ADDRSTRLEN];
+	char caddr[INET6_ADDRSTRLEN];
+	const struct ipaddr* a;
+
+	if (strcasecmp(rr->class, "IN"))
+		return;
+	if (ipdx>=0)
+		ipaddr_text(addr, &rr->ipaddr[ipdx]);
+	ipaddr_text(caddr, &rr->cipaddr);
+	if (strcasecmp(rr->type, "NS")==0) {
+		if (tinyfile) {
+			if (znix==0) {
+				if (ipdx<=0 && rr->cipaddr.len) {
+					fprintf(tinyfile, "&%s::%s:%s:%s:%s\n", rr->dnsdomainname, rr->cname, rr->ttl, rr->timestamp, rr->location);
+					if (rr->cname[0])
+						fprintf(tinyfile, "=%s:%s:%s:%s:%s\n", rr->cname, caddr, rr->ttl, rr->timestamp, rr->location);
+					if (ipdx==0)
+						fprintf(tinyfile, "+%s:%s:%s:%s:%s\n", rr->cname, addr, rr->ttl, rr->timestamp, rr->location);
+				} else if (ipdx<0)
+					fprintf(tinyfile, "&%s::%s:%s:%s:%s\n", rr->dnsdomainname, rr->cname, rr->ttl, rr->timestamp, rr->location);
+				else if (ipdx==0)
+					fprintf(tinyfile, "&%s:%s:%s:%s:%s:%s\n", rr->dnsdomainname, addr, rr->cname, rr->ttl, rr->timestamp, rr->location);
+				else if (ipdx>0 && rr->cname[0])
+					fprintf(tinyfile, "+%s:%s:%s:%s:%s\n", rr->cname, addr, rr->ttl, rr->timestamp, rr->location);
+			} else if (ipdx<=0) {
+				fprintf(tinyfile, "&%s::%s:%s:%s:%s\n", rr->dnsdomainname, rr->cname, rr->ttl, rr->timestamp, rr->location);
+			}
+		}
+		if (namedzone) {
+			fprintf(namedzone, "%s.\t%s\tIN NS\t%s.\n", rr->dnsdomainname, rr->ttl, rr->cname);
+			if (ipdx>=0)
+				fprintf(namedzone, "%s.\t%s\tIN A\t%s\n", rr->cname, rr->ttl, addr);
+		}
+	} else if (strcasecmp(rr->type, "MX")==0) {
+		if (tinyfile) {
+			if (znix==0) {
+				if (ipdx<=0 && rr->cipaddr.len) {
+					fprintf(tinyfile, "@%s::%s:%s:%s:%s:%s\n", rr->dnsdomainname, rr->cname, rr->preference, rr->ttl, rr->timestamp, rr->location);
+					if (rr->cname[0])
+						fprintf(tinyfile, "=%s:%s:%s:%s:%s\n", rr->cname, caddr, rr->ttl, rr->timestamp, rr->location);
+					if (ipdx==0)
+						fprintf(tinyfile, "+%s:%s:%s:%s:%s\n", rr->cname, addr, rr->ttl, rr->timestamp, rr->location);
+				} else if (ipdx<0)
 					fprintf(tinyfile, "@%s::%s:%s:%s:%s:%s\n", rr->dnsdomainname, rr->cname, rr->preference, rr->ttl, rr->timestamp, rr->location);
 				else if (ipdx==0)
-					fprintf(tinyfile, "@%s:%s:%s:%s:%s:%s:%s\n", rr->dnsdomainname, rr->ipaddr[0], rr->cname, rr->preference, rr->ttl, rr->timestamp, rr->location);
+					fprintf(tinyfile, "@%s:%s:%s:%s:%s:%s:%s\n", rr->dnsdomainname, addr, rr->cname, rr->preference, rr->ttl, rr->timestamp, rr->location);
 				else if (ipdx>0 && rr->cname[0])
-					fprintf(tinyfile, "+%s:%s:%s:%s:%s\n", rr->cname, rr->ipaddr[ipdx], rr->ttl, rr->timestamp, rr->location);
+					fprintf(tinyfile, "+%s:%s:%s:%s:%s\n", rr->cname, addr, rr->ttl, rr->timestamp, rr->location);
 			} else if (ipdx<=0) {
 				fprintf(tinyfile, "@%s::%s:%s:%s:%s:%s\n", rr->dnsdomainname, rr->cname, rr->preference, rr->ttl, rr->timestamp, rr->location);
 			}
@@ -596,41 +1655,30 @@ static void write_rr(struct resourcerecord* rr, int ipdx, int znix)
 		if (namedzone) {
 			fprintf(namedzone, "%s.\t%s\tIN MX\t%s %s.\n", rr->dnsdomainname, rr->ttl, rr->preference, rr->cname);
 			if (ipdx>=0)
-				fprintf(namedzone, "%s.\t%s\tIN A\t%s\n", rr->cname, rr->ttl, rr->ipaddr[ipdx]);
+				fprintf(namedzone, "%s.\t%s\tIN A\t%s\n", rr->cname, rr->ttl, addr);
 		}
 	} else if ( strcasecmp(rr->type, "A")==0) {
 		if (tinyfile) {
-			if (ipdx<=0 && rr->cipaddr[0])
-				fprintf(tinyfile, "%s%s:%s:%s:%s:%s\n", (znix==0 ? "=" : "+"), rr->dnsdomainname, rr->cipaddr, rr->ttl, rr->timestamp, rr->location);
+			if (ipdx<=0 && rr->cipaddr.len)
+				fprintf(tinyfile, "%s%s:%s:%s:%s:%s\n", (znix==0 ? "=" : "+"), rr->dnsdomainname, caddr, rr->ttl, rr->timestamp, rr->location);
 			if (ipdx>=0)
-				fprintf(tinyfile, "+%s:%s:%s:%s:%s\n", rr->dnsdomainname, rr->ipaddr[ipdx], rr->ttl, rr->timestamp, rr->location);
+				fprintf(tinyfile, "+%s:%s:%s:%s:%s\n", rr->dnsdomainname, addr, rr->ttl, rr->timestamp, rr->location);
 		}
 		if (namedzone) {
-			if (ipdx<=0 && rr->cipaddr[0])
-				fprintf(namedzone, "%s.\t%s\tIN A\t%s\n", rr->dnsdomainname, rr->ttl, rr->cipaddr);
+			if (ipdx<=0 && rr->cipaddr.len)
+				fprintf(namedzone, "%s.\t%s\tIN A\t%s\n", rr->dnsdomainname, rr->ttl, caddr);
 			if (ipdx>=0)
-				fprintf(namedzone, "%s.\t%s\tIN A\t%s\n", rr->dnsdomainname, rr->ttl, rr->ipaddr[ipdx]);
+				fprintf(namedzone, "%s.\t%s\tIN A\t%s\n", rr->dnsdomainname, rr->ttl, addr);
 		}
 	} else if (strcasecmp(rr->type, "PTR")==0) {
-		int ip[4] = {0, 0, 0, 0};
 		char buf[256];
-		char tmp[8];
 		if (ipdx>0) {
 			/* does not make to have more than one IPaddr for a PTR record */
 			return;
 		}
-		if (ipdx==0 && sscanf(rr->ipaddr[0], "%d.%d.%d.%d", &ip[0], &ip[1], &ip[2], &ip[3])==4) {
+		if (ipdx==0 && rr->ipaddr[0].len) {
 			/* lazy user, used DNSipaddr for reverse lookup */
-			snprintf(buf, sizeof(buf), "%d.%d.%d.%d.in-addr.arpa", ip[3], ip[2], ip[1], ip[0]);
-		} else if (ipdx==0 && inet_pton(AF_INET6, rr->ipaddr[0], in6addr)==1) {
-			*buf = '\0';
-			for (i = 15; i >= 0; i--) {
-				sprintf(tmp, "%x.", in6addr[i] & 0xf);
-				strcat(buf, tmp);
-				sprintf(tmp, "%x.", in6addr[i] >> 4);
-				strcat(buf, tmp);
-			}
-			strcat(buf, "ip6.int.");
+			ipaddr_reverse(buf, &rr->ipaddr[0]);
 		} else {
 			strncpy(buf, rr->dnsdomainname, sizeof(buf));
 			buf[ sizeof(buf) -1 ] = '\0';
@@ -652,7 +1700,8 @@ static void write_rr(struct resourcerecord* rr, int ipdx, int znix)
 	} else if (strcasecmp(rr->type, "SRV")==0) {
 		if (tinyfile) {
 			fprintf(tinyfile, ":%s:33:\\%03o\\%03o\\%03o\\%03o\\%03o\\%03o", rr->dnsdomainname, rr->srvpriority >> 8, rr->srvpriority & 0xff, rr->srvweight >> 8, rr->srvweight & 0xff, rr->srvport >> 8, rr->srvport & 0xff);
-			tmp = strdup(rr->cname);
+			strcpy(target, rr->cname);
+			tmp = target;
 			while (p = strchr(tmp, '.')) {
 				*p = '\0';
 				p++;
@@ -666,24 +1715,18 @@ static void write_rr(struct resourcerecord* rr, int ipdx, int znix)
 			fprintf(namedzone, "%s.\t%s\tIN SRV\t%d\t%d\t%d\t%s.\n", rr->dnsdomainname, rr->ttl, rr->srvpriority, rr->srvweight, rr->srvport, rr->cname);
 		}
 	} else if (strcasecmp(rr->type, "AAAA")==0) {
-		/* Even though we don't use the result of inet_pton() for BIND,
-		 * we can use it to validate the address. */
-		if (strlen(rr->cipaddr) > 0) {
-			res = inet_pton(AF_INET6, rr->cipaddr, in6addr);
-		} else {
-			res = inet_pton(AF_INET6, rr->ipaddr[0], in6addr);
-		}
-		if (res == 1) {
+		a = rr->cipaddr.len ? &rr->cipaddr : rr->ipaddr ? &rr->ipaddr[0] : NULL;
+		if (a && a->len==16) {
 			/* Valid IPv6 address found. */
 			if (tinyfile) {
 				fprintf(tinyfile, ":%s:28:", rr->dnsdomainname);
 				for (i=0;i<16;i++) {
-					fprintf(tinyfile, "\\%03o", in6addr[i]);
+					fprintf(tinyfile, "\\%03o", a->addr[i]);
 				}
 				fprintf(tinyfile, ":%s:%s:%s\n", rr->ttl, rr->timestamp, rr->location);
 			}
 			if (namedzone) {
-				fprintf(namedzone, "%s.\t%s\tIN AAAA\t%s\n", rr->dnsdomainname, rr->ttl, rr->ipaddr[0]);
+				fprintf(namedzone, "%s.\t%s\tIN AAAA\t%s\n", rr->dnsdomainname, rr->ttl, ipaddr_text(addr, a));
 			}
 		} else {
 			fprintf(stderr, "[**] Invalid IPv6 address found for %s; skipping record.\n", rr->dnsdomainname);
@@ -692,230 +1735,332 @@ static void write_rr(struct resourcerecord* rr, int ipdx, int znix)
 }
 
 #if defined DRAFT_RFC
-static void parse_rr(struct resourcerecord* rr)
+static void parse_rr(struct dnsrecord* rr, const char* text)
 {
 	char word1[64];
 	char word2[64];
-	int ip[4];
+	struct ipaddr a;
 
-	sscanf(rr->rr, "%16s %16s %64s %64s", rr->class, rr->type, word1, word2);
+	sscanf(text, "%16s %16s %64s %64s", rr->class, rr->type, word1, word2);
 	if (strcasecmp(rr->type, "NS")==0) {
-		if (sscanf(word1, "%d.%d.%d.%d", &ip[0], &ip[1], &ip[2], &ip[3])==4) {
-			snprintf(rr->ipaddr[0], sizeof(rr->ipaddr[0]), "%d.%d.%d.%d", ip[0], ip[1], ip[2], ip[3]);
+		if (ipaddr_parse(&a, word1) && a.len==4) {
+			if (rr->ipaddresses==0) {
+				rr->ipaddr = xcalloc(1, sizeof(rr->ipaddr[0]));
+				rr->ipaddresses = 1;
+			}
+			rr->ipaddr[0] = a;
 		} else {
-			int len = strlen(word1);
-			expand_domainname(rr->cname, word1, len);
+			dname_release(rr->cname);
+			rr->cname = dname_intern(word1);
 		}
 	} else if (strcasecmp(rr->type, "MX")==0) {
 		if (sscanf(word1, "%s", rr->preference)!=1)
 			rr->preference[0] = '\0';
-		if (sscanf(word2, "%d.%d.%d.%d", &ip[0], &ip[1], &ip[2], &ip[3])==4) {
-			snprintf(rr->ipaddr[0], sizeof(rr->ipaddr[0]), "%d.%d.%d.%d", ip[0], ip[1], ip[2], ip[3]);
+		if (ipaddr_parse(&a, word2) && a.len==4) {
+			if (rr->ipaddresses==0) {
+				rr->ipaddr = xcalloc(1, sizeof(rr->ipaddr[0]));
+				rr->ipaddresses = 1;
+			}
+			rr->ipaddr[0] = a;
 		} else {
-			int len = strlen(word2);
-			expand_domainname(rr->cname, word2, len);
+			dname_release(rr->cname);
+			rr->cname = dname_intern(word2);
 		}
 	} else if (strcasecmp(rr->type, "A")==0) {
-		if (sscanf(word1, "%d.%d.%d.%d", &ip[0], &ip[1], &ip[2], &ip[3])==4)
-			snprintf(rr->ipaddr[0], sizeof(rr->ipaddr[0]), "%d.%d.%d.%d", ip[0], ip[1], ip[2], ip[3]);
-		else
-			rr->ipaddr[0][0] = '\0';
-	} else if (strcasecmp(rr->type, "PTR")==0) {
-		expand_reverse(rr->dnsdomainname, word1);
+		if (ipaddr_parse(&a, word1) && a.len==4) {
+			if (rr->ipaddresses==0) {
+				rr->ipaddr = xcalloc(1, sizeof(rr->ipaddr[0]));
+				rr->ipaddresses = 1;
+			}
+			rr->ipaddr[0] = a;
+		}
 	} else if (strcasecmp(rr->type, "CNAME")==0) {
-		int len = strlen(word1);
-		expand_reverse(rr->cname, word1);
+		dname_release(rr->cname);
+		rr->cname = dname_intern(word1);
 	} else if (strcasecmp(rr->type, "TXT")==0) {
-		strncpy(rr->cname, word1, sizeof(rr->cname));
+		free(rr->txt);
+		rr->txt = xstrdup(word1);
 	}
 }
 #endif
 
 
-static void read_resourcerecords(char* dn, int znix)
+#if defined DRAFT_RFC
+static void read_resourcerecords(struct dnszone* z, char* dn);
+#endif
+
+
+/*
+ * An entry taken out of its LDAPMessage: the DN and the values of every
+ * attribute.  Only the thread reading the connection calls libldap with
+ * ldap_con, the pipelined refresh decodes entries on another thread.
+ */
+struct ldapattr
+{
+	char* name;
+	struct berval** vals;
+};
+
+struct ldapentry
+{
+	char* dn;
+	struct ldapattr* attr;
+	int attrs;
+};
+
+
+static struct ldapentry* entry_get(LDAPMessage* m)
 {
-	LDAPMessage* res = NULL;
-	LDAPMessage* m;
-	int ldaperr;
+	struct ldapentry* e = xcalloc(1, sizeof(struct ldapentry));
+	BerElement* ber = NULL;
+	char* attr;
+	int size = 0;
 
-	if ( (ldaperr = ldap_search_ext_s(ldap_con, dn, LDAP_SCOPE_SUBTREE, "objectclass=DNSrrset", NULL, 0, NULL, NULL, &options.searchtimeout, options.reclimit, &res))!=LDAP_SUCCESS )
-		die_ldap(ldaperr);
-	if (ldap_count_entries(ldap_con, res) < 1) {
-		fprintf(stderr, "\n[**] Warning: No DNS records found for domain %s.\n\n", zone.domainname);
-		return;
+	e->dn = ldap_get_dn(ldap_con, m);
+	for (attr = ldap_first_attribute(ldap_con, m, &ber); attr; attr = ldap_next_attribute(ldap_con, m, ber)) {
+		if (e->attrs==size) {
+			size = size ? 2*size : 16;
+			if ( !(e->attr = realloc(e->attr, size*sizeof(struct ldapattr))) )
+				die_exit(NULL);
+		}
+		e->attr[e->attrs].name = attr;
+		e->attr[e->attrs++].vals = ldap_get_values_len(ldap_con, m, attr);
 	}
-	for (m = ldap_first_entry(ldap_con, res); m; m = ldap_next_entry(ldap_con, m)) {
-		BerElement* ber = NULL;
-		char* attr;
-		char* dn = ldap_get_dn(ldap_con, m);
-		struct resourcerecord rr;
-		int ipaddresses = 0;
+	ber_free(ber, 0);
+	return e;
+}
 
-		if (options.ldifname[0])
-			fprintf(ldifout, "dn: %s\n", dn);
-		rr.cn[0] = '\0';
-		strncpy(rr.dnsdomainname, zone.domainname, 64);
-		strncpy(rr.class, "IN", 3);
-		rr.type[0] = '\0';
-		rr.cname[0] = '\0';
-		rr.cipaddr[0] = '\0';
-		rr.ttl[0] = '\0';
-		rr.timestamp[0] = '\0';
-		rr.preference[0] = '\0';
-		rr.location[0] = '\0';
+
+/* The values of attribute name, NULL if the entry has none */
+static struct berval** entry_values(const struct ldapentry* e, const char* name)
+{
+	int i;
+
+	for (i = 0; i<e->attrs; i++)
+		if (strcasecmp(e->attr[i].name, name)==0)
+			return e->attr[i].vals;
+	return NULL;
+}
+
+
+static void entry_free(struct ldapentry* e)
+{
+	int i;
+
+	for (i = 0; i<e->attrs; i++) {
+		if (e->attr[i].vals)
+			ldap_value_free_len(e->attr[i].vals);
+		ldap_memfree(e->attr[i].name);
+	}
+	free(e->attr);
+	ldap_memfree(e->dn);
+	free(e);
+}
+
+
+/* Decode one DNSrrset entry, append it to the records after last and return the new tail */
+static struct dnsrecord** read_rrset(struct dnszone* z, struct dnsrecord** last, const struct ldapentry* e)
+{
+	const char* dn = e->dn;
+	int a;
+	struct dnsrecord* rr = xcalloc(1, sizeof(struct dnsrecord));
+	struct ipaddr ipaddr[256];
+	char expanded[MAX_DOMAIN_LEN];
 #if defined DRAFT_RFC
-		rr.aliasedobjectname[0] = '\0';
-		rr.rr[0] = '\0';
+	char rrtext[1024];
+	char aliasedobjectname[256];
 #endif
-                rr.srvpriority = 0;
-                rr.srvweight = 0;
-                rr.srvport = 0;
-		for (attr = ldap_first_attribute(ldap_con, m, &ber); attr; attr = ldap_next_attribute(ldap_con, m, ber)) {
-			int len = strlen(attr);
-			struct berval** bvals;
-			char* dnsnname = "";
 
-			if ( (bvals = ldap_get_values_len(ldap_con, m, attr))!=NULL ) {
-				if (bvals[0] && bvals[0]->bv_len>0) {
-					if (strcasecmp(attr, "objectclass")==0) {
-						if (options.ldifname[0])
-							fprintf(ldifout, "%s: %s\n", attr, bvals[0]->bv_val);
-					} else if (strcasecmp(attr, "cn")==0) {
-						strncpy(rr.cn, bvals[0]->bv_val, 64);
-						if (options.ldifname[0])
-							fprintf(ldifout, "%s: %s\n", attr, rr.cn);
-					} else if (strcasecmp(attr, "DNSdomainname")==0) {
-						if (!expand_domainname(rr.dnsdomainname, bvals[0]->bv_val, bvals[0]->bv_len))
-							rr.dnsdomainname[0] = '\0';;
-						if (options.ldifname[0])
-							fprintf(ldifout, "%s: %s\n", attr, bvals[0]->bv_val);
-					} else if (strcasecmp(attr, "DNSclass")==0) {
-						if (sscanf(bvals[0]->bv_val, "%16s", rr.class)!=1)
-							rr.class[0] = '\0';
-						else if (options.ldifname[0])
-							fprintf(ldifout, "%s: %s\n", attr, rr.class);
-					} else if (strcasecmp(attr, "DNStype")==0) {
-						if (sscanf(bvals[0]->bv_val, "%16s", rr.type)!=1)
-							rr.type[0] = '\0';
-						else if (options.ldifname[0])
-							fprintf(ldifout, "%s: %s\n", attr, rr.type);
-					} else if (strcasecmp(attr, "DNSipaddr")==0) {
-						int ip[4];
-						unsigned char in6addr[sizeof(struct in6_addr)];
-						for (ipaddresses = 0; bvals[ipaddresses] && ipaddresses<256; ipaddresses++) {
-							rr.ipaddr[ipaddresses][0] = '\0';
-							if (inet_pton(AF_INET6, bvals[ipaddresses]->bv_val, in6addr)==1) {
-								snprintf(rr.ipaddr[ipaddresses], sizeof(rr.ipaddr[ipaddresses]), "%s", bvals[ipaddresses]->bv_val);
-								if (options.ldifname[0])
-									fprintf(ldifout, "%s: %s\n", attr, rr.ipaddr[ipaddresses]);
-							} else if (sscanf(bvals[ipaddresses]->bv_val, "%d.%d.%d.%d", &ip[0], &ip[1], &ip[2], &ip[3])==4) {
-								snprintf(rr.ipaddr[ipaddresses], sizeof(rr.ipaddr[ipaddresses]), "%d.%d.%d.%d", ip[0], ip[1], ip[2], ip[3]);
-								if (options.ldifname[0])
-									fprintf(ldifout, "%s: %s\n", attr, rr.ipaddr[ipaddresses]);
-							}
-						}
-					} else if (strcasecmp(attr, "DNScipaddr")==0) {
-						int ip[4];
-						unsigned char in6addr[sizeof(struct in6_addr)];
-						if (inet_pton(AF_INET6, bvals[0]->bv_val, in6addr)==1) {
-							snprintf(rr.cipaddr, sizeof(rr.cipaddr), "%s", bvals[0]->bv_val);
-							if (options.ldifname[0])
-								fprintf(ldifout, "%s: %s\n", attr, rr.cipaddr);
-						} else if (sscanf(bvals[0]->bv_val, "%d.%d.%d.%d", &ip[0], &ip[1], &ip[2], &ip[3])==4) {
-							snprintf(rr.cipaddr, sizeof(rr.cipaddr), "%d.%d.%d.%d", ip[0], ip[1], ip[2], ip[3]);
-							if (options.ldifname[0])
-								fprintf(ldifout, "%s: %s\n", attr, rr.cipaddr);
-						}
-					} else if (strcasecmp(attr, "DNScname")==0) {
-						if (!expand_domainname(rr.cname, bvals[0]->bv_val, bvals[0]->bv_len))
-							rr.cname[0] = '\0';
-						else if (options.ldifname[0])
-							fprintf(ldifout, "%s: %s\n", attr, bvals[0]->bv_val);
-					} else if (strcasecmp(attr, "DNStxt")==0) {
-						strncpy(rr.txt, bvals[0]->bv_val, sizeof(rr.txt) - 1);
-						if (options.ldifname[0])
-							fprintf(ldifout, "%s: %s\n", attr, bvals[0]->bv_val);
-					} else if (strcasecmp(attr, "DNSttl")==0) {
-						if (sscanf(bvals[0]->bv_val, "%12s", rr.ttl)!=1)
-							rr.ttl[0] = '\0';
-						else if (options.ldifname[0])
-							fprintf(ldifout, "%s: %s\n", attr, rr.ttl);
-					} else if (strcasecmp(attr, "DNStimestamp")==0) {
-						if (sscanf(bvals[0]->bv_val, "%16s", rr.timestamp)!=1)
-							rr.timestamp[0] = '\0';
-						else if (options.ldifname[0])
-							fprintf(ldifout, "%s: %s\n", attr, rr.timestamp);
-					} else if (strcasecmp(attr, "DNSpreference")==0) {
-						if (sscanf(bvals[0]->bv_val, "%s", rr.preference)!=1)
-							rr.preference[0] = '\0';
-						else if (options.ldifname[0])
-							fprintf(ldifout, "%s: %s\n", attr, bvals[0]->bv_val);
-					} else if (strcasecmp(attr, "DNSlocation")==0) {
-						if (sscanf(bvals[0]->bv_val, "%s", rr.location)!=1)
-							rr.location[0] = '\0';
-						else if (options.ldifname[0])
-							fprintf(ldifout, "%s: %s\n", attr, bvals[0]->bv_val);
-					}
+	strncpy(rr->class, "IN", 3);
 #if defined DRAFT_RFC
-					else if (strcasecmp(attr, "DNSrr")==0) {
-						strncpy(rr.rr, bvals[0]->bv_val, 1024);
-						if (options.ldifname[0])
-							fprintf(ldifout, "%s: %s\n", attr, rr.rr);
-					} else if (strcasecmp(attr, "DNSaliasedobjectname")==0) {
-						if (sscanf(bvals[0]->bv_val, "%256s", rr.aliasedobjectname)!=1)
-							rr.aliasedobjectname[0] = '\0';
-						else if (options.ldifname[0])
-							fprintf(ldifout, "%s: %s\n", attr, rr.aliasedobjectname);
-					} else if (strcasecmp(attr, "DNSmacaddress")==0) {
+	aliasedobjectname[0] = '\0';
+	rrtext[0] = '\0';
+#endif
+	for (a = 0; a<e->attrs; a++) {
+		const char* attr = e->attr[a].name;
+		struct berval** bvals;
+
+		if ( (bvals = e->attr[a].vals)!=NULL ) {
+			if (bvals[0] && bvals[0]->bv_len>0) {
+				if (strcasecmp(attr, "DNSdomainname")==0) {
+					dname_release(rr->domainname);
+					rr->domainname = dname_intern(bvals[0]->bv_val);
+				} else if (strcasecmp(attr, "DNSclass")==0) {
+					if (sscanf(bvals[0]->bv_val, "%16s", rr->class)!=1)
+						rr->class[0] = '\0';
+				} else if (strcasecmp(attr, "DNStype")==0) {
+					if (sscanf(bvals[0]->bv_val, "%16s", rr->type)!=1)
+						rr->type[0] = '\0';
+				} else if (strcasecmp(attr, "DNSipaddr")==0) {
+					int i;
+					rr->ipaddresses = 0;
+					for (i = 0; bvals[i] && rr->ipaddresses<256; i++) {
+						if (ipaddr_parse(&ipaddr[rr->ipaddresses], bvals[i]->bv_val))
+							rr->ipaddresses++;
+						else
+							fprintf(stderr, "[**] Warning: ignoring invalid DNSipaddr '%s' of %s\n", bvals[i]->bv_val, dn);
+					}
+					free(rr->ipaddr);
+					rr->ipaddr = NULL;
+					if (rr->ipaddresses>0) {
+						rr->ipaddr = xcalloc(rr->ipaddresses, sizeof(ipaddr[0]));
+						memcpy(rr->ipaddr, ipaddr, rr->ipaddresses*sizeof(ipaddr[0]));
+					}
+				} else if (strcasecmp(attr, "DNScipaddr")==0) {
+					if (!ipaddr_parse(&rr->cipaddr, bvals[0]->bv_val))
+						fprintf(stderr, "[**] Warning: ignoring invalid DNScipaddr '%s' of %s\n", bvals[0]->bv_val, dn);
+				} else if (strcasecmp(attr, "DNScname")==0) {
+					/* validate against the primary zone name, aliases are expanded on output */
+					if (expand_domainname(expanded, bvals[0]->bv_val, bvals[0]->bv_len)) {
+						dname_release(rr->cname);
+						rr->cname = dname_intern(bvals[0]->bv_val);
 					}
+				} else if (strcasecmp(attr, "DNStxt")==0) {
+					rr->txt = xstrdup(bvals[0]->bv_val);
+				} else if (strcasecmp(attr, "DNSttl")==0) {
+					if (sscanf(bvals[0]->bv_val, "%12s", rr->ttl)!=1)
+						rr->ttl[0] = '\0';
+				} else if (strcasecmp(attr, "DNStimestamp")==0) {
+					if (sscanf(bvals[0]->bv_val, "%16s", rr->timestamp)!=1)
+						rr->timestamp[0] = '\0';
+				} else if (strcasecmp(attr, "DNSpreference")==0) {
+					if (sscanf(bvals[0]->bv_val, "%11s", rr->preference)!=1)
+						rr->preference[0] = '\0';
+				} else if (strcasecmp(attr, "DNSlocation")==0) {
+					if (sscanf(bvals[0]->bv_val, "%2s", rr->location)!=1)
+						rr->location[0] = '\0';
+				}
+#if defined DRAFT_RFC
+				else if (strcasecmp(attr, "DNSrr")==0) {
+					strncpy(rrtext, bvals[0]->bv_val, sizeof(rrtext)-1);
+					rrtext[sizeof(rrtext)-1] = '\0';
+				} else if (strcasecmp(attr, "DNSaliasedobjectname")==0) {
+					if (sscanf(bvals[0]->bv_val, "%255s", aliasedobjectname)!=1)
+						aliasedobjectname[0] = '\0';
+				} else if (strcasecmp(attr, "DNSmacaddress")==0) {
+				}
 #endif
-					else if (strcasecmp(attr, "DNSsrvpriority")==0) {
-						if (!(rr.srvpriority = atoi(bvals[0]->bv_val)))
-                                                        rr.srvpriority = 0;
-                                                else if (options.ldifname[0])
-                                                        fprintf(ldifout, "%s: %d\n", attr, rr.srvpriority);
-					} else if (strcasecmp(attr, "DNSsrvweight")==0) {
-						if (!(rr.srvweight = atoi(bvals[0]->bv_val)))
-                                                        rr.srvweight = 0;
-                                                else if (options.ldifname[0])
-                                                        fprintf(ldifout, "%s: %d\n", attr, rr.srvweight);
-                                        } else if (strcasecmp(attr, "DNSsrvport")==0) {
-						if (!(rr.srvport = atoi(bvals[0]->bv_val)))
-                                                        rr.srvport = 0;
-                                                else if (options.ldifname[0])
-                                                        fprintf(ldifout, "%s: %d\n", attr, rr.srvport);
-                                        }
+				else if (strcasecmp(attr, "DNSsrvpriority")==0) {
+					if (!(rr->srvpriority = atoi(bvals[0]->bv_val)))
+						rr->srvpriority = 0;
+				} else if (strcasecmp(attr, "DNSsrvweight")==0) {
+					if (!(rr->srvweight = atoi(bvals[0]->bv_val)))
+						rr->srvweight = 0;
+				} else if (strcasecmp(attr, "DNSsrvport")==0) {
+					if (!(rr->srvport = atoi(bvals[0]->bv_val)))
+						rr->srvport = 0;
 				}
-				ldap_value_free_len(bvals);
 			}
 		}
+	}
 #if defined DRAFT_RFC
-		if (rr.rr[0]) {
-			parse_rr(&rr);
-		}
+	if (rrtext[0])
+		parse_rr(rr, rrtext);
 #endif
-		do {
-			ipaddresses--;
-			write_rr(&rr, ipaddresses, znix);
-		} while (ipaddresses>0);
+	*last = rr;
+	last = &rr->next;
 #if defined DRAFT_RFC
-		if (rr.aliasedobjectname[0])
-			read_resourcerecords(rr.aliasedobjectname);
+	if (aliasedobjectname[0])
+		read_resourcerecords(z, aliasedobjectname);
+	for (; *last; last = &(*last)->next);
 #endif
-		if (options.ldifname[0])
-			fprintf(ldifout, "\n");
-		if (options.verbose&2)
-			printf("\trr: %s %s %s\n", rr.class, rr.type, rr.dnsdomainname);
-		free(dn);
+	if (options.check || options.ldifname[0])
+		rr->dn = xstrdup(dn);
+	return last;
+}
+
+
+static void read_resourcerecords(struct dnszone* z, char* dn)
+{
+	LDAPMessage* res = NULL;
+	LDAPMessage* m;
+	struct dnsrecord** last;
+	int ldaperr;
+
+	if ( (ldaperr = ldap_search_ext_s(ldap_con, dn, LDAP_SCOPE_SUBTREE, "objectclass=DNSrrset", NULL, 0, NULL, NULL, &options.searchtimeout, options.reclimit, &res))!=LDAP_SUCCESS ) {
+		/* a partial result, e.g. after a size limit, is no zone to publish */
+		if (res)
+			ldap_msgfree(res);
+		ldap_failed(ldaperr);
+		return;
+	}
+	if (ldap_count_entries(ldap_con, res) < 1) {
+		fprintf(stderr, "\n[**] Warning: No DNS records found for domain %s.\n\n", zone.domainname);
+		ldap_msgfree(res);
+		return;
+	}
+	for (last = &z->records; *last; last = &(*last)->next);
+	for (m = ldap_first_entry(ldap_con, res); m; m = ldap_next_entry(ldap_con, m)) {
+		struct ldapentry* e = entry_get(m);
+		last = read_rrset(z, last, e);
+		entry_free(e);
 	}
 	ldap_msgfree(res);
 }
 
 
+/*
+ * Fill the scratch record used by the output writers from a decoded record,
+ * expanding relative names against the zone currently being written.
+ */
+static void load_record(struct resourcerecord* rr, const struct dnsrecord* r)
+{
+	char name[1024];
+
+	rr->cn[0] = '\0';
+	if (!r->domainname)
+		strncpy(rr->dnsdomainname, zone.domainname, 64);
+	else if (!expand_domainname(rr->dnsdomainname, name, strlen(dname_text(name, sizeof(name), r->domainname))))
+		rr->dnsdomainname[0] = '\0';
+	if (!r->cname || !expand_domainname(rr->cname, name, strlen(dname_text(name, sizeof(name), r->cname))))
+		rr->cname[0] = '\0';
+	strncpy(rr->class, r->class, sizeof(rr->class));
+	strncpy(rr->type, r->type, sizeof(rr->type));
+	rr->cipaddr = r->cipaddr;
+	strncpy(rr->ttl, r->ttl, sizeof(rr->ttl));
+	strncpy(rr->timestamp, r->timestamp, sizeof(rr->timestamp));
+	strncpy(rr->preference, r->preference, sizeof(rr->preference));
+	strncpy(rr->location, r->location, sizeof(rr->location));
+	rr->ipaddr = r->ipaddr;
+	rr->srvpriority = r->srvpriority;
+	rr->srvweight = r->srvweight;
+	rr->srvport = r->srvport;
+	if (r->txt) {
+		strncpy(rr->txt, r->txt, sizeof(rr->txt) - 1);
+		rr->txt[sizeof(rr->txt) - 1] = '\0';
+	} else
+		rr->txt[0] = '\0';
+}
+
+
+static void write_record(const struct dnsrecord* r, int znix)
+{
+	struct resourcerecord rr;
+	int ipaddresses = r->ipaddresses;
+
+	load_record(&rr, r);
+	do {
+		ipaddresses--;
+		write_rr(&rr, ipaddresses, znix);
+	} while (ipaddresses>0);
+	if (render_verbose&2)
+		printf("\trr: %s %s %s\n", rr.class, rr.type, rr.dnsdomainname);
+}
+
+
+/* Name of the BIND zone file for zonename */
+static const char* zone_filename(char* buf, size_t size, const char* zonename)
+{
+	snprintf(buf, size, options.output&OUTPUT_RAW ? "%s.raw" : "%s.db", zonename);
+	return buf;
+}
+
+
 static void write_zone(void)
 {
 	int len;
 	char soa[20];
+	char filename[128];
 
 	if (tinyfile) {
 		fprintf(tinyfile, "Z%s:%s:%s:%s:%s:%s:%s:%s:%s:%s:%s\n",
@@ -924,8 +2069,9 @@ static void write_zone(void)
 		    zone.minimum, zone.ttl, zone.timestamp, zone.location);
 	}
 	if (namedmaster) {
-		fprintf(namedmaster, "zone \"%s\" %s {\n\ttype master;\n\tfile \"%s.db\";\n};\n",
-		    zone.domainname, zone.class, zone.domainname);
+		fprintf(namedmaster, "zone \"%s\" %s {\n\ttype master;\n\tfile \"%s\";\n%s};\n",
+		    zone.domainname, zone.class, zone_filename(filename, sizeof(filename), zone.domainname),
+		    options.output&OUTPUT_RAW ? "\tmasterfile-format raw;\n" : "");
 	}
 	if (namedzone) {
 		fprintf(namedzone, ";\n; Automatically generated by ldap2dns v%s - DO NOT EDIT!\n;\n\n", VERSION);
@@ -940,8 +2086,6 @@ static void write_zone(void)
 		fprintf(namedzone, (zone.adminmailbox[len-1]=='.') ? "%s " : "%s. ", zone.adminmailbox);
 		fprintf(namedzone, "(\n\t%s\t; Serial\n\t%s\t; Refresh\n\t%s\t; Retry\n\t%s\t; Expire\n\t%s )\t; Minimum\n", zone.serial, zone.refresh, zone.retry, zone.expire, zone.minimum); 
 	}
-	if (options.ldifname[0])
-		fprintf(ldifout, "\n");
 }
 
 
@@ -951,12 +2095,18 @@ static void calc_checksum(int* num, int* sum)
 	LDAPMessage* m;
 	int ldaperr;
 	char* attr_list[2] = { "DNSserial", NULL };
+	char filter[1400];
 
 	*num = *sum = 0;
-	if ( ldaperr = ldap_search_ext_s(ldap_con, options.searchbase[0] ? options.searchbase : NULL, LDAP_SCOPE_ONELEVEL, "objectclass=DNSzone", attr_list, 0, NULL, NULL, &options.searchtimeout, options.reclimit, &res)!=LDAP_SUCCESS )
-		die_ldap(ldaperr);
+	if ( (ldaperr = ldap_search_ext_s(ldap_con, options.searchbase[0] ? options.searchbase : NULL, LDAP_SCOPE_ONELEVEL, zone_filter(filter, sizeof(filter)), attr_list, 0, NULL, NULL, &options.searchtimeout, options.reclimit, &res))!=LDAP_SUCCESS ) {
+		if (res)
+			ldap_msgfree(res);
+		ldap_failed(ldaperr);
+		return;
+	}
 	if (ldap_count_entries(ldap_con, res) < 1) {
 		fprintf(stderr, "\n[**] Warning: No records returned from search.  Check for correct credentials,\n[**] LDAP hostname, and search base DN.\n\n");
+		ldap_msgfree(res);
 		return;
 	}
 		
@@ -973,6 +2123,7 @@ static void calc_checksum(int* num, int* sum)
 				}	
 				ldap_value_free_len(bvals);
 			}
+			ldap_memfree(attr);
 		}
 		ber_free(ber, 0);
 	}
@@ -980,323 +2131,6834 @@ static void calc_checksum(int* num, int* sum)
 }
 
 
-static void read_dnszones(void)
+/*
+ * Normalization (-N).  The records of a freshly decoded zone are put into
+ * DNSSEC canonical order (RFC 4034, section 6): by owner name, compared
+ * label by label from the right and ignoring case, then by type and RDATA.
+ * Every RRset thus ends up in one piece and the output no longer depends on
+ * the order the server returned the entries in.  Records that would be
+ * written identically are dropped.
+ */
+struct rrkey
 {
-	LDAPMessage* res = NULL;
-	LDAPMessage* m;
-	int ldaperr;
+	struct dnsrecord* r;
+	char* owner;		/* expanded owner name */
+	char* canonical;	/* its labels reversed and lower cased */
+	char* cname;		/* expanded target name */
+	int type;
+};
 
-	if (tinyfile)
-		fprintf(tinyfile, "#\n# Automatically generated by ldap2dns v%s - DO NOT EDIT!\n#\n\n", VERSION);
-	if (namedmaster)
-		fprintf(namedmaster, "#\n# Automatically generated by ldap2dns v%s - DO NOT EDIT!\n#\n\n", VERSION);
-	if ( (ldaperr = ldap_search_ext_s(ldap_con, options.searchbase[0] ? options.searchbase : NULL, LDAP_SCOPE_SUBTREE, "objectclass=DNSzone", NULL, 0, NULL, NULL, &options.searchtimeout, options.reclimit, &res))!=LDAP_SUCCESS )
-		die_ldap(ldaperr);
-	if (ldap_count_entries(ldap_con, res) < 1) {
-		fprintf(stderr, "\n[**] Warning: No records returned from search.  Check for correct credentials,\n[**] LDAP hostname, and search base DN.\n\n");
-		return;
-	}
-	for (m = ldap_first_entry(ldap_con, res); m; m = ldap_next_entry(ldap_con, m)) {
-		BerElement* ber = NULL;
-		char* attr;
-		char* dn;
-		int i, zonenames = 0;
-		char zdn[256][64];
-		char ldif0;
-
-		strncpy(zone.class, "IN", 3);
-		zone.serial[0] = '\0';
-		zone.refresh[0] = '\0';
-		zone.retry[0] = '\0';
-		zone.expire[0] = '\0';
-		zone.minimum[0] = '\0';
-		zone.ttl[0] = '\0';
-		zone.timestamp[0] = '\0';
-		zone.location[0] = '\0';
-		dn = ldap_get_dn(ldap_con, m);
-		if (options.ldifname[0])
-			fprintf(ldifout, "dn: %s\n", dn);
-		for (attr = ldap_first_attribute(ldap_con, m, &ber); attr; attr = ldap_next_attribute(ldap_con, m, ber)) {
-			struct berval** bvals = ldap_get_values_len(ldap_con, m, attr);
-			if (bvals!=NULL) {
-				if (bvals[0] && bvals[0]->bv_len>0) {
-					if (strcasecmp(attr, "objectclass")==0
-					    || strcasecmp(attr, "DNSclass")==0
-					    || strcasecmp(attr, "DNStype")==0
-					    || strcasecmp(attr, "cn")==0) {
-						if (options.ldifname[0])
-							fprintf(ldifout, "%s: %s\n", attr, bvals[0]->bv_val);
-					} else if (strcasecmp(attr, "DNSzonename")==0) {
-						for (zonenames = 0; bvals[zonenames] && zonenames<256; zonenames++) {
-							if (sscanf(bvals[zonenames]->bv_val, "%64s", zdn[zonenames])!=1)
-								zdn[zonenames][0] = '\0';
-							else if (options.ldifname[0])
-								fprintf(ldifout, "%s: %s\n", attr, zdn[zonenames]);
-						}
-					} else if (strcasecmp(attr, "DNSserial")==0) {
-						if (sscanf(bvals[0]->bv_val, "%12s", zone.serial)!=1)
-							zone.serial[0] = '\0';
-						else if (options.ldifname[0])
-							fprintf(ldifout, "%s: %s\n", attr, zone.serial);
-					} else if (strcasecmp(attr, "DNSrefresh")==0) {
-						if (sscanf(bvals[0]->bv_val, "%12s", zone.refresh)!=1)
-							zone.refresh[0] = '\0';
-						else if (options.ldifname[0])
-							fprintf(ldifout, "%s: %s\n", attr, zone.refresh);
-					} else if (strcasecmp(attr, "DNSretry")==0) {
-						if (sscanf(bvals[0]->bv_val, "%12s", zone.retry)!=1)
-							zone.retry[0] = '\0';
-						else if (options.ldifname[0])
-							fprintf(ldifout, "%s: %s\n", attr, zone.retry);
-					} else if (strcasecmp(attr, "DNSexpire")==0) {
-						if (sscanf(bvals[0]->bv_val, "%12s", zone.expire)!=1)
-							zone.expire[0] = '\0';
-						else if (options.ldifname[0])
-							fprintf(ldifout, "%s: %s\n", attr, zone.expire);
-					} else if (strcasecmp(attr, "DNSminimum")==0) {
-						if (sscanf(bvals[0]->bv_val, "%12s", zone.minimum)!=1)
-							zone.minimum[0] = '\0';
-						else if (options.ldifname[0])
-							fprintf(ldifout, "%s: %s\n", attr, zone.minimum);
-					} else if (strcasecmp(attr, "DNSadminmailbox")==0) {
-						if (sscanf(bvals[0]->bv_val, "%64s", zone.adminmailbox)!=1)
-							zone.adminmailbox[0] = '\0';
-						else if (options.ldifname[0])
-							fprintf(ldifout, "%s: %s\n", attr, zone.adminmailbox);
-					} else if (strcasecmp(attr, "DNSzonemaster")==0) {
-						if (sscanf(bvals[0]->bv_val, "%64s", zone.zonemaster)!=1)
-							zone.zonemaster[0] = '\0';
-						else if (options.ldifname[0])
-							fprintf(ldifout, "%s: %s\n", attr, zone.zonemaster);
-					} else if (strcasecmp(attr, "DNSttl")==0) {
-						if (sscanf(bvals[0]->bv_val, "%12s", zone.ttl)!=1)
-							zone.ttl[0] = '\0';
-						else if (options.ldifname[0])
-							fprintf(ldifout, "%s: %s\n", attr, zone.ttl);
-					} else if (strcasecmp(attr, "DNStimestamp")==0) {
-						if (sscanf(bvals[0]->bv_val, "%16s", zone.timestamp)!=1)
-							zone.timestamp[0] = '\0';
-						else if (options.ldifname[0])
-							fprintf(ldifout, "%s: %s\n", attr, zone.timestamp);
-					} else if (strcasecmp(attr, "DNSlocation")==0) {
-						if (sscanf(bvals[0]->bv_val, "%2s", zone.location)!=1)
-							zone.location[0] = '\0';
-						else if (options.ldifname[0])
-							fprintf(ldifout, "%s: %s\n", attr, zone.location);
-					}
-				}
-				ldap_value_free_len(bvals);
-			}
-		}
-		ldif0 = options.ldifname[0];
-		for (i = 0; i<zonenames; i++) {
-			strncpy(zone.domainname, zdn[i], 64);
-			if (i>0)
-				options.ldifname[0] = '\0';
-			if (options.verbose&1)
-				printf("zonename: %s\n", zone.domainname);
-			if (options.output&OUTPUT_DB) {
-				char namedzonename[128];
-				snprintf(namedzonename, sizeof(namedzonename), "%s.db", zone.domainname);
-				if ( !(namedzone = fopen(namedzonename, "w")) )
-					die_exit("Unable to open db-file for writing");
-			}
-			write_zone();
-			read_resourcerecords(dn, i);
-			if (namedzone)
-				fclose(namedzone);
-			if (options.verbose&2)
-				printf("\n");
-			if (options.ldifname[0])
-				fprintf(ldifout, "\n");
-		}
-		options.ldifname[0] = ldif0;
-		free(dn);
-	}
-	ldap_msgfree(res);
-}
 
-static void write_loccode(int lidx)
+static void free_record(struct dnsrecord* r)
 {
-	if (tinyfile) {
-		fprintf(tinyfile, "%%%s:%s\n", loc_rec.locname, loc_rec.member[lidx]);
-	}
-	if (options.ldifname[0])
-		fprintf(ldifout, "\n");
+	dname_release(r->domainname);
+	dname_release(r->cname);
+	free(r->txt);
+	free(r->ipaddr);
+	free(r->dn);
+	free(r);
 }
 
 
-static void read_loccodes(void)
+/* Type code for canonical ordering, unknown types sort last by name */
+static int rr_typecode(const char* type)
 {
-	LDAPMessage* res = NULL;
-	LDAPMessage* m;
-	int ldaperr;
+	static const struct { const char* name; int code; } types[] = {
+		{ "A", 1 }, { "NS", 2 }, { "CNAME", 5 }, { "PTR", 12 }, { "MX", 15 },
+		{ "TXT", 16 }, { "AAAA", 28 }, { "SRV", 33 }, { NULL, 0 }
+	};
+	int i;
 
-	if ( (ldaperr = ldap_search_ext_s(ldap_con, options.searchbase[0] ? options.searchbase : NULL, LDAP_SCOPE_SUBTREE, "objectclass=DNSloccodes", NULL, 0, NULL, NULL, &options.searchtimeout, options.reclimit, &res))!=LDAP_SUCCESS )
-		die_ldap(ldaperr);
+	for (i = 0; types[i].name; i++)
+		if (!strcasecmp(type, types[i].name))
+			return types[i].code;
+	return 65536;
+}
 
-	// We aren't going to warn for zero records here as many installs do
-	// not use location codes at all
-	if ((ldap_count_entries(ldap_con, res) > 0) && tinyfile) {
-		fprintf(tinyfile, "#\n# Location Codes (if any) - generated by ldap2dns v%s - DO NOT EDIT!\n#\n\n", VERSION);
-	} else {
+
+static char* canonical_name(const char* name)
+{
+	size_t len = strlen(name);
+	char* key = malloc(len+2);
+	const char* end = name+len;
+	const char* label;
+	const char* c;
+	char* p = key;
+
+	if (!key)
+		die_exit(NULL);
+	while (end>name) {
+		for (label = end; label>name && label[-1]!='.'; label--);
+		for (c = label; c<end; c++)
+			*p++ = tolower((unsigned char)*c);
+		/* below any label character, so parents sort before children */
+		*p++ = '\001';
+		end = label-1;
+	}
+	*p = '\0';
+	return key;
+}
+
+
+/* Addresses by value, unset ones first and IPv4 before IPv6 */
+static int cmp_addr(const struct ipaddr* a, const struct ipaddr* b)
+{
+	if (a->len!=b->len)
+		return a->len<b->len ? -1 : 1;
+	return memcmp(a->addr, b->addr, a->len);
+}
+
+
+static int cmp_ipaddr(const void* a, const void* b)
+{
+	/* written from the last one, so this puts them out in ascending order */
+	return cmp_addr(b, a);
+}
+
+
+static int cmp_rrkey(const void* a, const void* b)
+{
+	const struct rrkey* x = a;
+	const struct rrkey* y = b;
+	const struct dnsrecord* r = x->r;
+	const struct dnsrecord* s = y->r;
+	int res, i;
+
+	if ((res = strcmp(x->canonical, y->canonical)))
+		return res;
+	if (x->type!=y->type)
+		return x->type<y->type ? -1 : 1;
+	if ((res = strcasecmp(r->type, s->type)))
+		return res;
+	if ((res = atoi(r->preference)-atoi(s->preference)))
+		return res;
+	if ((res = r->srvpriority-s->srvpriority) || (res = r->srvweight-s->srvweight) || (res = r->srvport-s->srvport))
+		return res;
+	if ((res = strcasecmp(x->cname, y->cname)))
+		return res;
+	if ((res = cmp_addr(&r->cipaddr, &s->cipaddr)))
+		return res;
+	if ((res = r->ipaddresses-s->ipaddresses))
+		return res;
+	for (i = r->ipaddresses-1; i>=0; i--)
+		if ((res = cmp_addr(&r->ipaddr[i], &s->ipaddr[i])))
+			return res;
+	if ((res = strcmp(r->txt ? r->txt : "", s->txt ? s->txt : "")))
+		return res;
+	if ((res = strcmp(r->class, s->class)) || (res = strcmp(r->ttl, s->ttl)) || (res = strcmp(r->timestamp, s->timestamp)))
+		return res;
+	if ((res = strcmp(r->location, s->location)))
+		return res;
+	/* equal in DNS terms, keep the spelling found in LDAP apart */
+	if ((res = strcmp(x->owner, y->owner)))
+		return res;
+	return strcmp(x->cname, y->cname);
+}
+
+
+static void normalize_zone(struct dnszone* z)
+{
+	struct resourcerecord rr;
+	struct dnsrecord** last;
+	struct dnsrecord* r;
+	struct rrkey* keys;
+	int count, i, k;
+
+	for (count = 0, r = z->records; r; r = r->next)
+		count++;
+	if (count==0)
+		return;
+	zone = z->soa;
+	strncpy(zone.domainname, z->zonename[0], 64);
+	keys = xcalloc(count, sizeof(struct rrkey));
+	for (i = 0, r = z->records; r; r = r->next, i++) {
+		load_record(&rr, r);
+		keys[i].r = r;
+		keys[i].owner = xstrdup(rr.dnsdomainname);
+		keys[i].canonical = canonical_name(rr.dnsdomainname);
+		keys[i].cname = xstrdup(rr.cname);
+		keys[i].type = rr_typecode(r->type);
+		if (r->ipaddresses>1) {
+			qsort(r->ipaddr, r->ipaddresses, sizeof(r->ipaddr[0]), cmp_ipaddr);
+			for (k = 1; k<r->ipaddresses; ) {
+				if (cmp_addr(&r->ipaddr[k-1], &r->ipaddr[k]))
+					k++;
+				else
+					memmove(&r->ipaddr[k-1], &r->ipaddr[k], (--r->ipaddresses - k + 1)*sizeof(r->ipaddr[0]));
+			}
+		}
+	}
+	qsort(keys, count, sizeof(struct rrkey), cmp_rrkey);
+	last = &z->records;
+	for (i = 0, k = 0; i<count; i++) {
+		if (i>0 && cmp_rrkey(&keys[k], &keys[i])==0) {
+			free_record(keys[i].r);
+			continue;
+		}
+		k = i;
+		*last = keys[i].r;
+		last = &keys[i].r->next;
+	}
+	*last = NULL;
+	for (i = 0; i<count; i++) {
+		free(keys[i].owner);
+		free(keys[i].canonical);
+		free(keys[i].cname);
+	}
+	free(keys);
+}
+
+
+/* Equal lines in the order they were written */
+static int cmp_linepos(const void* a, const void* b)
+{
+	const char* x = *(char* const*)a;
+	const char* y = *(char* const*)b;
+	int res = strcmp(x, y);
+
+	return res ? res : x<y ? -1 : x>y;
+}
+
+
+/*
+ * Pass the tinydns lines a zone rendered into buf on to fp, leaving out the
+ * ones already written for it, e.g. absolute names under every alias
+ */
+static void write_unique_lines(FILE* fp, char* buf)
+{
+	char** line;
+	char** sorted;
+	char* save;
+	char* p;
+	int count, n, i, k;
+
+	for (count = 0, p = buf; *p; p++)
+		count += *p=='\n';
+	line = xcalloc(count+1, sizeof(char*));
+	sorted = xcalloc(count+1, sizeof(char*));
+	for (n = 0, p = strtok_r(buf, "\n", &save); p; p = strtok_r(NULL, "\n", &save), n++)
+		line[n] = sorted[n] = p;
+	qsort(sorted, n, sizeof(char*), cmp_linepos);
+	for (i = 1, k = 0; i<n; i++) {
+		if (strcmp(sorted[k], sorted[i]))
+			k = i;
+		else
+			sorted[i][0] = '\0';
+	}
+	for (i = 0; i<n; i++)
+		if (line[i][0])
+			fprintf(fp, "%s\n", line[i]);
+	free(sorted);
+	free(line);
+}
+
+
+static void writers_push(const struct dnszone* z);
+
+
+static int cmp_zonedn(const void* a, const void* b)
+{
+	return strcmp((*(const struct dnszone**)a)->dn, (*(const struct dnszone**)b)->dn);
+}
+
+
+/* A shard attribute is either the shard number or hashed like a zone DN */
+static int shard_value(const char* value)
+{
+	char* end;
+	long n = strtol(value, &end, 10);
+
+	if (end!=value && !*end && n>=0)
+		return n;
+	return fnv64(FNV64_INIT, value, strlen(value)) & 0x7fffffff;
+}
+
+
+static int zone_shard(const struct dnszone* z)
+{
+	if (z->shard>=0)
+		return z->shard % options.shards;
+	return fnv64(FNV64_INIT, z->dn, strlen(z->dn)) % options.shards;
+}
+
+
+/* Decode the SOA and names of one DNSzone entry, without its records */
+static struct dnszone* read_dnszone(const struct ldapentry* e)
+{
+	struct dnszone* z = xcalloc(1, sizeof(struct dnszone));
+	char zdn[256][64];
+	int a;
+
+	strncpy(z->soa.class, "IN", 3);
+	z->shard = -1;
+	z->dn = xstrdup(e->dn);
+	for (a = 0; a<e->attrs; a++) {
+		const char* attr = e->attr[a].name;
+		struct berval** bvals = e->attr[a].vals;
+		if (bvals!=NULL) {
+			if (bvals[0] && bvals[0]->bv_len>0) {
+				if (options.shard_attr[0] && strcasecmp(attr, options.shard_attr)==0)
+					z->shard = shard_value(bvals[0]->bv_val);
+				if (strcasecmp(attr, "DNSzonename")==0) {
+					for (z->zonenames = 0; bvals[z->zonenames] && z->zonenames<256; z->zonenames++)
+						if (sscanf(bvals[z->zonenames]->bv_val, "%63s", zdn[z->zonenames])!=1)
+							zdn[z->zonenames][0] = '\0';
+				} else if (strcasecmp(attr, "DNSserial")==0) {
+					if (sscanf(bvals[0]->bv_val, "%11s", z->soa.serial)!=1)
+						z->soa.serial[0] = '\0';
+				} else if (strcasecmp(attr, "DNSrefresh")==0) {
+					if (sscanf(bvals[0]->bv_val, "%11s", z->soa.refresh)!=1)
+						z->soa.refresh[0] = '\0';
+				} else if (strcasecmp(attr, "DNSretry")==0) {
+					if (sscanf(bvals[0]->bv_val, "%11s", z->soa.retry)!=1)
+						z->soa.retry[0] = '\0';
+				} else if (strcasecmp(attr, "DNSexpire")==0) {
+					if (sscanf(bvals[0]->bv_val, "%11s", z->soa.expire)!=1)
+						z->soa.expire[0] = '\0';
+				} else if (strcasecmp(attr, "DNSminimum")==0) {
+					if (sscanf(bvals[0]->bv_val, "%11s", z->soa.minimum)!=1)
+						z->soa.minimum[0] = '\0';
+				} else if (strcasecmp(attr, "DNSadminmailbox")==0) {
+					if (sscanf(bvals[0]->bv_val, "%63s", z->soa.adminmailbox)!=1)
+						z->soa.adminmailbox[0] = '\0';
+				} else if (strcasecmp(attr, "DNSzonemaster")==0) {
+					if (sscanf(bvals[0]->bv_val, "%63s", z->soa.zonemaster)!=1)
+						z->soa.zonemaster[0] = '\0';
+				} else if (strcasecmp(attr, "DNSttl")==0) {
+					if (sscanf(bvals[0]->bv_val, "%11s", z->soa.ttl)!=1)
+						z->soa.ttl[0] = '\0';
+				} else if (strcasecmp(attr, "DNStimestamp")==0) {
+					if (sscanf(bvals[0]->bv_val, "%16s", z->soa.timestamp)!=1)
+						z->soa.timestamp[0] = '\0';
+				} else if (strcasecmp(attr, "DNSlocation")==0) {
+					if (sscanf(bvals[0]->bv_val, "%2s", z->soa.location)!=1)
+						z->soa.location[0] = '\0';
+				}
+			}
+		}
+	}
+	if (z->zonenames>0) {
+		z->zonename = xcalloc(z->zonenames, sizeof(zdn[0]));
+		memcpy(z->zonename, zdn, z->zonenames*sizeof(zdn[0]));
+	}
+	return z;
+}
+
+
+/* Index of the previous zones by DN, NULL if there are none */
+static struct dnszone** zone_index(struct dataset* prev, int* indexed)
+{
+	struct dnszone** index;
+	struct dnszone* z;
+
+	*indexed = 0;
+	if (!prev)
+		return NULL;
+	for (z = prev->zones; z; z = z->next)
+		(*indexed)++;
+	index = xcalloc(*indexed+1, sizeof(struct dnszone*));
+	for (*indexed = 0, z = prev->zones; z; z = z->next)
+		index[(*indexed)++] = z;
+	qsort(index, *indexed, sizeof(struct dnszone*), cmp_zonedn);
+	return index;
+}
+
+
+static struct dnszone* unchanged_zone(struct dnszone** index, int indexed, const char* dn, const char* serial)
+{
+	struct dnszone key;
+	struct dnszone* k = &key;
+	struct dnszone** old;
+
+	if (!index || !serial[0])
+		return NULL;
+	key.dn = (char*)dn;
+	if ( !(old = bsearch(&k, index, indexed, sizeof(struct dnszone*), cmp_zonedn)) )
+		return NULL;
+	return strcmp((*old)->soa.serial, serial)==0 ? *old : NULL;
+}
+
+
+/* Take over the records of the previous copy of z if its serial is unchanged */
+static int reuse_records(struct dnszone* z, struct dnszone** index, int indexed)
+{
+	struct dnszone* old = unchanged_zone(index, indexed, z->dn, z->soa.serial);
+
+	if (!old)
+		return 0;
+	if (options.verbose&2)
+		printf("zone: %s unchanged at serial %s\n", z->dn, z->soa.serial);
+	z->records = old->records;
+	old->records = NULL;
+	return 1;
+}
+
+
+/* Hand the records taken over by reuse_records() back to prev after a failed refresh */
+static void return_records(struct dataset* ds, struct dataset* prev)
+{
+	struct dnszone** index;
+	struct dnszone* old;
+	struct dnszone* z;
+	int indexed;
+
+	if ( !(index = zone_index(prev, &indexed)) )
+		return;
+	for (z = ds->zones; z; z = z->next)
+		if ((old = unchanged_zone(index, indexed, z->dn, z->soa.serial)) && !old->records) {
+			old->records = z->records;
+			z->records = NULL;
+		}
+	free(index);
+}
+
+
+/*
+ * Name as compared by PTR synthesis (-r): lowercase without a trailing dot,
+ * with the ip6.int of older reverse names turned into ip6.arpa
+ */
+static void reverse_key(char key[MAX_DOMAIN_LEN], const char* name)
+{
+	size_t len;
+
+	for (len = 0; name[len] && len<MAX_DOMAIN_LEN-2; len++)
+		key[len] = tolower((unsigned char)name[len]);
+	if (len>0 && key[len-1]=='.')
+		len--;
+	key[len] = '\0';
+	if (len>=7 && strcmp(key+len-7, "ip6.int")==0 && (len==7 || key[len-8]=='.'))
+		strcpy(key+len-3, "arpa");
+}
+
+
+/* Whether key is suffix or a name below it */
+static int name_under(const char* key, const char* suffix)
+{
+	size_t k = strlen(key);
+	size_t n = strlen(suffix);
+
+	if (k==n)
+		return strcmp(key, suffix)==0;
+	return k>n && key[k-n-1]=='.' && strcmp(key+k-n, suffix)==0;
+}
+
+
+static int reverse_zone(const struct dnszone* z)
+{
+	char key[MAX_DOMAIN_LEN];
+	int i;
+
+	for (i = 0; i<z->zonenames; i++) {
+		reverse_key(key, z->zonename[i]);
+		if (name_under(key, "in-addr.arpa") || name_under(key, "ip6.arpa"))
+			return 1;
+	}
+	return 0;
+}
+
+
+/* With -r, reverse zones are only written once their PTRs are synthesized */
+static int held_back(const struct dnszone* z)
+{
+	return options.reverse && reverse_zone(z);
+}
+
+
+/* Serial z is written with, raised by -r for PTRs synthesized from other zones */
+static const char* zone_serial(const struct dnszone* z)
+{
+	return z->ptrserial[0] ? z->ptrserial : z->soa.serial;
+}
+
+
+static struct zonerecord zone_soa(const struct dnszone* z)
+{
+	struct zonerecord soa = z->soa;
+
+	strcpy(soa.serial, zone_serial(z));
+	return soa;
+}
+
+
+/*
+ * Decode all zones into ds.  Zones of the previous dataset whose serial is
+ * unchanged hand over their records instead of fetching them again.
+ */
+static void read_dnszones(struct dataset* ds, struct dataset* prev)
+{
+	LDAPMessage* res = NULL;
+	LDAPMessage* m;
+	struct ldapentry* e;
+	struct dnszone** last = &ds->zones;
+	struct dnszone** index;
+	struct dnszone* z;
+	char filter[1400];
+	int indexed;
+	int ldaperr;
+
+	if ( (ldaperr = ldap_search_ext_s(ldap_con, options.searchbase[0] ? options.searchbase : NULL, LDAP_SCOPE_SUBTREE, zone_filter(filter, sizeof(filter)), NULL, 0, NULL, NULL, &options.searchtimeout, options.reclimit, &res))!=LDAP_SUCCESS ) {
+		if (res)
+			ldap_msgfree(res);
+		ldap_failed(ldaperr);
+		return;
+	}
+	if (ldap_count_entries(ldap_con, res) < 1) {
+		fprintf(stderr, "\n[**] Warning: No records returned from search.  Check for correct credentials,\n[**] LDAP hostname, and search base DN.\n\n");
+		ldap_msgfree(res);
+		return;
+	}
+	index = zone_index(prev, &indexed);
+	for (m = ldap_first_entry(ldap_con, res); m; m = ldap_next_entry(ldap_con, m)) {
+		e = entry_get(m);
+		z = read_dnszone(e);
+		entry_free(e);
+		if (z->zonenames>0) {
+			/* records are read once and shared by all names of the zone */
+			zone = z->soa;
+			strncpy(zone.domainname, z->zonename[0], 64);
+			if (!reuse_records(z, index, indexed)) {
+				read_resourcerecords(z, z->dn);
+				if (options.normalize)
+					normalize_zone(z);
+			}
+		}
+		*last = z;
+		last = &z->next;
+		if (ldap_error)
+			break;
+		if (!held_back(z))
+			writers_push(z);
+	}
+	free(index);
+	ldap_msgfree(res);
+}
+
+
+/*
+ * Pipelined refresh (-P depth).  A fetch thread owns the LDAP connection:
+ * it streams the zone entries with ldap_result(LDAP_MSG_ONE) and keeps up to
+ * depth record searches in flight on the same connection.  Every entry is
+ * taken out of its message there, as libldap is not safe to use on one
+ * connection from two threads, and handed to the decoding thread through a
+ * lock-free single producer/single consumer ring; a full ring stalls the fetch thread, a full writer queue the
+ * decoder.  Zones are released to the writers in the order the zone search
+ * returned them, so the outputs are identical to those of a serial refresh.
+ */
+#define PIPE_RING 1024
+#define PIPE_ZONE 1	/* zone entry, seq numbers zones in arrival order */
+#define PIPE_RRSET 2	/* record entry belonging to zone seq */
+#define PIPE_DONE 3	/* all records of zone seq have been received */
+#define PIPE_END 4	/* nothing follows */
+
+struct pipeitem
+{
+	struct ldapentry* entry;
+	int kind;
+	int seq;
+	int fetch;
+};
+
+struct pipeline
+{
+	struct pipeitem ring[PIPE_RING];
+	unsigned int head;
+	unsigned int tail;
+	struct dnszone** index;
+	int indexed;
+	int ldaperr;	/* of the fetch thread, set before PIPE_END */
+};
+
+struct pipesearch
+{
+	int msgid;
+	int seq;
+};
+
+struct pipezone
+{
+	struct dnszone* z;
+	struct dnsrecord** last;
+	int complete;
+};
+
+
+static void pipe_wait(unsigned int* spins)
+{
+	if (++*spins<64)
+		sched_yield();
+	else
+		usleep(100);
+}
+
+
+static void pipe_push(struct pipeline* p, int kind, int seq, int fetch, struct ldapentry* entry)
+{
+	unsigned int tail = p->tail;
+	unsigned int spins = 0;
+	struct pipeitem* it;
+
+	while (tail - __atomic_load_n(&p->head, __ATOMIC_ACQUIRE)==PIPE_RING)
+		pipe_wait(&spins);
+	it = &p->ring[tail % PIPE_RING];
+	it->entry = entry;
+	it->kind = kind;
+	it->seq = seq;
+	it->fetch = fetch;
+	__atomic_store_n(&p->tail, tail+1, __ATOMIC_RELEASE);
+}
+
+
+static struct pipeitem pipe_pop(struct pipeline* p)
+{
+	unsigned int head = p->head;
+	unsigned int spins = 0;
+	struct pipeitem it;
+
+	while (__atomic_load_n(&p->tail, __ATOMIC_ACQUIRE)==head)
+		pipe_wait(&spins);
+	it = p->ring[head % PIPE_RING];
+	__atomic_store_n(&p->head, head+1, __ATOMIC_RELEASE);
+	return it;
+}
+
+
+/* Does this zone entry need its records fetched, or can they be reused? */
+static int pipe_needs_records(struct pipeline* p, const struct ldapentry* e)
+{
+	struct berval** bvals;
+	char serial[12] = "";
+
+	if ( !(bvals = entry_values(e, "DNSzonename")) || !bvals[0] || bvals[0]->bv_len==0 )
+		return 0;
+	if ( (bvals = entry_values(e, "DNSserial")) ) {
+		if (!bvals[0] || bvals[0]->bv_len==0 || sscanf(bvals[0]->bv_val, "%11s", serial)!=1)
+			serial[0] = '\0';
+	}
+	return !unchanged_zone(p->index, p->indexed, e->dn, serial);
+}
+
+
+static void* pipe_fetch_thread(void* arg)
+{
+	struct pipeline* p = arg;
+	struct pipesearch* search;
+	struct ldapentry* e;
+	LDAPMessage* msg;
+	char** pending = NULL;
+	int depth = options.pipeline;
+	int zones = 0, started = 0, running = 0;
+	int zonemsgid, msgid, ldaperr;
+	int zonesdone = 0;
+	char filter[1400];
+	int i;
+
+	search = xcalloc(depth, sizeof(struct pipesearch));
+	if ( (ldaperr = ldap_search_ext(ldap_con, options.searchbase[0] ? options.searchbase : NULL, LDAP_SCOPE_SUBTREE, zone_filter(filter, sizeof(filter)), NULL, 0, NULL, NULL, &options.searchtimeout, options.reclimit, &zonemsgid))!=LDAP_SUCCESS )
+		ldap_failed(ldaperr);
+	/* after an error the searches still running are left to die with the connection */
+	while (ldap_error==LDAP_SUCCESS) {
+		/* keep the record searches window full, oldest zone first */
+		for (i = 0; i<depth && started<zones; i++) {
+			if (search[i].msgid)
+				continue;
+			for (; started<zones && !pending[started]; started++)
+				pipe_push(p, PIPE_DONE, started, 0, NULL);
+			if (started==zones)
+				break;
+			if ( (ldaperr = ldap_search_ext(ldap_con, pending[started], LDAP_SCOPE_SUBTREE, "objectclass=DNSrrset", NULL, 0, NULL, NULL, &options.searchtimeout, options.reclimit, &search[i].msgid))!=LDAP_SUCCESS ) {
+				ldap_failed(ldaperr);
+				break;
+			}
+			free(pending[started]);
+			pending[started] = NULL;
+			search[i].seq = started++;
+			running++;
+		}
+		if (ldap_error)
+			break;
+		for (; started<zones && !pending[started]; started++)
+			pipe_push(p, PIPE_DONE, started, 0, NULL);
+		if (zonesdone && running==0 && started==zones)
+			break;
+		switch (ldap_result(ldap_con, LDAP_RES_ANY, LDAP_MSG_ONE, &options.searchtimeout, &msg)) {
+		case -1:
+			ldaperr = LDAP_SERVER_DOWN;
+			ldap_get_option(ldap_con, LDAP_OPT_RESULT_CODE, &ldaperr);
+			ldap_failed(ldaperr);
+			break;
+		case 0:
+			ldap_failed(LDAP_TIMEOUT);
+			break;
+		case LDAP_RES_SEARCH_ENTRY:
+			msgid = ldap_msgid(msg);
+			if (msgid==zonemsgid) {
+				int fetch;
+				e = entry_get(msg);
+				ldap_msgfree(msg);
+				fetch = pipe_needs_records(p, e);
+				if ( !(pending = realloc(pending, (zones+1)*sizeof(char*))) )
+					die_exit(NULL);
+				pending[zones] = fetch ? xstrdup(e->dn) : NULL;
+				/* a zone whose records are reused is complete right away */
+				pipe_push(p, PIPE_ZONE, zones++, fetch, e);
+				break;
+			}
+			for (i = 0; i<depth && search[i].msgid!=msgid; i++);
+			if (i<depth)
+				pipe_push(p, PIPE_RRSET, search[i].seq, 0, entry_get(msg));
+			ldap_msgfree(msg);
+			break;
+		case LDAP_RES_SEARCH_RESULT:
+			msgid = ldap_msgid(msg);
+			ldap_parse_result(ldap_con, msg, &ldaperr, NULL, NULL, NULL, NULL, 1);
+			if (ldaperr!=LDAP_SUCCESS) {
+				ldap_failed(ldaperr);
+				break;
+			}
+			if (msgid==zonemsgid) {
+				zonesdone = 1;
+				if (zones==0)
+					fprintf(stderr, "\n[**] Warning: No records returned from search.  Check for correct credentials,\n[**] LDAP hostname, and search base DN.\n\n");
+				break;
+			}
+			for (i = 0; i<depth && search[i].msgid!=msgid; i++);
+			if (i<depth) {
+				pipe_push(p, PIPE_DONE, search[i].seq, 1, NULL);
+				search[i].msgid = 0;
+				running--;
+			}
+			break;
+		default:
+			ldap_msgfree(msg);
+		}
+	}
+	for (i = started; i<zones; i++)
+		free(pending[i]);
+	p->ldaperr = ldap_error;
+	pipe_push(p, PIPE_END, zones, 0, NULL);
+	free(pending);
+	free(search);
+	return NULL;
+}
+
+
+static void read_dnszones_pipelined(struct dataset* ds, struct dataset* prev)
+{
+	struct pipeline* p = xcalloc(1, sizeof(struct pipeline));
+	struct pipezone* pz = NULL;
+	struct dnszone** last = &ds->zones;
+	struct pipeitem it;
+	pthread_t fetcher;
+	int zones = 0, released = 0;
+	int current = -1;
+
+	p->index = zone_index(prev, &p->indexed);
+	if (start_thread(&fetcher, pipe_fetch_thread, p)!=0)
+		die_exit("Unable to start LDAP fetch thread");
+	for (it = pipe_pop(p); it.kind!=PIPE_END; it = pipe_pop(p)) {
+		struct pipezone* c;
+
+		if (it.kind==PIPE_ZONE) {
+			if ( !(pz = realloc(pz, (zones+1)*sizeof(struct pipezone))) )
+				die_exit(NULL);
+			zones++;
+			c = &pz[it.seq];
+			c->z = read_dnszone(it.entry);
+			c->last = &c->z->records;
+			c->complete = 0;
+			entry_free(it.entry);
+			if (!it.fetch && c->z->zonenames>0)
+				reuse_records(c->z, p->index, p->indexed);
+		} else if (it.kind==PIPE_RRSET) {
+			c = &pz[it.seq];
+			if (current!=it.seq) {
+				/* names are validated against the zone being decoded */
+				zone = c->z->soa;
+				strncpy(zone.domainname, c->z->zonename[0], 64);
+				current = it.seq;
+			}
+			c->last = read_rrset(c->z, c->last, it.entry);
+			entry_free(it.entry);
+		} else if (it.kind==PIPE_DONE) {
+			c = &pz[it.seq];
+			c->complete = 1;
+			if (it.fetch && !c->z->records)
+				fprintf(stderr, "\n[**] Warning: No DNS records found for domain %s.\n\n", c->z->zonename[0]);
+			if (it.fetch && options.normalize) {
+				normalize_zone(c->z);
+				current = -1;
+			}
+		}
+		while (released<zones && pz[released].complete) {
+			*last = pz[released].z;
+			last = &(*last)->next;
+			if (!held_back(pz[released].z))
+				writers_push(pz[released].z);
+			released++;
+		}
+	}
+	pthread_join(fetcher, NULL);
+	/* after an LDAP error the zones never completed are only there to be freed */
+	for (; released<zones; released++) {
+		*last = pz[released].z;
+		last = &(*last)->next;
+	}
+	if (p->ldaperr!=LDAP_SUCCESS && ldap_error==LDAP_SUCCESS)
+		ldap_error = p->ldaperr;
+	free(p->index);
+	free(pz);
+	free(p);
+}
+
+
+/*
+ * Output files are written under a temporary name and only renamed over the
+ * live file once they are complete and on stable storage, so named and
+ * tinydns-data never read a half written file, not even after a crash.  The
+ * fsync() and rename() of every zone file is handed to a small pool of
+ * threads, and the directory is synced once when all of them are done.  A
+ * file which cannot be written fails the refresh, not the process.
+ */
+#define SYNC_THREADS 4
+#define SYNC_PENDING 16		/* files open for the pool at most */
+
+/* Files committed for one refresh; every tenant waits only for its own */
+struct syncgroup
+{
+	int busy;
+	int failed;
+};
+
+struct syncjob
+{
+	struct syncjob* next;
+	struct syncgroup* group;
+	FILE* fp;
+	char temp[264];
+	char name[256];
+};
+
+static struct
+{
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t idle;
+	struct syncjob* head;
+	struct syncjob** tail;
+	int pending;
+	int started;
+} syncpool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+
+static void* sync_thread(void* arg)
+{
+	struct syncjob* job;
+	int failed;
+
+	for (;;) {
+		pthread_mutex_lock(&syncpool.lock);
+		while (!syncpool.head)
+			pthread_cond_wait(&syncpool.work, &syncpool.lock);
+		job = syncpool.head;
+		if ( !(syncpool.head = job->next) )
+			syncpool.tail = &syncpool.head;
+		pthread_mutex_unlock(&syncpool.lock);
+
+		failed = fsync(fileno(job->fp))!=0;
+		failed |= fclose(job->fp)!=0;
+		if (failed || rename(job->temp, job->name)==-1) {
+			fprintf(stderr, "[**] Unable to write %s\n", job->name);
+			unlink(job->temp);
+			failed = 1;
+		}
+
+		pthread_mutex_lock(&syncpool.lock);
+		job->group->failed |= failed;
+		job->group->busy--;
+		syncpool.pending--;
+		pthread_cond_broadcast(&syncpool.idle);
+		pthread_mutex_unlock(&syncpool.lock);
+		free(job);
+	}
+	return NULL;
+}
+
+
+static struct syncgroup* current_syncgroup(void)
+{
+	if (!syncgroup)
+		syncgroup = xcalloc(1, sizeof(struct syncgroup));
+	return syncgroup;
+}
+
+
+/* Fail the current refresh for an output which could not be written */
+static void sync_failed(const char* name)
+{
+	struct syncgroup* group = current_syncgroup();
+
+	fprintf(stderr, "[**] Unable to write %s\n", name);
+	pthread_mutex_lock(&syncpool.lock);
+	group->failed = 1;
+	pthread_mutex_unlock(&syncpool.lock);
+}
+
+
+/* Path of the BIND output name, kept in the tenant's directory if there is one */
+static const char* output_file(char* buf, size_t size, const char* name)
+{
+	if (options.directory[0])
+		snprintf(buf, size, "%s/%s", options.directory, name);
+	else
+		snprintf(buf, size, "%s", name);
+	return buf;
+}
+
+
+/* Open the temporary file for output name */
+static FILE* open_output(const char* name)
+{
+	char temp[264];
+
+	snprintf(temp, sizeof(temp), "%s.temp", name);
+	return fopen(temp, "w");
+}
+
+
+/*
+ * Queue a file opened by open_output() to be synced and moved into place,
+ * waiting while SYNC_PENDING files are, so rendering cannot run ahead of the
+ * disk by more than that many open files
+ */
+static void commit_output(FILE* fp, const char* name)
+{
+	struct syncjob* job;
+	char temp[264];
+	pthread_t thread;
+	int i;
+
+	if (fflush(fp)!=0 || ferror(fp)) {
+		fclose(fp);
+		snprintf(temp, sizeof(temp), "%s.temp", name);
+		unlink(temp);
+		sync_failed(name);
+		return;
+	}
+	job = xcalloc(1, sizeof(struct syncjob));
+	job->fp = fp;
+	job->group = current_syncgroup();
+	snprintf(job->name, sizeof(job->name), "%s", name);
+	snprintf(job->temp, sizeof(job->temp), "%s.temp", name);
+	pthread_mutex_lock(&syncpool.lock);
+	if (!syncpool.started) {
+		syncpool.tail = &syncpool.head;
+		for (i = 0; i<SYNC_THREADS; i++) {
+			if (pthread_create(&thread, NULL, sync_thread, NULL)!=0)
+				die_exit("Unable to start sync thread");
+			pthread_detach(thread);
+		}
+		syncpool.started = 1;
+	}
+	while (syncpool.pending>=SYNC_PENDING)
+		pthread_cond_wait(&syncpool.idle, &syncpool.lock);
+	*syncpool.tail = job;
+	syncpool.tail = &job->next;
+	syncpool.pending++;
+	job->group->busy++;
+	pthread_cond_signal(&syncpool.work);
+	pthread_mutex_unlock(&syncpool.lock);
+}
+
+
+/*
+ * Wait until every committed file is in place, then make the renames
+ * durable.  Returns 0 if an output of the refresh could not be written.
+ */
+static int sync_outputs(const char* dir)
+{
+	struct syncgroup* group = current_syncgroup();
+	int failed;
+	int fd;
+
+	pthread_mutex_lock(&syncpool.lock);
+	while (group->busy>0)
+		pthread_cond_wait(&syncpool.idle, &syncpool.lock);
+	failed = group->failed;
+	group->failed = 0;
+	pthread_mutex_unlock(&syncpool.lock);
+	if ((fd = open(dir, O_RDONLY))>=0) {
+		fsync(fd);
+		close(fd);
+	}
+	return !failed;
+}
+
+
+static void write_rawzone(FILE* fp, char* text);
+#ifdef DNSSEC
+static void write_signedzone(FILE* fp, char* text);
+#endif
+
+static void write_dnszone(const struct dnszone* z)
+{
+	const struct dnsrecord* r;
+	char namedzonename[256];
+	char filename[128];
+	FILE* datafile = tinyfile;
+	char* buf = NULL;
+	char* text = NULL;
+	size_t size = 0;
+	size_t textsize = 0;
+	int encode = options.output&OUTPUT_RAW || options.signkeys[0];
+	int i;
+
+	if (options.normalize && tinyfile && z->zonenames>1 && !(tinyfile = open_memstream(&buf, &size)))
+		die_exit(NULL);
+	for (i = 0; i<z->zonenames; i++) {
+		zone = zone_soa(z);
+		strncpy(zone.domainname, z->zonename[i], 64);
+		if (render_verbose&1)
+			printf("zonename: %s\n", zone.domainname);
+		output_file(namedzonename, sizeof(namedzonename), zone_filename(filename, sizeof(filename), zone.domainname));
+		if (namedmaster && encode && !(namedzone = open_memstream(&text, &textsize)))
+			die_exit(NULL);
+		if (namedmaster && !encode && !(namedzone = open_output(namedzonename)))
+			sync_failed(namedzonename);
+		write_zone();
+		for (r = z->records; r; r = r->next)
+			write_record(r, i);
+		for (r = z->synthesized; r; r = r->next)
+			write_record(r, i);
+		if (namedzone && encode) {
+			/* the text is only the input of the raw encoder or the signer */
+			fclose(namedzone);
+			if ( !(namedzone = open_output(namedzonename)) )
+				sync_failed(namedzonename);
+#ifdef DNSSEC
+			else if (!(options.output&OUTPUT_RAW))
+				write_signedzone(namedzone, text);
+#endif
+			else
+				write_rawzone(namedzone, text);
+			free(text);
+			text = NULL;
+		}
+		if (namedzone) {
+			commit_output(namedzone, namedzonename);
+			namedzone = NULL;
+		}
+		if (render_verbose&2)
+			printf("\n");
+	}
+	if (tinyfile!=datafile) {
+		fclose(tinyfile);
+		write_unique_lines(datafile, buf);
+		free(buf);
+		tinyfile = datafile;
+	}
+}
+
+
+static void write_loccode(int lidx)
+{
+	if (tinyfile) {
+		fprintf(tinyfile, "%%%s:%s\n", loc_rec.locname, loc_rec.member[lidx]);
+	}
+}
+
+
+/*
+ * Location members (the DNSipaddr values of DNSloccodes entries) may be
+ * tinydns style prefixes such as 10.6.1, IPv4 or IPv6 CIDR blocks or single
+ * addresses.  All members of a location, from however many entries, go into
+ * one binary trie per address family: members inside another member are
+ * dropped and blocks whose two halves are both members are merged.  The
+ * location is then written as the fewest prefixes tinydns can match, which
+ * are whole octets for IPv4 and whole nibbles for IPv6.  IPv6 prefixes are
+ * written as hex digits in groups of four, each group followed by a colon,
+ * so ":" alone matches every IPv6 client.
+ */
+struct locnode
+{
+	struct locnode* child[2];
+	int member;
+};
+
+struct loctrie
+{
+	struct dnsloccode* lc;
+	struct locnode root[2];	/* IPv4, IPv6 */
+};
+
+
+static void loc_free(struct locnode* n)
+{
+	if (!n)
+		return;
+	loc_free(n->child[0]);
+	loc_free(n->child[1]);
+	free(n);
+}
+
+
+static int loc_bit(const unsigned char* addr, int i)
+{
+	return addr[i/8] >> (7 - i%8) & 1;
+}
+
+
+static void loc_setbit(unsigned char* addr, int i, int v)
+{
+	if (v)
+		addr[i/8] |= 0x80 >> i%8;
+	else
+		addr[i/8] &= ~(0x80 >> i%8);
+}
+
+
+/* Parse a member into addr and its prefix length, 0 if it is none */
+static int loc_parse(const char* text, unsigned char addr[16], int* bits, int* v6)
+{
+	struct ipaddr a;
+	char buf[64];
+	char* slash;
+	char* p;
+	unsigned long v;
+	int n, i;
+
+	memset(addr, 0, 16);
+	strncpy(buf, text, sizeof(buf)-1);
+	buf[sizeof(buf)-1] = '\0';
+	if ( (slash = strchr(buf, '/')) )
+		*slash++ = '\0';
+	if ( (*v6 = strchr(buf, ':')!=NULL) ) {
+		if (ipaddr_parse(&a, buf) && a.len==16) {
+			memcpy(addr, a.addr, 16);
+			*bits = 128;
+		} else {
+			/* a prefix the way it is written out */
+			for (n = 0, p = buf; *p; p++) {
+				if (*p==':')
+					continue;
+				if (!isxdigit((unsigned char)*p) || n==32)
+					return 0;
+				v = isdigit((unsigned char)*p) ? *p-'0' : tolower((unsigned char)*p)-'a'+10;
+				addr[n/2] |= n%2 ? v : v << 4;
+				n++;
+			}
+			*bits = 4*n;
+		}
+	} else {
+		/* up to four octets, fewer for a tinydns style prefix */
+		for (n = 0, p = buf; *p && n<4; n++) {
+			if (!isdigit((unsigned char)*p) || (v = strtoul(p, &p, 10))>255)
+				return 0;
+			addr[n] = v;
+			if (*p=='.')
+				p++;
+			else if (*p)
+				return 0;
+		}
+		if (*p)
+			return 0;
+		*bits = 8*n;
+	}
+	if (slash) {
+		if (!isdigit((unsigned char)*slash) || (v = strtoul(slash, &p, 10))>(*v6 ? 128 : 32) || *p)
+			return 0;
+		*bits = v;
+	}
+	for (i = *bits; i<(*v6 ? 128 : 32); i++)
+		loc_setbit(addr, i, 0);
+	return 1;
+}
+
+
+static void loc_insert(struct locnode* root, const unsigned char* addr, int bits)
+{
+	struct locnode* n = root;
+	int i, b;
+
+	for (i = 0; i<bits && !n->member; i++) {
+		b = loc_bit(addr, i);
+		if (!n->child[b])
+			n->child[b] = xcalloc(1, sizeof(struct locnode));
+		n = n->child[b];
+	}
+	if (n->member)
+		return;		/* already covered */
+	n->member = 1;
+	loc_free(n->child[0]);
+	loc_free(n->child[1]);
+	n->child[0] = n->child[1] = NULL;
+}
+
+
+/* Merge every block whose halves are both members, returns whether n is one */
+static int loc_merge(struct locnode* n)
+{
+	if (!n)
+		return 0;
+	if (n->member)
+		return 1;
+	if (loc_merge(n->child[0]) & loc_merge(n->child[1])) {
+		n->member = 1;
+		loc_free(n->child[0]);
+		loc_free(n->child[1]);
+		n->child[0] = n->child[1] = NULL;
+	}
+	return n->member;
+}
+
+
+static void loc_add(struct dnsloccode* lc, const unsigned char* addr, int bits, int v6)
+{
+	char* p;
+	int i;
+
+	if (lc->members==0 || !(lc->members & (lc->members-1))) {
+		/* grown in powers of two */
+		if ( !(lc->loc.member = realloc(lc->loc.member, (lc->members ? 2*lc->members : 1)*sizeof(lc->loc.member[0]))) )
+			die_exit(NULL);
+	}
+	p = lc->loc.member[lc->members++];
+	*p = '\0';
+	if (!v6) {
+		for (i = 0; i<bits/8; i++)
+			p += sprintf(p, i ? ".%d" : "%d", addr[i]);
+		return;
+	}
+	for (i = 0; i<bits/4; i++) {
+		p += sprintf(p, "%x", i%2 ? addr[i/2] & 0xf : addr[i/2] >> 4);
+		if (i%4==3)
+			*p++ = ':';
+	}
+	if (bits==0 || bits%16)
+		*p++ = ':';
+	*p = '\0';
+}
+
+
+static void loc_emit(struct dnsloccode* lc, const struct locnode* n, unsigned char* addr, int depth, int v6)
+{
+	int step = v6 ? 4 : 8;
+	int boundary, j, i;
+
+	if (!n)
+		return;
+	if (n->member) {
+		/* tinydns only matches whole octets or nibbles */
+		boundary = (depth+step-1)/step*step;
+		for (j = 0; j < 1<<(boundary-depth); j++) {
+			for (i = depth; i<boundary; i++)
+				loc_setbit(addr, i, j >> (boundary-1-i) & 1);
+			loc_add(lc, addr, boundary, v6);
+		}
+		for (i = depth; i<boundary; i++)
+			loc_setbit(addr, i, 0);
+		return;
+	}
+	loc_emit(lc, n->child[0], addr, depth+1, v6);
+	loc_setbit(addr, depth, 1);
+	loc_emit(lc, n->child[1], addr, depth+1, v6);
+	loc_setbit(addr, depth, 0);
+}
+
+
+static void read_loccodes(struct dataset* ds)
+{
+	LDAPMessage* res = NULL;
+	LDAPMessage* m;
+	struct dnsloccode** last = &ds->loccodes;
+	struct loctrie* tries = NULL;
+	struct loctrie* t;
+	unsigned char addr[16];
+	int ntries = 0;
+	int bits, v6;
+	int ldaperr;
+	int i;
+
+	if ( (ldaperr = ldap_search_ext_s(ldap_con, options.searchbase[0] ? options.searchbase : NULL, LDAP_SCOPE_SUBTREE, "objectclass=DNSloccodes", NULL, 0, NULL, NULL, &options.searchtimeout, options.reclimit, &res))!=LDAP_SUCCESS ) {
+		if (res)
+			ldap_msgfree(res);
+		ldap_failed(ldaperr);
+		return;
+	}
+
+	for (m = ldap_first_entry(ldap_con, res); m; m = ldap_next_entry(ldap_con, m)) {
+		BerElement* ber = NULL;
+		char* attr;
+		char* dn = ldap_get_dn(ldap_con, m);
+		struct berval** members = NULL;
+		char locname[3] = "";
+
+		for (attr = ldap_first_attribute(ldap_con, m, &ber); attr; attr = ldap_next_attribute(ldap_con, m, ber)) {
+			struct berval** bvals = ldap_get_values_len(ldap_con, m, attr);
+			if (bvals!=NULL) {
+				if (bvals[0] && bvals[0]->bv_len>0) {
+					if (strcasecmp(attr, "DNSlocation")==0) {
+						if (sscanf(bvals[0]->bv_val, "%2s", locname)!=1)
+							locname[0] = '\0';
+					} else if (strcasecmp(attr, "DNSipaddr")==0) {
+						ldap_value_free_len(members);
+						members = bvals;
+						bvals = NULL;
+					}
+				}
+				ldap_value_free_len(bvals);
+			}
+			ldap_memfree(attr);
+		}
+		ber_free(ber, 0);
+		/* entries of the same location are compiled together */
+		for (t = tries; t<tries+ntries && strcmp(t->lc->loc.locname, locname); t++);
+		if (t==tries+ntries) {
+			if ( !(tries = realloc(tries, (ntries+1)*sizeof(struct loctrie))) )
+				die_exit(NULL);
+			t = &tries[ntries++];
+			memset(t, 0, sizeof(struct loctrie));
+			t->lc = xcalloc(1, sizeof(struct dnsloccode));
+			t->lc->dn = xstrdup(dn);
+			strcpy(t->lc->loc.locname, locname);
+			*last = t->lc;
+			last = &t->lc->next;
+		}
+		for (i = 0; members && members[i]; i++) {
+			if (loc_parse(members[i]->bv_val, addr, &bits, &v6))
+				loc_insert(&t->root[v6], addr, bits);
+			else
+				fprintf(stderr, "[**] Invalid member %s of location %s; skipping.\n", members[i]->bv_val, locname);
+		}
+		ldap_value_free_len(members);
+		ldap_memfree(dn);
+	}
+	ldap_msgfree(res);
+	for (t = tries; t<tries+ntries; t++) {
+		for (v6 = 0; v6<2; v6++) {
+			loc_merge(&t->root[v6]);
+			memset(addr, 0, sizeof(addr));
+			loc_emit(t->lc, &t->root[v6], addr, 0, v6);
+			loc_free(t->root[v6].child[0]);
+			loc_free(t->root[v6].child[1]);
+		}
+	}
+	free(tries);
+}
+
+
+static void write_loccodes(const struct dataset* ds)
+{
+	const struct dnsloccode* lc;
+	int i;
+
+	// We aren't going to warn for zero records here as many installs do
+	// not use location codes at all
+	if (!ds->loccodes || !tinyfile)
+		return;
+	fprintf(tinyfile, "#\n# Location Codes (if any) - generated by ldap2dns v%s - DO NOT EDIT!\n#\n\n", VERSION);
+	for (lc = ds->loccodes; lc; lc = lc->next) {
+		loc_rec = lc->loc;
+		if (render_verbose&1)
+			printf("locationcodename: %s (%d members)\n", loc_rec.locname, lc->members);
+		for (i = 0; i<lc->members; i++)
+			write_loccode(i);
+	}
+}
+
+
+/*
+ * RFC 9432 catalog zone (-C name) listing every zone written for BIND, so
+ * that secondaries learn about added and removed zones through an ordinary
+ * zone transfer instead of a reconfiguration.  Member IDs are hashed from the
+ * zone's DN and name and stay the same from run to run; the catalog is only
+ * rewritten, with a higher serial, when its list of members changes.
+ */
+static void write_catalog(const struct dataset* ds)
+{
+	const struct dnszone* z;
+	unsigned long long members = FNV64_INIT;
+	unsigned long long oldmembers = 0;
+	unsigned long oldserial = 0;
+	unsigned long serial;
+	char filename[256];
+	char name[144];
+	char line[256];
+	FILE* fp;
+	int i;
+
+	for (z = ds->zones; z; z = z->next) {
+		for (i = 0; i<z->zonenames; i++) {
+			members = fnv64(members, z->dn, strlen(z->dn)+1);
+			members = fnv64(members, z->zonename[i], strlen(z->zonename[i])+1);
+		}
+	}
+	snprintf(name, sizeof(name), "%s.db", options.catalog);
+	output_file(filename, sizeof(filename), name);
+	if ( (fp = fopen(filename, "r")) ) {
+		while (fgets(line, sizeof(line), fp)) {
+			if (sscanf(line, "; members %llx", &oldmembers)!=1)
+				sscanf(line, "%*s IN SOA %*s %*s %lu", &oldserial);
+		}
+		fclose(fp);
+		if (oldmembers==members)
+			return;
+	}
+	serial = time_now>0 ? (unsigned long)time_now : 1;
+	if (serial<=oldserial)
+		serial = oldserial+1;
+	if (options.verbose&1)
+		printf("catalog: %s serial %lu\n", options.catalog, serial);
+	if ( !(fp = open_output(filename)) ) {
+		sync_failed(filename);
+		return;
+	}
+	fprintf(fp, ";\n; Automatically generated by ldap2dns v%s - DO NOT EDIT!\n; members %016llx\n;\n\n", VERSION, members);
+	fprintf(fp, "$TTL 0\n");
+	fprintf(fp, "%s.\tIN SOA\tinvalid. invalid. %lu 3600 600 2147483646 0\n", options.catalog, serial);
+	fprintf(fp, "%s.\tIN NS\tinvalid.\n", options.catalog);
+	fprintf(fp, "version.%s.\tIN TXT\t\"2\"\n", options.catalog);
+	for (z = ds->zones; z; z = z->next) {
+		for (i = 0; i<z->zonenames; i++) {
+			unsigned long long id = fnv64(FNV64_INIT, z->dn, strlen(z->dn)+1);
+			id = fnv64(id, z->zonename[i], strlen(z->zonename[i]));
+			fprintf(fp, "%016llx.zones.%s.\tIN PTR\t%s.\n", id, options.catalog, z->zonename[i]);
+		}
+	}
+	commit_output(fp, filename);
+}
+
+
+/*
+ * LDIF export (-L).  The entries are written from the decoded dataset by a
+ * writer thread of their own, so decoding does not look at -L at all.  Zone
+ * and record entries carry the attributes ldap2dns uses, a location one entry
+ * with its compiled members.  Values which are no SAFE-STRING in the sense
+ * of RFC 2849 are base64 encoded.
+ */
+static void ldif_value(FILE* fp, const char* attr, const char* value)
+{
+	static const char base64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	const unsigned char* p = (const unsigned char*)value;
+	size_t len = strlen(value);
+	unsigned long v;
+	size_t i;
+
+	if (!len)
+		return;
+	for (i = 0; i<len && p[i]>=0x20 && p[i]<0x7f; i++);
+	if (i==len && p[0]!=' ' && p[0]!=':' && p[0]!='<' && p[len-1]!=' ') {
+		fprintf(fp, "%s: %s\n", attr, value);
+		return;
+	}
+	fprintf(fp, "%s:: ", attr);
+	for (i = 0; i<len; i += 3) {
+		v = p[i] << 16 | (i+1<len ? p[i+1] << 8 : 0) | (i+2<len ? p[i+2] : 0);
+		putc(base64[v >> 18], fp);
+		putc(base64[v >> 12 & 0x3f], fp);
+		putc(i+1<len ? base64[v >> 6 & 0x3f] : '=', fp);
+		putc(i+2<len ? base64[v & 0x3f] : '=', fp);
+	}
+	putc('\n', fp);
+}
+
+
+/* The entry's cn, taken from the DN if that starts with it */
+static void ldif_cn(FILE* fp, const char* dn)
+{
+	char cn[256];
+	unsigned int c;
+	int n = 0;
+
+	if (strncasecmp(dn, "cn=", 3))
+		return;
+	for (dn += 3; *dn && *dn!=',' && *dn!='+' && n<sizeof(cn)-1; dn++) {
+		if (*dn=='\\' && isxdigit((unsigned char)dn[1]) && isxdigit((unsigned char)dn[2]) && sscanf(dn+1, "%2x", &c)==1) {
+			cn[n++] = c;
+			dn += 2;
+		} else {
+			if (*dn=='\\' && dn[1])
+				dn++;
+			cn[n++] = *dn;
+		}
+	}
+	cn[n] = '\0';
+	ldif_value(fp, "cn", cn);
+}
+
+
+static void ldif_number(FILE* fp, const char* attr, int value)
+{
+	if (value)
+		fprintf(fp, "%s: %d\n", attr, value);
+}
+
+
+static void ldif_loccodes(FILE* fp, const struct dataset* ds)
+{
+	const struct dnsloccode* lc;
+	int i;
+
+	for (lc = ds->loccodes; lc; lc = lc->next) {
+		if (!lc->dn)
+			continue;
+		ldif_value(fp, "dn", lc->dn);
+		fprintf(fp, "objectClass: top\nobjectClass: DNSloccodes\n");
+		ldif_value(fp, "dnslocation", lc->loc.locname);
+		for (i = 0; i<lc->members; i++)
+			ldif_value(fp, "dnsipaddr", lc->loc.member[i]);
+		fprintf(fp, "\n");
+	}
+}
+
+
+static void ldif_zone(FILE* fp, const struct dnszone* z)
+{
+	const struct dnsrecord* r;
+	char name[1024];
+	char addr[INET6_ADDRSTRLEN];
+	int i;
+
+	ldif_value(fp, "dn", z->dn);
+	fprintf(fp, "objectClass: top\nobjectClass: DNSzone\n");
+	ldif_cn(fp, z->dn);
+	for (i = 0; i<z->zonenames; i++)
+		ldif_value(fp, "dnszonename", z->zonename[i]);
+	ldif_value(fp, "dnsttl", z->soa.ttl);
+	ldif_value(fp, "dnsadminmailbox", z->soa.adminmailbox);
+	ldif_value(fp, "dnszonemaster", z->soa.zonemaster);
+	ldif_value(fp, "dnsserial", z->soa.serial);
+	ldif_value(fp, "dnsrefresh", z->soa.refresh);
+	ldif_value(fp, "dnsretry", z->soa.retry);
+	ldif_value(fp, "dnsexpire", z->soa.expire);
+	ldif_value(fp, "dnsminimum", z->soa.minimum);
+	ldif_value(fp, "dnstimestamp", z->soa.timestamp);
+	ldif_value(fp, "dnslocation", z->soa.location);
+	fprintf(fp, "\n");
+	for (r = z->records; r; r = r->next) {
+		if (!r->dn)
+			continue;
+		ldif_value(fp, "dn", r->dn);
+		fprintf(fp, "objectClass: top\nobjectClass: DNSrrset\n");
+		ldif_cn(fp, r->dn);
+		if (strcmp(r->class, "IN"))
+			ldif_value(fp, "dnsclass", r->class);
+		ldif_value(fp, "dnstype", r->type);
+		if (r->domainname)
+			ldif_value(fp, "dnsdomainname", dname_text(name, sizeof(name), r->domainname));
+		if (r->cname)
+			ldif_value(fp, "dnscname", dname_text(name, sizeof(name), r->cname));
+		for (i = 0; i<r->ipaddresses; i++)
+			ldif_value(fp, "dnsipaddr", ipaddr_text(addr, &r->ipaddr[i]));
+		ldif_value(fp, "dnscipaddr", ipaddr_text(addr, &r->cipaddr));
+		if (r->txt)
+			ldif_value(fp, "dnstxt", r->txt);
+		ldif_value(fp, "dnsttl", r->ttl);
+		ldif_value(fp, "dnstimestamp", r->timestamp);
+		ldif_value(fp, "dnspreference", r->preference);
+		ldif_value(fp, "dnslocation", r->location);
+		ldif_number(fp, "dnssrvpriority", r->srvpriority);
+		ldif_number(fp, "dnssrvweight", r->srvweight);
+		ldif_number(fp, "dnssrvport", r->srvport);
+		fprintf(fp, "\n");
+	}
+}
+
+
+/*
+ * Output writers.  Every output format is rendered by its own thread, which
+ * is fed the decoded zones through a bounded queue while decoding goes on,
+ * so LDAP decoding, rendering and file I/O overlap and a slow output only
+ * holds back the decoder once its queue is full.
+ */
+#define WRITER_QUEUE 64
+
+struct writer
+{
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t notempty;
+	pthread_cond_t notfull;
+	const struct dnszone* queue[WRITER_QUEUE];
+	unsigned int head;
+	unsigned int tail;
+	int done;
+	int verbose;
+	FILE* tinyfile;
+	FILE* shardfile[MAX_SHARDS];
+	FILE* namedmaster;
+	FILE* ldif;
+	const struct dataset* ds;
+	time_t sign_due;
+};
+
+static __thread struct writer writers[3];
+static __thread int numwriters;
+
+
+static const struct dnszone* writer_pop(struct writer* w)
+{
+	const struct dnszone* z = NULL;
+
+	pthread_mutex_lock(&w->lock);
+	while (w->head==w->tail && !w->done)
+		pthread_cond_wait(&w->notempty, &w->lock);
+	if (w->head!=w->tail) {
+		z = w->queue[w->head++ % WRITER_QUEUE];
+		pthread_cond_signal(&w->notfull);
+	}
+	pthread_mutex_unlock(&w->lock);
+	return z;
+}
+
+
+static void* writer_thread(void* arg)
+{
+	struct writer* w = arg;
+	const struct dnszone* z;
+
+	int i;
+
+	if (w->ldif) {
+		ldif_loccodes(w->ldif, w->ds);
+		while ( (z = writer_pop(w)) )
+			ldif_zone(w->ldif, z);
+		return NULL;
+	}
+	namedmaster = w->namedmaster;
+	render_verbose = w->verbose;
+	for (i = 0; i<options.shards && w->shardfile[0]; i++) {
+		tinyfile = w->shardfile[i];
+		write_loccodes(w->ds);
+		fprintf(tinyfile, "#\n# Automatically generated by ldap2dns v%s - DO NOT EDIT!\n#\n\n", VERSION);
+	}
+	tinyfile = w->tinyfile;
+	write_loccodes(w->ds);
+	if (tinyfile)
+		fprintf(tinyfile, "#\n# Automatically generated by ldap2dns v%s - DO NOT EDIT!\n#\n\n", VERSION);
+	if (namedmaster) {
+		fprintf(namedmaster, "#\n# Automatically generated by ldap2dns v%s - DO NOT EDIT!\n#\n\n", VERSION);
+		if (options.catalog[0])
+			fprintf(namedmaster, "zone \"%s\" IN {\n\ttype master;\n\tfile \"%s.db\";\n};\n", options.catalog, options.catalog);
+	}
+	sign_due = 0;
+	while ( (z = writer_pop(w)) ) {
+		if (w->shardfile[0])
+			tinyfile = w->shardfile[zone_shard(z)];
+		write_dnszone(z);
+	}
+	w->sign_due = sign_due;
+	return NULL;
+}
+
+
+/* Close the outputs of writers whose threads are gone and remove their temporary files */
+static void close_writers(void)
+{
+	struct writer* w;
+	char filename[256];
+	char temp[264];
+	int i, k;
+
+	for (i = 0; i<numwriters; i++) {
+		w = &writers[i];
+		if (w->namedmaster) {
+			sync_outputs(options.directory[0] ? options.directory : ".");
+			fclose(w->namedmaster);
+			snprintf(temp, sizeof(temp), "%s.temp", output_file(filename, sizeof(filename), "named.zones"));
+			unlink(temp);
+		}
+		if (w->tinyfile) {
+			fclose(w->tinyfile);
+			unlink(tinydns_texttemp);
+		}
+		for (k = 0; k<MAX_SHARDS && w->shardfile[k]; k++) {
+			fclose(w->shardfile[k]);
+			unlink(shard_file(filename, sizeof(filename), k, "data.temp"));
+		}
+	}
+	numwriters = 0;
+}
+
+
+/*
+ * Open the outputs and start one writer per format; the loccodes must be
+ * decoded.  Returns 0 if an output cannot be opened, nothing is started then.
+ */
+static int writers_start(const struct dataset* ds)
+{
+	struct writer* w;
+	char filename[256];
+	int i;
+
+	time(&time_now);
+	numwriters = 0;
+	if (options.output&OUTPUT_DATA) {
+		w = &writers[numwriters++];
+		memset(w, 0, sizeof(struct writer));
+		for (i = 0; i<options.shards; i++) {
+			mkdir(shard_file(filename, sizeof(filename), i, ""), 0755);
+			if ( !(w->shardfile[i] = fopen(shard_file(filename, sizeof(filename), i, "data.temp"), "w")) ) {
+				fprintf(stderr, "[**] Unable to write %s\n", filename);
+				close_writers();
+				return 0;
+			}
+		}
+		if (!options.shards && !(w->tinyfile = fopen(tinydns_texttemp, "w")) ) {
+			fprintf(stderr, "[**] Unable to write %s\n", tinydns_texttemp);
+			close_writers();
+			return 0;
+		}
+	}
+	if (options.output&OUTPUT_DB) {
+		w = &writers[numwriters++];
+		memset(w, 0, sizeof(struct writer));
+		if ( !(w->namedmaster = open_output(output_file(filename, sizeof(filename), "named.zones"))) ) {
+			fprintf(stderr, "[**] Unable to write %s\n", filename);
+			close_writers();
+			return 0;
+		}
+	}
+	if (ldifout) {
+		w = &writers[numwriters++];
+		memset(w, 0, sizeof(struct writer));
+		w->ldif = ldifout;
+	}
+	for (i = 0; i<numwriters; i++) {
+		w = &writers[i];
+		w->ds = ds;
+		/* only the first writer reports progress */
+		w->verbose = i==0 ? options.verbose : 0;
+		pthread_mutex_init(&w->lock, NULL);
+		pthread_cond_init(&w->notempty, NULL);
+		pthread_cond_init(&w->notfull, NULL);
+		if (start_thread(&w->thread, writer_thread, w)!=0)
+			die_exit("Unable to start writer thread");
+	}
+	return 1;
+}
+
+
+static void writers_push(const struct dnszone* z)
+{
+	struct writer* w;
+	int i;
+
+	for (i = 0; i<numwriters; i++) {
+		w = &writers[i];
+		pthread_mutex_lock(&w->lock);
+		while (w->tail - w->head==WRITER_QUEUE)
+			pthread_cond_wait(&w->notfull, &w->lock);
+		w->queue[w->tail++ % WRITER_QUEUE] = z;
+		pthread_cond_signal(&w->notempty);
+		pthread_mutex_unlock(&w->lock);
+	}
+}
+
+
+/*
+ * Wait until every writer has drained its queue, then close the outputs.
+ * Returns 0 if one could not be written; the live data and named.zones stay
+ * as they are then, as with writers_abort().
+ */
+static int writers_finish(void)
+{
+	struct writer* w;
+	char filename[256];
+	char temp[264];
+	int failed = 0, f;
+	int i, k;
+
+	sign_due = 0;
+	for (i = 0; i<numwriters; i++) {
+		w = &writers[i];
+		pthread_mutex_lock(&w->lock);
+		w->done = 1;
+		pthread_cond_signal(&w->notempty);
+		pthread_mutex_unlock(&w->lock);
+	}
+	for (i = 0; i<numwriters; i++) {
+		w = &writers[i];
+		pthread_join(w->thread, NULL);
+		if (w->sign_due && (!sign_due || w->sign_due<sign_due))
+			sign_due = w->sign_due;
+		pthread_mutex_destroy(&w->lock);
+		pthread_cond_destroy(&w->notempty);
+		pthread_cond_destroy(&w->notfull);
+		if (w->namedmaster) {
+			/* named.zones only goes live once all zone files it lists are */
+			if (options.catalog[0])
+				write_catalog(w->ds);
+			if (sync_outputs(options.directory[0] ? options.directory : ".")) {
+				commit_output(w->namedmaster, output_file(filename, sizeof(filename), "named.zones"));
+				failed |= !sync_outputs(options.directory[0] ? options.directory : ".");
+			} else {
+				fclose(w->namedmaster);
+				snprintf(temp, sizeof(temp), "%s.temp", output_file(filename, sizeof(filename), "named.zones"));
+				unlink(temp);
+				failed = 1;
+			}
+		}
+		if (w->tinyfile) {
+			f = fflush(w->tinyfile)!=0 || fsync(fileno(w->tinyfile))!=0;
+			if (fclose(w->tinyfile)!=0 || f) {
+				fprintf(stderr, "[**] Unable to write %s\n", tinydns_texttemp);
+				failed = 1;
+			}
+		}
+		if (w->ldif && (fflush(w->ldif)!=0 || ferror(w->ldif))) {
+			fprintf(stderr, "[**] Unable to write %s\n", options.ldifname);
+			failed = 1;
+		}
+		for (k = 0; k<MAX_SHARDS && w->shardfile[k]; k++) {
+			f = fflush(w->shardfile[k])!=0 || fsync(fileno(w->shardfile[k]))!=0;
+			if (fclose(w->shardfile[k])!=0 || f) {
+				fprintf(stderr, "[**] Unable to write %s\n", shard_file(filename, sizeof(filename), k, "data.temp"));
+				failed = 1;
+			}
+		}
+	}
+	/* the data is not published, see publish_tinydns() */
+	for (k = 0; failed && options.output&OUTPUT_DATA && k<options.shards; k++)
+		unlink(shard_file(filename, sizeof(filename), k, "data.temp"));
+	if (failed && options.output&OUTPUT_DATA && !options.shards)
+		unlink(tinydns_texttemp);
+	numwriters = 0;
+	return !failed;
+}
+
+
+/*
+ * Stop the writers after a refresh failed half way.  The live data and
+ * named.zones stay as they are and their temporary files are removed; zone
+ * files already written for complete zones still go into place.
+ */
+static void writers_abort(void)
+{
+	struct writer* w;
+	int i;
+
+	for (i = 0; i<numwriters; i++) {
+		w = &writers[i];
+		pthread_mutex_lock(&w->lock);
+		w->done = 1;
+		pthread_cond_signal(&w->notempty);
+		pthread_mutex_unlock(&w->lock);
+	}
+	for (i = 0; i<numwriters; i++) {
+		w = &writers[i];
+		pthread_join(w->thread, NULL);
+		pthread_mutex_destroy(&w->lock);
+		pthread_cond_destroy(&w->notempty);
+		pthread_cond_destroy(&w->notfull);
+	}
+	close_writers();
+}
+
+
+static void free_dataset(struct dataset* ds)
+{
+	struct dnsloccode* lc;
+	struct dnszone* z;
+	struct dnsrecord* r;
+
+	while ( (lc = ds->loccodes) ) {
+		ds->loccodes = lc->next;
+		free(lc->dn);
+		free(lc->loc.member);
+		free(lc);
+	}
+	while ( (z = ds->zones) ) {
+		ds->zones = z->next;
+		while ( (r = z->records) ) {
+			z->records = r->next;
+			free_record(r);
+		}
+		while ( (r = z->synthesized) ) {
+			z->synthesized = r->next;
+			free_record(r);
+		}
+		free(z->zonename);
+		free(z->dn);
+		free(z);
+	}
+	free(ds);
+}
+
+
+/*
+ * Persistent copy of the last dataset, written after every successful cycle
+ * (-s).  A restarted daemon loads it instead of fetching everything from
+ * LDAP: if the zone serials are unchanged it only checks that the outputs on
+ * disk still match, otherwise it fetches just the zones whose serial moved.
+ * All integers are stored in network byte order, strings length-prefixed.
+ */
+#define SNAPSHOT_MAGIC 0x4c32444eu	/* "L2DN" */
+#define SNAPSHOT_VERSION 4
+#define SNAP_KEEP 0xffffffffu	/* record count of a zone the follower already has */
+
+struct snapreader
+{
+	const unsigned char* p;
+	const unsigned char* end;
+	int bad;
+};
+
+
+static unsigned long long hash_file(unsigned long long h, const char* filename)
+{
+	char buf[65536];
+	size_t len;
+	FILE* fp;
+
+	if ( !(fp = fopen(filename, "r")) )
+		return 0;
+	while ( (len = fread(buf, 1, sizeof(buf), fp))>0 )
+		h = fnv64(h, buf, len);
+	fclose(fp);
+	return h;
+}
+
+
+/* Hash over everything written for the dataset, 0 if an output is missing */
+static unsigned long long hash_outputs(const struct dataset* ds)
+{
+	unsigned long long h = FNV64_INIT;
+	const struct dnszone* z;
+	char namedzonename[128];
+	char filename[256];
+	int i;
+
+	if (options.output&OUTPUT_DATA && !options.shards && !(h = hash_file(h, tinydns_textfile)))
+		return 0;
+	for (i = 0; options.output&OUTPUT_DATA && i<options.shards; i++)
+		if (!(h = hash_file(h, shard_file(filename, sizeof(filename), i, "data"))))
+			return 0;
+	if (options.output&OUTPUT_DB) {
+		if (!(h = hash_file(h, output_file(filename, sizeof(filename), "named.zones"))))
+			return 0;
+		if (options.catalog[0]) {
+			snprintf(namedzonename, sizeof(namedzonename), "%s.db", options.catalog);
+			if (!(h = hash_file(h, output_file(filename, sizeof(filename), namedzonename))))
+				return 0;
+		}
+		for (z = ds->zones; z; z = z->next) {
+			for (i = 0; i<z->zonenames; i++) {
+				zone_filename(namedzonename, sizeof(namedzonename), z->zonename[i]);
+				if (!(h = hash_file(h, output_file(filename, sizeof(filename), namedzonename))))
+					return 0;
+			}
+		}
+	}
+	return h;
+}
+
+
+/* Move the data.temp of every shard whose contents changed over its data, 0 if one could not be */
+static int publish_shards(void)
+{
+	char data[300];
+	char temp[300];
+	int fd;
+	int i;
+
+	for (i = 0; i<options.shards; i++) {
+		shard_file(data, sizeof(data), i, "data");
+		shard_file(temp, sizeof(temp), i, "data.temp");
+		shard_changed[i] = hash_file(FNV64_INIT, temp)!=hash_file(FNV64_INIT, data);
+		if (!shard_changed[i]) {
+			unlink(temp);
+			continue;
+		}
+		if (options.verbose&1)
+			printf("shard %d changed\n", i);
+		if (rename(temp, data)==-1) {
+			fprintf(stderr, "[**] Unable to move %s to %s\n", temp, data);
+			unlink(temp);
+			return 0;
+		}
+		if ((fd = open(shard_file(data, sizeof(data), i, ""), O_RDONLY))>=0) {
+			fsync(fd);
+			close(fd);
+		}
+	}
+	return 1;
+}
+
+
+static void snap_put32(FILE* fp, unsigned int v)
+{
+	putc(v >> 24, fp);
+	putc(v >> 16, fp);
+	putc(v >> 8, fp);
+	putc(v, fp);
+}
+
+
+/* NULL is stored as 0xffff so that it survives the round trip */
+static void snap_putstr(FILE* fp, const char* s)
+{
+	size_t len = s ? strlen(s) : 0xffff;
+
+	if (len>0xfffe)
+		len = s ? 0xfffe : 0xffff;
+	putc(len >> 8, fp);
+	putc(len, fp);
+	if (s)
+		fwrite(s, 1, len, fp);
+}
+
+
+static unsigned int snap_get32(struct snapreader* r)
+{
+	unsigned int v;
+
+	if (r->end - r->p < 4) {
+		r->bad = 1;
+		return 0;
+	}
+	v = (unsigned int)r->p[0] << 24 | r->p[1] << 16 | r->p[2] << 8 | r->p[3];
+	r->p += 4;
+	return v;
+}
+
+
+/* Copy a string into a fixed size buffer, or into a fresh allocation if buf is NULL */
+static char* snap_getstr(struct snapreader* r, char* buf, size_t size)
+{
+	size_t len, n;
+
+	if (r->end - r->p < 2) {
+		r->bad = 1;
+		return NULL;
+	}
+	len = (r->p[0]<<8) | r->p[1];
+	r->p += 2;
+	if (len==0xffff)
+		return NULL;
+	if (r->end - r->p < len) {
+		r->bad = 1;
+		return NULL;
+	}
+	if (!buf) {
+		buf = xcalloc(1, len+1);
+		size = len+1;
+	}
+	n = len<size ? len : size-1;
+	memcpy(buf, r->p, n);
+	buf[n] = '\0';
+	r->p += len;
+	return buf;
+}
+
+
+static void snap_putaddr(FILE* fp, const struct ipaddr* a)
+{
+	putc(a->len, fp);
+	fwrite(a->addr, 1, a->len, fp);
+}
+
+
+static void snap_getaddr(struct snapreader* r, struct ipaddr* a)
+{
+	memset(a, 0, sizeof(*a));
+	if (r->end - r->p < 1 || (r->p[0]!=4 && r->p[0]!=16 && r->p[0]) || r->end - r->p < 1 + r->p[0]) {
+		r->bad = 1;
+		return;
+	}
+	a->len = *r->p++;
+	memcpy(a->addr, r->p, a->len);
+	r->p += a->len;
+}
+
+
+static void snap_putsoa(FILE* fp, const struct zonerecord* soa)
+{
+	snap_putstr(fp, soa->zonemaster);
+	snap_putstr(fp, soa->class);
+	snap_putstr(fp, soa->adminmailbox);
+	snap_putstr(fp, soa->serial);
+	snap_putstr(fp, soa->refresh);
+	snap_putstr(fp, soa->retry);
+	snap_putstr(fp, soa->expire);
+	snap_putstr(fp, soa->minimum);
+	snap_putstr(fp, soa->ttl);
+	snap_putstr(fp, soa->timestamp);
+	snap_putstr(fp, soa->location);
+}
+
+
+static void snap_getsoa(struct snapreader* r, struct zonerecord* soa)
+{
+	snap_getstr(r, soa->zonemaster, sizeof(soa->zonemaster));
+	snap_getstr(r, soa->class, sizeof(soa->class));
+	snap_getstr(r, soa->adminmailbox, sizeof(soa->adminmailbox));
+	snap_getstr(r, soa->serial, sizeof(soa->serial));
+	snap_getstr(r, soa->refresh, sizeof(soa->refresh));
+	snap_getstr(r, soa->retry, sizeof(soa->retry));
+	snap_getstr(r, soa->expire, sizeof(soa->expire));
+	snap_getstr(r, soa->minimum, sizeof(soa->minimum));
+	snap_getstr(r, soa->ttl, sizeof(soa->ttl));
+	snap_getstr(r, soa->timestamp, sizeof(soa->timestamp));
+	snap_getstr(r, soa->location, sizeof(soa->location));
+}
+
+
+/* Where a zone went in an encoded dataset, see snap_putdataset() */
+struct snapzone
+{
+	char* dn;
+	unsigned long long hash;
+	long start;		/* the zone entry */
+	long records;		/* its record count, followed by the records */
+	long end;
+};
+
+/* Loccodes and zones of ds; index, if given, is filled in for every zone */
+static void snap_putdataset(FILE* fp, const struct dataset* ds, struct snapzone* index)
+{
+	const struct dnsloccode* lc;
+	const struct dnszone* z;
+	const struct dnsrecord* rr;
+	char name[1024];
+	unsigned int n;
+	int i;
+
+	for (n = 0, lc = ds->loccodes; lc; lc = lc->next)
+		n++;
+	snap_put32(fp, n);
+	for (lc = ds->loccodes; lc; lc = lc->next) {
+		snap_putstr(fp, lc->loc.locname);
+		snap_put32(fp, lc->members);
+		for (i = 0; i<lc->members; i++)
+			snap_putstr(fp, lc->loc.member[i]);
+	}
+	for (n = 0, z = ds->zones; z; z = z->next)
+		n++;
+	snap_put32(fp, n);
+	for (z = ds->zones; z; z = z->next) {
+		if (index)
+			index->start = ftell(fp);
+		snap_putstr(fp, z->dn);
+		snap_put32(fp, z->shard);
+		snap_put32(fp, z->zonenames);
+		for (i = 0; i<z->zonenames; i++)
+			snap_putstr(fp, z->zonename[i]);
+		snap_putsoa(fp, &z->soa);
+		if (index)
+			index->records = ftell(fp);
+		for (n = 0, rr = z->records; rr; rr = rr->next)
+			n++;
+		snap_put32(fp, n);
+		for (rr = z->records; rr; rr = rr->next) {
+			snap_putstr(fp, dname_text(name, sizeof(name), rr->domainname));
+			snap_putstr(fp, dname_text(name, sizeof(name), rr->cname));
+			snap_putstr(fp, rr->txt);
+			snap_putstr(fp, rr->class);
+			snap_putstr(fp, rr->type);
+			snap_putaddr(fp, &rr->cipaddr);
+			snap_putstr(fp, rr->ttl);
+			snap_putstr(fp, rr->timestamp);
+			snap_putstr(fp, rr->preference);
+			snap_putstr(fp, rr->location);
+			snap_put32(fp, rr->srvpriority);
+			snap_put32(fp, rr->srvweight);
+			snap_put32(fp, rr->srvport);
+			snap_put32(fp, rr->ipaddresses);
+			for (i = 0; i<rr->ipaddresses; i++)
+				snap_putaddr(fp, &rr->ipaddr[i]);
+			snap_putstr(fp, rr->dn);
+		}
+		if (index) {
+			index->dn = xstrdup(z->dn);
+			index->end = ftell(fp);
+			index++;
+		}
+	}
+}
+
+
+static void save_dataset(const struct dataset* ds, int numzones, int checksum, unsigned long long outputhash)
+{
+	char tempname[sizeof(options.snapshot)+8];
+	FILE* fp;
+
+	snprintf(tempname, sizeof(tempname), "%s.temp", options.snapshot);
+	if ( !(fp = fopen(tempname, "w")) ) {
+		fprintf(stderr, "[**] Warning: unable to write snapshot %s\n", tempname);
+		return;
+	}
+	snap_put32(fp, SNAPSHOT_MAGIC);
+	snap_put32(fp, SNAPSHOT_VERSION);
+	snap_put32(fp, options.output);
+	snap_put32(fp, numzones);
+	snap_put32(fp, checksum);
+	snap_put32(fp, outputhash >> 32);
+	snap_put32(fp, outputhash);
+	snap_putdataset(fp, ds, NULL);
+	if (fflush(fp)!=0 || ferror(fp) || fsync(fileno(fp))!=0) {
+		fprintf(stderr, "[**] Warning: unable to write snapshot %s\n", tempname);
+		fclose(fp);
+		unlink(tempname);
+		return;
+	}
+	fclose(fp);
+	if (rename(tempname, options.snapshot)==-1)
+		fprintf(stderr, "[**] Warning: unable to move snapshot into place at %s\n", options.snapshot);
+}
+
+
+/*
+ * Decode loccodes and zones.  A zone whose record count is SNAP_KEEP, which
+ * only a leader sends (see -R), takes over the records of the zone with the
+ * same DN in prev instead.  Returns NULL if the data is corrupt, prev is
+ * left as it was then.
+ */
+static struct dataset* snap_getdataset(struct snapreader* r, struct dataset* prev)
+{
+	struct dataset* ds;
+	struct dnsloccode** lastloc;
+	struct dnszone** lastzone;
+	struct dnszone** index;
+	struct dnszone* (*kept)[2];
+	struct dnszone key;
+	struct dnszone* k = &key;
+	struct dnszone** old;
+	const unsigned char* records;
+	char* text;
+	unsigned int n, c;
+	int i, indexed, nkept = 0;
+
+	index = zone_index(prev, &indexed);
+	kept = xcalloc(indexed+1, sizeof(kept[0]));
+	ds = xcalloc(1, sizeof(struct dataset));
+	lastloc = &ds->loccodes;
+	for (n = snap_get32(r); n>0 && !r->bad; n--) {
+		struct dnsloccode* lc = xcalloc(1, sizeof(struct dnsloccode));
+		*lastloc = lc;
+		lastloc = &lc->next;
+		snap_getstr(r, lc->loc.locname, sizeof(lc->loc.locname));
+		if ((c = snap_get32(r))>(unsigned int)(r->end-r->p)/4)
+			r->bad = 1;
+		else if (c>0)
+			lc->loc.member = xcalloc(c, sizeof(lc->loc.member[0]));
+		for (; lc->members<c && !r->bad; lc->members++)
+			snap_getstr(r, lc->loc.member[lc->members], sizeof(lc->loc.member[0]));
+	}
+	lastzone = &ds->zones;
+	for (n = snap_get32(r); n>0 && !r->bad; n--) {
+		struct dnszone* z = xcalloc(1, sizeof(struct dnszone));
+		struct dnsrecord** lastrr = &z->records;
+		*lastzone = z;
+		lastzone = &z->next;
+		z->dn = snap_getstr(r, NULL, 0);
+		z->shard = snap_get32(r);
+		if ((c = snap_get32(r))>256 || !z->dn)
+			r->bad = 1;
+		else if (c>0)
+			z->zonename = xcalloc(c, sizeof(z->zonename[0]));
+		for (; z->zonenames<c && !r->bad; z->zonenames++)
+			snap_getstr(r, z->zonename[z->zonenames], sizeof(z->zonename[0]));
+		snap_getsoa(r, &z->soa);
+		records = r->p;
+		if ((c = snap_get32(r))==SNAP_KEEP && !r->bad) {
+			/* a zone is taken over once at most, its hash is cleared meanwhile */
+			key.dn = z->dn;
+			if (!index || !(old = bsearch(&k, index, indexed, sizeof(struct dnszone*), cmp_zonedn)) || !(*old)->hash) {
+				r->bad = 1;
+				break;
+			}
+			z->records = (*old)->records;
+			z->hash = (*old)->hash;
+			(*old)->records = NULL;
+			(*old)->hash = 0;
+			kept[nkept][0] = z;
+			kept[nkept++][1] = *old;
+			continue;
+		}
+		for (; c>0 && !r->bad; c--) {
+			struct dnsrecord* rr = xcalloc(1, sizeof(struct dnsrecord));
+			*lastrr = rr;
+			lastrr = &rr->next;
+			text = snap_getstr(r, NULL, 0);
+			rr->domainname = dname_intern(text);
+			free(text);
+			text = snap_getstr(r, NULL, 0);
+			rr->cname = dname_intern(text);
+			free(text);
+			rr->txt = snap_getstr(r, NULL, 0);
+			snap_getstr(r, rr->class, sizeof(rr->class));
+			snap_getstr(r, rr->type, sizeof(rr->type));
+			snap_getaddr(r, &rr->cipaddr);
+			snap_getstr(r, rr->ttl, sizeof(rr->ttl));
+			snap_getstr(r, rr->timestamp, sizeof(rr->timestamp));
+			snap_getstr(r, rr->preference, sizeof(rr->preference));
+			snap_getstr(r, rr->location, sizeof(rr->location));
+			rr->srvpriority = snap_get32(r);
+			rr->srvweight = snap_get32(r);
+			rr->srvport = snap_get32(r);
+			if ((rr->ipaddresses = snap_get32(r))>256)
+				r->bad = 1;
+			if (r->bad)
+				break;
+			if (rr->ipaddresses>0)
+				rr->ipaddr = xcalloc(rr->ipaddresses, sizeof(rr->ipaddr[0]));
+			for (i = 0; i<rr->ipaddresses; i++)
+				snap_getaddr(r, &rr->ipaddr[i]);
+			rr->dn = snap_getstr(r, NULL, 0);
+			if (!options.check && !options.ldifname[0]) {
+				free(rr->dn);
+				rr->dn = NULL;
+			}
+		}
+		z->hash = fnv64(FNV64_INIT, records, r->p-records);
+	}
+	if (r->bad) {
+		/* hand back what was taken over */
+		for (i = 0; i<nkept; i++) {
+			kept[i][1]->records = kept[i][0]->records;
+			kept[i][1]->hash = kept[i][0]->hash;
+			kept[i][0]->records = NULL;
+		}
+		free_dataset(ds);
+		ds = NULL;
+	}
+	free(kept);
+	free(index);
+	return ds;
+}
+
+
+static struct dataset* load_dataset(int* numzones, int* checksum, unsigned long long* outputhash)
+{
+	struct snapreader r;
+	struct dataset* ds;
+	const struct dnszone* z;
+	const struct dnsrecord* rr;
+	struct stat st;
+	unsigned long long hash;
+	void* map;
+	int fd, nz, cs, nodn = 0;
+
+	if ((fd = open(options.snapshot, O_RDONLY))<0)
+		return NULL;
+	if (fstat(fd, &st)<0 || st.st_size==0
+	    || (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0))==MAP_FAILED) {
+		close(fd);
+		return NULL;
+	}
+	close(fd);
+	r.p = map;
+	r.end = r.p + st.st_size;
+	r.bad = 0;
+	if (snap_get32(&r)!=SNAPSHOT_MAGIC || snap_get32(&r)!=SNAPSHOT_VERSION || snap_get32(&r)!=options.output) {
+		munmap(map, st.st_size);
+		fprintf(stderr, "[**] Warning: ignoring incompatible snapshot %s\n", options.snapshot);
+		return NULL;
+	}
+	nz = snap_get32(&r);
+	cs = snap_get32(&r);
+	hash = (unsigned long long)snap_get32(&r) << 32;
+	hash |= snap_get32(&r);
+	ds = snap_getdataset(&r, NULL);
+	munmap(map, st.st_size);
+	if (!ds || r.p!=r.end) {
+		fprintf(stderr, "[**] Warning: ignoring truncated or corrupt snapshot %s\n", options.snapshot);
+		if (ds)
+			free_dataset(ds);
+		return NULL;
+	}
+	/* a snapshot written without -L lacks the record DNs the LDIF needs */
+	for (z = ds->zones; options.ldifname[0] && z && !nodn; z = z->next)
+		for (rr = z->records; rr && !nodn; rr = rr->next)
+			nodn = !rr->dn;
+	if (nodn) {
+		fprintf(stderr, "[**] Warning: snapshot %s holds no record DNs for -L, ignoring it\n", options.snapshot);
+		free_dataset(ds);
+		return NULL;
+	}
+	*numzones = nz;
+	*checksum = cs;
+	*outputhash = hash;
+	return ds;
+}
+
+
+/*
+ * Built-in authoritative responder.  After each refresh the decoded dataset
+ * is compiled into an immutable snapshot indexed by owner name.  The UDP and
+ * TCP threads answer from the current snapshot without taking any lock; a
+ * refresh swaps in the new snapshot atomically and frees the old one as soon
+ * as every reader has left the epoch in which it could still have seen it.
+ */
+#define DNS_PORT "53"
+#define DNS_MAXTHREADS 8
+#define DNS_TCPTHREADS 4
+#define DNS_TCPIDLE 3		/* seconds a TCP client may take for a read */
+#define DNS_TCPLIFE 10		/* seconds a TCP connection is served at most */
+#define DNS_MAXNAME 255
+#define DNS_MAXCHASE 8
+#define DNS_T_A 1
+#define DNS_T_NS 2
+#define DNS_T_CNAME 5
+#define DNS_T_SOA 6
+#define DNS_T_PTR 12
+#define DNS_T_MX 15
+#define DNS_T_TXT 16
+#define DNS_T_AAAA 28
+#define DNS_T_SRV 33
+#define DNS_T_OPT 41
+#define DNS_T_DS 43
+#define DNS_T_RRSIG 46
+#define DNS_T_NSEC 47
+#define DNS_T_DNSKEY 48
+#define DNS_T_ANY 255
+#define DNS_R_FORMERR 1
+#define DNS_R_NXDOMAIN 3
+#define DNS_R_NOTIMP 4
+#define DNS_R_REFUSED 5
+
+struct dnsrrdata
+{
+	struct dnsrrdata* next;
+	unsigned short type;
+	unsigned short rdlength;
+	unsigned int ttl;
+	char location[3];
+	unsigned char rdata[];
+};
+
+struct dnsnode
+{
+	struct dnsnode* next;
+	struct dnsrrdata* rrs;
+	unsigned int hash;
+	int namelen;
+	int apex;
+	unsigned char name[];	/* lower-cased, uncompressed wire format */
+};
+
+struct dnslocation
+{
+	unsigned char prefix[16];
+	int bits;		/* whole octets for IPv4, nibbles for IPv6 */
+	int v6;
+	char locname[3];
+};
+
+struct snapshot
+{
+	struct dnsnode** buckets;
+	unsigned int nbuckets;
+	unsigned int nnodes;
+	struct dnslocation* locations;
+	int nlocations;
+};
+
+struct dnsreply
+{
+	unsigned char* buf;
+	int len;
+	int size;
+	int full;
+	int count[3];
+};
+
+static struct snapshot* dns_snapshot;
+static unsigned long dns_epoch = 1;
+static unsigned long dns_reader[DNS_MAXTHREADS+DNS_TCPTHREADS];
+static int dns_udpsock = -1;
+static int dns_tcpsock = -1;
+
+
+static int dns_namelen(const unsigned char* name)
+{
+	const unsigned char* p = name;
+
+	while (*p)
+		p += *p + 1;
+	return p - name + 1;
+}
+
+
+static unsigned int dns_hash(const unsigned char* name, int len)
+{
+	unsigned int h = 2166136261u;
+
+	while (len--) {
+		h ^= *name++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+
+/* Convert a dotted name into wire format, returns its length or 0 */
+static int dns_encodename(unsigned char* out, const char* name)
+{
+	int len = 0;
+
+	while (*name && strcmp(name, ".")) {
+		const char* dot = strchr(name, '.');
+		int l = dot ? dot - name : strlen(name);
+		if (l<1 || l>63 || len+l+2>DNS_MAXNAME)
+			return 0;
+		out[len++] = l;
+		memcpy(out+len, name, l);
+		len += l;
+		name += l;
+		if (*name=='.')
+			name++;
+	}
+	out[len++] = 0;
+	return len;
+}
+
+
+static void dns_lowercase(unsigned char* name)
+{
+	int l;
+
+	while ( (l = *name++) )
+		for (; l; l--, name++)
+			*name = tolower(*name);
+}
+
+
+static struct dnsnode* snap_lookup(const struct snapshot* s, const unsigned char* name)
+{
+	int len = dns_namelen(name);
+	unsigned int h = dns_hash(name, len);
+	struct dnsnode* n;
+
+	for (n = s->buckets[h & (s->nbuckets-1)]; n; n = n->next)
+		if (n->hash==h && n->namelen==len && memcmp(n->name, name, len)==0)
+			return n;
+	return NULL;
+}
+
+
+static struct dnsnode* snap_node(struct snapshot* s, const unsigned char* name)
+{
+	struct dnsnode* n;
+	int len;
+
+	if ( (n = snap_lookup(s, name)) )
+		return n;
+	if (s->nnodes>=s->nbuckets) {
+		unsigned int i, nbuckets = s->nbuckets*2;
+		struct dnsnode** buckets = xcalloc(nbuckets, sizeof(struct dnsnode*));
+		for (i = 0; i<s->nbuckets; i++) {
+			while ( (n = s->buckets[i]) ) {
+				s->buckets[i] = n->next;
+				n->next = buckets[n->hash & (nbuckets-1)];
+				buckets[n->hash & (nbuckets-1)] = n;
+			}
+		}
+		free(s->buckets);
+		s->buckets = buckets;
+		s->nbuckets = nbuckets;
+	}
+	len = dns_namelen(name);
+	n = xcalloc(1, sizeof(struct dnsnode) + len);
+	memcpy(n->name, name, len);
+	n->namelen = len;
+	n->hash = dns_hash(name, len);
+	n->next = s->buckets[n->hash & (s->nbuckets-1)];
+	s->buckets[n->hash & (s->nbuckets-1)] = n;
+	s->nnodes++;
+	return n;
+}
+
+
+static void snap_add(struct snapshot* s, const char* owner, unsigned short type, unsigned int ttl, const unsigned char* rdata, int rdlength, const char* location)
+{
+	unsigned char name[DNS_MAXNAME+1];
+	const unsigned char* p;
+	struct dnsnode* n;
+	struct dnsrrdata** rd;
+
+	if (!dns_encodename(name, owner))
+		return;
+	dns_lowercase(name);
+	n = snap_node(s, name);
+	for (rd = &n->rrs; *rd; rd = &(*rd)->next)
+		if ((*rd)->type==type && (*rd)->rdlength==rdlength && memcmp((*rd)->rdata, rdata, rdlength)==0
+		    && strcmp((*rd)->location, location)==0)
+			return;
+	*rd = xcalloc(1, sizeof(struct dnsrrdata) + rdlength);
+	(*rd)->type = type;
+	(*rd)->ttl = ttl;
+	(*rd)->rdlength = rdlength;
+	strncpy((*rd)->location, location, sizeof((*rd)->location)-1);
+	memcpy((*rd)->rdata, rdata, rdlength);
+
+	/* empty non-terminals, so that NXDOMAIN is only returned for names that really do not exist */
+	for (p = name + *name + 1; *p && !snap_lookup(s, p); p += *p + 1)
+		snap_node(s, p);
+}
+
+
+static unsigned int snap_ttl(const char* ttl)
+{
+	if (ttl[0])
+		return strtoul(ttl, NULL, 10);
+	if (zone.ttl[0])
+		return strtoul(zone.ttl, NULL, 10);
+	return 3600;
+}
+
+
+static void snap_name(struct snapshot* s, const char* owner, unsigned short type, const struct resourcerecord* rr, int prefix, const char* target)
+{
+	unsigned char rdata[2+DNS_MAXNAME+1];
+	int len;
+
+	if (prefix>=0) {
+		rdata[0] = prefix >> 8;
+		rdata[1] = prefix & 0xff;
+	}
+	if ( (len = dns_encodename(rdata + (prefix>=0 ? 2 : 0), target)) )
+		snap_add(s, owner, type, snap_ttl(rr->ttl), rdata, len + (prefix>=0 ? 2 : 0), rr->location);
+}
+
+
+/* A record, with the matching PTR if this is a tinydns '=' style address */
+static void snap_addr(struct snapshot* s, const char* owner, const struct ipaddr* addr, const struct resourcerecord* rr, int withptr)
+{
+	char reverse[80];
+
+	if (!owner[0] || addr->len!=4)
+		return;
+	snap_add(s, owner, DNS_T_A, snap_ttl(rr->ttl), addr->addr, 4, rr->location);
+	if (withptr)
+		snap_name(s, ipaddr_reverse(reverse, addr), DNS_T_PTR, rr, -1, owner);
+}
+
+
+/* Owner of a PTR record, the reverse name of its first DNSipaddr if withaddr */
+static const char* ptr_owner(char owner[MAX_DOMAIN_LEN], const struct resourcerecord* rr, int withaddr)
+{
+	if (withaddr && rr->ipaddr[0].len) {
+		ipaddr_reverse(owner, &rr->ipaddr[0]);
+	} else {
+		strncpy(owner, rr->dnsdomainname, MAX_DOMAIN_LEN);
+		owner[MAX_DOMAIN_LEN-1] = '\0';
+	}
+	return owner;
+}
+
+
+/* Mirrors the tinydns branch of write_rr(), which is what the responder replaces */
+static void snap_rr(struct snapshot* s, const struct resourcerecord* rr, int ipdx, int znix)
+{
+	unsigned char rdata[6+DNS_MAXNAME+1];
+	int i, len;
+
+	if (strcasecmp(rr->class, "IN"))
+		return;
+	if (strcasecmp(rr->type, "NS")==0 || strcasecmp(rr->type, "MX")==0) {
+		unsigned short type = strcasecmp(rr->type, "NS")==0 ? DNS_T_NS : DNS_T_MX;
+		int pref = type==DNS_T_MX ? atoi(rr->preference) : -1;
+		if (!rr->cname[0])
+			return;
+		if (ipdx<=0)
+			snap_name(s, rr->dnsdomainname, type, rr, pref, rr->cname);
+		if (znix==0 && ipdx<=0 && rr->cipaddr.len)
+			snap_addr(s, rr->cname, &rr->cipaddr, rr, 1);
+		if (znix==0 && ipdx>=0)
+			snap_addr(s, rr->cname, &rr->ipaddr[ipdx], rr, 0);
+	} else if (strcasecmp(rr->type, "A")==0) {
+		if (ipdx<=0 && rr->cipaddr.len)
+			snap_addr(s, rr->dnsdomainname, &rr->cipaddr, rr, znix==0);
+		if (ipdx>=0)
+			snap_addr(s, rr->dnsdomainname, &rr->ipaddr[ipdx], rr, 0);
+	} else if (strcasecmp(rr->type, "PTR")==0) {
+		char owner[MAX_DOMAIN_LEN];
+		if (ipdx>0)
+			return;
+		snap_name(s, ptr_owner(owner, rr, ipdx==0), DNS_T_PTR, rr, -1, rr->cname);
+	} else if (strcasecmp(rr->type, "CNAME")==0) {
+		snap_name(s, rr->dnsdomainname, DNS_T_CNAME, rr, -1, rr->cname);
+	} else if (strcasecmp(rr->type, "TXT")==0) {
+		unsigned char text[sizeof(rr->txt) + sizeof(rr->txt)/255 + 1];
+		int tlen = strlen(rr->txt);
+		len = 0;
+		for (i = 0; i<tlen || i==0; i += 255) {
+			int chunk = tlen-i>255 ? 255 : tlen-i;
+			text[len++] = chunk;
+			memcpy(text+len, rr->txt+i, chunk);
+			len += chunk;
+		}
+		snap_add(s, rr->dnsdomainname, DNS_T_TXT, snap_ttl(rr->ttl), text, len, rr->location);
+	} else if (strcasecmp(rr->type, "SRV")==0) {
+		rdata[0] = rr->srvpriority >> 8;
+		rdata[1] = rr->srvpriority & 0xff;
+		rdata[2] = rr->srvweight >> 8;
+		rdata[3] = rr->srvweight & 0xff;
+		rdata[4] = rr->srvport >> 8;
+		rdata[5] = rr->srvport & 0xff;
+		if ( (len = dns_encodename(rdata+6, rr->cname)) )
+			snap_add(s, rr->dnsdomainname, DNS_T_SRV, snap_ttl(rr->ttl), rdata, len+6, rr->location);
+	} else if (strcasecmp(rr->type, "AAAA")==0) {
+		const struct ipaddr* a = rr->cipaddr.len ? &rr->cipaddr : rr->ipaddr ? &rr->ipaddr[0] : NULL;
+		if (a && a->len==16)
+			snap_add(s, rr->dnsdomainname, DNS_T_AAAA, snap_ttl(rr->ttl), a->addr, 16, rr->location);
+	}
+}
+
+
+/* SOA rdata of the current zone, 0 if its names do not encode */
+static int soa_rdata(unsigned char rdata[2*DNS_MAXNAME+20])
+{
+	unsigned int values[5];
+	int i, len, l;
+
+	if (!(len = dns_encodename(rdata, zone.zonemaster)))
+		return 0;
+	if (!(l = dns_encodename(rdata+len, zone.adminmailbox)))
+		return 0;
+	len += l;
+	values[0] = strtoul(zone.serial, NULL, 10);
+	values[1] = zone.refresh[0] ? strtoul(zone.refresh, NULL, 10) : 16384;
+	values[2] = zone.retry[0] ? strtoul(zone.retry, NULL, 10) : 2048;
+	values[3] = zone.expire[0] ? strtoul(zone.expire, NULL, 10) : 1048576;
+	values[4] = zone.minimum[0] ? strtoul(zone.minimum, NULL, 10) : 2560;
+	for (i = 0; i<5; i++) {
+		rdata[len++] = values[i] >> 24;
+		rdata[len++] = values[i] >> 16;
+		rdata[len++] = values[i] >> 8;
+		rdata[len++] = values[i];
+	}
+	return len;
+}
+
+
+static void snap_soa(struct snapshot* s)
+{
+	unsigned char rdata[2*DNS_MAXNAME+20];
+	unsigned char name[DNS_MAXNAME+1];
+	int len;
+
+	if (!(len = soa_rdata(rdata)))
+		return;
+	snap_add(s, zone.domainname, DNS_T_SOA, snap_ttl(""), rdata, len, zone.location);
+	if (dns_encodename(name, zone.domainname)) {
+		dns_lowercase(name);
+		snap_node(s, name)->apex = 1;
+	}
+}
+
+
+/*
+ * BIND raw zone files (-o bind-raw).  A zone is rendered as master file
+ * text exactly as for -o bind, and every line is then encoded the way
+ * named-compilezone -F raw writes it: a header followed by one block per
+ * RRset holding its class, type, TTL and count, the owner name and the
+ * rdata of each record, names uncompressed and all integers in network
+ * byte order.  named loads such files (masterfile-format raw) without
+ * parsing any text.
+ */
+#define RAW_FORMAT 2		/* dns_masterformat_raw */
+#define RAW_VERSION 1
+#define RAW_MAXRDATA (2*DNS_MAXNAME+20)
+
+struct rawrr
+{
+	unsigned char owner[DNS_MAXNAME+1];
+	unsigned char key[DNS_MAXNAME+1];	/* owner lower cased */
+	int ownerlen;
+	int seq;
+	unsigned short type;
+	unsigned short rdlength;
+	unsigned int ttl;
+	unsigned char rdata[RAW_MAXRDATA];
+};
+
+
+static void raw_put16(FILE* fp, unsigned int v)
+{
+	putc(v >> 8 & 0xff, fp);
+	putc(v & 0xff, fp);
+}
+
+
+static void raw_put32(FILE* fp, unsigned int v)
+{
+	raw_put16(fp, v >> 16);
+	raw_put16(fp, v);
+}
+
+
+/* TXT character strings from the quoted master file text, with its escapes */
+static int raw_text(unsigned char* out, const char* text)
+{
+	unsigned char buf[RAW_MAXRDATA];
+	int len = 0, i, res = 0;
+	const char* end;
+
+	if (*text++!='"' || !(end = strrchr(text, '"')))
+		return 0;
+	while (text<end && len<(int)sizeof(buf)) {
+		if (*text=='\\' && isdigit(text[1]) && isdigit(text[2]) && isdigit(text[3])) {
+			buf[len++] = (text[1]-'0')*100 + (text[2]-'0')*10 + text[3]-'0';
+			text += 4;
+		} else if (*text=='\\' && text+1<end) {
+			buf[len++] = text[1];
+			text += 2;
+		} else
+			buf[len++] = *text++;
+	}
+	for (i = 0; i<len || i==0; i += 255) {
+		int chunk = len-i>255 ? 255 : len-i;
+		if (res+chunk+1>RAW_MAXRDATA)
+			return 0;
+		out[res++] = chunk;
+		memcpy(out+res, buf+i, chunk);
+		res += chunk;
+	}
+	return res;
+}
+
+
+/* Encode one "owner.<tab>ttl<tab>IN type<tab>rdata" line as written by write_rr() */
+static int raw_record(struct rawrr* rr, char* line, unsigned int defttl)
+{
+	char* ttl;
+	char* type;
+	char* rdata;
+	char* p;
+	struct ipaddr a;
+	int len = 0;
+
+	if ( !(ttl = strchr(line, '\t')) || !(type = strchr(ttl+1, '\t')) || !(rdata = strchr(type+1, '\t')) )
+		return 0;
+	*ttl++ = *type++ = *rdata++ = '\0';
+	if (strncasecmp(type, "IN ", 3) || !(rr->ownerlen = dns_encodename(rr->owner, line)))
+		return 0;
+	type += 3;
+	memcpy(rr->key, rr->owner, rr->ownerlen);
+	dns_lowercase(rr->key);
+	rr->ttl = ttl[0] ? strtoul(ttl, NULL, 10) : defttl;
+	if (!strcasecmp(type, "A")) {
+		rr->type = DNS_T_A;
+		len = ipaddr_parse(&a, rdata) && a.len==4 ? 4 : 0;
+		memcpy(rr->rdata, a.addr, len);
+	} else if (!strcasecmp(type, "AAAA")) {
+		rr->type = DNS_T_AAAA;
+		len = ipaddr_parse(&a, rdata) && a.len==16 ? 16 : 0;
+		memcpy(rr->rdata, a.addr, len);
+	} else if (!strcasecmp(type, "NS") || !strcasecmp(type, "CNAME") || !strcasecmp(type, "PTR")) {
+		rr->type = !strcasecmp(type, "NS") ? DNS_T_NS : !strcasecmp(type, "CNAME") ? DNS_T_CNAME : DNS_T_PTR;
+		len = dns_encodename(rr->rdata, rdata);
+	} else if (!strcasecmp(type, "MX")) {
+		unsigned int pref = strtoul(rdata, &p, 10);
+		rr->type = DNS_T_MX;
+		rr->rdata[0] = pref >> 8;
+		rr->rdata[1] = pref & 0xff;
+		if (*p==' ' && (len = dns_encodename(rr->rdata+2, p+1)))
+			len += 2;
+	} else if (!strcasecmp(type, "SRV")) {
+		unsigned int v[3];
+		int i;
+		rr->type = DNS_T_SRV;
+		for (i = 0, p = rdata; i<3; i++) {
+			v[i] = strtoul(p, &p, 10);
+			rr->rdata[2*i] = v[i] >> 8;
+			rr->rdata[2*i+1] = v[i] & 0xff;
+			if (*p++!='\t')
+				return 0;
+		}
+		if ( (len = dns_encodename(rr->rdata+6, p)) )
+			len += 6;
+	} else if (!strcasecmp(type, "TXT")) {
+		rr->type = DNS_T_TXT;
+		len = raw_text(rr->rdata, rdata);
+	}
+	rr->rdlength = len;
+	return len>0;
+}
+
+
+/* Type an RRSIG covers, RRSIGs of each type are an RRset of their own */
+static unsigned int raw_covers(const struct rawrr* rr)
+{
+	return rr->type==DNS_T_RRSIG ? rr->rdata[0] << 8 | rr->rdata[1] : 0;
+}
+
+
+static int cmp_rawrr(const void* a, const void* b)
+{
+	const struct rawrr* x = *(struct rawrr* const*)a;
+	const struct rawrr* y = *(struct rawrr* const*)b;
+	int res;
+
+	if (x->ownerlen!=y->ownerlen)
+		return x->ownerlen-y->ownerlen;
+	if ((res = memcmp(x->key, y->key, x->ownerlen)))
+		return res;
+	if (x->type!=y->type)
+		return x->type-y->type;
+	if (raw_covers(x)!=raw_covers(y))
+		return raw_covers(x)-raw_covers(y);
+	return x->seq-y->seq;
+}
+
+
+/* Write one RRset; records are unique as for named, the TTL is the first one's */
+static void raw_rrset(FILE* fp, struct rawrr** rrs, int count)
+{
+	unsigned int total = 4+2+2+2+4+4 + 2+rrs[0]->ownerlen;
+	int unique = 0;
+	int i, k;
+
+	for (i = 0; i<count; i++) {
+		for (k = 0; k<i; k++)
+			if (rrs[k]->rdlength==rrs[i]->rdlength && !memcmp(rrs[k]->rdata, rrs[i]->rdata, rrs[i]->rdlength))
+				break;
+		if (k<i) {
+			rrs[i]->rdlength = 0;
+			continue;
+		}
+		total += 2+rrs[i]->rdlength;
+		unique++;
+	}
+	raw_put32(fp, total);
+	raw_put16(fp, 1);	/* IN */
+	raw_put16(fp, rrs[0]->type);
+	raw_put16(fp, raw_covers(rrs[0]));
+	raw_put32(fp, rrs[0]->ttl);
+	raw_put32(fp, unique);
+	raw_put16(fp, rrs[0]->ownerlen);
+	fwrite(rrs[0]->owner, 1, rrs[0]->ownerlen, fp);
+	for (i = 0; i<count; i++) {
+		if (!rrs[i]->rdlength)
+			continue;
+		raw_put16(fp, rrs[i]->rdlength);
+		fwrite(rrs[i]->rdata, 1, rrs[i]->rdlength, fp);
+	}
+}
+
+
+/*
+ * Records of the zone in text, the master file rendered for it by
+ * write_dnszone().  The first one is the SOA, encoded from the zone itself
+ * with rdlength 0 if that fails.
+ */
+static struct rawrr** raw_parse(char* text, int* count, unsigned int* defttl)
+{
+	struct rawrr** rrs = xcalloc(64, sizeof(struct rawrr*));
+	struct rawrr* soa = xcalloc(1, sizeof(struct rawrr));
+	char* line;
+	char* save;
+	int size = 64;
+	int insoa = 0;
+
+	*defttl = 3600;
+	rrs[0] = soa;
+	*count = 1;
+	for (line = strtok_r(text, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+		if (insoa) {
+			insoa = !strchr(line, ')');
+			continue;
+		}
+		if (line[0]==';')
+			continue;
+		if (!strncmp(line, "$TTL ", 5)) {
+			*defttl = strtoul(line+5, NULL, 10);
+			continue;
+		}
+		if (strstr(line, " IN SOA ")) {
+			/* spread over several lines, encoded from the zone itself */
+			insoa = !strchr(line, ')');
+			continue;
+		}
+		if (*count==size) {
+			size *= 2;
+			if ( !(rrs = realloc(rrs, size*sizeof(struct rawrr*))) )
+				die_exit(NULL);
+		}
+		rrs[*count] = malloc(sizeof(struct rawrr));
+		if (!rrs[*count])
+			die_exit(NULL);
+		if (!raw_record(rrs[*count], line, *defttl)) {
+			fprintf(stderr, "[**] Unable to encode \"%s\" for raw output or signing; skipping record.\n", line);
+			free(rrs[*count]);
+			continue;
+		}
+		rrs[*count]->seq = *count;
+		(*count)++;
+	}
+	if ( (soa->ownerlen = dns_encodename(soa->owner, zone.domainname)) && (soa->rdlength = soa_rdata(soa->rdata)) ) {
+		memcpy(soa->key, soa->owner, soa->ownerlen);
+		dns_lowercase(soa->key);
+		soa->type = DNS_T_SOA;
+		soa->ttl = *defttl;
+	} else
+		soa->rdlength = 0;
+	return rrs;
+}
+
+
+#ifdef DNSSEC
+static void sign_zone(struct rawrr*** rrs, int* count, unsigned int defttl);
+#endif
+
+/* Write the zone in text, the master file rendered for it by write_dnszone(), to fp */
+static void write_rawzone(FILE* fp, char* text)
+{
+	struct rawrr** rrs;
+	unsigned int defttl;
+	int count;
+	int i, k;
+
+	rrs = raw_parse(text, &count, &defttl);
+#ifdef DNSSEC
+	if (options.signkeys[0])
+		sign_zone(&rrs, &count, defttl);
+#endif
+	raw_put32(fp, RAW_FORMAT);
+	raw_put32(fp, RAW_VERSION);
+	raw_put32(fp, time(NULL));
+	raw_put32(fp, 0);	/* flags */
+	raw_put32(fp, 0);	/* source serial */
+	raw_put32(fp, 0);	/* last transfer */
+	if (rrs[0]->rdlength)
+		raw_rrset(fp, rrs, 1);
+	qsort(rrs+1, count-1, sizeof(struct rawrr*), cmp_rawrr);
+	for (i = 1; i<count; i = k) {
+		for (k = i+1; k<count && rrs[k]->type==rrs[i]->type && rrs[k]->ownerlen==rrs[i]->ownerlen
+		    && !memcmp(rrs[k]->key, rrs[i]->key, rrs[i]->ownerlen) && raw_covers(rrs[k])==raw_covers(rrs[i]); k++);
+		raw_rrset(fp, rrs+i, k-i);
+	}
+	for (i = 0; i<count; i++)
+		free(rrs[i]);
+	free(rrs);
+}
+
+
+#ifdef DNSSEC
+/*
+ * DNSSEC signing of the BIND zone files, with -K.  The keys of a zone are
+ * the BIND key pairs K<zone>.+<alg>+<tag>.key and .private in the key
+ * directory; their Publish, Activate, Inactive and Delete times are obeyed
+ * and they are read again when the directory or the files change.  Active
+ * keys with the SEP flag sign the DNSKEY RRset, the others everything else.
+ *
+ * A zone is signed in full every time it is rendered, but the signatures
+ * made before are kept in memory, per zone, under a hash of the RRset and
+ * the key.  An RRset whose hash is found again gets its previous RRSIG,
+ * unless that expires within a quarter of the validity.  The NSEC chain is
+ * built anew each time and goes through the same cache, so only the links
+ * next to added or removed names are signed again.  What is left to sign
+ * is spread over one thread per core, and the expiry times are spread over
+ * an eighth of the validity so that renewals do not all fall due at once.
+ */
+#define SIGN_MAXKEYS 8
+#define SIGN_MAXTYPES 32
+#define SIGN_MAXTHREADS 16
+#define SIGN_BATCH 64		/* RRsets a signing thread takes at a time */
+#define SIGN_SKEW 3600		/* inception before now, for clocks running behind */
+
+struct signkey
+{
+	char name[256];		/* of the files, without .key or .private */
+	time_t mtime;		/* of the .private file */
+	EVP_PKEY* pkey;
+	const EVP_MD* md;	/* NULL for EdDSA */
+	int ecdsa;		/* bytes of r and s, 0 if not ECDSA */
+	unsigned short flags;
+	unsigned short tag;
+	unsigned long long id;	/* hash of the DNSKEY */
+	time_t publish;		/* these are 0 if not set */
+	time_t activate;
+	time_t inactive;
+	time_t remove;
+	unsigned short rdlength;
+	unsigned char rdata[RAW_MAXRDATA];	/* the DNSKEY */
+};
+
+struct sigentry
+{
+	unsigned long long hash;	/* of the RRset and the key, 0 if the slot is free */
+	unsigned int expire;
+	unsigned short rdlength;
+	unsigned char* rdata;		/* the RRSIG */
+};
+
+struct signzone
+{
+	struct signzone* next;
+	char name[64];
+	pthread_mutex_t lock;
+	time_t used;
+	struct timespec scanned;	/* mtime of the key directory when last read */
+	struct signkey* keys[SIGN_MAXKEYS];
+	int numkeys;
+	struct sigentry* cache;
+	unsigned int size;	/* a power of two */
+};
+
+struct signjob
+{
+	struct rawrr** rrs;	/* the RRset, in canonical order without duplicates */
+	int count;
+	unsigned int ttl;
+	const struct signkey* key;
+	unsigned long long hash;
+	struct sigentry sig;
+};
+
+struct signwork
+{
+	struct signjob** jobs;
+	int count;
+	int next;
+	const unsigned char* signer;
+	int signerlen;
+	unsigned int inception;
+	int failed;
+};
+
+static struct
+{
+	pthread_mutex_t lock;
+	struct signzone* zones;
+	unsigned long made;
+	unsigned long reused;
+} signer = { PTHREAD_MUTEX_INITIALIZER };
+
+static const struct
+{
+	int algorithm;
+	const char* type;	/* of the OpenSSL key */
+	const char* group;	/* curve of ECDSA keys */
+	const char* digest;	/* NULL for EdDSA */
+	int ecdsa;
+} sign_algorithms[] = {
+	{ 8, "RSA", NULL, "SHA256", 0 },
+	{ 10, "RSA", NULL, "SHA512", 0 },
+	{ 13, "EC", "P-256", "SHA256", 32 },
+	{ 14, "EC", "P-384", "SHA384", 48 },
+	{ 15, "ED25519", NULL, NULL, 0 },
+	{ 16, "ED448", NULL, NULL, 0 },
+	{ 0, NULL, NULL, NULL, 0 }
+};
+
+
+static void sign_put16(unsigned char* p, unsigned int v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+
+static void sign_put32(unsigned char* p, unsigned int v)
+{
+	sign_put16(p, v >> 16);
+	sign_put16(p+2, v);
+}
+
+
+static unsigned int sign_get32(const unsigned char* p)
+{
+	return (unsigned int)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+
+/* Decode base64 text, which may contain white space; returns the length or 0 */
+static int sign_base64(unsigned char* out, int size, const char* text)
+{
+	unsigned char buf[4096];
+	int len = 0, res;
+
+	for (; *text && len<(int)sizeof(buf)-1; text++)
+		if (!isspace((unsigned char)*text))
+			buf[len++] = *text;
+	if (len==0 || len%4 || len/4*3>size || (res = EVP_DecodeBlock(out, buf, len))<0)
+		return 0;
+	while (len>0 && buf[--len]=='=')
+		res--;
+	return res;
+}
+
+
+/* A YYYYMMDDHHMMSS time as in the key files and RRSIGs */
+static time_t sign_time(const char* text)
+{
+	struct tm tm;
+
+	memset(&tm, 0, sizeof(tm));
+	if (sscanf(text, "%4d%2d%2d%2d%2d%2d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec)!=6)
+		return 0;
+	tm.tm_year -= 1900;
+	tm.tm_mon--;
+	return timegm(&tm);
+}
+
+
+/* RFC 4034 appendix B */
+static unsigned short sign_keytag(const unsigned char* rdata, int len)
+{
+	unsigned long ac = 0;
+	int i;
+
+	for (i = 0; i<len; i++)
+		ac += i&1 ? rdata[i] : rdata[i] << 8;
+	ac += ac >> 16 & 0xffff;
+	return ac & 0xffff;
+}
+
+
+static void sign_freekey(struct signkey* k)
+{
+	EVP_PKEY_free(k->pkey);
+	free(k);
+}
+
+
+/* The private key from the values of the .private file, see sign_loadkey() */
+static EVP_PKEY* sign_pkey(int alg, struct signkey* k, unsigned char value[][512], const int* len)
+{
+	static const char* const params[] = {
+		NULL, OSSL_PKEY_PARAM_RSA_N, OSSL_PKEY_PARAM_RSA_E, OSSL_PKEY_PARAM_RSA_D,
+		OSSL_PKEY_PARAM_RSA_FACTOR1, OSSL_PKEY_PARAM_RSA_FACTOR2, OSSL_PKEY_PARAM_RSA_EXPONENT1,
+		OSSL_PKEY_PARAM_RSA_EXPONENT2, OSSL_PKEY_PARAM_RSA_COEFFICIENT1
+	};
+	unsigned char pub[RAW_MAXRDATA];
+	OSSL_PARAM_BLD* bld;
+	OSSL_PARAM* param = NULL;
+	EVP_PKEY_CTX* ctx = NULL;
+	EVP_PKEY* pkey = NULL;
+	BIGNUM* bn[9] = { NULL };
+	int i, ok = 1;
+
+	if (!sign_algorithms[alg].group && strcmp(sign_algorithms[alg].type, "RSA"))
+		return len[0] ? EVP_PKEY_new_raw_private_key_ex(NULL, sign_algorithms[alg].type, NULL, value[0], len[0]) : NULL;
+	if ( !(bld = OSSL_PARAM_BLD_new()) )
+		return NULL;
+	if (sign_algorithms[alg].group) {
+		/* the public key is the point of the DNSKEY, uncompressed */
+		pub[0] = 4;
+		memcpy(pub+1, k->rdata+4, k->rdlength-4);
+		ok = len[0] && (bn[0] = BN_bin2bn(value[0], len[0], NULL))
+		    && OSSL_PARAM_BLD_push_utf8_string(bld, OSSL_PKEY_PARAM_GROUP_NAME, sign_algorithms[alg].group, 0)
+		    && OSSL_PARAM_BLD_push_BN(bld, OSSL_PKEY_PARAM_PRIV_KEY, bn[0])
+		    && OSSL_PARAM_BLD_push_octet_string(bld, OSSL_PKEY_PARAM_PUB_KEY, pub, k->rdlength-3);
+	} else {
+		for (i = 1; i<9 && ok; i++)
+			ok = len[i] && (bn[i] = BN_bin2bn(value[i], len[i], NULL)) && OSSL_PARAM_BLD_push_BN(bld, params[i], bn[i]);
+	}
+	if (ok && (param = OSSL_PARAM_BLD_to_param(bld)) && (ctx = EVP_PKEY_CTX_new_from_name(NULL, sign_algorithms[alg].type, NULL))
+	    && EVP_PKEY_fromdata_init(ctx)==1)
+		EVP_PKEY_fromdata(ctx, &pkey, EVP_PKEY_KEYPAIR, param);
+	EVP_PKEY_CTX_free(ctx);
+	OSSL_PARAM_free(param);
+	OSSL_PARAM_BLD_free(bld);
+	for (i = 0; i<9; i++)
+		BN_free(bn[i]);
+	return pkey;
+}
+
+
+/* Read the key pair name.key and name.private of the key directory, NULL if unusable */
+static struct signkey* sign_loadkey(const char* name, time_t mtime, int signerlen)
+{
+	static const char* const fields[] = {
+		"PrivateKey", "Modulus", "PublicExponent", "PrivateExponent",
+		"Prime1", "Prime2", "Exponent1", "Exponent2", "Coefficient", NULL
+	};
+	struct signkey* k = xcalloc(1, sizeof(struct signkey));
+	unsigned char value[9][512];
+	int len[9] = { 0 };
+	unsigned int flags, protocol, algorithm = 0, keyalg = 0;
+	char path[512];
+	char line[4096];
+	char* p;
+	FILE* fp;
+	int alg, i, n;
+
+	snprintf(k->name, sizeof(k->name), "%s", name);
+	k->mtime = mtime;
+	snprintf(path, sizeof(path), "%s/%s.key", options.signkeys, name);
+	if ( (fp = fopen(path, "r")) ) {
+		while (fgets(line, sizeof(line), fp) && !k->rdlength) {
+			if (line[0]==';' || !(p = strstr(line, "DNSKEY")))
+				continue;
+			if (sscanf(p+6, "%u %u %u %n", &flags, &protocol, &keyalg, &n)<3 || protocol!=3)
+				break;
+			if ( (k->rdlength = sign_base64(k->rdata+4, RAW_MAXRDATA-4, p+6+n)) )
+				k->rdlength += 4;
+		}
+		fclose(fp);
+	}
+	snprintf(path, sizeof(path), "%s/%s.private", options.signkeys, name);
+	if (k->rdlength && (fp = fopen(path, "r"))) {
+		while (fgets(line, sizeof(line), fp)) {
+			if (!(p = strchr(line, ':')))
+				continue;
+			*p++ = '\0';
+			if (!strcmp(line, "Algorithm"))
+				algorithm = atoi(p);
+			else if (!strcmp(line, "Publish"))
+				k->publish = sign_time(p+1);
+			else if (!strcmp(line, "Activate"))
+				k->activate = sign_time(p+1);
+			else if (!strcmp(line, "Inactive"))
+				k->inactive = sign_time(p+1);
+			else if (!strcmp(line, "Delete"))
+				k->remove = sign_time(p+1);
+			for (i = 0; fields[i]; i++)
+				if (!strcmp(line, fields[i]))
+					len[i] = sign_base64(value[i], sizeof(value[i]), p);
+		}
+		fclose(fp);
+	}
+	for (alg = 0; sign_algorithms[alg].algorithm && sign_algorithms[alg].algorithm!=(int)keyalg; alg++);
+	if (k->rdlength && algorithm==keyalg && sign_algorithms[alg].algorithm && (k->pkey = sign_pkey(alg, k, value, len))
+	    && 18+signerlen+EVP_PKEY_get_size(k->pkey)<=RAW_MAXRDATA) {
+		k->flags = flags;
+		k->rdata[0] = flags >> 8;
+		k->rdata[1] = flags;
+		k->rdata[2] = 3;
+		k->rdata[3] = keyalg;
+		k->tag = sign_keytag(k->rdata, k->rdlength);
+		k->id = fnv64(FNV64_INIT, k->rdata, k->rdlength);
+		k->md = sign_algorithms[alg].digest ? EVP_get_digestbyname(sign_algorithms[alg].digest) : NULL;
+		k->ecdsa = sign_algorithms[alg].ecdsa;
+		OPENSSL_cleanse(value, sizeof(value));
+		return k;
+	}
+	OPENSSL_cleanse(value, sizeof(value));
+	fprintf(stderr, "[**] Warning: unable to use DNSSEC key %s/%s\n", options.signkeys, name);
+	sign_freekey(k);
+	return NULL;
+}
+
+
+/* Read the keys of zone sz again if the key directory or the key files changed */
+static void sign_keys(struct signzone* sz, int signerlen)
+{
+	struct signkey* keys[SIGN_MAXKEYS];
+	struct dirent* de;
+	struct stat st;
+	char prefix[80];
+	char path[512];
+	size_t plen, len;
+	DIR* dir;
+	int n = 0, i;
+
+	if (stat(options.signkeys, &st)!=0) {
+		fprintf(stderr, "[**] Warning: unable to read DNSSEC key directory %s\n", options.signkeys);
+		return;
+	}
+	if (st.st_mtim.tv_sec==sz->scanned.tv_sec && st.st_mtim.tv_nsec==sz->scanned.tv_nsec) {
+		for (i = 0; i<sz->numkeys; i++) {
+			snprintf(path, sizeof(path), "%s/%s.private", options.signkeys, sz->keys[i]->name);
+			if (stat(path, &st)!=0 || st.st_mtime!=sz->keys[i]->mtime)
+				break;
+		}
+		if (i==sz->numkeys)
+			return;
+		memset(&sz->scanned, 0, sizeof(sz->scanned));
+		sign_keys(sz, signerlen);
+		return;
+	}
+	sz->scanned = st.st_mtim;
+	if ( !(dir = opendir(options.signkeys)) )
+		return;
+	plen = snprintf(prefix, sizeof(prefix), "K%s.+", sz->name);
+	while ((de = readdir(dir)) && n<SIGN_MAXKEYS) {
+		len = strlen(de->d_name);
+		if (len<=plen+8 || strncasecmp(de->d_name, prefix, plen) || strcmp(de->d_name+len-8, ".private"))
+			continue;
+		de->d_name[len-8] = '\0';
+		snprintf(path, sizeof(path), "%s/%s.private", options.signkeys, de->d_name);
+		if (stat(path, &st)!=0)
+			continue;
+		for (i = 0; i<sz->numkeys; i++)
+			if (sz->keys[i] && !strcmp(sz->keys[i]->name, de->d_name) && sz->keys[i]->mtime==st.st_mtime)
+				break;
+		if (i<sz->numkeys) {
+			keys[n++] = sz->keys[i];
+			sz->keys[i] = NULL;
+		} else if ( (keys[n] = sign_loadkey(de->d_name, st.st_mtime, signerlen)) )
+			n++;
+	}
+	closedir(dir);
+	for (i = 0; i<sz->numkeys; i++)
+		if (sz->keys[i])
+			sign_freekey(sz->keys[i]);
+	memcpy(sz->keys, keys, n*sizeof(struct signkey*));
+	sz->numkeys = n;
+}
+
+
+static void sign_freezone(struct signzone* sz)
+{
+	unsigned int i;
+	int k;
+
+	for (k = 0; k<sz->numkeys; k++)
+		sign_freekey(sz->keys[k]);
+	for (i = 0; i<sz->size; i++)
+		free(sz->cache[i].rdata);
+	free(sz->cache);
+	pthread_mutex_destroy(&sz->lock);
+	free(sz);
+}
+
+
+/* The signing state of zone name, locked; that of zones not signed for a validity is dropped */
+static struct signzone* sign_getzone(const char* name, time_t now)
+{
+	struct signzone** p = &signer.zones;
+	struct signzone* sz = NULL;
+	struct signzone* stale;
+
+	pthread_mutex_lock(&signer.lock);
+	while (*p) {
+		if (!strcasecmp((*p)->name, name))
+			sz = *p;
+		else if ((*p)->used+options.sign_validity<now && pthread_mutex_trylock(&(*p)->lock)==0) {
+			stale = *p;
+			*p = stale->next;
+			pthread_mutex_unlock(&stale->lock);
+			sign_freezone(stale);
+			continue;
+		}
+		p = &(*p)->next;
+	}
+	if (!sz) {
+		sz = xcalloc(1, sizeof(struct signzone));
+		snprintf(sz->name, sizeof(sz->name), "%s", name);
+		pthread_mutex_init(&sz->lock, NULL);
+		sz->next = signer.zones;
+		signer.zones = sz;
+	}
+	sz->used = now;
+	pthread_mutex_unlock(&signer.lock);
+	pthread_mutex_lock(&sz->lock);
+	return sz;
+}
+
+
+/* Canonical DNSSEC order of two lower cased names in wire format */
+static int sign_cmpname(const unsigned char* a, const unsigned char* b)
+{
+	const unsigned char* la[128];
+	const unsigned char* lb[128];
+	int na = 0, nb = 0;
+	int len, res;
+
+	for (; *a; a += *a+1)
+		la[na++] = a;
+	for (; *b; b += *b+1)
+		lb[nb++] = b;
+	while (na>0 && nb>0) {
+		a = la[--na];
+		b = lb[--nb];
+		len = *a<*b ? *a : *b;
+		if ((res = memcmp(a+1, b+1, len)))
+			return res;
+		if (*a!=*b)
+			return *a-*b;
+	}
+	return na-nb;
+}
+
+
+static int cmp_signrr(const void* a, const void* b)
+{
+	const struct rawrr* x = *(struct rawrr* const*)a;
+	const struct rawrr* y = *(struct rawrr* const*)b;
+	int res;
+
+	if ((res = sign_cmpname(x->key, y->key)))
+		return res;
+	if (x->type!=y->type)
+		return x->type-y->type;
+	return x->seq-y->seq;
+}
+
+
+/* The rdata of rr in canonical form, with the names in it lower cased */
+static int sign_rdata(unsigned char* out, const struct rawrr* rr)
+{
+	memcpy(out, rr->rdata, rr->rdlength);
+	switch (rr->type) {
+	case DNS_T_NS:
+	case DNS_T_CNAME:
+	case DNS_T_PTR:
+		dns_lowercase(out);
+		break;
+	case DNS_T_MX:
+		dns_lowercase(out+2);
+		break;
+	case DNS_T_SRV:
+		dns_lowercase(out+6);
+		break;
+	case DNS_T_SOA:
+		dns_lowercase(out);
+		dns_lowercase(out+dns_namelen(out));
+		break;
+	}
+	return rr->rdlength;
+}
+
+
+static int cmp_signrdata(const void* a, const void* b)
+{
+	unsigned char x[RAW_MAXRDATA];
+	unsigned char y[RAW_MAXRDATA];
+	int xl = sign_rdata(x, *(struct rawrr* const*)a);
+	int yl = sign_rdata(y, *(struct rawrr* const*)b);
+	int res;
+
+	if ((res = memcmp(x, y, xl<yl ? xl : yl)))
+		return res;
+	return xl-yl;
+}
+
+
+/* Whether the lower cased name is parent or below it */
+static int sign_below(const unsigned char* name, const unsigned char* parent, int parentlen)
+{
+	int len = dns_namelen(name);
+
+	while (len>parentlen) {
+		len -= *name+1;
+		name += *name+1;
+	}
+	return len==parentlen && !memcmp(name, parent, parentlen);
+}
+
+
+/* A record of the signer's own, only as much of rdata allocated as it needs */
+static struct rawrr* sign_newrr(const struct rawrr* owner, unsigned short type, unsigned int ttl, const unsigned char* rdata, int rdlength)
+{
+	struct rawrr* rr = malloc(offsetof(struct rawrr, rdata)+rdlength);
+
+	if (!rr)
+		die_exit(NULL);
+	memcpy(rr->owner, owner->owner, owner->ownerlen);
+	memcpy(rr->key, owner->key, owner->ownerlen);
+	rr->ownerlen = owner->ownerlen;
+	rr->seq = 0;
+	rr->type = type;
+	rr->ttl = ttl;
+	rr->rdlength = rdlength;
+	memcpy(rr->rdata, rdata, rdlength);
+	return rr;
+}
+
+
+/* NSEC type bitmap of the sorted types */
+static int sign_bitmap(unsigned char* out, const unsigned short* types, int count)
+{
+	int len = 0, window = -1, start = 0;
+	int i, octet;
+
+	for (i = 0; i<count; i++) {
+		if (types[i] >> 8!=window) {
+			window = types[i] >> 8;
+			start = len;
+			out[len++] = window;
+			out[len++] = 0;
+		}
+		octet = (types[i] & 0xff) >> 3;
+		if (out[start+1]<=octet) {
+			memset(out+start+2+out[start+1], 0, octet+1-out[start+1]);
+			out[start+1] = octet+1;
+			len = start+2+octet+1;
+		}
+		out[start+2+octet] |= 0x80 >> (types[i] & 7);
+	}
+	return len;
+}
+
+
+static unsigned long long sign_hash(const struct signjob* j)
+{
+	unsigned char rdata[RAW_MAXRDATA];
+	unsigned char head[6];
+	unsigned long long h;
+	int i, len;
+
+	h = fnv64(FNV64_INIT, &j->key->id, sizeof(j->key->id));
+	h = fnv64(h, j->rrs[0]->key, j->rrs[0]->ownerlen);
+	sign_put16(head, j->rrs[0]->type);
+	sign_put32(head+2, j->ttl);
+	h = fnv64(h, head, sizeof(head));
+	for (i = 0; i<j->count; i++) {
+		len = sign_rdata(rdata, j->rrs[i]);
+		sign_put16(head, len);
+		h = fnv64(h, head, 2);
+		h = fnv64(h, rdata, len);
+	}
+	return h ? h : 1;
+}
+
+
+static struct sigentry* sign_lookup(struct sigentry* cache, unsigned int size, unsigned long long hash)
+{
+	unsigned int i;
+
+	if (!size)
+		return NULL;
+	for (i = hash & (size-1); cache[i].hash; i = (i+1) & (size-1))
+		if (cache[i].hash==hash)
+			return &cache[i];
+	return NULL;
+}
+
+
+/* Make the RRSIG of job j, the signed data is built in buf */
+static void sign_rrset(EVP_MD_CTX* ctx, struct signwork* w, struct signjob* j, unsigned char** buf, size_t* size)
+{
+	const struct rawrr* first = j->rrs[0];
+	unsigned char sig[1024];
+	unsigned char raw[128];
+	unsigned char* p;
+	size_t siglen = sizeof(sig);
+	size_t len;
+	unsigned int expire;
+	int labels = 0;
+	int i, head;
+
+	/* spread the expiry times, by the hash so that they stay apart */
+	expire = w->inception+SIGN_SKEW+options.sign_validity - j->hash%(options.sign_validity/8+1);
+	len = 18+w->signerlen;
+	for (i = 0; i<j->count; i++)
+		len += j->rrs[i]->ownerlen+10+j->rrs[i]->rdlength;
+	if (len>*size) {
+		*size = len;
+		if ( !(*buf = realloc(*buf, len)) )
+			die_exit(NULL);
+	}
+	for (p = (unsigned char*)first->key; *p; p += *p+1)
+		labels++;
+	if (first->key[0]==1 && first->key[1]=='*')
+		labels--;
+	p = *buf;
+	sign_put16(p, first->type);
+	p[2] = j->key->rdata[3];
+	p[3] = labels;
+	sign_put32(p+4, j->ttl);
+	sign_put32(p+8, expire);
+	sign_put32(p+12, w->inception);
+	sign_put16(p+16, j->key->tag);
+	memcpy(p+18, w->signer, w->signerlen);
+	head = 18+w->signerlen;
+	p += head;
+	for (i = 0; i<j->count; i++) {
+		memcpy(p, j->rrs[i]->key, j->rrs[i]->ownerlen);
+		p += j->rrs[i]->ownerlen;
+		sign_put16(p, j->rrs[i]->type);
+		sign_put16(p+2, 1);	/* IN */
+		sign_put32(p+4, j->ttl);
+		sign_put16(p+8, j->rrs[i]->rdlength);
+		p += 10;
+		p += sign_rdata(p, j->rrs[i]);
+	}
+	EVP_MD_CTX_reset(ctx);
+	if (EVP_DigestSignInit(ctx, NULL, j->key->md, NULL, j->key->pkey)!=1 || EVP_DigestSign(ctx, sig, &siglen, *buf, len)!=1) {
+		__atomic_add_fetch(&w->failed, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	if (j->key->ecdsa) {
+		/* DER to the r and s of RFC 6605 */
+		const unsigned char* der = sig;
+		const BIGNUM* r;
+		const BIGNUM* s;
+		ECDSA_SIG* es = d2i_ECDSA_SIG(NULL, &der, siglen);
+
+		if (!es) {
+			__atomic_add_fetch(&w->failed, 1, __ATOMIC_RELAXED);
+			return;
+		}
+		ECDSA_SIG_get0(es, &r, &s);
+		BN_bn2binpad(r, raw, j->key->ecdsa);
+		BN_bn2binpad(s, raw+j->key->ecdsa, j->key->ecdsa);
+		ECDSA_SIG_free(es);
+		siglen = 2*j->key->ecdsa;
+		memcpy(sig, raw, siglen);
+	}
+	if ( !(j->sig.rdata = malloc(head+siglen)) )
+		die_exit(NULL);
+	memcpy(j->sig.rdata, *buf, head);
+	memcpy(j->sig.rdata+head, sig, siglen);
+	j->sig.rdlength = head+siglen;
+	j->sig.expire = expire;
+}
+
+
+static void* sign_thread(void* arg)
+{
+	struct signwork* w = arg;
+	EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+	unsigned char* buf = NULL;
+	size_t size = 0;
+	int i, k;
+
+	if (!ctx)
+		die_exit(NULL);
+	while ((i = __atomic_fetch_add(&w->next, SIGN_BATCH, __ATOMIC_RELAXED))<w->count)
+		for (k = i; k<i+SIGN_BATCH && k<w->count; k++)
+			sign_rrset(ctx, w, w->jobs[k], &buf, &size);
+	EVP_MD_CTX_free(ctx);
+	free(buf);
+	return NULL;
+}
+
+
+/* Sign the jobs of w on as many threads as there are cores, at most one per batch */
+static void sign_jobs(struct signwork* w)
+{
+	pthread_t threads[SIGN_MAXTHREADS];
+	long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	int started = 0;
+	int i;
+
+	if (nthreads>SIGN_MAXTHREADS)
+		nthreads = SIGN_MAXTHREADS;
+	if (nthreads>(w->count+SIGN_BATCH-1)/SIGN_BATCH)
+		nthreads = (w->count+SIGN_BATCH-1)/SIGN_BATCH;
+	for (i = 1; i<nthreads; i++)
+		if (start_thread(&threads[started], sign_thread, w)==0)
+			started++;
+	sign_thread(w);
+	for (i = 0; i<started; i++)
+		pthread_join(threads[i], NULL);
+}
+
+
+static int sign_types(unsigned short* types, int count, unsigned short type)
+{
+	int i;
+
+	for (i = count; i>0 && types[i-1]>type; i--)
+		types[i] = types[i-1];
+	types[i] = type;
+	return count+1;
+}
+
+
+/*
+ * Sign the records of the current zone as parsed by raw_parse(), rrs[0]
+ * being the SOA, and append the DNSKEY, NSEC and RRSIG records to them.
+ * sign_due is lowered to when the signatures need renewing.
+ */
+static void sign_zone(struct rawrr*** rrs, int* count, unsigned int defttl)
+{
+	const struct rawrr* soa = (*rrs)[0];
+	const struct signkey* zsk[SIGN_MAXKEYS];
+	const struct signkey* ksk[SIGN_MAXKEYS];
+	const struct signkey* key;
+	const struct rawrr* cut = NULL;
+	struct signzone* sz;
+	struct signwork w;
+	struct signjob* jobs;
+	struct signjob* j;
+	struct sigentry* cache;
+	struct sigentry* e;
+	struct rawrr** v;
+	struct rawrr** set;
+	struct rawrr** nsec;
+	struct rawrr** next;
+	unsigned short types[SIGN_MAXTYPES+2];
+	unsigned char rdata[RAW_MAXRDATA];
+	unsigned int size, margin = options.sign_validity/4;
+	unsigned int minimum;
+	time_t now = time(NULL);
+	time_t due = 0;
+	time_t events[4];
+	int nzsk = 0, nksk = 0, published = 0;
+	int n = 0, numsets = 0, numjobs = 0, numnsec = 0, reused = 0, numtypes;
+	int delegation, len;
+	int i, k, m, s, x;
+
+	if (!soa->rdlength) {
+		fprintf(stderr, "[**] Warning: zone %s has no SOA, not signing it\n", zone.domainname);
+		return;
+	}
+	sz = sign_getzone(zone.domainname, now);
+	sign_keys(sz, soa->ownerlen);
+	for (i = 0; i<sz->numkeys; i++) {
+		key = sz->keys[i];
+		if ((!key->publish || key->publish<=now) && (!key->remove || now<key->remove))
+			published++;
+		if ((key->activate && now<key->activate) || (key->inactive && key->inactive<=now) || (key->remove && key->remove<=now))
+			continue;
+		if (key->flags&1)
+			ksk[nksk++] = key;
+		else
+			zsk[nzsk++] = key;
+	}
+	/* a zone with only one kind of key has it sign everything */
+	if (!nzsk)
+		memcpy(zsk, ksk, (nzsk = nksk)*sizeof(struct signkey*));
+	if (!nksk)
+		memcpy(ksk, zsk, (nksk = nzsk)*sizeof(struct signkey*));
+	if (!nzsk) {
+		fprintf(stderr, "[**] Warning: no active DNSSEC key for zone %s in %s, not signing it\n", zone.domainname, options.signkeys);
+		pthread_mutex_unlock(&sz->lock);
+		return;
+	}
+
+	/* the DNSKEY RRset is part of the zone like any other */
+	if ( !(*rrs = realloc(*rrs, (*count+published)*sizeof(struct rawrr*))) )
+		die_exit(NULL);
+	for (i = 0; i<sz->numkeys; i++) {
+		key = sz->keys[i];
+		if ((key->publish && now<key->publish) || (key->remove && key->remove<=now))
+			continue;
+		(*rrs)[*count] = sign_newrr(soa, DNS_T_DNSKEY, defttl, key->rdata, key->rdlength);
+		(*rrs)[*count]->seq = *count;
+		(*count)++;
+	}
+	v = xcalloc(*count, sizeof(struct rawrr*));
+	for (i = 0; i<*count; i++)
+		if (sign_below((*rrs)[i]->key, soa->key, soa->ownerlen))
+			v[n++] = (*rrs)[i];
+	qsort(v, n, sizeof(struct rawrr*), cmp_signrr);
+
+	/*
+	 * One pass over the names in canonical order: names below a delegation
+	 * are glue and neither signed nor in the NSEC chain, at the delegation
+	 * only the NS RRset (unsigned) and the DS RRset count.  Every RRset
+	 * signed is kept in set, in canonical rdata order, and every name
+	 * gets an NSEC record whose next name is filled in afterwards.
+	 */
+	set = xcalloc(n, sizeof(struct rawrr*));
+	nsec = xcalloc(n, sizeof(struct rawrr*));
+	next = xcalloc(n, sizeof(struct rawrr*));
+	jobs = xcalloc((n+n)*SIGN_MAXKEYS, sizeof(struct signjob));
+	minimum = sign_get32(soa->rdata+soa->rdlength-4);
+	if (minimum>soa->ttl)
+		minimum = soa->ttl;
+	for (i = 0; i<n; i = k) {
+		for (k = i+1; k<n && v[k]->ownerlen==v[i]->ownerlen && !memcmp(v[k]->key, v[i]->key, v[i]->ownerlen); k++);
+		if (cut && sign_below(v[i]->key, cut->key, cut->ownerlen))
+			continue;
+		delegation = 0;
+		if (v[i]->ownerlen!=soa->ownerlen || memcmp(v[i]->key, soa->key, soa->ownerlen))
+			for (m = i; m<k; m++)
+				delegation |= v[m]->type==DNS_T_NS;
+		if (delegation)
+			cut = v[i];
+		numtypes = 0;
+		for (m = i; m<k; m = x) {
+			for (x = m+1; x<k && v[x]->type==v[m]->type; x++);
+			if (delegation && v[m]->type!=DNS_T_NS && v[m]->type!=DNS_T_DS)
+				continue;
+			if (numtypes<SIGN_MAXTYPES)
+				numtypes = sign_types(types, numtypes, v[m]->type);
+			if (delegation && v[m]->type==DNS_T_NS)
+				continue;
+			/* duplicates are one record to the resolver as well */
+			memcpy(set+numsets, v+m, (x-m)*sizeof(struct rawrr*));
+			qsort(set+numsets, x-m, sizeof(struct rawrr*), cmp_signrdata);
+			for (len = 1, s = 1; s<x-m; s++)
+				if (cmp_signrdata(&set[numsets+s], &set[numsets+len-1]))
+					set[numsets+len++] = set[numsets+s];
+			for (s = 0; s<(v[m]->type==DNS_T_DNSKEY ? nksk : nzsk); s++) {
+				j = &jobs[numjobs++];
+				j->rrs = set+numsets;
+				j->count = len;
+				j->ttl = v[m]->ttl;
+				j->key = v[m]->type==DNS_T_DNSKEY ? ksk[s] : zsk[s];
+			}
+			numsets += len;
+		}
+		numtypes = sign_types(types, numtypes, DNS_T_RRSIG);
+		numtypes = sign_types(types, numtypes, DNS_T_NSEC);
+		len = sign_bitmap(rdata, types, numtypes);
+		/* the next name goes in front of the bitmap once known */
+		nsec[numnsec] = malloc(offsetof(struct rawrr, rdata)+DNS_MAXNAME+1+len);
+		if (!nsec[numnsec])
+			die_exit(NULL);
+		memcpy(nsec[numnsec]->rdata+DNS_MAXNAME+1, rdata, len);
+		nsec[numnsec]->rdlength = len;
+		next[numnsec++] = v[i];
+	}
+	for (i = 0; i<numnsec; i++) {
+		const struct rawrr* to = next[(i+1)%numnsec];
+		struct rawrr* rr;
+
+		memcpy(rdata, to->key, to->ownerlen);
+		memcpy(rdata+to->ownerlen, nsec[i]->rdata+DNS_MAXNAME+1, nsec[i]->rdlength);
+		rr = sign_newrr(next[i], DNS_T_NSEC, minimum, rdata, to->ownerlen+nsec[i]->rdlength);
+		free(nsec[i]);
+		nsec[i] = rr;
+		for (s = 0; s<nzsk; s++) {
+			j = &jobs[numjobs++];
+			j->rrs = &nsec[i];
+			j->count = 1;
+			j->ttl = minimum;
+			j->key = zsk[s];
+		}
+	}
+
+	/* take over what is still valid, sign the rest */
+	memset(&w, 0, sizeof(w));
+	w.jobs = xcalloc(numjobs ? numjobs : 1, sizeof(struct signjob*));
+	w.signer = soa->key;
+	w.signerlen = soa->ownerlen;
+	w.inception = now-SIGN_SKEW;
+	for (i = 0; i<numjobs; i++) {
+		j = &jobs[i];
+		j->hash = sign_hash(j);
+		if ((e = sign_lookup(sz->cache, sz->size, j->hash)) && e->rdata && e->expire>now+margin) {
+			j->sig = *e;
+			e->rdata = NULL;
+			reused++;
+		} else
+			w.jobs[w.count++] = j;
+	}
+	sign_jobs(&w);
+	if (w.failed)
+		fprintf(stderr, "[**] Warning: %d RRsets of zone %s could not be signed\n", w.failed, zone.domainname);
+
+	for (size = 16; size<2*(unsigned int)numjobs; size *= 2);
+	cache = xcalloc(size, sizeof(struct sigentry));
+	if ( !(*rrs = realloc(*rrs, (*count+numnsec+numjobs)*sizeof(struct rawrr*))) )
+		die_exit(NULL);
+	for (i = 0; i<numnsec; i++)
+		(*rrs)[(*count)++] = nsec[i];
+	for (i = 0; i<numjobs; i++) {
+		j = &jobs[i];
+		if (!j->sig.rdata)
+			continue;
+		(*rrs)[(*count)++] = sign_newrr(j->rrs[0], DNS_T_RRSIG, j->ttl, j->sig.rdata, j->sig.rdlength);
+		for (k = j->hash & (size-1); cache[k].hash; k = (k+1) & (size-1));
+		cache[k] = j->sig;
+		cache[k].hash = j->hash;
+		if (!due || j->sig.expire-margin<due)
+			due = j->sig.expire-margin;
+	}
+	for (i = 0; i<(int)sz->size; i++)
+		free(sz->cache[i].rdata);
+	free(sz->cache);
+	sz->cache = cache;
+	sz->size = size;
+
+	/* keys coming or going also need the zone signed again */
+	for (i = 0; i<sz->numkeys; i++) {
+		events[0] = sz->keys[i]->publish;
+		events[1] = sz->keys[i]->activate;
+		events[2] = sz->keys[i]->inactive;
+		events[3] = sz->keys[i]->remove;
+		for (k = 0; k<4; k++)
+			if (events[k]>now && (!due || events[k]<due))
+				due = events[k];
+	}
+	pthread_mutex_unlock(&sz->lock);
+	if (due && (!sign_due || due<sign_due))
+		sign_due = due;
+	pthread_mutex_lock(&signer.lock);
+	signer.made += w.count-w.failed;
+	signer.reused += reused;
+	pthread_mutex_unlock(&signer.lock);
+	if (render_verbose&1)
+		printf("signed: %d RRSIGs made, %d reused\n", w.count-w.failed, reused);
+	free(w.jobs);
+	free(jobs);
+	free(next);
+	free(nsec);
+	free(set);
+	free(v);
+}
+
+
+static const char* sign_typename(char* buf, unsigned int type)
+{
+	static const struct { unsigned int type; const char* name; } names[] = {
+		{ DNS_T_A, "A" }, { DNS_T_NS, "NS" }, { DNS_T_CNAME, "CNAME" }, { DNS_T_SOA, "SOA" },
+		{ DNS_T_PTR, "PTR" }, { DNS_T_MX, "MX" }, { DNS_T_TXT, "TXT" }, { DNS_T_AAAA, "AAAA" },
+		{ DNS_T_SRV, "SRV" }, { DNS_T_DS, "DS" }, { DNS_T_RRSIG, "RRSIG" }, { DNS_T_NSEC, "NSEC" },
+		{ DNS_T_DNSKEY, "DNSKEY" }, { 0, NULL }
+	};
+	int i;
+
+	for (i = 0; names[i].name; i++)
+		if (names[i].type==type)
+			return names[i].name;
+	sprintf(buf, "TYPE%u", type);
+	return buf;
+}
+
+
+/* A name in wire format as master file text, escaping what needs it */
+static void sign_printname(FILE* fp, const unsigned char* name)
+{
+	int i;
+
+	if (!*name)
+		putc('.', fp);
+	for (; *name; name += *name+1) {
+		for (i = 1; i<=*name; i++) {
+			if (name[i]<=' ' || name[i]>='\177')
+				fprintf(fp, "\\%03u", name[i]);
+			else if (strchr(".;\\\"()@$", name[i]))
+				fprintf(fp, "\\%c", name[i]);
+			else
+				putc(name[i], fp);
+		}
+		putc('.', fp);
+	}
+}
+
+
+static void sign_printtime(FILE* fp, time_t t)
+{
+	char buf[16];
+	struct tm tm;
+
+	gmtime_r(&t, &tm);
+	strftime(buf, sizeof(buf), "%Y%m%d%H%M%S", &tm);
+	fprintf(fp, "%s ", buf);
+}
+
+
+/* Write a DNSKEY, NSEC or RRSIG record made by sign_zone() as write_rr() would */
+static void sign_printrr(FILE* fp, const struct rawrr* rr)
+{
+	unsigned char text[4*RAW_MAXRDATA/3+4];
+	char type[16];
+	int len, i, b;
+
+	sign_printname(fp, rr->owner);
+	fprintf(fp, "\t%u\tIN %s\t", rr->ttl, sign_typename(type, rr->type));
+	switch (rr->type) {
+	case DNS_T_DNSKEY:
+		EVP_EncodeBlock(text, rr->rdata+4, rr->rdlength-4);
+		fprintf(fp, "%u %u %u %s", rr->rdata[0] << 8 | rr->rdata[1], rr->rdata[2], rr->rdata[3], text);
+		break;
+	case DNS_T_RRSIG:
+		fprintf(fp, "%s %u %u %u ", sign_typename(type, rr->rdata[0] << 8 | rr->rdata[1]), rr->rdata[2], rr->rdata[3], sign_get32(rr->rdata+4));
+		sign_printtime(fp, sign_get32(rr->rdata+8));
+		sign_printtime(fp, sign_get32(rr->rdata+12));
+		fprintf(fp, "%u ", rr->rdata[16] << 8 | rr->rdata[17]);
+		sign_printname(fp, rr->rdata+18);
+		len = dns_namelen(rr->rdata+18);
+		EVP_EncodeBlock(text, rr->rdata+18+len, rr->rdlength-18-len);
+		fprintf(fp, " %s", text);
+		break;
+	case DNS_T_NSEC:
+		sign_printname(fp, rr->rdata);
+		for (i = dns_namelen(rr->rdata); i+2<=rr->rdlength; i += 2+rr->rdata[i+1])
+			for (b = 0; b<8*rr->rdata[i+1]; b++)
+				if (rr->rdata[i+2+b/8] & 0x80 >> b%8)
+					fprintf(fp, " %s", sign_typename(type, rr->rdata[i] << 8 | b));
+		break;
+	}
+	putc('\n', fp);
+}
+
+
+/* Write the zone in text as it is, followed by the records sign_zone() adds */
+static void write_signedzone(FILE* fp, char* text)
+{
+	struct rawrr** rrs;
+	unsigned int defttl;
+	int count, first;
+	int i;
+
+	fputs(text, fp);
+	rrs = raw_parse(text, &count, &defttl);
+	first = count;
+	sign_zone(&rrs, &count, defttl);
+	for (i = first; i<count; i++)
+		sign_printrr(fp, rrs[i]);
+	for (i = 0; i<count; i++)
+		free(rrs[i]);
+	free(rrs);
+}
+#endif
+
+
+static struct snapshot* build_snapshot(const struct dataset* ds)
+{
+	struct snapshot* s = xcalloc(1, sizeof(struct snapshot));
+	const struct dnsloccode* lc;
+	const struct dnszone* z;
+	const struct dnsrecord* r;
+	struct resourcerecord rr;
+	int i, n;
+
+	s->nbuckets = 1024;
+	s->buckets = xcalloc(s->nbuckets, sizeof(struct dnsnode*));
+	for (lc = ds->loccodes; lc; lc = lc->next)
+		s->nlocations += lc->members;
+	s->locations = xcalloc(s->nlocations, sizeof(struct dnslocation));
+	for (n = 0, lc = ds->loccodes; lc; lc = lc->next) {
+		for (i = 0; i<lc->members; i++) {
+			struct dnslocation* l = &s->locations[n];
+			const char* p = lc->loc.member[i];
+			if ( (l->v6 = strchr(p, ':')!=NULL) ) {
+				/* nibbles, as in "2001:0db8:" */
+				for (; *p; p++) {
+					if (*p==':')
+						continue;
+					if (!isxdigit((unsigned char)*p) || l->bits==128)
+						break;
+					l->prefix[l->bits/8] |= (isdigit((unsigned char)*p) ? *p-'0' : tolower((unsigned char)*p)-'a'+10) << (l->bits%8 ? 0 : 4);
+					l->bits += 4;
+				}
+			} else {
+				while (l->bits<32 && *p && isdigit((unsigned char)*p)) {
+					l->prefix[l->bits/8] = atoi(p);
+					l->bits += 8;
+					p += strspn(p, "0123456789");
+					if (*p=='.')
+						p++;
+				}
+			}
+			if (*p) {
+				/* not a prefix tinydns would accept */
+				memset(l, 0, sizeof(struct dnslocation));
+				continue;
+			}
+			strncpy(l->locname, lc->loc.locname, sizeof(l->locname)-1);
+			n++;
+		}
+	}
+	s->nlocations = n;
+	for (z = ds->zones; z; z = z->next) {
+		for (i = 0; i<z->zonenames; i++) {
+			zone = zone_soa(z);
+			strncpy(zone.domainname, z->zonename[i], 64);
+			snap_soa(s);
+			for (r = z->records; r; r = r->next) {
+				int ipaddresses = r->ipaddresses;
+				load_record(&rr, r);
+				do {
+					ipaddresses--;
+					snap_rr(s, &rr, ipaddresses, i);
+				} while (ipaddresses>0);
+			}
+			for (r = z->synthesized; r; r = r->next) {
+				load_record(&rr, r);
+				snap_rr(s, &rr, -1, i);
+			}
+		}
+	}
+	return s;
+}
+
+
+static void free_snapshot(struct snapshot* s)
+{
+	struct dnsnode* n;
+	struct dnsrrdata* rd;
+	unsigned int i;
+
+	for (i = 0; i<s->nbuckets; i++) {
+		while ( (n = s->buckets[i]) ) {
+			s->buckets[i] = n->next;
+			while ( (rd = n->rrs) ) {
+				n->rrs = rd->next;
+				free(rd);
+			}
+			free(n);
+		}
+	}
+	free(s->buckets);
+	free(s->locations);
+	free(s);
+}
+
+
+static void publish_snapshot(struct snapshot* s)
+{
+	struct snapshot* old = __atomic_exchange_n(&dns_snapshot, s, __ATOMIC_SEQ_CST);
+	unsigned long epoch = __atomic_add_fetch(&dns_epoch, 1, __ATOMIC_SEQ_CST);
+	unsigned long e;
+	int i;
+
+	if (!old)
+		return;
+	for (i = 0; i<DNS_MAXTHREADS+DNS_TCPTHREADS; i++)
+		while ( (e = __atomic_load_n(&dns_reader[i], __ATOMIC_SEQ_CST)) && e<epoch )
+			usleep(1000);
+	free_snapshot(old);
+}
+
+
+static const struct snapshot* dns_enter(int slot)
+{
+	__atomic_store_n(&dns_reader[slot], __atomic_load_n(&dns_epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+	return __atomic_load_n(&dns_snapshot, __ATOMIC_SEQ_CST);
+}
+
+
+static void dns_leave(int slot)
+{
+	__atomic_store_n(&dns_reader[slot], 0, __ATOMIC_RELEASE);
+}
+
+
+/* Whether ip starts with the prefix of location l */
+static int dns_inlocation(const struct dnslocation* l, const unsigned char* ip)
+{
+	if (memcmp(l->prefix, ip, l->bits/8)!=0)
+		return 0;
+	return l->bits%8==0 || (ip[l->bits/8] & 0xf0)==l->prefix[l->bits/8];
+}
+
+
+/*
+ * Location code of a client, as tinydns determines it: the longest IPv4
+ * prefix matching an IPv4 (or v4 mapped) address, the longest IPv6 prefix
+ * matching an IPv6 one
+ */
+static void dns_clientloc(const struct snapshot* s, const struct sockaddr_storage* peer, char loc[3])
+{
+	const unsigned char* ip = NULL;
+	int i, v6 = 0, best = -1;
+
+	loc[0] = '\0';
+	if (peer->ss_family==AF_INET)
+		ip = (const unsigned char*)&((const struct sockaddr_in*)peer)->sin_addr;
+	else if (peer->ss_family==AF_INET6 && IN6_IS_ADDR_V4MAPPED(&((const struct sockaddr_in6*)peer)->sin6_addr))
+		ip = (const unsigned char*)&((const struct sockaddr_in6*)peer)->sin6_addr + 12;
+	else if (peer->ss_family==AF_INET6) {
+		ip = (const unsigned char*)&((const struct sockaddr_in6*)peer)->sin6_addr;
+		v6 = 1;
+	}
+	if (!ip)
+		return;
+	for (i = 0; i<s->nlocations; i++) {
+		if (s->locations[i].v6==v6 && s->locations[i].bits>best && dns_inlocation(&s->locations[i], ip)) {
+			best = s->locations[i].bits;
+			strcpy(loc, s->locations[i].locname);
+		}
+	}
+}
+
+
+static void reply_rr(struct dnsreply* r, int section, const unsigned char* owner, int ownerlen, const struct dnsrrdata* rd)
+{
+	unsigned char* p;
+
+	if (r->full)
+		return;
+	if (r->len + ownerlen + 10 + rd->rdlength > r->size) {
+		r->full = 1;
+		return;
+	}
+	p = r->buf + r->len;
+	memcpy(p, owner, ownerlen);
+	p += ownerlen;
+	*p++ = rd->type >> 8;
+	*p++ = rd->type & 0xff;
+	*p++ = 0;
+	*p++ = 1;
+	*p++ = rd->ttl >> 24;
+	*p++ = rd->ttl >> 16;
+	*p++ = rd->ttl >> 8;
+	*p++ = rd->ttl;
+	*p++ = rd->rdlength >> 8;
+	*p++ = rd->rdlength & 0xff;
+	memcpy(p, rd->rdata, rd->rdlength);
+	r->len += ownerlen + 10 + rd->rdlength;
+	r->count[section]++;
+}
+
+
+static int reply_rrset(struct dnsreply* r, int section, const unsigned char* owner, int ownerlen, const struct dnsnode* n, unsigned short type, const char* loc)
+{
+	const struct dnsrrdata* rd;
+	int added = 0;
+
+	for (rd = n->rrs; rd; rd = rd->next) {
+		if ((rd->type==type || (type==DNS_T_ANY && rd->type!=DNS_T_SOA)) && (!rd->location[0] || strcmp(rd->location, loc)==0)) {
+			reply_rr(r, section, owner, ownerlen, rd);
+			added++;
+		}
+	}
+	return added;
+}
+
+
+static const struct dnsnode* dns_findapex(const struct snapshot* s, const unsigned char* name)
+{
+	const struct dnsnode* n;
+
+	for (;; name += *name + 1) {
+		if ( (n = snap_lookup(s, name)) && n->apex )
+			return n;
+		if (!*name)
+			return NULL;
+	}
+}
+
+
+static void reply_soa(struct dnsreply* r, const struct dnsnode* apex, const char* loc)
+{
+	reply_rrset(r, 1, apex->name, apex->namelen, apex, DNS_T_SOA, loc);
+}
+
+
+/* Build the answer to one query, returns its length or 0 to drop it */
+static int dns_respond(const struct snapshot* s, const unsigned char* query, int qlen, unsigned char* buf, int size, int tcp, const char* loc)
+{
+	static const unsigned char qptr[2] = { 0xc0, 0x0c };
+	struct dnsreply r;
+	unsigned char qname[DNS_MAXNAME+1];
+	unsigned char cur[DNS_MAXNAME+1];
+	const struct dnsnode* apex;
+	const struct dnsnode* node;
+	const struct dnsnode* cut = NULL;
+	const struct dnsrrdata* rd;
+	const unsigned char* p;
+	int pos = 12, namelen = 0, qtype, qclass, edns = 0, udpsize = 512, hop, rcode = 0, aa = 0;
+
+	if (qlen<12 || (query[2] & 0x80))
+		return 0;
+	memset(&r, 0, sizeof(r));
+	r.buf = buf;
+	memcpy(buf, query, 4);
+	buf[2] = 0x80 | (query[2] & 0x79);	/* QR, opcode and RD */
+	buf[3] = 0;
+	memset(buf+4, 0, 8);
+	r.len = 12;
+	if (((query[4]<<8) | query[5])!=1) {
+		buf[3] = DNS_R_FORMERR;
+		return r.len;
+	}
+	while (pos<qlen && query[pos]) {
+		int l = query[pos];
+		if ((l & 0xc0) || pos+l+1>=qlen || namelen+l+1>DNS_MAXNAME) {
+			buf[3] = DNS_R_FORMERR;
+			return r.len;
+		}
+		memcpy(qname+namelen, query+pos, l+1);
+		namelen += l+1;
+		pos += l+1;
+	}
+	if (pos+5>qlen) {
+		buf[3] = DNS_R_FORMERR;
+		return r.len;
+	}
+	qname[namelen++] = 0;
+	pos++;
+	qtype = (query[pos]<<8) | query[pos+1];
+	qclass = (query[pos+2]<<8) | query[pos+3];
+	pos += 4;
+	if (!tcp && ((query[10]<<8) | query[11])==1 && pos+11<=qlen && query[pos]==0
+	    && ((query[pos+1]<<8) | query[pos+2])==DNS_T_OPT) {
+		edns = 1;
+		udpsize = (query[pos+3]<<8) | query[pos+4];
+		if (udpsize<512)
+			udpsize = 512;
+	}
+	r.size = tcp ? size : (udpsize<size ? udpsize : size);
+	if (edns)
+		r.size -= 11;
+	memcpy(buf+12, query+12, pos-12);
+	buf[5] = 1;
+	r.len = pos;
+	dns_lowercase(qname);
+
+	if (((query[2]>>3) & 0xf)!=0) {
+		rcode = DNS_R_NOTIMP;
+	} else if ((qclass!=1 && qclass!=DNS_T_ANY) || !(apex = dns_findapex(s, qname))) {
+		rcode = DNS_R_REFUSED;
+	} else {
+		/* the topmost zone cut between the apex and the query name */
+		for (p = qname; p+apex->namelen<qname+namelen; p += *p + 1) {
+			if (p==qname && qtype==DNS_T_DS)
+				continue;
+			if ( (node = snap_lookup(s, p)) ) {
+				for (rd = node->rrs; rd && rd->type!=DNS_T_NS; rd = rd->next);
+				if (rd)
+					cut = node;
+			}
+		}
+		if (cut) {
+			reply_rrset(&r, 1, cut->name, cut->namelen, cut, DNS_T_NS, loc);
+			for (rd = cut->rrs; rd; rd = rd->next) {
+				if (rd->type!=DNS_T_NS || (rd->location[0] && strcmp(rd->location, loc)))
+					continue;
+				memcpy(cur, rd->rdata, rd->rdlength);
+				dns_lowercase(cur);
+				if ( (node = snap_lookup(s, cur)) ) {
+					reply_rrset(&r, 2, node->name, node->namelen, node, DNS_T_A, loc);
+					reply_rrset(&r, 2, node->name, node->namelen, node, DNS_T_AAAA, loc);
+				}
+			}
+		} else {
+			aa = 1;
+			memcpy(cur, qname, namelen);
+			for (hop = 0; hop<DNS_MAXCHASE; hop++) {
+				const unsigned char* owner = hop ? cur : qptr;
+				int ownerlen = hop ? dns_namelen(cur) : 2;
+				if (!(node = snap_lookup(s, cur))) {
+					/* wildcard at the closest encloser */
+					unsigned char wild[DNS_MAXNAME+3];
+					if (!*cur)
+						break;
+					for (p = cur + *cur + 1; *p && !snap_lookup(s, p); p += *p + 1);
+					wild[0] = 1;
+					wild[1] = '*';
+					memcpy(wild+2, p, dns_namelen(p));
+					if (!(node = snap_lookup(s, wild))) {
+						rcode = DNS_R_NXDOMAIN;
+						reply_soa(&r, apex, loc);
+						break;
+					}
+				}
+				if (reply_rrset(&r, 0, owner, ownerlen, node, qtype, loc))
+					break;
+				if (qtype!=DNS_T_CNAME) {
+					for (rd = node->rrs; rd; rd = rd->next)
+						if (rd->type==DNS_T_CNAME && (!rd->location[0] || strcmp(rd->location, loc)==0))
+							break;
+					if (rd) {
+						reply_rr(&r, 0, owner, ownerlen, rd);
+						memcpy(cur, rd->rdata, rd->rdlength);
+						dns_lowercase(cur);
+						if ( (apex = dns_findapex(s, cur)) )
+							continue;
+						break;
+					}
+				}
+				reply_soa(&r, apex, loc);
+				break;
+			}
+		}
+	}
+	if (r.full) {
+		/* does not fit, let the client retry over TCP */
+		r.len = pos;
+		memset(r.count, 0, sizeof(r.count));
+		buf[2] |= 0x02;
+	}
+	if (edns) {
+		static const unsigned char opt[11] = { 0, 0, DNS_T_OPT, 0x04, 0xd0, 0, 0, 0, 0, 0, 0 };
+		memcpy(buf+r.len, opt, sizeof(opt));
+		r.len += sizeof(opt);
+		r.count[2]++;
+	}
+	if (aa)
+		buf[2] |= 0x04;
+	buf[3] = rcode;
+	buf[6] = r.count[0] >> 8;
+	buf[7] = r.count[0] & 0xff;
+	buf[8] = r.count[1] >> 8;
+	buf[9] = r.count[1] & 0xff;
+	buf[10] = r.count[2] >> 8;
+	buf[11] = r.count[2] & 0xff;
+	return r.len;
+}
+
+
+static void* dns_udp_thread(void* arg)
+{
+	int slot = (int)(long)arg;
+	unsigned char query[4096];
+	unsigned char reply[4096];
+
+	for (;;) {
+		const struct snapshot* s;
+		struct sockaddr_storage peer;
+		socklen_t peerlen = sizeof(peer);
+		char loc[3];
+		int len = recvfrom(dns_udpsock, query, sizeof(query), 0, (struct sockaddr*)&peer, &peerlen);
+
+		if (len<0)
+			continue;
+		if ( (s = dns_enter(slot)) ) {
+			dns_clientloc(s, &peer, loc);
+			len = dns_respond(s, query, len, reply, sizeof(reply), 0, loc);
+		} else
+			len = 0;
+		dns_leave(slot);
+		if (len>0)
+			sendto(dns_udpsock, reply, len, 0, (struct sockaddr*)&peer, peerlen);
+	}
+	return NULL;
+}
+
+
+/* Read len bytes, 0 if the client closes, stalls or the connection's time is up */
+static int dns_readall(int fd, unsigned char* buf, int len, time_t deadline)
+{
+	int n, got = 0;
+
+	while (got<len) {
+		if (time(NULL)>=deadline || (n = read(fd, buf+got, len-got))<=0)
+			return 0;
+		got += n;
+	}
+	return 1;
+}
+
+
+/*
+ * Several threads accept TCP connections, so a client holding one up only
+ * ties down its own thread, and only for DNS_TCPLIFE seconds at most.
+ */
+static void* dns_tcp_thread(void* arg)
+{
+	int slot = (int)(long)arg;
+	unsigned char* query = xcalloc(1, 65536);
+	unsigned char* reply = xcalloc(1, 65536+2);
+	struct timeval tv = { DNS_TCPIDLE, 0 };
+
+	for (;;) {
+		struct sockaddr_storage peer;
+		socklen_t peerlen = sizeof(peer);
+		int fd = accept(dns_tcpsock, (struct sockaddr*)&peer, &peerlen);
+		unsigned char lenbuf[2];
+		time_t deadline = time(NULL)+DNS_TCPLIFE;
+
+		if (fd<0)
+			continue;
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		while (dns_readall(fd, lenbuf, 2, deadline)) {
+			const struct snapshot* s;
+			char loc[3];
+			int len = (lenbuf[0]<<8) | lenbuf[1];
+			if (!dns_readall(fd, query, len, deadline))
+				break;
+			if ( (s = dns_enter(slot)) ) {
+				dns_clientloc(s, &peer, loc);
+				len = dns_respond(s, query, len, reply+2, 65535, 1, loc);
+			} else
+				len = 0;
+			dns_leave(slot);
+			if (len<=0)
+				break;
+			reply[0] = len >> 8;
+			reply[1] = len & 0xff;
+			if (write(fd, reply, len+2)!=len+2)
+				break;
+		}
+		close(fd);
+	}
+	return NULL;
+}
+
+
+/* Split "host", "host:port" or "[v6addr]:port" in place, returns the port or defport */
+static const char* split_port(char* host, const char* defport)
+{
+	char* p;
+
+	if (host[0]=='[' && (p = strchr(host, ']'))) {
+		*p++ = '\0';
+		memmove(host, host+1, strlen(host));
+		return *p==':' ? p+1 : defport;
+	}
+	if ( (p = strchr(host, ':')) && !strchr(p+1, ':') ) {
+		*p = '\0';
+		return p+1;
+	}
+	return defport;
+}
+
+
+static void start_responder(void)
+{
+	char host[128];
+	const char* port;
+	struct addrinfo hints;
+	struct addrinfo* ai;
+	pthread_t thread;
+	long i, nthreads;
+	int on = 1;
+
+	strncpy(host, options.listen, sizeof(host));
+	host[sizeof(host)-1] = '\0';
+	port = split_port(host, DNS_PORT);
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_flags = AI_PASSIVE | AI_NUMERICHOST | AI_NUMERICSERV;
+	hints.ai_socktype = SOCK_DGRAM;
+	if (getaddrinfo(host[0] ? host : NULL, port, &hints, &ai)!=0)
+		die_exit("Invalid address for the DNS responder");
+	if ((dns_udpsock = socket(ai->ai_family, SOCK_DGRAM, 0))<0
+	    || bind(dns_udpsock, ai->ai_addr, ai->ai_addrlen)<0)
+		die_exit("Unable to bind the DNS responder's UDP socket");
+	if ((dns_tcpsock = socket(ai->ai_family, SOCK_STREAM, 0))<0
+	    || setsockopt(dns_tcpsock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on))<0
+	    || bind(dns_tcpsock, ai->ai_addr, ai->ai_addrlen)<0
+	    || listen(dns_tcpsock, 64)<0)
+		die_exit("Unable to bind the DNS responder's TCP socket");
+	freeaddrinfo(ai);
+
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads<1)
+		nthreads = 1;
+	if (nthreads>DNS_MAXTHREADS)
+		nthreads = DNS_MAXTHREADS;
+	for (i = 0; i<nthreads; i++)
+		if (start_thread(&thread, dns_udp_thread, (void*)i)==0)
+			pthread_detach(thread);
+	for (i = 0; i<DNS_TCPTHREADS; i++)
+		if (start_thread(&thread, dns_tcp_thread, (void*)(DNS_MAXTHREADS+i))==0)
+			pthread_detach(thread);
+	if (options.verbose&1)
+		printf("DNS responder listening on %s port %s (%ld UDP, %d TCP threads)\n", host[0] ? host : "*", port, nthreads, DNS_TCPTHREADS);
+}
+
+
+/*
+ * Leader and followers.  A leader (-R address) refreshes from LDAP as usual
+ * and after every update publishes the decoded dataset as a feed, encoded
+ * once the way a snapshot (-s) is.  Followers (-g address,...) never search
+ * LDAP: they ask the first leader that accepts their connection for its
+ * dataset and render that locally, so the directory sees one search per
+ * change however large the fleet.  A follower sends
+ *
+ *	L2DN <epoch> <version>
+ *	<hash> <dn>		for every zone it holds
+ *	<empty line>
+ *
+ * and gets the feed header back, followed by the dataset if the leader's
+ * epoch (its start time) or version (counting its updates) differ.  A zone
+ * whose records hash the same on both sides is sent with SNAP_KEEP for a
+ * record count, so only the zones that changed travel again.  The address
+ * is host:port, [v6addr]:port, or a unix socket if it contains a '/'.
+ */
+#define FEED_UNCHANGED 0
+#define FEED_DATASET 1
+#define FEED_TIMEOUT 10
+#define FEED_THREADS 8		/* followers served at a time */
+#define FEED_REQUEST 65536	/* request size allowed beyond the zones of the feed */
+#define FEED_MAXREPLY (1UL << 30)
+
+struct feed
+{
+	int refs;
+	unsigned int version;
+	int numzones;
+	int checksum;
+	char* buf;
+	size_t len;
+	size_t held;		/* of a request listing all its zones */
+	int count;
+	struct snapzone* zone;
+};
+
+static struct
+{
+	pthread_mutex_t lock;
+	struct feed* current;
+	unsigned int epoch;
+	int sock;
+} leader = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, -1 };
+
+
+static void feed_release(struct feed* f)
+{
+	int i;
+
+	pthread_mutex_lock(&leader.lock);
+	i = --f->refs;
+	pthread_mutex_unlock(&leader.lock);
+	if (i>0)
+		return;
+	for (i = 0; i<f->count; i++)
+		free(f->zone[i].dn);
+	free(f->zone);
+	free(f->buf);
+	free(f);
+}
+
+
+/* Encode ds once for all followers and make it the current feed */
+static void feed_publish(const struct dataset* ds, int numzones, int checksum)
+{
+	struct feed* f = xcalloc(1, sizeof(struct feed));
+	struct feed* old;
+	const struct dnszone* z;
+	FILE* fp;
+	int i;
+
+	for (z = ds->zones; z; z = z->next)
+		f->count++;
+	f->zone = xcalloc(f->count+1, sizeof(struct snapzone));
+	f->numzones = numzones;
+	f->checksum = checksum;
+	f->refs = 1;
+	if ( !(fp = open_memstream(&f->buf, &f->len)) )
+		die_exit(NULL);
+	snap_putdataset(fp, ds, f->zone);
+	if (fclose(fp)!=0)
+		die_exit(NULL);
+	for (i = 0; i<f->count; i++) {
+		f->zone[i].hash = fnv64(FNV64_INIT, f->buf+f->zone[i].records, f->zone[i].end-f->zone[i].records);
+		f->held += 18+strlen(f->zone[i].dn);
+	}
+	pthread_mutex_lock(&leader.lock);
+	old = leader.current;
+	f->version = old ? old->version+1 : 1;
+	leader.current = f;
+	pthread_mutex_unlock(&leader.lock);
+	if (options.verbose&1)
+		printf("Feed version %u published, %lu bytes\n", f->version, (unsigned long)f->len);
+	if (old)
+		feed_release(old);
+}
+
+
+static int cmp_snapzone(const void* a, const void* b)
+{
+	return strcmp(((const struct snapzone*)a)->dn, ((const struct snapzone*)b)->dn);
+}
+
+
+/* The zones a follower holds, from the lines of its request after the first */
+static struct snapzone* feed_held(char* lines, int* count)
+{
+	struct snapzone* held;
+	char* line;
+	char* next;
+	int n = 0;
+
+	for (line = lines; *line; line++)
+		n += *line=='\n';
+	held = xcalloc(n+1, sizeof(struct snapzone));
+	for (line = lines; *line && *line!='\n'; line = next) {
+		if ( !(next = strchr(line, '\n')) )
+			break;
+		*next++ = '\0';
+		if (sscanf(line, "%llx", &held[*count].hash)==1 && (held[*count].dn = strchr(line, ' ')))
+			held[(*count)++].dn++;
+	}
+	qsort(held, *count, sizeof(struct snapzone), cmp_snapzone);
+	return held;
+}
+
+
+/*
+ * A follower's request up to its empty line, NULL if it breaks off, takes
+ * longer than FEED_TIMEOUT or holds a NUL.  The zones listed beyond limit
+ * bytes are read but dropped, the follower gets them in full.
+ */
+static char* feed_request(int fd, size_t limit)
+{
+	char* req = NULL;
+	char* buf;
+	char* end;
+	char drop[4096];
+	char last = '\0';
+	size_t size = 0, len = 0, room;
+	time_t deadline = time(NULL)+FEED_TIMEOUT;
+	ssize_t n, i;
+
+	for (;;) {
+		if (len+1>=size && size<limit) {
+			size = 2*size+65536<limit ? 2*size+65536 : limit;
+			if ( !(req = realloc(req, size)) )
+				die_exit(NULL);
+		}
+		buf = len+1<size ? req+len : drop;
+		room = len+1<size ? size-len-1 : sizeof(drop);
+		if ((n = recv(fd, buf, room, 0))<=0 || memchr(buf, '\0', n) || time(NULL)>deadline)
+			break;
+		if (buf==drop) {
+			for (i = 0; i<n && !(last=='\n' && drop[i]=='\n'); i++)
+				last = drop[i];
+			if (i==n)
+				continue;
+			/* up to the last whole line */
+			if ( !(end = strrchr(req, '\n')) )
+				break;
+			end[1] = '\0';
+			return req;
+		}
+		len += n;
+		req[len] = '\0';
+		last = req[len-1];
+		if (strstr(req+len-n-(len>n), "\n\n"))
+			return req;
+	}
+	free(req);
+	return NULL;
+}
+
+
+/* Serve one follower, see above */
+static void feed_serve(int fd)
+{
+	struct timeval tv = { FEED_TIMEOUT, 0 };
+	struct snapzone* held = NULL;
+	struct snapzone* have;
+	struct feed* f;
+	char* req;
+	unsigned int epoch, version;
+	size_t limit;
+	FILE* fp;
+	int i, count = 0, kept = 0;
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	/* room for the zones of the feed, which a follower mostly holds */
+	pthread_mutex_lock(&leader.lock);
+	limit = FEED_REQUEST + (leader.current ? leader.current->held : 0);
+	pthread_mutex_unlock(&leader.lock);
+	if ( !(req = feed_request(fd, limit)) || sscanf(req, "L2DN %u %u", &epoch, &version)!=2 || !(fp = fdopen(fd, "w")) ) {
+		free(req);
+		close(fd);
+		return;
+	}
+	pthread_mutex_lock(&leader.lock);
+	if ( (f = leader.current) )
+		f->refs++;
+	pthread_mutex_unlock(&leader.lock);
+	snap_put32(fp, SNAPSHOT_MAGIC);
+	snap_put32(fp, SNAPSHOT_VERSION);
+	snap_put32(fp, leader.epoch);
+	snap_put32(fp, f ? f->version : 0);
+	snap_put32(fp, f ? f->numzones : 0);
+	snap_put32(fp, f ? f->checksum : 0);
+	if (!f || (epoch==leader.epoch && version==f->version)) {
+		snap_put32(fp, FEED_UNCHANGED);
+	} else {
+		snap_put32(fp, FEED_DATASET);
+		held = feed_held(strchr(req, '\n')+1, &count);
+		fwrite(f->buf, 1, f->count ? f->zone[0].start : f->len, fp);
+		for (i = 0; i<f->count; i++) {
+			have = bsearch(&f->zone[i], held, count, sizeof(struct snapzone), cmp_snapzone);
+			if (have && have->hash==f->zone[i].hash) {
+				fwrite(f->buf+f->zone[i].start, 1, f->zone[i].records-f->zone[i].start, fp);
+				snap_put32(fp, SNAP_KEEP);
+				kept++;
+			} else
+				fwrite(f->buf+f->zone[i].start, 1, f->zone[i].end-f->zone[i].start, fp);
+		}
+	}
+	fclose(fp);
+	if (held && options.verbose&1)
+		printf("follower: version %u -> %u, %d of %d zones kept\n", version, f->version, kept, f->count);
+	free(held);
+	free(req);
+	if (f)
+		feed_release(f);
+}
+
+
+/* One of FEED_THREADS, the followers beyond wait in the listen queue */
+static void* feed_thread(void* arg)
+{
+	int fd;
+
+	for (;;) {
+		if ((fd = accept(leader.sock, NULL, NULL))>=0)
+			feed_serve(fd);
+	}
+	return NULL;
+}
+
+
+/* Socket for a leader address, bound to it or else connected to it */
+static int feed_socket(const char* address, int bound)
+{
+	struct sockaddr_un sun;
+	struct addrinfo hints;
+	struct addrinfo* ai;
+	struct timeval tv = { FEED_TIMEOUT, 0 };
+	char host[128];
+	const char* port;
+	int fd, on = 1;
+
+	if (strchr(address, '/')) {
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		strncpy(sun.sun_path, address, sizeof(sun.sun_path)-1);
+		if ((fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0))<0)
+			return -1;
+		if (bound)
+			unlink(address);
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		if ((bound ? bind(fd, (struct sockaddr*)&sun, sizeof(sun)) : connect(fd, (struct sockaddr*)&sun, sizeof(sun)))<0) {
+			close(fd);
+			return -1;
+		}
+		return fd;
+	}
+	strncpy(host, address, sizeof(host));
+	host[sizeof(host)-1] = '\0';
+	if ( !(port = split_port(host, NULL)) )
+		return -1;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = bound ? AI_PASSIVE : 0;
+	if (getaddrinfo(host[0] ? host : NULL, port, &hints, &ai)!=0)
+		return -1;
+	if ((fd = socket(ai->ai_family, SOCK_STREAM|SOCK_CLOEXEC, 0))>=0) {
+		/* bounds connect() as well */
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		if (bound)
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		if ((bound ? bind(fd, ai->ai_addr, ai->ai_addrlen) : connect(fd, ai->ai_addr, ai->ai_addrlen))<0) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	freeaddrinfo(ai);
+	return fd;
+}
+
+
+static void start_leader(void)
+{
+	pthread_t thread;
+	int i;
+
+	if ((leader.sock = feed_socket(options.leader, 1))<0 || listen(leader.sock, 64)<0)
+		die_exit("Unable to listen for followers");
+	leader.epoch = time(NULL);
+	for (i = 0; i<FEED_THREADS; i++) {
+		if (start_thread(&thread, feed_thread, NULL)!=0)
+			die_exit("Unable to start the leader");
+		pthread_detach(thread);
+	}
+	if (options.verbose&1)
+		printf("Leading followers on %s\n", options.leader);
+}
+
+
+/*
+ * Ask the leaders of -g in turn for the dataset after version of epoch,
+ * listing the zones of have.  Returns the reply of the first which answers.
+ */
+static unsigned char* feed_fetch(const struct dataset* have, unsigned int epoch, unsigned int version, size_t* len)
+{
+	char addresses[sizeof(options.follow)];
+	struct timeval tv = { FEED_TIMEOUT, 0 };
+	const struct dnszone* z;
+	unsigned char* reply = NULL;
+	char* req = NULL;
+	char* address;
+	char* last;
+	size_t reqlen = 0, size = 0, off;
+	ssize_t n = 0;
+	FILE* fp;
+	int fd = -1, large = 0;
+
+	strcpy(addresses, options.follow);
+	for (address = strtok_r(addresses, ",", &last); address; address = strtok_r(NULL, ",", &last)) {
+		if ((fd = feed_socket(address, 0))>=0)
+			break;
+		fprintf(stderr, "[**] Warning: leader %s is not reachable\n", address);
+	}
+	if (fd<0)
+		return NULL;
+	if (options.verbose&1)
+		printf("Following leader %s\n", address);
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	if ( !(fp = open_memstream(&req, &reqlen)) )
+		die_exit(NULL);
+	fprintf(fp, "L2DN %u %u\n", epoch, version);
+	for (z = have ? have->zones : NULL; z; z = z->next)
+		if (z->hash && !strchr(z->dn, '\n'))
+			fprintf(fp, "%016llx %s\n", z->hash, z->dn);
+	fprintf(fp, "\n");
+	fclose(fp);
+	for (off = 0; off<reqlen; off += n)
+		if ((n = send(fd, req+off, reqlen-off, MSG_NOSIGNAL))<=0)
+			break;
+	free(req);
+	*len = 0;
+	if (off==reqlen) {
+		for (;;) {
+			if (*len==size) {
+				if ( (large = size>=FEED_MAXREPLY) )
+					break;
+				size = 2*size+65536<FEED_MAXREPLY ? 2*size+65536 : FEED_MAXREPLY;
+				if ( !(reply = realloc(reply, size)) )
+					die_exit(NULL);
+			}
+			if ((n = recv(fd, reply+*len, size-*len, 0))<=0)
+				break;
+			*len += n;
+		}
+	}
+	close(fd);
+	if (large) {
+		fprintf(stderr, "[**] Warning: the reply of leader %s is too large\n", address);
+		free(reply);
+		return NULL;
+	}
+	if (off!=reqlen || n<0) {
+		fprintf(stderr, "[**] Warning: lost the connection to leader %s\n", address);
+		free(reply);
+		return NULL;
+	}
+	return reply;
+}
+
+
+/*
+ * Consistency check (--check).  The decoded records are entered into the
+ * name index the responder answers from, which holds the RRsets of every
+ * owner name, and each record is then checked with a few lookups in it, so
+ * the whole directory is checked in linear time:
+ *
+ *	a CNAME must be the only data at its name
+ *	NS and MX targets inside our zones must have an address
+ *	NS, MX and SRV targets must not be CNAMEs
+ *	a reverse name must have a single PTR
+ *
+ * Records for different DNSlocations do not conflict.  Every problem is
+ * reported on stderr with the DN of the record (of the zone for records
+ * loaded from a snapshot); with --check=block nothing is published.
+ */
+static int check_visible(const char* loc, const char* other)
+{
+	return !loc[0] || !other[0] || strcmp(loc, other)==0;
+}
+
+
+/* Records of type (0 for any) at n that are served together with location loc */
+static int check_count(const struct dnsnode* n, unsigned short type, const char* loc)
+{
+	const struct dnsrrdata* rd;
+	int count = 0;
+
+	for (rd = n ? n->rrs : NULL; rd; rd = rd->next)
+		if ((!type || rd->type==type) && check_visible(rd->location, loc))
+			count++;
+	return count;
+}
+
+
+static const struct dnsnode* check_node(const struct snapshot* s, const char* name)
+{
+	unsigned char wire[DNS_MAXNAME+1];
+
+	if (!dns_encodename(wire, name))
+		return NULL;
+	dns_lowercase(wire);
+	return snap_lookup(s, wire);
+}
+
+
+/* 0 if name is inside one of our zones but has no address, not even through a wildcard */
+static int check_address(const struct snapshot* s, const char* name)
+{
+	unsigned char wire[DNS_MAXNAME+1];
+	const struct dnsnode* n;
+	unsigned char* p;
+
+	if (!dns_encodename(wire, name))
+		return 1;
+	dns_lowercase(wire);
+	if (!dns_findapex(s, wire))
+		return 1;
+	if ( (n = snap_lookup(s, wire)) )
+		return check_count(n, DNS_T_A, "") + check_count(n, DNS_T_AAAA, "") > 0;
+	/* tinydns answers for a missing name from the closest wildcard above it */
+	for (p = wire + *wire + 1; p-wire>=2; p += *p + 1) {
+		p[-2] = 1;
+		p[-1] = '*';
+		if ( (n = snap_lookup(s, p-2)) )
+			return check_count(n, DNS_T_A, "") + check_count(n, DNS_T_AAAA, "") > 0;
+		if (!*p || ((n = snap_lookup(s, p)) && n->apex))
+			break;
+	}
+	return 0;
+}
+
+
+static void check_report(const struct dnszone* z, const struct dnsrecord* r, const char* problem)
+{
+	fprintf(stderr, "[**] %s: %s\n", r->dn ? r->dn : z->dn, problem);
+}
+
+
+/* Check every record of ds against s, built from ds; returns the number of problems */
+static int check_dataset(const struct dataset* ds, const struct snapshot* s)
+{
+	const struct dnszone* z;
+	const struct dnsrecord* r;
+	struct resourcerecord rr;
+	char problem[2048];
+	char owner[MAX_DOMAIN_LEN];
+	const char* type;
+	int problems = 0;
+	int i, k;
+
+	for (z = ds->zones; z; z = z->next) {
+		for (i = 0; i<z->zonenames; i++) {
+			zone = z->soa;
+			strncpy(zone.domainname, z->zonename[i], 64);
+			for (r = z->records; r; r = r->next) {
+				load_record(&rr, r);
+				if (strcasecmp(rr.class, "IN"))
+					continue;
+				problem[0] = '\0';
+				type = strcasecmp(rr.type, "NS")==0 ? "NS" : strcasecmp(rr.type, "MX")==0 ? "MX"
+					: strcasecmp(rr.type, "SRV")==0 ? "SRV" : NULL;
+				if (!rr.cname[0]) {
+					/* nothing is written for the types below */
+				} else if (strcasecmp(rr.type, "CNAME")==0) {
+					if ( (k = check_count(check_node(s, rr.dnsdomainname), 0, rr.location))>1 )
+						snprintf(problem, sizeof(problem), "CNAME %s shares its name with %d other record(s)", rr.dnsdomainname, k-1);
+				} else if (type && strcmp(rr.cname, ".")) {
+					if (check_count(check_node(s, rr.cname), DNS_T_CNAME, "")>0)
+						snprintf(problem, sizeof(problem), "%s target %s of %s is a CNAME", type, rr.cname, rr.dnsdomainname);
+					else if (strcmp(type, "SRV") && !check_address(s, rr.cname))
+						snprintf(problem, sizeof(problem), "%s target %s of %s has no address", type, rr.cname, rr.dnsdomainname);
+				} else if (strcasecmp(rr.type, "PTR")==0) {
+					ptr_owner(owner, &rr, r->ipaddresses>0);
+					if ( (k = check_count(check_node(s, owner), DNS_T_PTR, rr.location))>1 )
+						snprintf(problem, sizeof(problem), "%s has %d PTR records", owner, k);
+				}
+				if (problem[0]) {
+					check_report(z, r, problem);
+					problems++;
+				}
+				/* the address of a tinydns '=' line comes with a PTR as well */
+				if (i>0 || rr.cipaddr.len!=4
+				    || (strcasecmp(rr.type, "A") && !(type && strcmp(type, "SRV") && rr.cname[0])))
+					continue;
+				ipaddr_reverse(owner, &rr.cipaddr);
+				if ( (k = check_count(check_node(s, owner), DNS_T_PTR, rr.location))>1 ) {
+					snprintf(problem, sizeof(problem), "%s has %d PTR records", owner, k);
+					check_report(z, r, problem);
+					problems++;
+				}
+			}
+		}
+	}
+	return problems;
+}
+
+
+/* Connect to the first URI that works, a handle left from before is closed */
+static int do_connect()
+{
+	int i, version, res = LDAP_SUCCESS;
+	struct berval creds = { 0, NULL };
+	struct berval* servercred;
+	if (options.useduris < 1) {
+		fprintf(stderr, "\n[!!] Must define at least one LDAP host with which to connect.\n\n");
+		fprintf(stderr, "Use --help to see usage information\n");
+		exit(1);
+	}
+	if (ldap_con) {
+		ldap_unbind_ext_s(ldap_con, NULL, NULL);
+		ldap_con = NULL;
+	}
+
+	for (i = 0; i<options.useduris; i++) {
+		if ( strlen(options.urildap[i]) > 0) {
+			if (ldap_con) {
+				/* the previous URI failed */
+				ldap_unbind_ext_s(ldap_con, NULL, NULL);
+				ldap_con = NULL;
+			}
+			res = ldap_initialize(&ldap_con, options.urildap[i]);
+			if (options.verbose&1 && res == LDAP_SUCCESS) {
+				printf("ldap_initialization successful (%s)\n", options.urildap[i]);
+			} else if ( res != LDAP_SUCCESS ) {
+				fprintf(stderr, "ldap_initialization to %s failed %s\n", options.urildap[i], ldap_err2string(res));
+				ldap_con = NULL;
+				continue;
+			}
+			version = LDAP_VERSION3;
+			if ( (res = ldap_set_option(ldap_con, LDAP_OPT_PROTOCOL_VERSION, &version)) != LDAP_SUCCESS ) {
+				fprintf(stderr, "ldap_set_option to %s failed with err %s!\n", options.urildap[i], ldap_err2string(res));
+				continue;
+			}
+			if ( options.use_tls[i] && (res = ldap_start_tls_s( ldap_con, NULL, NULL )) != LDAP_SUCCESS ) {
+				fprintf(stderr, "ldap_start_tls_s to %s failed with err %s!\n", options.urildap[i], ldap_err2string(res));
+				continue;
+			}
+
+			// Yes, you really do use ldap_sasl_bind_s() when doing a simple
+			// bind. This is apparently the "new" way, if not entirely obvious
+			if (strlen(options.binddn)) {
+				if (strlen(options.password)) {
+					creds.bv_len = strlen(options.password);
+					creds.bv_val = options.password;
+				}
+				servercred = NULL;
+				// FIXME: Allow *real* SASL binds
+				if ((res = ldap_sasl_bind_s(ldap_con, options.binddn, NULL, &creds, NULL, NULL, &servercred)) != LDAP_SUCCESS) {
+					fprintf(stderr, "LDAP bind problem:\n\t%s\n", ldap_err2string(res));
+					fprintf(stderr, "Attempting to continue with anonymous credentials.\n");
+					res = LDAP_SUCCESS;
+				}
+				if (servercred)
+					ber_bvfree(servercred);
+			}
+			return res;
+		}
+	}
+	if (ldap_con) {
+		ldap_unbind_ext_s(ldap_con, NULL, NULL);
+		ldap_con = NULL;
+	}
+	return res;
+}
+
+void hosts2uri(void)
+{
+	int i, t;
+	// Convert any old host:port sets into URIs.  This allows us
+	// to use the more modern ldap_initialize() instead of the
+	// deprecated ldap_init()
+	for (i = 0; i<options.usedhosts; i++) {
+		if ( strlen(options.hostname[i]) > 0) {
+			t = options.useduris++;
+			snprintf(options.urildap[t],
+				sizeof(options.urildap[t]),
+				"ldap://%s:%d",
+				options.hostname[i],
+				options.port[i] ? options.port[i] : LDAP_PORT);
+		}
+	}
+}
+
+
+/*
+ * PTR synthesis (-r).  Once all zones are decoded, the addresses of the A
+ * and AAAA records are indexed with their owner names.  Every address that
+ * falls into a reverse zone of the dataset, one under in-addr.arpa, ip6.arpa
+ * or ip6.int, gets a PTR to its owner there, unless a PTR entry or the '='
+ * line of a DNScipaddr already provides one.  An address with several names
+ * points to the lowest of them, names without a location first.  The PTRs
+ * live in z->synthesized, apart from the records read from LDAP, so neither
+ * snapshots nor the LDIF export nor the leader feed hold them; they are made
+ * again from the whole dataset on every refresh.
+ */
+struct ptrsource
+{
+	struct ipaddr addr;
+	char* owner;
+	const struct dnszone* z;
+	const struct dnsrecord* r;
+};
+
+struct ptrzone
+{
+	char key[MAX_DOMAIN_LEN];
+	struct dnszone* z;
+};
+
+
+static int cmp_ptrsource(const void* a, const void* b)
+{
+	const struct ptrsource* x = a;
+	const struct ptrsource* y = b;
+	int res;
+
+	if ((res = cmp_addr(&x->addr, &y->addr)))
+		return res;
+	if ((res = (x->r->location[0]!='\0') - (y->r->location[0]!='\0')))
+		return res;
+	return strcasecmp(x->owner, y->owner);
+}
+
+
+static int cmp_ptrzone(const void* a, const void* b)
+{
+	return strcmp(((const struct ptrzone*)a)->key, ((const struct ptrzone*)b)->key);
+}
+
+
+static int cmp_string(const void* a, const void* b)
+{
+	return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+
+static void ptr_source(struct ptrsource** src, int* count, const struct ipaddr* a, const char* owner, const struct dnszone* z, const struct dnsrecord* r)
+{
+	/* grows in powers of two */
+	if ((*count & (*count-1))==0 && !(*src = realloc(*src, (*count ? 2 * *count : 1) * sizeof(struct ptrsource))))
+		die_exit(NULL);
+	(*src)[*count].addr = *a;
+	(*src)[*count].owner = xstrdup(owner);
+	(*src)[*count].z = z;
+	(*src)[(*count)++].r = r;
+}
+
+
+static void ptr_given(char*** given, int* count, const char* owner)
+{
+	char key[MAX_DOMAIN_LEN];
+
+	if ((*count & (*count-1))==0 && !(*given = realloc(*given, (*count ? 2 * *count : 1) * sizeof(char*))))
+		die_exit(NULL);
+	reverse_key(key, owner);
+	(*given)[(*count)++] = xstrdup(key);
+}
+
+
+/*
+ * A reverse zone is written with the highest DNSserial of itself and the
+ * zones its PTRs came from, so secondaries see a change in either
+ */
+static void raise_serial(struct dnszone* z, const char* serial)
+{
+	if (z->soa.serial[0] && serial[0] && strtoul(serial, NULL, 10)>strtoul(zone_serial(z), NULL, 10))
+		snprintf(z->ptrserial, sizeof(z->ptrserial), "%s", serial);
+}
+
+
+static void synthesize_ptrs(struct dataset* ds)
+{
+	struct ptrsource* src = NULL;
+	struct ptrsource* best;
+	struct ptrzone* zones;
+	struct ptrzone* target;
+	struct ptrzone key;
+	struct dnszone* z;
+	struct dnsrecord* r;
+	struct resourcerecord rr;
+	const struct ipaddr* a;
+	char owner[MAX_DOMAIN_LEN];
+	char name[MAX_DOMAIN_LEN];
+	char** given = NULL;
+	char* p;
+	int nsrc = 0, nzones = 0, ngiven = 0;
+	int made = 0, present = 0;
+	int first, len, k;
+
+	/* what an earlier call made for this dataset goes */
+	for (z = ds->zones; z; z = z->next) {
+		while ( (r = z->synthesized) ) {
+			z->synthesized = r->next;
+			free_record(r);
+		}
+		z->ptrserial[0] = '\0';
+		if (reverse_zone(z))
+			nzones += z->zonenames;
+	}
+	zones = xcalloc(nzones+1, sizeof(struct ptrzone));
+	for (nzones = 0, z = ds->zones; z; z = z->next) {
+		if (z->zonenames==0)
+			continue;
+		for (k = 0; reverse_zone(z) && k<z->zonenames; k++) {
+			reverse_key(zones[nzones].key, z->zonename[k]);
+			zones[nzones++].z = z;
+		}
+		zone = z->soa;
+		strncpy(zone.domainname, z->zonename[0], 64);
+		for (r = z->records; r; r = r->next) {
+			load_record(&rr, r);
+			if (strcasecmp(rr.class, "IN") || !rr.dnsdomainname[0])
+				continue;
+			if (strcasecmp(rr.type, "PTR")==0)
+				ptr_given(&given, &ngiven, ptr_owner(owner, &rr, r->ipaddresses>0));
+			else if (rr.cipaddr.len==4 && (strcasecmp(rr.type, "A")==0
+			    || ((strcasecmp(rr.type, "NS")==0 || strcasecmp(rr.type, "MX")==0) && rr.cname[0])))
+				ptr_given(&given, &ngiven, ipaddr_reverse(owner, &rr.cipaddr));
+			if (rr.dnsdomainname[0]=='*')
+				continue;
+			if (strcasecmp(rr.type, "A")==0) {
+				for (k = 0; k<r->ipaddresses; k++)
+					if (r->ipaddr[k].len==4)
+						ptr_source(&src, &nsrc, &r->ipaddr[k], rr.dnsdomainname, z, r);
+			} else if (strcasecmp(rr.type, "AAAA")==0) {
+				/* the one address write_rr() gives an AAAA record */
+				a = rr.cipaddr.len ? &r->cipaddr : r->ipaddresses ? &r->ipaddr[0] : NULL;
+				if (a && a->len==16)
+					ptr_source(&src, &nsrc, a, rr.dnsdomainname, z, r);
+			}
+		}
+	}
+	qsort(zones, nzones, sizeof(struct ptrzone), cmp_ptrzone);
+	qsort(given, ngiven, sizeof(char*), cmp_string);
+	qsort(src, nsrc, sizeof(struct ptrsource), cmp_ptrsource);
+
+	/* from the highest address down, so prepending leaves every list in address order */
+	for (k = nsrc; k>0; k = first) {
+		for (first = k-1; first>0 && !cmp_addr(&src[first-1].addr, &src[k-1].addr); first--);
+		best = &src[first];
+		reverse_key(name, ipaddr_reverse(owner, &best->addr));
+		p = name;
+		if (bsearch(&p, given, ngiven, sizeof(char*), cmp_string)) {
+			present++;
+			continue;
+		}
+		/* the longest zone name the reverse name is in */
+		for (target = NULL; p && !target; p = (p = strchr(p, '.')) ? p+1 : NULL) {
+			strcpy(key.key, p);
+			target = bsearch(&key, zones, nzones, sizeof(struct ptrzone), cmp_ptrzone);
+		}
+		if (!target)
+			continue;
+		r = xcalloc(1, sizeof(struct dnsrecord));
+		/* relative to the zone, so that it comes out under each of its names */
+		len = strlen(name)-strlen(target->key);
+		if (len>0) {
+			name[len-1] = '\0';
+			r->domainname = dname_intern(name);
+		}
+		snprintf(owner, sizeof(owner), "%s.", best->owner);
+		r->cname = dname_intern(owner);
+		strcpy(r->class, "IN");
+		strcpy(r->type, "PTR");
+		strcpy(r->ttl, best->r->ttl);
+		strcpy(r->timestamp, best->r->timestamp);
+		strcpy(r->location, best->r->location);
+		r->next = target->z->synthesized;
+		target->z->synthesized = r;
+		raise_serial(target->z, best->z->soa.serial);
+		made++;
+	}
+	if (options.verbose&1)
+		printf("ptr: %d synthesized, %d addresses with a PTR of their own\n", made, present);
+	for (k = 0; k<nsrc; k++)
+		free(src[k].owner);
+	for (k = 0; k<ngiven; k++)
+		free(given[k]);
+	free(src);
+	free(given);
+	free(zones);
+}
+
+
+/* Hand the zones held back while decoding to the writers */
+static void writers_push_held(const struct dataset* ds)
+{
+	const struct dnszone* z;
+
+	for (z = ds->zones; z; z = z->next)
+		if (held_back(z))
+			writers_push(z);
+}
+
+
+/* Returns 0 if an output could not be written, see writers_finish() */
+static int write_outputs(const struct dataset* ds)
+{
+	const struct dnszone* z;
+
+	if (!writers_start(ds))
+		return 0;
+	for (z = ds->zones; z; z = z->next)
+		if (!held_back(z))
+			writers_push(z);
+	writers_push_held(ds);
+	return writers_finish();
+}
+
+
+/*
+ * Hooks run after a refresh.  The zones added, changed (new DNSserial) or
+ * removed since the previous refresh are passed to -e in the environment
+ * variables LDAP2DNS_ZONES_ADDED, LDAP2DNS_ZONES_CHANGED and
+ * LDAP2DNS_ZONES_REMOVED, and -E is run once for every added or changed
+ * zone with %zone% replaced by its name.  Tenant workers run their hooks at
+ * the same time, so the variables are handed to the command in an
+ * environment of its own; the one of the process is never changed.
+ */
+struct zoneref
+{
+	const char* name;
+	const char* serial;
+	const struct dnszone* zone;
+	int index;
+};
+
+struct zonelist
+{
+	char* names;
+	size_t len;
+	int count;
+};
+
+
+static int cmp_zoneref(const void* a, const void* b)
+{
+	return strcmp(((const struct zoneref*)a)->name, ((const struct zoneref*)b)->name);
+}
+
+
+static struct zoneref* zone_refs(const struct dataset* ds, int* count)
+{
+	const struct dnszone* z;
+	struct zoneref* refs;
+	int i;
+
+	*count = 0;
+	for (z = ds ? ds->zones : NULL; z; z = z->next)
+		*count += z->zonenames;
+	refs = xcalloc(*count+1, sizeof(struct zoneref));
+	for (*count = 0, z = ds ? ds->zones : NULL; z; z = z->next) {
+		for (i = 0; i<z->zonenames; i++) {
+			refs[*count].name = z->zonename[i];
+			refs[*count].serial = zone_serial(z);
+			refs[*count].zone = z;
+			refs[(*count)++].index = i;
+		}
+	}
+	qsort(refs, *count, sizeof(struct zoneref), cmp_zoneref);
+	return refs;
+}
+
+
+static void zonelist_add(struct zonelist* l, const char* name)
+{
+	size_t n = strlen(name);
+
+	if ( !(l->names = realloc(l->names, l->len+n+2)) )
+		die_exit(NULL);
+	if (l->len)
+		l->names[l->len++] = ' ';
+	memcpy(l->names+l->len, name, n+1);
+	l->len += n;
+	l->count++;
+}
+
+
+/* "name=value", for the environment of a hook */
+static char* hook_var(const char* name, const char* value)
+{
+	char* var;
+
+	if (!value)
+		value = "";
+	var = xcalloc(strlen(name)+strlen(value)+2, 1);
+	sprintf(var, "%s=%s", name, value);
+	return var;
+}
+
+
+/*
+ * Run command with sh -c and wait for it, with the environment of the
+ * process plus the NULL terminated "name=value" list vars, which replace
+ * variables of the same name.  The signals blocked for the signalfd are not
+ * blocked in the command.
+ */
+static void run_command(const char* command, char* const* vars)
+{
+	extern char** environ;
+	char* argv[4] = { "sh", "-c", (char*)command, NULL };
+	char** envp;
+	posix_spawnattr_t attr;
+	sigset_t none;
+	pid_t pid;
+	size_t len;
+	int n, k, i, j;
+
+	for (n = 0; environ[n]; n++);
+	for (k = 0; vars && vars[k]; k++);
+	envp = xcalloc(n+k+1, sizeof(char*));
+	for (i = j = 0; i<n; i++) {
+		for (k = 0; vars && vars[k]; k++) {
+			len = strchr(vars[k], '=')-vars[k]+1;
+			if (strncmp(environ[i], vars[k], len)==0)
+				break;
+		}
+		if (!vars || !vars[k])
+			envp[j++] = environ[i];
+	}
+	for (k = 0; vars && vars[k]; k++)
+		envp[j++] = vars[k];
+	sigemptyset(&none);
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setsigmask(&attr, &none);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+	if (posix_spawn(&pid, "/bin/sh", NULL, &attr, argv, envp)!=0)
+		fprintf(stderr, "[**] Warning: unable to run '%s'\n", command);
+	else
+		while (waitpid(pid, NULL, 0)<0 && errno==EINTR);
+	posix_spawnattr_destroy(&attr);
+	free(envp);
+}
+
+
+/* Zone names end up in a shell command, so only plain host names qualify */
+static int safe_zonename(const char* name)
+{
+	for (; *name; name++)
+		if (!isalnum((unsigned char)*name) && !strchr(".-_", *name))
+			return 0;
+	return 1;
+}
+
+
+static void run_zone_command(const char* name)
+{
+	char command[512];
+	const char* t;
+	size_t len = 0;
+	size_t n;
+
+	if (!safe_zonename(name)) {
+		fprintf(stderr, "[**] Warning: not running -E for zone '%s'\n", name);
+		return;
+	}
+	for (t = options.zone_command; *t && len<sizeof(command)-1; ) {
+		if (strncmp(t, "%zone%", 6)==0) {
+			n = strlen(name);
+			if (n>sizeof(command)-1-len)
+				n = sizeof(command)-1-len;
+			memcpy(command+len, name, n);
+			len += n;
+			t += 6;
+		} else
+			command[len++] = *t++;
+	}
+	command[len] = '\0';
+	if (options.verbose&1)
+		printf("exec: %s\n", command);
+	run_command(command, NULL);
+}
+
+
+/* The zones added, changed and removed in shard (-1 for all of them) */
+static void zone_changes(const struct zoneref* now, int nnow, const struct zoneref* old, int nold, int shard,
+	struct zonelist* added, struct zonelist* changed, struct zonelist* removed)
+{
+	int i = 0, k = 0;
+	int c;
+
+	while (i<nnow || k<nold) {
+		c = i==nnow ? 1 : k==nold ? -1 : strcmp(now[i].name, old[k].name);
+		if (c<0) {
+			if (shard<0 || zone_shard(now[i].zone)==shard)
+				zonelist_add(added, now[i].name);
+			i++;
+		} else if (c>0) {
+			if (shard<0 || zone_shard(old[k].zone)==shard)
+				zonelist_add(removed, old[k].name);
+			k++;
+		} else {
+			if (strcmp(now[i].serial, old[k].serial)!=0 && (shard<0 || zone_shard(now[i].zone)==shard))
+				zonelist_add(changed, now[i].name);
+			i++;
+			k++;
+		}
+	}
+}
+
+
+/* Run -e with the zone lists, and the shard and its directory if shard is not NULL */
+static void exec_hook(const struct zonelist* added, const struct zonelist* changed, const struct zonelist* removed,
+	const char* shard, const char* sharddir)
+{
+	char* vars[6];
+	int n = 0;
+
+	vars[n++] = hook_var("LDAP2DNS_ZONES_ADDED", added->names);
+	vars[n++] = hook_var("LDAP2DNS_ZONES_CHANGED", changed->names);
+	vars[n++] = hook_var("LDAP2DNS_ZONES_REMOVED", removed->names);
+	if (shard) {
+		vars[n++] = hook_var("LDAP2DNS_SHARD", shard);
+		vars[n++] = hook_var("LDAP2DNS_SHARD_DIR", sharddir);
+	}
+	vars[n] = NULL;
+	run_command(options.exec_command, vars);
+	while (n>0)
+		free(vars[--n]);
+}
+
+
+static void run_hooks(const struct dataset* ds, const struct dataset* prev)
+{
+	struct zonelist added = { NULL, 0, 0 };
+	struct zonelist changed = { NULL, 0, 0 };
+	struct zonelist removed = { NULL, 0, 0 };
+	struct zoneref* now;
+	struct zoneref* old;
+	char shard[12];
+	char dir[300];
+	int nnow, nold;
+	int i;
+
+	if (!options.exec_command[0] && !options.zone_command[0])
+		return;
+	now = zone_refs(ds, &nnow);
+	old = zone_refs(prev, &nold);
+	zone_changes(now, nnow, old, nold, -1, &added, &changed, &removed);
+	if (options.verbose&1)
+		printf("zones added: %d, changed: %d, removed: %d\n", added.count, changed.count, removed.count);
+	if (options.zone_command[0]) {
+		for (i = 0; i<nnow; i++) {
+			/* the lists are sorted, so look the zone up in the previous refresh */
+			struct zoneref* o = bsearch(&now[i], old, nold, sizeof(struct zoneref), cmp_zoneref);
+			if (!o || strcmp(now[i].serial, o->serial)!=0)
+				run_zone_command(now[i].name);
+		}
+	}
+	if (options.exec_command[0] && options.shards && options.output&OUTPUT_DATA) {
+		/* once for every shard whose data changed, with its own zones */
+		for (i = 0; i<options.shards; i++) {
+			struct zonelist a = { NULL, 0, 0 }, c = { NULL, 0, 0 }, r = { NULL, 0, 0 };
+
+			if (!shard_changed[i])
+				continue;
+			zone_changes(now, nnow, old, nold, i, &a, &c, &r);
+			snprintf(shard, sizeof(shard), "%d", i);
+			exec_hook(&a, &c, &r, shard, shard_file(dir, sizeof(dir), i, ""));
+			free(a.names);
+			free(c.names);
+			free(r.names);
+		}
+	} else if (options.exec_command[0]) {
+		exec_hook(&added, &changed, &removed, NULL, NULL);
+	}
+	free(added.names);
+	free(changed.names);
+	free(removed.names);
+	free(now);
+	free(old);
+}
+
+
+/*
+ * Incremental output (-X dir).  For every zone whose serial changed, the
+ * records of the previous and the new refresh are rendered as BIND master
+ * file lines and compared as sorted lists.  Only the difference is written,
+ * as an nsupdate batch (zone.update) and as an RFC 1995 style difference
+ * sequence (zone.ixfr), so a dynamic primary can apply the change without
+ * reloading the zone.
+ */
+struct rrlines
+{
+	char* buf;
+	char** line;
+	int count;
+};
+
+
+static int cmp_line(const void* a, const void* b)
+{
+	return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+
+/* Render records and the PTRs of z under its name i the way write_dnszone() does, one line each */
+static void render_lines(struct rrlines* l, const struct dnszone* z, const struct dnsrecord* records, int i)
+{
+	const struct dnsrecord* r;
+	size_t size = 0;
+	char* p;
+	int n;
+
+	zone = zone_soa(z);
+	strncpy(zone.domainname, z->zonename[i], 64);
+	if ( !(namedzone = open_memstream(&l->buf, &size)) )
+		die_exit(NULL);
+	for (r = records; r; r = r->next)
+		write_record(r, i);
+	for (r = z->synthesized; r; r = r->next)
+		write_record(r, i);
+	fclose(namedzone);
+	namedzone = NULL;
+	for (n = 0, p = l->buf; *p; p++)
+		n += *p=='\n';
+	l->line = xcalloc(n+1, sizeof(char*));
+	for (l->count = 0, p = strtok(l->buf, "\n"); p; p = strtok(NULL, "\n"))
+		l->line[l->count++] = p;
+	qsort(l->line, l->count, sizeof(char*), cmp_line);
+}
+
+
+/* SOA as a single master file line, 0 if the zone lacks SOA timers */
+static int soa_line(char* buf, size_t size, const struct zonerecord* soa, const char* name)
+{
+	size_t m = strlen(soa->zonemaster);
+	size_t a = strlen(soa->adminmailbox);
+
+	if (!m || !a || !soa->serial[0] || !soa->refresh[0] || !soa->retry[0] || !soa->expire[0] || !soa->minimum[0])
+		return 0;
+	snprintf(buf, size, "%s.\t%s\tIN SOA\t%s%s %s%s %s %s %s %s %s", name, soa->ttl,
+	    soa->zonemaster, soa->zonemaster[m-1]=='.' ? "" : ".",
+	    soa->adminmailbox, soa->adminmailbox[a-1]=='.' ? "" : ".",
+	    soa->serial, soa->refresh, soa->retry, soa->expire, soa->minimum);
+	return 1;
+}
+
+
+/* Write one line as "update add|delete", supplying the zone TTL where none is given */
+static void nsupdate_line(FILE* fp, const char* op, const char* line, int withttl)
+{
+	const char* ttl = strchr(line, '\t');
+	const char* rest = ttl ? strchr(ttl+1, '\t') : NULL;
+	const char* p;
+
+	if (!rest)
+		return;
+	fprintf(fp, "update %s %.*s", op, (int)(ttl-line), line);
+	if (withttl && rest>ttl+1)
+		fprintf(fp, " %.*s", (int)(rest-ttl-1), ttl+1);
+	else if (withttl)
+		fprintf(fp, " %s", zone.ttl[0] ? zone.ttl : "3600");
+	for (p = rest; *p; p++)
+		putc(*p=='\t' ? ' ' : *p, fp);
+	putc('\n', fp);
+}
+
+
+static void write_delta(const struct dnszone* z, int i, const struct dnszone* oldz, int oldi)
+{
+	struct rrlines now = { NULL, NULL, 0 };
+	struct rrlines old = { NULL, NULL, 0 };
+	struct zonerecord oldzone = zone_soa(oldz);
+	struct zonerecord nowzone = zone_soa(z);
+	char filename[256];
+	char oldsoa[512], newsoa[512];
+	int a = 0, d = 0, c;
+	int adds = 0, dels = 0;
+	FILE* update;
+	FILE* ixfr;
+
+	snprintf(filename, sizeof(filename), "%s/%s.update", options.deltadir, z->zonename[i]);
+	if ( !(update = open_output(filename)) ) {
+		sync_failed(filename);
+		return;
+	}
+	snprintf(filename, sizeof(filename), "%s/%s.ixfr", options.deltadir, z->zonename[i]);
+	if ( !(ixfr = open_output(filename)) ) {
+		sync_failed(filename);
+		fclose(update);
+		snprintf(filename, sizeof(filename), "%s/%s.update.temp", options.deltadir, z->zonename[i]);
+		unlink(filename);
 		return;
 	}
+	/* with -r a zone can change at the same DNSserial, its records were taken over then */
+	render_lines(&old, oldz, strcmp(oldz->soa.serial, z->soa.serial) ? oldz->records : z->records, oldi);
+	render_lines(&now, z, z->records, i);
+
+	fprintf(update, "; %s serial %s -> %s, generated by ldap2dns v%s\n", zone.domainname, oldzone.serial, nowzone.serial, VERSION);
+	fprintf(update, "zone %s.\n", zone.domainname);
+	fprintf(ixfr, "; %s serial %s -> %s, generated by ldap2dns v%s\n", zone.domainname, oldzone.serial, nowzone.serial, VERSION);
+	if (soa_line(oldsoa, sizeof(oldsoa), &oldzone, zone.domainname))
+		fprintf(ixfr, "%s\n", oldsoa);
+	/* deletions first, as in an IXFR difference sequence */
+	while (d<old.count) {
+		c = a==now.count ? -1 : strcmp(old.line[d], now.line[a]);
+		if (c<0) {
+			nsupdate_line(update, "delete", old.line[d], 0);
+			fprintf(ixfr, "%s\n", old.line[d++]);
+			dels++;
+		} else if (c>0)
+			a++;
+		else {
+			a++;
+			d++;
+		}
+	}
+	if (soa_line(newsoa, sizeof(newsoa), &nowzone, zone.domainname)) {
+		fprintf(ixfr, "%s\n", newsoa);
+		nsupdate_line(update, "add", newsoa, 1);
+	}
+	for (a = d = 0; a<now.count; ) {
+		c = d==old.count ? -1 : strcmp(now.line[a], old.line[d]);
+		if (c<0) {
+			nsupdate_line(update, "add", now.line[a], 1);
+			fprintf(ixfr, "%s\n", now.line[a++]);
+			adds++;
+		} else if (c>0)
+			d++;
+		else {
+			a++;
+			d++;
+		}
+	}
+	fprintf(update, "send\n");
+	if (options.verbose&1)
+		printf("delta: %s %d added, %d deleted\n", zone.domainname, adds, dels);
+	snprintf(filename, sizeof(filename), "%s/%s.update", options.deltadir, z->zonename[i]);
+	commit_output(update, filename);
+	snprintf(filename, sizeof(filename), "%s/%s.ixfr", options.deltadir, z->zonename[i]);
+	commit_output(ixfr, filename);
+	free(old.buf);
+	free(old.line);
+	free(now.buf);
+	free(now.line);
+}
+
+
+/* Returns 0 if a delta could not be written */
+static int write_deltas(const struct dataset* ds, const struct dataset* prev)
+{
+	struct zoneref* now;
+	struct zoneref* old;
+	struct zoneref* o;
+	int nnow, nold;
+	int i;
+
+	if (!prev)
+		return 1;
+	now = zone_refs(ds, &nnow);
+	old = zone_refs(prev, &nold);
+	for (i = 0; i<nnow; i++) {
+		o = bsearch(&now[i], old, nold, sizeof(struct zoneref), cmp_zoneref);
+		if (o && strcmp(o->serial, now[i].serial)!=0)
+			write_delta(now[i].zone, now[i].index, o->zone, o->index);
+	}
+	free(now);
+	free(old);
+	return sync_outputs(options.deltadir);
+}
+
+
+/*
+ * Per-zone polling (-z).  Between the refreshes every -u seconds, each zone
+ * is checked on its own with a base search for its DNSserial.  The zones sit
+ * in a binary heap ordered by when they are due next.  A zone starts with its
+ * DNSrefresh as interval, limited to the -z bounds; the interval is halved
+ * whenever the zone changed and grows by a quarter whenever it did not, so
+ * busy zones are looked at every few seconds and idle ones rarely.  Every
+ * interval is randomly shortened by up to a tenth, so that several daemons
+ * polling the same server do not fall into step.
+ */
+struct zonepoll
+{
+	char* dn;
+	char serial[12];
+	unsigned int interval;
+	time_t due;
+};
+
+struct pollqueue
+{
+	struct zonepoll* heap;
+	int size;
+};
+
+static __thread unsigned int poll_seed;
+
+
+static time_t poll_due(time_t now, unsigned int interval)
+{
+	if (!poll_seed)
+		poll_seed = time(NULL) ^ getpid() ^ (unsigned int)(unsigned long)&poll_seed;
+	return now + interval - rand_r(&poll_seed) % (interval/10+1);
+}
+
+
+static void pollq_push(struct pollqueue* q, const struct zonepoll* p)
+{
+	int i = q->size++;
+
+	if ( !(q->heap = realloc(q->heap, q->size*sizeof(struct zonepoll))) )
+		die_exit(NULL);
+	for (; i>0 && q->heap[(i-1)/2].due>p->due; i = (i-1)/2)
+		q->heap[i] = q->heap[(i-1)/2];
+	q->heap[i] = *p;
+}
+
+
+static struct zonepoll pollq_pop(struct pollqueue* q)
+{
+	struct zonepoll top = q->heap[0];
+	struct zonepoll last = q->heap[--q->size];
+	int i = 0, c;
+
+	while ((c = 2*i+1)<q->size) {
+		if (c+1<q->size && q->heap[c+1].due<q->heap[c].due)
+			c++;
+		if (last.due<=q->heap[c].due)
+			break;
+		q->heap[i] = q->heap[c];
+		i = c;
+	}
+	if (q->size)
+		q->heap[i] = last;
+	return top;
+}
+
+
+/* When the next zone is due, or 0 if none is polled */
+static time_t pollq_next(const struct pollqueue* q)
+{
+	return q->size ? q->heap[0].due : 0;
+}
+
+
+static int cmp_zonepoll(const void* a, const void* b)
+{
+	return strcmp(((const struct zonepoll*)a)->dn, ((const struct zonepoll*)b)->dn);
+}
+
+
+/* Take over the zones of a new dataset, keeping what was learned about known ones */
+static void schedule_zones(struct pollqueue* q, const struct dataset* ds)
+{
+	struct pollqueue old = *q;
+	const struct dnszone* z;
+	struct zonepoll key;
+	struct zonepoll* o;
+	struct zonepoll p;
+	unsigned int refresh;
+	time_t now = time(NULL);
+	int i;
+
+	qsort(old.heap, old.size, sizeof(struct zonepoll), cmp_zonepoll);
+	q->heap = NULL;
+	q->size = 0;
+	for (z = ds->zones; z; z = z->next) {
+		key.dn = z->dn;
+		o = bsearch(&key, old.heap, old.size, sizeof(struct zonepoll), cmp_zonepoll);
+		p.dn = xstrdup(z->dn);
+		snprintf(p.serial, sizeof(p.serial), "%s", z->soa.serial);
+		if (!o) {
+			if (sscanf(z->soa.refresh, "%u", &refresh)!=1 || refresh>options.poll_max)
+				refresh = options.poll_max;
+			p.interval = refresh<options.poll_min ? options.poll_min : refresh;
+			p.due = poll_due(now, p.interval);
+		} else if (strcmp(o->serial, p.serial)) {
+			/* changed without being polled, e.g. found by the -u refresh */
+			p.interval = o->interval/2<options.poll_min ? options.poll_min : o->interval/2;
+			p.due = poll_due(now, p.interval);
+		} else {
+			p.interval = o->interval;
+			p.due = o->due;
+		}
+		pollq_push(q, &p);
+	}
+	for (i = 0; i<old.size; i++)
+		free(old.heap[i].dn);
+	free(old.heap);
+}
+
+
+/*
+ * Check the zones that are due, ldap_con must be bound; returns 1 if one
+ * changed.  After an LDAP error the polling stops with ldap_error set.
+ */
+static int poll_zones(struct pollqueue* q)
+{
+	char* attr_list[2] = { "DNSserial", NULL };
+	LDAPMessage* res;
+	LDAPMessage* m;
+	struct berval** bvals;
+	struct zonepoll p;
+	time_t now = time(NULL);
+	int changed = 0;
+	int ldaperr;
+
+	ldap_error = LDAP_SUCCESS;
+	while (q->size && q->heap[0].due<=now && !changed && !ldap_error) {
+		p = pollq_pop(q);
+		res = NULL;
+		ldaperr = ldap_search_ext_s(ldap_con, p.dn, LDAP_SCOPE_BASE, "objectclass=DNSzone", attr_list, 0, NULL, NULL, &options.searchtimeout, 1, &res);
+		if (ldaperr==LDAP_NO_SUCH_OBJECT) {
+			/* removed, the refresh drops it */
+			changed = 1;
+		} else if (ldaperr!=LDAP_SUCCESS) {
+			ldap_failed(ldaperr);
+		} else if ( (m = ldap_first_entry(ldap_con, res)) && (bvals = ldap_get_values_len(ldap_con, m, "DNSserial")) ) {
+			if (strncmp(p.serial, bvals[0]->bv_val, sizeof(p.serial)-1)) {
+				snprintf(p.serial, sizeof(p.serial), "%s", bvals[0]->bv_val);
+				changed = 1;
+			}
+			ldap_value_free_len(bvals);
+		}
+		if (res)
+			ldap_msgfree(res);
+		if (changed) {
+			p.interval = p.interval/2<options.poll_min ? options.poll_min : p.interval/2;
+			if (options.verbose&1)
+				printf("zone %s changed, polling every %us\n", p.dn, p.interval);
+		} else if (p.interval<options.poll_max) {
+			p.interval += p.interval/4+1;
+			if (p.interval>options.poll_max)
+				p.interval = options.poll_max;
+		}
+		p.due = poll_due(now, p.interval);
+		pollq_push(q, &p);
+	}
+	return changed;
+}
+
+
+/*
+ * Tenants.  Without -T there is just one, made up from the command line.
+ * With -T one daemon serves several search bases, each rendered into its
+ * own directory with its own formats.  A small pool of workers refreshes
+ * whichever tenant is due first; a worker keeps its LDAP connection while
+ * there is work left, and a slow tenant only ever holds up one worker.
+ */
+#define TENANT_WORKERS 4
+
+struct tenant
+{
+	char searchbase[128];
+	char directory[128];
+	unsigned int output;
+	int numzones;
+	int checksum;
+	struct dataset* dataset;
+	struct pollqueue polls;
+	time_t due;
+	time_t retry;
+	char (*forced)[64];
+	int numforced;
+	int busy;
+	int done;
+	/* reported after each refresh with -v */
+	unsigned long checks;
+	unsigned long updates;
+	unsigned long failures;
+	int zones;
+	int records;
+	long lastmsecs;
+	int blocked;		/* the last refresh failed --check=block */
+	unsigned int epoch;	/* of the leader's dataset, with -g */
+	unsigned int version;
+	time_t resign;		/* signatures need renewing, with -K */
+	struct timespec keydir;	/* mtime of the -K directory when last looked at */
+};
+
+static struct
+{
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	struct tenant* list;
+	int count;
+} tenants = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+
+static void sleep_until(time_t when)
+{
+	time_t now = time(NULL);
+
+	if (when>now)
+		sleep(when-now);
+}
+
+
+/*
+ * Daemon event loop.  Between refreshes the main thread waits in epoll for
+ * the refresh timer (a timerfd), SIGHUP and SIGUSR1 (a signalfd) and the
+ * control socket given with -c, so that an urgent change can be published
+ * right away instead of after the -u interval:
+ *
+ *	SIGHUP			refresh now
+ *	SIGUSR1			print the statistics to stdout
+ *	refresh			refresh now
+ *	refresh zone <name>	fetch zone <name> again now, even if its
+ *				DNSserial did not change
+ *	stats			reply with the statistics
+ */
+static struct
+{
+	int epoll;
+	int timer;
+	int signals;
+	int control;
+} events = { -1, -1, -1, -1 };
+
+
+static void print_tenant(FILE* fp, const struct tenant* t)
+{
+	fprintf(fp, "tenant %s: %d zones, %d records, %lu checks, %lu updates, %lu failures, last refresh %ld ms\n",
+		t->searchbase, t->zones, t->records, t->checks, t->updates, t->failures, t->lastmsecs);
+}
+
+
+/*
+ * Resident set size and the bytes malloc() has handed out.  The latter only
+ * covers the main arena and counts chunks kept in the per-thread caches as
+ * used; run with MALLOC_ARENA_MAX=1 and glibc.malloc.tcache_count=0 in
+ * GLIBC_TUNABLES to have it exact (scripts/soak.pl does).
+ */
+static void print_memory(FILE* fp)
+{
+	long rss = -1;
+	long heap = -1;
+#ifdef __linux__
+	FILE* statm;
+
+	if ( (statm = fopen("/proc/self/statm", "r")) ) {
+		if (fscanf(statm, "%*s %ld", &rss)==1)
+			rss *= sysconf(_SC_PAGESIZE)/1024;
+		fclose(statm);
+	}
+#endif
+#if defined __GLIBC__ && (__GLIBC__>2 || __GLIBC_MINOR__>=33)
+	struct mallinfo2 mi = mallinfo2();
+	heap = mi.uordblks + mi.hblkhd;
+#endif
+	fprintf(fp, "memory: %ld kB resident, %ld bytes allocated\n", rss, heap);
+}
+
+
+static void print_stats(FILE* fp)
+{
+	int i;
+
+	pthread_mutex_lock(&tenants.lock);
+	for (i = 0; i<tenants.count; i++)
+		print_tenant(fp, &tenants.list[i]);
+	pthread_mutex_unlock(&tenants.lock);
+	pthread_mutex_lock(&names.lock);
+	fprintf(fp, "names: %u interned\n", names.count);
+	pthread_mutex_unlock(&names.lock);
+#ifdef DNSSEC
+	if (options.signkeys[0]) {
+		pthread_mutex_lock(&signer.lock);
+		fprintf(fp, "signatures: %lu made, %lu reused\n", signer.made, signer.reused);
+		pthread_mutex_unlock(&signer.lock);
+	}
+#endif
+	print_memory(fp);
+}
 
-	for (m = ldap_first_entry(ldap_con, res); m; m = ldap_next_entry(ldap_con, m)) {
-		BerElement* ber = NULL;
-		char* attr;
-		char* dn = ldap_get_dn(ldap_con, m);
-		int i, locmembers = 0;
-		char l_members[256][15];
-		//char loc[256][64];
-		char loc[2];
-		char ldif0;
 
-		loc_rec.locname[0] = '\0';
-		if (options.ldifname[0])
-			fprintf(ldifout, "dn: %s\n", dn);
-		for (attr = ldap_first_attribute(ldap_con, m, &ber); attr; attr = ldap_next_attribute(ldap_con, m, ber)) {
-			struct berval** bvals = ldap_get_values_len(ldap_con, m, attr);
-			if (bvals!=NULL) {
-				if (bvals[0] && bvals[0]->bv_len>0) {
-					if (strcasecmp(attr, "objectclass")==0
-					    || strcasecmp(attr, "cn")==0) {
-						if (options.ldifname[0])
-							fprintf(ldifout, "%s: %s\n", attr, bvals[0]->bv_val);
-					} else if (strcasecmp(attr, "DNSlocation")==0) {
-						if (sscanf(bvals[0]->bv_val, "%2s", loc_rec.locname)!=1)
-							loc_rec.locname[0] = '\0';
-						else if (options.ldifname[0])
-							fprintf(ldifout, "%s: %s\n", attr, loc_rec.locname);
-					} else if (strcasecmp(attr, "DNSipaddr")==0) {
-						for (locmembers = 0; bvals[locmembers] && locmembers<256; locmembers++) {
-							if (sscanf(bvals[locmembers]->bv_val, "%15s", loc_rec.member[locmembers])!=1)
-								loc_rec.member[locmembers][0] = '\0';
-							else if (options.ldifname[0])
-								fprintf(ldifout, "%s: %s\n", attr, loc_rec.member[locmembers]);
-						}
-					} else {
-						if (options.ldifname[0])
-							fprintf(ldifout, "%s: %s\n", attr, bvals[0]->bv_val);
-					}
+/* Have every tenant refreshed now; zonename, if given, is fetched again in full */
+static void request_refresh(const char* zonename)
+{
+	struct tenant* t;
+	int i;
+
+	pthread_mutex_lock(&tenants.lock);
+	for (i = 0; i<tenants.count; i++) {
+		t = &tenants.list[i];
+		t->due = 0;
+		t->retry = 0;
+		if (zonename) {
+			if ( !(t->forced = realloc(t->forced, (t->numforced+1)*sizeof(t->forced[0]))) )
+				die_exit(NULL);
+			snprintf(t->forced[t->numforced++], sizeof(t->forced[0]), "%s", zonename);
+		}
+	}
+	pthread_cond_broadcast(&tenants.changed);
+	pthread_mutex_unlock(&tenants.lock);
+}
+
+
+/* Make the zones requested with "refresh zone" miss the reuse of unchanged zones */
+static void apply_forced(struct tenant* t)
+{
+	struct dnszone* z;
+	int i, j;
+
+	pthread_mutex_lock(&tenants.lock);
+	for (i = 0; i<t->numforced; i++) {
+		for (z = t->dataset ? t->dataset->zones : NULL; z; z = z->next) {
+			for (j = 0; j<z->zonenames; j++) {
+				if (strcasecmp(z->zonename[j], t->forced[i])==0) {
+					if (options.verbose&1)
+						printf("zone %s will be fetched again\n", t->forced[i]);
+					z->soa.serial[0] = '\0';
+					t->numzones = -1;
 				}
-				ldap_value_free_len(bvals);
 			}
 		}
-		ldif0 = options.ldifname[0];
-		if (options.verbose&1)
-			printf("locationcodename: %s (%d members)\n", loc_rec.locname, locmembers);
-		for (i = 0; i<locmembers; i++) {
-			if (i>0)
-				options.ldifname[0] = '\0';
-			write_loccode(i);
-			if (options.ldifname[0])
-				fprintf(ldifout, "\n");
-		}
-		options.ldifname[0] = ldif0;
-		free(dn);
 	}
-	ldap_msgfree(res);
+	free(t->forced);
+	t->forced = NULL;
+	t->numforced = 0;
+	pthread_mutex_unlock(&tenants.lock);
 }
 
 
-static int do_connect()
+#ifdef __linux__
+static void events_init(void)
 {
-	int i, version, res;
-	struct berval* creds = malloc(sizeof(struct berval));
-	struct berval* msgid = malloc(sizeof(struct berval));
-	if (options.useduris < 1) {
-		fprintf(stderr, "\n[!!] Must define at least one LDAP host with which to connect.\n\n");
-		fprintf(stderr, "Use --help to see usage information\n");
-		exit(1);
+	struct epoll_event ev;
+	struct sockaddr_un sun;
+	sigset_t mask;
+
+	/* blocked before any thread is started, so they all inherit it */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGHUP);
+	sigaddset(&mask, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+	if ((events.epoll = epoll_create1(EPOLL_CLOEXEC))<0
+	 || (events.timer = timerfd_create(CLOCK_REALTIME, TFD_CLOEXEC))<0
+	 || (events.signals = signalfd(-1, &mask, SFD_CLOEXEC))<0)
+		die_exit("Unable to set up the event loop");
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = events.timer;
+	epoll_ctl(events.epoll, EPOLL_CTL_ADD, events.timer, &ev);
+	ev.data.fd = events.signals;
+	epoll_ctl(events.epoll, EPOLL_CTL_ADD, events.signals, &ev);
+	if (!options.control[0])
+		return;
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strncpy(sun.sun_path, options.control, sizeof(sun.sun_path)-1);
+	unlink(options.control);
+	if ((events.control = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0))<0
+	 || bind(events.control, (struct sockaddr*)&sun, sizeof(sun))<0
+	 || listen(events.control, 8)<0)
+		die_exit("Unable to create the control socket");
+	ev.data.fd = events.control;
+	epoll_ctl(events.epoll, EPOLL_CTL_ADD, events.control, &ev);
+}
+
+
+/* Serve one connection to the control socket; returns 1 if a refresh was requested */
+static int control_command(void)
+{
+	struct timeval tv = { 1, 0 };
+	char buf[256];
+	char zonename[MAX_DOMAIN_LEN];
+	char* reply = NULL;
+	size_t replylen = 0;
+	FILE* fp;
+	ssize_t len;
+	int requested = 0;
+	int fd;
+
+	if ((fd = accept(events.control, NULL, NULL))<0)
+		return 0;
+	/* a client which does not send its command in time is dropped */
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	if ((len = recv(fd, buf, sizeof(buf)-1, 0))<=0) {
+		close(fd);
+		return 0;
 	}
+	buf[len] = '\0';
+	buf[strcspn(buf, "\r\n")] = '\0';
+	if ( !(fp = open_memstream(&reply, &replylen)) )
+		die_exit(NULL);
+	if (strcmp(buf, "refresh")==0) {
+		request_refresh(NULL);
+		requested = 1;
+		fprintf(fp, "ok\n");
+	} else if (sscanf(buf, "refresh zone %255s", zonename)==1) {
+		if (zonename[0] && zonename[strlen(zonename)-1]=='.')
+			zonename[strlen(zonename)-1] = '\0';
+		request_refresh(zonename);
+		requested = 1;
+		fprintf(fp, "ok\n");
+	} else if (strcmp(buf, "stats")==0) {
+		print_stats(fp);
+	} else {
+		fprintf(fp, "error: unknown command\n");
+	}
+	fclose(fp);
+	send(fd, reply, replylen, MSG_NOSIGNAL);
+	free(reply);
+	close(fd);
+	if (options.verbose&1)
+		printf("control: %s\n", buf);
+	return requested;
+}
+#endif
 
-	for (i = 0; i<options.useduris; i++) {
-		if ( strlen(options.urildap[i]) > 0) {
-			res = ldap_initialize(&ldap_con, options.urildap[i]);
-			if (options.verbose&1 && res == LDAP_SUCCESS) {
-				printf("ldap_initialization successful (%s)\n", options.urildap[i]);
-			} else if ( res != LDAP_SUCCESS ) {
-				fprintf(stderr, "ldap_initialization to %s failed %s\n", options.urildap[i], ldap_err2string(res));
-				ldap_con = NULL;
-				return res;
-			}
-			version = LDAP_VERSION3;
-			if ( (res = ldap_set_option(ldap_con, LDAP_OPT_PROTOCOL_VERSION, &version)) != LDAP_SUCCESS ) {
-				fprintf(stderr, "ldap_set_option to %s failed with err %s!\n", options.urildap[i], ldap_err2string(res));
-				ldap_con = NULL;
-				return res;
-			}
-			if ( options.use_tls[i] && (res = ldap_start_tls_s( ldap_con, NULL, NULL )) != LDAP_SUCCESS ) {
-				fprintf(stderr, "ldap_start_tls_s to %s failed with err %s!\n", options.urildap[i], ldap_err2string(res));
-				ldap_con = NULL;
-				return res;
-			}
 
-			// Yes, you really do use ldap_sasl_bind_s() when doing a simple
-			// bind. This is apparently the "new" way, if not entirely obvious
-			if (strlen(options.binddn)) {
-				if (strlen(options.password)) {
-					creds->bv_len = strlen(options.password);
-					creds->bv_val = options.password;
-				}
-				// FIXME: Allow *real* SASL binds
-				if ((res = ldap_sasl_bind_s(ldap_con, options.binddn, NULL, creds, NULL, NULL, &msgid)) != LDAP_SUCCESS) {
-					fprintf(stderr, "LDAP bind problem:\n\t%s\n", ldap_err2string(res));
-					fprintf(stderr, "Attempting to continue with anonymous credentials.\n");
-					res = LDAP_SUCCESS;
-				}
+/* Wait until time until (0 for ever), or until a refresh is requested */
+static void wait_events(time_t until)
+{
+#ifdef __linux__
+	struct itimerspec its;
+	struct epoll_event ev;
+	struct signalfd_siginfo si;
+	unsigned long long expirations;
+
+	if (events.epoll<0) {
+		sleep_until(until);
+		return;
+	}
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = until;
+	timerfd_settime(events.timer, TFD_TIMER_ABSTIME, &its, NULL);
+	for (;;) {
+		if (epoll_wait(events.epoll, &ev, 1, -1)<1)
+			continue;
+		if (ev.data.fd==events.timer) {
+			read(events.timer, &expirations, sizeof(expirations));
+			if (time(NULL)>=until)
+				return;
+			/* time() can lag behind the timer's clock, give it a moment to catch up */
+			memset(&its, 0, sizeof(its));
+			its.it_value.tv_nsec = 10000000;
+			timerfd_settime(events.timer, 0, &its, NULL);
+		} else if (ev.data.fd==events.signals) {
+			if (read(events.signals, &si, sizeof(si))!=sizeof(si))
+				continue;
+			if (si.ssi_signo==SIGHUP) {
+				request_refresh(NULL);
+				return;
 			}
+			print_stats(stdout);
+			fflush(stdout);
+		} else if (ev.data.fd==events.control && control_command()) {
+			return;
 		}
 	}
-	return res;
+#else
+	if (until)
+		sleep_until(until);
+	else
+		pause();
+#endif
 }
 
-void hosts2uri(void)
+
+/* Lines of "searchbase directory [output]", the output defaults to -o */
+static void read_tenants(const char* filename)
 {
-	int i, t;
-	// Convert any old host:port sets into URIs.  This allows us
-	// to use the more modern ldap_initialize() instead of the
-	// deprecated ldap_init()
-	for (i = 0; i<options.usedhosts; i++) {
-		if ( strlen(options.hostname[i]) > 0) {
-			t = options.useduris++;
-			snprintf(options.urildap[t],
-				sizeof(options.urildap[t]),
-				"ldap://%s:%d",
-				options.hostname[i],
-				options.port[i] ? options.port[i] : LDAP_PORT);
+	char line[512];
+	char output[128];
+	struct tenant* t;
+	FILE* fp;
+	int n;
+
+	if ( !(fp = fopen(filename, "r")) )
+		die_exit("Unable to open tenants file");
+	while (fgets(line, sizeof(line), fp)) {
+		if (line[0]=='#')
+			continue;
+		if ( !(tenants.list = realloc(tenants.list, (tenants.count+1)*sizeof(struct tenant))) )
+			die_exit(NULL);
+		t = &tenants.list[tenants.count];
+		memset(t, 0, sizeof(struct tenant));
+		if ((n = sscanf(line, "%127s %127s %127s", t->searchbase, t->directory, output))<=0)
+			continue;
+		if (n<2) {
+			fprintf(stderr, "[!!]\tNo output directory for tenant %s\n", t->searchbase);
+			exit(1);
+		}
+		t->output = n==3 ? parse_output(output) : options.output;
+		if (!t->output) {
+			fprintf(stderr, "[!!]\tNo output type for tenant %s\n", t->searchbase);
+			exit(1);
+		}
+		tenants.count++;
+	}
+	fclose(fp);
+}
+
+
+/*
+ * Make ds, just decoded, the dataset of tenant t and publish it.  If written
+ * is set, the writers already rendered it while it was decoded.  Returns 0
+ * if nothing was published.
+ */
+static int publish_dataset(struct tenant* t, struct dataset* ds, int numzones, int checksum, int written, const struct timespec* start)
+{
+	const struct dnszone* z;
+	const struct dnsrecord* r;
+	struct dataset* prev;
+	struct snapshot* s = NULL;
+	struct timespec end;
+	int problems;
+
+	prev = t->dataset;
+	t->dataset = ds;
+	if (options.check || dns_udpsock>=0)
+		s = build_snapshot(ds);
+	t->blocked = 0;
+	if (options.check && (problems = check_dataset(ds, s))) {
+		fprintf(stderr, "[**] Warning: %d consistency problem(s) in %s\n", problems, t->searchbase);
+		if (options.check==CHECK_BLOCK) {
+			/* ds holds the records taken over from prev, keep it so the next refresh can reuse them */
+			free_snapshot(s);
+			if (prev)
+				free_dataset(prev);
+			if (options.ldifname[0] && ldifout)
+				fclose(ldifout);
+			ldifout = NULL;
+			t->blocked = 1;
+			return 0;
+		}
+	}
+	if ((!written && !write_outputs(ds))
+	    || (options.output&OUTPUT_DATA && numzones!=0 && checksum!=0 && !publish_tinydns())) {
+		/* as after an LDAP error, but ds is kept so the next refresh can reuse its records */
+		if (s)
+			free_snapshot(s);
+		if (prev)
+			free_dataset(prev);
+		if (options.ldifname[0] && ldifout)
+			fclose(ldifout);
+		ldifout = NULL;
+		t->numzones = -1;
+		t->version = 0;
+		return 0;
+	}
+	t->resign = sign_due;
+	if (dns_udpsock>=0)
+		publish_snapshot(s);
+	else if (s)
+		free_snapshot(s);
+	if (options.output&OUTPUT_DATA && (numzones==0 || checksum==0)) {
+		if (prev)
+			free_dataset(prev);
+		return 0;
+	}
+	if (options.ldifname[0] && ldifout)
+		fclose(ldifout);
+	ldifout = NULL;
+	if (options.snapshot[0])
+		save_dataset(ds, numzones, checksum, hash_outputs(ds));
+	if (leader.sock>=0)
+		feed_publish(ds, numzones, checksum);
+	/* the deltas are lost then, prev is gone on the next refresh */
+	if (options.deltadir[0] && !write_deltas(ds, prev))
+		t->failures++;
+	run_hooks(ds, prev);
+	if (prev)
+		free_dataset(prev);
+	if (options.poll_min)
+		schedule_zones(&t->polls, ds);
+	t->updates++;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	t->lastmsecs = (end.tv_sec-start->tv_sec)*1000 + (end.tv_nsec-start->tv_nsec)/1000000;
+	t->zones = 0;
+	t->records = 0;
+	for (z = ds->zones; z; z = z->next) {
+		t->zones += z->zonenames;
+		for (r = z->records; r; r = r->next)
+			t->records++;
+	}
+	return 1;
+}
+
+
+/* Whether the mtime of directory dir differs from *seen, which is updated */
+static int dir_changed(const char* dir, struct timespec* seen)
+{
+	struct stat st;
+
+	if (stat(dir, &st)!=0 || (st.st_mtim.tv_sec==seen->tv_sec && st.st_mtim.tv_nsec==seen->tv_nsec))
+		return 0;
+	*seen = st.st_mtim;
+	return 1;
+}
+
+
+/* With -K, whether the zones of t need signing again although they did not change */
+static int resign_due(struct tenant* t)
+{
+	if (!options.signkeys[0])
+		return 0;
+	/* keys added or removed, or a signature or key state change due */
+	return dir_changed(options.signkeys, &t->keydir) || (t->resign && time(NULL)>=t->resign);
+}
+
+
+static void open_ldif(void)
+{
+	if (!options.ldifname[0])
+		return;
+	if (options.ldifname[0]=='-')
+		ldifout = stdout;
+	else
+		ldifout = fopen(options.ldifname, "w");
+	if (!ldifout)
+		die_exit("Unable to open LDIF-file for writing");
+	/* written by a writer thread of its own, see ldif_zone() */
+	setvbuf(ldifout, NULL, _IOFBF, 1 << 16);
+}
+
+
+/* LDIF of a dataset loaded from a snapshot, whose zones are not read again */
+static void write_ldif(const struct dataset* ds)
+{
+	const struct dnszone* z;
+
+	open_ldif();
+	ldif_loccodes(ldifout, ds);
+	for (z = ds->zones; z; z = z->next)
+		ldif_zone(ldifout, z);
+	fclose(ldifout);
+	ldifout = NULL;
+}
+
+
+/*
+ * Regenerate the outputs of tenant t if a DNSserial changed, ldap_con must
+ * be bound.  Returns 0 if the search came back empty or failed and nothing
+ * was published.
+ */
+static int refresh(struct tenant* t)
+{
+	struct dataset* ds;
+	struct timespec start;
+	int numzones;
+	int checksum;
+	int resign;
+	int opened = 1;
+
+	if (t->numforced)
+		apply_forced(t);
+	t->checks++;
+	ldap_error = LDAP_SUCCESS;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	resign = resign_due(t);
+	calc_checksum(&numzones, &checksum);
+	if (ldap_error)
+		return 0;
+	if (numzones==t->numzones && checksum==t->checksum) {
+		if (!resign)
+			return 1;
+		/* unchanged zones are taken over from t->dataset, mostly keeping their signatures */
+		if (options.verbose&1)
+			printf("DNSSEC keys changed or signatures are due for renewal\n");
+	} else if (options.verbose&1)
+		printf("DNSserial has changed in LDAP zone(s)\n");
+	t->numzones = numzones;
+	t->checksum = checksum;
+	open_ldif();
+	ds = xcalloc(1, sizeof(struct dataset));
+	read_loccodes(ds);
+	/* with --check=block the outputs are only written once the check passed */
+	if (options.check!=CHECK_BLOCK)
+		opened = writers_start(ds);
+	if (opened && ldap_error==LDAP_SUCCESS) {
+		if (options.pipeline)
+			read_dnszones_pipelined(ds, t->dataset);
+		else
+			read_dnszones(ds, t->dataset);
+	}
+	if (opened && !ldap_error && options.reverse) {
+		synthesize_ptrs(ds);
+		writers_push_held(ds);
+	}
+	if (ldap_error)
+		writers_abort();
+	else if (opened && writers_finish())
+		return publish_dataset(t, ds, numzones, checksum, options.check!=CHECK_BLOCK, &start);
+	/* keep what was published; the next attempt reads everything again */
+	if (options.ldifname[0] && ldifout)
+		fclose(ldifout);
+	ldifout = NULL;
+	return_records(ds, t->dataset);
+	free_dataset(ds);
+	t->numzones = -1;
+	return 0;
+}
+
+
+/*
+ * Follower counterpart of refresh(): take over the dataset of a leader if
+ * it has a newer one.  Returns 0 if no leader answered or nothing was published.
+ */
+static int follow(struct tenant* t)
+{
+	struct snapreader r;
+	struct dataset* ds;
+	struct timespec start;
+	unsigned char* reply;
+	unsigned int epoch, version;
+	size_t len;
+	int numzones;
+	int checksum;
+
+	t->checks++;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	/* with signatures due for renewal, have the leader send its dataset even if we hold it */
+	if ( !(reply = feed_fetch(t->dataset, t->epoch, resign_due(t) ? 0 : t->version, &len)) )
+		return 0;
+	r.p = reply;
+	r.end = reply+len;
+	r.bad = 0;
+	if (snap_get32(&r)!=SNAPSHOT_MAGIC || snap_get32(&r)!=SNAPSHOT_VERSION) {
+		fprintf(stderr, "[**] Warning: the leader does not speak this version\n");
+		free(reply);
+		return 0;
+	}
+	epoch = snap_get32(&r);
+	version = snap_get32(&r);
+	numzones = snap_get32(&r);
+	checksum = snap_get32(&r);
+	if (snap_get32(&r)!=FEED_DATASET || r.bad) {
+		free(reply);
+		return !r.bad;
+	}
+	if (options.verbose&1)
+		printf("Leader has version %u, %lu bytes received\n", version, (unsigned long)len);
+	ds = snap_getdataset(&r, t->dataset);
+	if (!ds || r.p!=r.end) {
+		fprintf(stderr, "[**] Warning: truncated or corrupt dataset from the leader\n");
+		if (ds)
+			free_dataset(ds);
+		free(reply);
+		return 0;
+	}
+	free(reply);
+	if (options.reverse)
+		synthesize_ptrs(ds);
+	t->epoch = epoch;
+	t->version = version;
+	t->numzones = numzones;
+	t->checksum = checksum;
+	return publish_dataset(t, ds, numzones, checksum, 0, &start);
+}
+
+
+/* When t needs attention next, for a refresh or to poll a zone */
+static time_t tenant_next(const struct tenant* t)
+{
+	time_t next = pollq_next(&t->polls);
+
+	if (!next || t->due<next)
+		next = t->due;
+	return next<t->retry ? t->retry : next;
+}
+
+
+static void disconnect(void)
+{
+	int ldaperr;
+
+	ldaperr = ldap_unbind_ext_s(ldap_con, NULL, NULL);
+	ldap_con = NULL;
+	if (ldaperr!=LDAP_SUCCESS)
+		ldap_failed(ldaperr);
+}
+
+
+static void* tenant_worker(void* arg)
+{
+	struct config base = options;
+	struct tenant* t;
+	struct tenant* c;
+	time_t now;
+	int full, failed;
+	int res;
+	int i;
+
+	pthread_mutex_lock(&tenants.lock);
+	for (;;) {
+		t = NULL;
+		for (i = 0; i<tenants.count; i++) {
+			c = &tenants.list[i];
+			if (!c->busy && !c->done && (!t || tenant_next(c)<tenant_next(t)))
+				t = c;
+		}
+		if (!t) {
+			if (!base.is_daemon)
+				break;
+			pthread_cond_wait(&tenants.changed, &tenants.lock);
+			continue;
+		}
+		time(&now);
+		if (tenant_next(t)>now) {
+			struct timespec until = { tenant_next(t), 0 };
+			if (ldap_con) {
+				/* nothing due, do not keep the server busy meanwhile */
+				pthread_mutex_unlock(&tenants.lock);
+				disconnect();
+				pthread_mutex_lock(&tenants.lock);
+				continue;
+			}
+			pthread_cond_timedwait(&tenants.changed, &tenants.lock, &until);
+			continue;
+		}
+		t->busy = 1;
+		pthread_mutex_unlock(&tenants.lock);
+
+		options = base;
+		strcpy(options.searchbase, t->searchbase);
+		strcpy(options.directory, t->directory);
+		options.output = t->output;
+		set_datadir(t->directory);
+		full = failed = 0;
+		if (!ldap_con && ((res = do_connect())!=LDAP_SUCCESS || ldap_con==NULL)) {
+			fprintf(stderr, "Warning - Problem while connecting to LDAP server:\n\t%s\n", ldap_err2string(res));
+			failed = 1;
+		} else if (t->due<=now || poll_zones(&t->polls)) {
+			full = 1;
+			if (!refresh(t)) {
+				fprintf(stderr, "[**] Warning: Nothing published for %s\n", t->searchbase);
+				failed = 1;
+			}
+		} else if (ldap_error) {
+			failed = 1;
+		}
+		if (failed)
+			t->failures++;
+		if (ldap_error && ldap_con)
+			disconnect();
+		if ((full || failed) && options.verbose&1) {
+			print_tenant(stdout, t);
+			if (options.is_daemon)
+				print_memory(stdout);
 		}
+
+		pthread_mutex_lock(&tenants.lock);
+		t->busy = 0;
+		t->done = !base.is_daemon;
+		if (full || failed)
+			t->due = time(NULL)+base.update_iv;
+		if (failed)
+			t->retry = t->due;
+		pthread_cond_broadcast(&tenants.changed);
 	}
+	pthread_mutex_unlock(&tenants.lock);
+	if (ldap_con)
+		disconnect();
+	return NULL;
+}
+
+
+static void run_tenants(void)
+{
+	pthread_t workers[TENANT_WORKERS];
+	int n = tenants.count<TENANT_WORKERS ? tenants.count : TENANT_WORKERS;
+	int i;
+
+	for (i = 0; i<n; i++)
+		if (start_thread(&workers[i], tenant_worker, NULL)!=0)
+			die_exit("Unable to start tenant worker");
+	if (options.is_daemon)
+		for (;;)
+			wait_events(0);
+	for (i = 0; i<n; i++)
+		pthread_join(workers[i], NULL);
 }
 
 
 int main(int argc, char** argv)
 {
-	int soa_numzones;
-	int soa_checksum;
-	int old_numzones;
-	int old_checksum;
+	struct tenant single;
+	unsigned long long outputhash;
 	int res;
 
+#ifdef ADDRBENCH
+	return addr_bench(argc, argv);
+#endif
 	umask(022);
 	main_argc = argc;
 	main_argv = argv;
 	parse_options();
+	if (options.tenants[0])
+		read_tenants(options.tenants);
 
-	if (!options.output) {
+	if (!options.output && !options.listen[0] && !options.leader[0] && !tenants.count) {
 		fprintf(stderr, "[!!]\tMust select an output type (\"bind\" or \"tinydns\")\n");
 		fprintf(stderr, "Use --help to see usage information\n");
 		exit(1);
 	}
 
-	if (!strlen(options.searchbase)) {
+	if (!strlen(options.searchbase) && !tenants.count && !options.follow[0]) {
 		fprintf(stderr, "[!!]\tMust provide the base DN for the search.\n");
 		fprintf(stderr, "Use --help to see usage information\n");
 		exit(1);
 	}
 
+	if (tenants.count && (options.listen[0] || options.snapshot[0] || options.ldifname[0] || options.leader[0] || options.follow[0])) {
+		fprintf(stderr, "[**] Warning: -l, -s, -L, -R and -g are not used with -T, ignoring them.\n");
+		options.listen[0] = '\0';
+		options.snapshot[0] = '\0';
+		options.ldifname[0] = '\0';
+		options.leader[0] = '\0';
+		options.follow[0] = '\0';
+	}
+
+#ifndef DNSSEC
+	if (options.signkeys[0]) {
+		fprintf(stderr, "[!!]\tThis ldap2dns was built without DNSSEC support, rebuild it with make DNSSEC=1\n");
+		exit(1);
+	}
+#endif
+	if (options.signkeys[0] && !(options.output&OUTPUT_DB) && !tenants.count) {
+		fprintf(stderr, "[**] Warning: -K only signs BIND zone files, ignoring it.\n");
+		options.signkeys[0] = '\0';
+	}
+
+	/* the leader's dataset lacks the DNs of the records */
+	if (options.follow[0] && options.ldifname[0]) {
+		fprintf(stderr, "[**] Warning: -L is not used with -g, ignoring it.\n");
+		options.ldifname[0] = '\0';
+	}
+
 
 	/* Initialization complete.  If we're in daemon mode, fork and continue */
 	if (options.is_daemon) {
@@ -1310,16 +8972,92 @@ int main(int argc, char** argv)
 		/* lowest priority */
 		nice(19);
 	}
-	set_datadir();
+	set_datadir(NULL);
 
 	/* Convert our list of hosts into ldap_initialize() compatible URIs */
 	hosts2uri();
 
+#ifdef __linux__
+	if (options.is_daemon)
+		events_init();
+	else
+#endif
+	if (options.control[0])
+		fprintf(stderr, "[**] Warning: -c is only used in daemon mode on Linux, ignoring it.\n");
+
+	if (tenants.count) {
+		run_tenants();
+		for (res = 0; res<tenants.count; res++)
+			if (tenants.list[res].blocked)
+				return 1;
+		return 0;
+	}
+
+	if (options.listen[0]) {
+		if (options.is_daemon)
+			start_responder();
+		else
+			fprintf(stderr, "[**] Warning: -l is only used in daemon mode, not answering queries.\n");
+	}
+	if (options.leader[0]) {
+		if (options.is_daemon)
+			start_leader();
+		else
+			fprintf(stderr, "[**] Warning: -R is only used in daemon mode, not leading followers.\n");
+	}
+
+	memset(&single, 0, sizeof(single));
+	strcpy(single.searchbase, options.follow[0] ? options.follow : options.searchbase);
+	single.output = options.output;
+	tenants.list = &single;
+	tenants.count = 1;
+
+	/* Warm start: serve and keep the outputs of the last run until LDAP changes */
+	if (options.snapshot[0] && (single.dataset = load_dataset(&single.numzones, &single.checksum, &outputhash))) {
+		if (options.verbose&1)
+			printf("Loaded %d zones from snapshot %s\n", single.numzones, options.snapshot);
+		if (options.reverse)
+			synthesize_ptrs(single.dataset);
+		if (dns_udpsock>=0)
+			publish_snapshot(build_snapshot(single.dataset));
+		/* signed zones are written again, the signatures are not in the snapshot */
+		if (options.output && (hash_outputs(single.dataset)!=outputhash || options.signkeys[0])) {
+			if (options.verbose&1)
+				printf("Outputs differ from snapshot, regenerating them\n");
+			if (!write_outputs(single.dataset)
+			    || (options.output&OUTPUT_DATA && single.numzones!=0 && single.checksum!=0 && !publish_tinydns()))
+				single.numzones = -1;	/* written again by the first refresh */
+			single.resign = sign_due;
+		}
+		if (options.ldifname[0])
+			write_ldif(single.dataset);
+		if (options.poll_min)
+			schedule_zones(&single.polls, single.dataset);
+	}
+
+	/* Follower: the leader's dataset takes the place of LDAP */
+	if (options.follow[0]) {
+		for (;;) {
+			unsigned long updates = single.updates;
+
+			if (single.due<=time(NULL)) {
+				if (!follow(&single)) {
+					single.failures++;
+					if (options.is_daemon==0)
+						return 1;
+				}
+				single.due = time(NULL)+options.update_iv;
+			}
+			if (options.is_daemon==0)
+				return single.blocked;
+			if (single.updates!=updates && options.verbose&1)
+				print_memory(stdout);
+			wait_events(single.due);
+		}
+	}
+
 	/* Main loop */
 	for (;;) {
-		int ldaperr = -1;
-
-			
 		res = do_connect();
 		if (res != LDAP_SUCCESS || ldap_con == NULL) {
 			fprintf(stderr, "Warning - Problem while connecting to LDAP server:\n\t%s\n", ldap_err2string(res));
@@ -1328,50 +9066,24 @@ int main(int argc, char** argv)
 			sleep(options.update_iv);
 			continue;
 		}
-		calc_checksum(&old_numzones, &old_checksum);
-		if (old_numzones!=soa_numzones || old_checksum!=soa_checksum) {
-			if (options.verbose&1)
-				printf("DNSserial has changed in LDAP zone(s)\n");
-			soa_numzones = old_numzones;
-			soa_checksum = old_checksum;
-		} else {
-			goto skip;
-		}
-		if (options.ldifname[0]) {
-			if (options.ldifname[0]=='-')
-				ldifout = stdout;
-			else
-				ldifout = fopen(options.ldifname, "w");
-			if (!ldifout)
-				die_exit("Unable to open LDIF-file for writing");
-		}
-		time(&time_now);
-		if ( options.output&OUTPUT_DATA && !(tinyfile = fopen(tinydns_texttemp, "w")) )
-			die_exit("Unable to open file 'data.temp' for writing");
-		if ( options.output&OUTPUT_DB && !(namedmaster = fopen("named.zones", "w")) )
-			die_exit("Unable to open file 'named.zones' for writing");
-		read_loccodes();
-		read_dnszones();
-		if (namedmaster)
-			fclose(namedmaster);
-		if (tinyfile) {
-			fclose(tinyfile);
-			if (soa_numzones==0 || soa_checksum==0)
-				break;
-			if (rename(tinydns_texttemp, tinydns_textfile)==-1)
-				die_exit("Unable to move 'data.temp' to 'data'");
+		if (single.due<=time(NULL) || poll_zones(&single.polls)) {
+			if (!refresh(&single)) {
+				/* outputs which could not be written fail the run */
+				if (options.is_daemon==0)
+					return ldap_error==LDAP_SUCCESS ? 1 : single.blocked;
+				/* the daemon carries on with what it published last */
+				single.failures++;
+			}
+			single.due = time(NULL)+options.update_iv;
+			if (options.is_daemon && options.verbose&1)
+				print_memory(stdout);
+		} else if (ldap_error) {
+			single.failures++;
 		}
-		if (options.ldifname[0] && ldifout)
-			fclose(ldifout);
-		if (options.exec_command[0])
-			system(options.exec_command);
-	    skip:
-		if ( (ldaperr = ldap_unbind_ext_s(ldap_con, NULL, NULL))!=LDAP_SUCCESS )
-			die_ldap(ldaperr);
+		disconnect();
 		if (options.is_daemon==0)
 			break;
-		sleep(options.update_iv);
+		wait_events(tenant_next(&single));
 	}
-	return 0;
+	return single.blocked;
 }
-
@@ -0,0 +1,217 @@
+#!/usr/bin/perl
+# Check that the -X difference files turn the old zone files into the new ones
+# $Id$
+#
+# usage: deltacheck.pl [-v] [-k] [-c command] ldap2dns options...
+#
+# ldap2dns is run twice with the options given, which select the directory,
+# and -o bind -s snapshot -X deltadir in a temporary directory, e.g.
+#
+#	deltacheck.pl -c 'ldapmodify -f change.ldif' ./ldap2dns -H ldap://localhost -b ou=DNS,dc=example,dc=com
+#
+# Between the runs the command given with -c changes some zones in the
+# directory; without -c the script waits until return is pressed.  For every
+# zone.update and zone.ixfr written by the second run, the difference is
+# applied to the zone.db of the first run and the result is compared with the
+# zone.db of the second run: the ixfr file line by line, the nsupdate batch
+# as the set of records it leaves.  A zone file which changed without a
+# difference file is an error too.  An ixfr file without SOA records, for a
+# zone which lacks SOA timers, cannot tell deletions from additions and is
+# only counted.  With -k the temporary directory is kept and its name
+# printed.  Exits with status 1 if any difference does not apply.
+
+use strict;
+use Getopt::Std;
+use File::Temp qw(tempdir);
+
+my %opts;
+getopts('vkc:h', \%opts);
+if ($opts{h} || !@ARGV) {
+	print "usage: $0 [-v] [-k] [-c command] ldap2dns options...\n";
+	exit(1);
+}
+my ($program, @args) = @ARGV;
+
+my $dir = tempdir(CLEANUP => !$opts{k});
+my $failed = 0;
+
+sub run {
+	my ($name) = @_;
+	mkdir("$dir/$name");
+	mkdir("$dir/delta");
+	my $pid = fork();
+	die "Unable to fork: $!\n" unless (defined($pid));
+	if ($pid==0) {
+		chdir("$dir/$name");
+		open(STDOUT, '>', '/dev/null') unless ($opts{v});
+		exec($program, @args, '-o', 'bind', '-s', "$dir/snapshot", '-X', "$dir/delta")
+			or die "Unable to run $program: $!\n";
+	}
+	waitpid($pid, 0);
+	die "$program failed in the $name run\n" if ($?);
+}
+
+sub problem {
+	my ($zone, $msg) = @_;
+	print "$zone: $msg\n";
+	$failed = 1;
+	return undef;
+}
+
+# The serial, $TTL and the record lines of a zone file, the SOA left out
+sub zonefile {
+	my ($file) = @_;
+	my ($serial, $ttl, $soa) = ('', '', 0);
+	my @lines;
+
+	open(my $fh, '<', $file) or return undef;
+	while (my $line = <$fh>) {
+		chomp($line);
+		if ($soa) {
+			$serial = $1 if ($line =~ /^\s*(\d+)\s*; Serial/);
+			$soa = 0 if ($line =~ /\)/);
+		} elsif ($line =~ /^\S+ IN SOA /) {
+			$soa = 1;
+		} elsif ($line =~ /^\$TTL\s+(\d+)/) {
+			$ttl = $1;
+		} elsif ($line ne '' && $line !~ /^;/) {
+			push(@lines, $line);
+		}
+	}
+	close($fh);
+	return { serial => $serial, ttl => $ttl || 3600, lines => \@lines };
+}
+
+sub serial {
+	my ($soa) = @_;
+	return (split(/\s+/, $soa))[6];
+}
+
+# Name, class, type and data of a record, and its TTL, as nsupdate sees them
+sub record {
+	my ($owner, $ttl, $rest, $default) = @_;
+	$rest =~ s/\s+/ /g;
+	$rest =~ s/^ | $//g;
+	return (lc($owner) . " $rest", $ttl eq '' ? $default : $ttl);
+}
+
+sub records {
+	my ($z) = @_;
+	my %set;
+	foreach my $line (@{$z->{lines}}) {
+		my ($owner, $ttl, $rest) = split(/\t/, $line, 3);
+		my ($key, $t) = record($owner, $ttl, $rest, $z->{ttl});
+		$set{$key} = $t;
+	}
+	return \%set;
+}
+
+sub check_ixfr {
+	my ($zone, $file, $old, $new) = @_;
+	my (@soa, @deleted, @added);
+	my %count;
+
+	open(my $fh, '<', $file) or return problem($zone, "unable to read $file");
+	while (my $line = <$fh>) {
+		chomp($line);
+		next if ($line =~ /^;/ || $line eq '');
+		if ($line =~ /\tIN SOA\t/) {
+			push(@soa, $line);
+		} elsif (@soa<2) {
+			push(@deleted, $line);
+		} else {
+			push(@added, $line);
+		}
+	}
+	close($fh);
+	return 0 if (!@soa);
+	return problem($zone, "ixfr holds " . scalar(@soa) . " SOA records") if (@soa!=2);
+	return problem($zone, "ixfr starts at serial " . serial($soa[0]) . ", not $old->{serial}")
+		if (serial($soa[0]) ne $old->{serial});
+	return problem($zone, "ixfr ends at serial " . serial($soa[1]) . ", not $new->{serial}")
+		if (serial($soa[1]) ne $new->{serial});
+	$count{$_}++ foreach (@{$old->{lines}});
+	foreach my $line (@deleted) {
+		return problem($zone, "ixfr deletes a record not in the old zone: $line") if (!$count{$line});
+		$count{$line}--;
+	}
+	$count{$_}++ foreach (@added);
+	$count{$_}-- foreach (@{$new->{lines}});
+	foreach my $line (sort(keys(%count))) {
+		return problem($zone, "ixfr leaves " . ($count{$line}>0 ? "an extra" : "a missing") . " record: $line")
+			if ($count{$line});
+	}
+	return 1;
+}
+
+sub check_update {
+	my ($zone, $file, $old, $new) = @_;
+	my $set = records($old);
+	my $want = records($new);
+	my $sent = 0;
+
+	open(my $fh, '<', $file) or return problem($zone, "unable to read $file");
+	while (my $line = <$fh>) {
+		chomp($line);
+		next if ($line =~ /^;/ || $line eq '');
+		if ($line =~ /^zone (\S+)$/) {
+			return problem($zone, "update is for zone $1") if (lc($1) ne lc("$zone."));
+		} elsif ($line eq 'send') {
+			$sent = 1;
+		} elsif ($line =~ /^update delete (\S+) (.*)$/) {
+			my ($key) = record($1, '', $2, '');
+			return problem($zone, "update deletes a record not in the old zone: $line") if (!exists($set->{$key}));
+			delete($set->{$key});
+		} elsif ($line =~ /^update add (\S+) (\d+) (IN SOA .*)$/) {
+			return problem($zone, "update sets serial " . (split(/ /, $3))[4] . ", not $new->{serial}")
+				if ((split(/ /, $3))[4] ne $new->{serial});
+		} elsif ($line =~ /^update add (\S+) (\d+) (.*)$/) {
+			my ($key, $ttl) = record($1, $2, $3, '');
+			$set->{$key} = $ttl;
+		} else {
+			return problem($zone, "unexpected update line: $line");
+		}
+	}
+	close($fh);
+	return problem($zone, "update is not sent") if (!$sent);
+	foreach my $key (sort(keys(%$set), keys(%$want))) {
+		return problem($zone, "update leaves an extra record: $key") if (!exists($want->{$key}));
+		return problem($zone, "update leaves a missing record: $key") if (!exists($set->{$key}));
+		return problem($zone, "update leaves TTL $set->{$key} instead of $want->{$key}: $key")
+			if ($set->{$key} ne $want->{$key});
+	}
+	return 1;
+}
+
+run('old');
+if ($opts{c}) {
+	system($opts{c})==0 or die "$opts{c} failed\n";
+} else {
+	print "change some zones in the directory, then press return\n";
+	<STDIN>;
+}
+run('new');
+
+my ($checked, $nosoa) = (0, 0);
+opendir(my $dh, "$dir/new") or die "Unable to read $dir/new: $!\n";
+foreach my $file (sort(readdir($dh))) {
+	next unless ($file =~ /^(.+)\.db$/);
+	my $zone = $1;
+	my $old = zonefile("$dir/old/$file");
+	my $new = zonefile("$dir/new/$file");
+	next if (!$old);
+	if (!-e "$dir/delta/$zone.update") {
+		problem($zone, "the zone changed without a difference file")
+			if (join("\n", sort(@{$old->{lines}})) ne join("\n", sort(@{$new->{lines}})));
+		next;
+	}
+	my $ixfr = check_ixfr($zone, "$dir/delta/$zone.ixfr", $old, $new);
+	my $update = check_update($zone, "$dir/delta/$zone.update", $old, $new);
+	$checked++;
+	$nosoa++ if (defined($ixfr) && $ixfr==0);
+	print "$zone: serial $old->{serial} -> $new->{serial} applies\n" if ($opts{v} && defined($ixfr) && $update);
+}
+closedir($dh);
+print "$checked zones changed, $nosoa ixfr files without SOA not applied, " . ($failed ? "FAILED" : "all differences apply") . "\n";
+print "files kept in $dir\n" if ($opts{k});
+exit($failed);
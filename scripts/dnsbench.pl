@@ -0,0 +1,103 @@
+#!/usr/bin/perl
+# Query load generator for the ldap2dnsd built-in responder (-l option)
+# $Id$
+#
+# usage: dnsbench.pl [-s server] [-p port] [-n queries] [-w window] [-t secs] \
+#                    name[/type] ...
+#
+# Names may also be given on stdin, one per line.  Queries are sent over UDP
+# keeping up to "window" of them outstanding, cycling through the names until
+# "queries" answers have been received or "secs" seconds have passed.
+
+use strict;
+use IO::Socket::INET;
+use IO::Select;
+use Getopt::Std;
+use Time::HiRes qw(time);
+
+my %TYPES = (A => 1, NS => 2, CNAME => 5, SOA => 6, PTR => 12, MX => 15,
+	TXT => 16, AAAA => 28, SRV => 33, ANY => 255);
+my %RCODES = (0 => 'NOERROR', 1 => 'FORMERR', 2 => 'SERVFAIL', 3 => 'NXDOMAIN',
+	4 => 'NOTIMP', 5 => 'REFUSED');
+
+my %opts;
+getopts('s:p:n:w:t:h', \%opts);
+if ($opts{h}) {
+	print "usage: $0 [-s server] [-p port] [-n queries] [-w window] [-t secs] name[/type] ...\n";
+	exit 0;
+}
+my $server = $opts{s} || '127.0.0.1';
+my $port = $opts{p} || 53;
+my $total = $opts{n} || 100000;
+my $window = $opts{w} || 64;
+my $limit = $opts{t} || 60;
+
+my @names = @ARGV;
+if (!@names) {
+	while (<STDIN>) {
+		chomp;
+		push(@names, $_) if /\S/;
+	}
+}
+die "No query names given\n" unless @names;
+
+my @queries;
+foreach my $q (@names) {
+	my ($name, $type) = split(m#/#, $q);
+	$type = uc($type || 'A');
+	die "Unknown query type $type\n" unless $TYPES{$type};
+	my $wire = '';
+	foreach my $label (split(/\./, $name)) {
+		$wire .= chr(length($label)) . $label;
+	}
+	push(@queries, $wire . "\0" . pack('nn', $TYPES{$type}, 1));
+}
+
+my $sock = IO::Socket::INET->new(PeerAddr => $server, PeerPort => $port,
+	Proto => 'udp') or die "Unable to create socket: $!\n";
+my $sel = IO::Select->new($sock);
+
+my (%pending, @latency, %rcodes);
+my ($sent, $received, $timeouts, $id) = (0, 0, 0, 0);
+my $start = time();
+while ($received + $timeouts < $total && time() - $start < $limit) {
+	while (keys(%pending) < $window && $sent < $total) {
+		$id = ($id + 1) & 0xffff;
+		next if exists $pending{$id};
+		$sock->send(pack('nnnnnn', $id, 0x0100, 1, 0, 0, 0) . $queries[$sent % @queries]);
+		$pending{$id} = time();
+		$sent++;
+	}
+	if ($sel->can_read(0.5)) {
+		my $buf;
+		$sock->recv($buf, 65535);
+		next if length($buf) < 12;
+		my ($rid, $flags) = unpack('nn', $buf);
+		next unless exists $pending{$rid};
+		push(@latency, time() - $pending{$rid});
+		delete $pending{$rid};
+		$rcodes{$RCODES{$flags & 0xf} || ($flags & 0xf)}++;
+		$received++;
+	} else {
+		# anything outstanding for more than a second is lost
+		foreach my $p (keys %pending) {
+			if (time() - $pending{$p} > 1) {
+				delete $pending{$p};
+				$timeouts++;
+			}
+		}
+	}
+}
+my $elapsed = time() - $start;
+
+@latency = sort { $a <=> $b } @latency;
+sub pct { my $p = shift; return @latency ? $latency[int($p * $#latency)] * 1000 : 0; }
+printf("queries sent:     %d\n", $sent);
+printf("answers received: %d (%d lost)\n", $received, $timeouts);
+printf("elapsed:          %.3f s\n", $elapsed);
+printf("throughput:       %.0f queries/s\n", $received / ($elapsed || 1));
+printf("latency (ms):     min %.3f  p50 %.3f  p90 %.3f  p99 %.3f  max %.3f\n",
+	pct(0), pct(0.5), pct(0.9), pct(0.99), pct(1));
+foreach my $rc (sort keys %rcodes) {
+	printf("  %-10s %d\n", $rc, $rcodes{$rc});
+}
@@ -0,0 +1,111 @@
+#!/usr/bin/perl
+# Run a leader and several followers locally and check they all agree
+# $Id$
+#
+# usage: fleet.pl [-v] [-n followers] [-u seconds] [-t timeout] [-c changes] ldap2dns options...
+#
+# ldap2dns is started as a foreground daemon with the options given, which
+# select the directory, and -o tinydns -R, leading followers on a unix socket
+# in a temporary directory, e.g.
+#
+#	fleet.pl -n 8 ./ldap2dns -H ldap://localhost -b ou=DNS,dc=example,dc=com
+#
+# The followers are started with -o tinydns -g and poll the leader every -u
+# seconds (default 1), each writing into a directory of its own.  The test
+# passes once the data file of every follower is the same as the leader's.
+# With -c, the leader is then asked to fetch every zone again that many times
+# through its control socket, and the followers must catch up each time;
+# change some zones in the directory meanwhile to watch only those travel
+# (see the "follower:" lines printed with -v).  Exits with status 1 if the
+# followers do not agree with the leader within -t seconds (default 30).
+
+use strict;
+use Getopt::Std;
+use IO::Socket::UNIX;
+use File::Temp qw(tempdir);
+use Time::HiRes qw(sleep time);
+
+my %opts;
+getopts('vn:u:t:c:h', \%opts);
+if ($opts{h} || !@ARGV) {
+	print "usage: $0 [-v] [-n followers] [-u seconds] [-t timeout] [-c changes] ldap2dns options...\n";
+	exit(1);
+}
+my $followers = $opts{n} || 3;
+my $interval = $opts{u} || 1;
+my $timeout = $opts{t} || 30;
+my $changes = $opts{c} || 0;
+my ($program, @args) = @ARGV;
+
+my $dir = tempdir(CLEANUP => 1);
+my @pids;
+
+sub start {
+	my ($name, @cmd) = @_;
+	mkdir("$dir/$name");
+	my $pid = fork();
+	die "Unable to fork: $!\n" unless (defined($pid));
+	if ($pid==0) {
+		chdir("$dir/$name");
+		$ENV{TINYDNSDIR} = "$dir/$name";
+		open(STDOUT, '>', '/dev/null') unless ($opts{v});
+		exec($program, @cmd) or die "Unable to run $program: $!\n";
+	}
+	push(@pids, $pid);
+}
+
+sub stop {
+	kill('TERM', @pids);
+	waitpid($_, 0) foreach (@pids);
+}
+
+sub slurp {
+	my ($file) = @_;
+	open(my $fh, '<', $file) or return undef;
+	local $/;
+	my $data = <$fh>;
+	close($fh);
+	return $data;
+}
+
+# Seconds until every follower has the leader's data file, undef on timeout
+sub converge {
+	my $start = time();
+	while (time()-$start<$timeout) {
+		my $data = slurp("$dir/leader/data");
+		if (defined($data) && !grep { (slurp("$dir/f$_/data") // '') ne $data } (1..$followers)) {
+			return time()-$start;
+		}
+		sleep(0.1);
+	}
+	return undef;
+}
+
+start("leader", @args, '-d', '-f', '-o', 'tinydns', '-R', "$dir/feed", '-c', "$dir/control");
+for (my $i = 0; $i<100 && !-S "$dir/feed"; $i++) {
+	sleep(0.1);
+}
+start("f$_", '-d', '-f', '-u', $interval, '-o', 'tinydns', '-g', "$dir/feed") foreach (1..$followers);
+
+my $failed = 0;
+for (my $c = 0; $c<=$changes && !$failed; $c++) {
+	if ($c>0) {
+		foreach my $zone (split(/\n/, slurp("$dir/leader/data"))) {
+			next unless ($zone =~ /^Z([^:]+):/);
+			my $s = IO::Socket::UNIX->new(Type => SOCK_STREAM, Peer => "$dir/control") or next;
+			print $s "refresh zone $1\n";
+			local $/;
+			<$s>;
+			close($s);
+		}
+	}
+	my $secs = converge();
+	if (defined($secs)) {
+		printf("%s: %d followers agree with the leader after %.1f s\n", $c ? "change $c" : "start", $followers, $secs);
+	} else {
+		print "followers do not agree with the leader after $timeout s\n";
+		$failed = 1;
+	}
+}
+stop();
+exit($failed);
@@ -0,0 +1,283 @@
+#!/usr/bin/perl
+# Put a slow or faulty network between ldap2dns and its LDAP server
+# $Id$
+#
+# usage: ldapfault.pl [-l port] [-u host:port] [-r ms] [-w bytes/s] [-s ms]
+#                     [-k entries] [-e entries] [-m n]
+#                     [-v] [-n cycles] [-d] [-z zone,...] [ldap2dns options...]
+#
+# A TCP proxy listens on 127.0.0.1 port -l (default 3389) and passes every
+# connection on to the plain LDAP server at -u (default 127.0.0.1:389),
+# e.g. a local slapd holding a copy of the directory.  It reads the LDAP
+# messages going either way and can make the link worse:
+#
+#	-r ms		round trip time added, half of it in each direction
+#	-w bytes/s	bandwidth of the link, in each direction
+#	-s ms		delay of the server before it starts on a search
+#	-k entries	drop the connection after that many search entries
+#	-e entries	end each search after that many entries with a
+#			sizeLimitExceeded result, dropping the rest
+#	-m n		only make every n-th connection fail with -k or -e
+#
+# Without ldap2dns options the proxy just runs until it is interrupted.
+# Otherwise ldap2dns is run with them, pointed at the proxy with -h and -p,
+# so they should not include -H, e.g.
+#
+#	ldapfault.pl -r 80 -w 1000000 -u localhost:389 ./ldap2dns -o tinydns \
+#		-b ou=DNS,dc=example,dc=com
+#
+# ldap2dns is run -n times (default 5) in a temporary directory, and the
+# time each run took and how it exited is printed.  With -d it is started
+# once as a foreground daemon with a control socket instead, and each of
+# the -n cycles asks for a refresh and waits for it to finish; with -z the
+# zones in the list are fetched again as if their DNSserial had changed.
+# The time of every refresh is printed, and whether it failed.  The daemon
+# must survive the faults: should it exit, the test fails with exit status 1.
+
+use strict;
+use Getopt::Std;
+use IO::Select;
+use IO::Socket::INET;
+use IO::Socket::UNIX;
+use File::Spec;
+use File::Temp qw(tempdir);
+use POSIX qw(:sys_wait_h);
+use Time::HiRes qw(time sleep);
+
+my %opts;
+getopts('l:u:r:w:s:k:e:m:vn:dz:h', \%opts);
+if ($opts{h}) {
+	print "usage: $0 [-l port] [-u host:port] [-r ms] [-w bytes/s] [-s ms]\n";
+	print "       [-k entries] [-e entries] [-m n]\n";
+	print "       [-v] [-n cycles] [-d] [-z zone,...] [ldap2dns options...]\n";
+	exit(1);
+}
+my $port = $opts{l} || 3389;
+my $upstream = $opts{u} || "127.0.0.1:389";
+my $delay = ($opts{r} || 0)/2000;
+my $bandwidth = $opts{w} || 0;
+my $searchdelay = ($opts{s} || 0)/1000;
+my $killafter = $opts{k} || 0;
+my $sizelimit = $opts{e} || 0;
+my $every = $opts{m} || 1;
+my $cycles = $opts{n} || 5;
+my @zones = $opts{z} ? split(/,/, $opts{z}) : ();
+
+# Length, BER encoded messageID and operation tag of the first complete message in $buf
+sub message {
+	my ($buf) = @_;
+	my ($len, $hdr, $n, $idlen);
+
+	return () if (length($buf)<2);
+	$len = ord(substr($buf, 1, 1));
+	$hdr = 2;
+	if ($len & 0x80) {
+		$n = $len & 0x7f;
+		return () if (length($buf)<2+$n);
+		$len = 0;
+		$len = $len*256 + ord(substr($buf, 2+$_, 1)) foreach (0..$n-1);
+		$hdr += $n;
+	}
+	return () if (length($buf)<$hdr+$len);
+	$idlen = ord(substr($buf, $hdr+1, 1));
+	return ($hdr+$len, substr($buf, $hdr, 2+$idlen), ord(substr($buf, $hdr+2+$idlen, 1)));
+}
+
+# Queue $data to arrive after the link delay, $extra seconds later still; undef closes
+sub send_later {
+	my ($d, $data, $extra) = @_;
+	my $now = time();
+	my $start = $d->{free}>$now ? $d->{free} : $now;
+
+	$d->{free} = $start + ($bandwidth && defined($data) ? length($data)/$bandwidth : 0);
+	my $due = $d->{free} + $delay + $extra;
+	$due = $d->{last} if ($due<$d->{last});
+	$d->{last} = $due;
+	push(@{$d->{queue}}, [ $due, $data ]);
+}
+
+# Pass one connection on, in a process of its own
+sub relay {
+	my ($client, $faulty) = @_;
+	my $server = IO::Socket::INET->new(PeerAddr => $upstream, Proto => 'tcp') or exit(1);
+	my $up = { from => $client, to => $server, in => '', queue => [], free => 0, last => 0 };
+	my $down = { from => $server, to => $client, in => '', queue => [], free => 0, last => 0 };
+	my $sel = IO::Select->new($client, $server);
+	my (%entries, %dropped);
+	my $seen = 0;
+
+	for (;;) {
+		my $now = time();
+		my $next;
+		foreach my $d ($up, $down) {
+			while (@{$d->{queue}} && $d->{queue}[0][0]<=$now) {
+				my $m = shift(@{$d->{queue}});
+				exit(0) unless (defined($m->[1]));
+				for (my $off = 0; $off<length($m->[1]); ) {
+					my $n = syswrite($d->{to}, $m->[1], length($m->[1])-$off, $off);
+					exit(0) unless ($n);
+					$off += $n;
+				}
+			}
+			$next = $d->{queue}[0][0] if (@{$d->{queue}} && (!defined($next) || $d->{queue}[0][0]<$next));
+		}
+		foreach my $fh ($sel->can_read(defined($next) ? $next-$now : undef)) {
+			my $d = $fh==$client ? $up : $down;
+			my $other = $fh==$client ? $down : $up;
+			my $buf;
+			if (!sysread($fh, $buf, 65536)) {
+				# closed, the other side learns of it once all data sent before is there
+				$sel->remove($fh);
+				send_later($other, undef, 0);
+				next;
+			}
+			$d->{in} .= $buf;
+			while (my ($len, $id, $op) = message($d->{in})) {
+				my $msg = substr($d->{in}, 0, $len, '');
+				if ($d==$up) {
+					send_later($d, $msg, $op==0x63 ? $searchdelay : 0);
+					next;
+				}
+				next if ($dropped{$id});
+				if ($faulty && $op==0x64 && $sizelimit && ++$entries{$id}>$sizelimit) {
+					# sizeLimitExceeded in place of the remaining entries
+					my $done = $id."\x65\x07\x0a\x01\x04\x04\x00\x04\x00";
+					send_later($d, "\x30".chr(length($done)).$done, 0);
+					$dropped{$id} = 1;
+					next;
+				}
+				send_later($d, $msg, 0);
+				if ($faulty && $op==0x64 && $killafter && ++$seen>=$killafter) {
+					$sel->remove($server);
+					send_later($d, undef, 0);
+					last;
+				}
+			}
+		}
+	}
+}
+
+sub proxy {
+	my $listen = IO::Socket::INET->new(LocalAddr => '127.0.0.1', LocalPort => $port, Listen => 16, ReuseAddr => 1, Proto => 'tcp')
+		or die "Unable to listen on port $port: $!\n";
+	my $connections = 0;
+
+	$SIG{CHLD} = 'IGNORE';
+	for (;;) {
+		my $client = $listen->accept() or next;
+		$connections++;
+		my $pid = fork();
+		if (defined($pid) && $pid==0) {
+			close($listen);
+			relay($client, $connections % $every==0);
+		}
+		close($client);
+	}
+}
+
+proxy() unless (@ARGV);
+
+my $proxy = fork();
+die "Unable to fork: $!\n" unless (defined($proxy));
+proxy() if ($proxy==0);
+sleep(0.2);
+
+my ($program, @args) = @ARGV;
+$program = File::Spec->rel2abs($program) if ($program =~ m{/});
+push(@args, '-h', '127.0.0.1', '-p', $port);
+my $dir = tempdir(CLEANUP => 1);
+my $socket = "$dir/control";
+my ($failed, $total, $done) = (0, 0, 0);
+my $status = 0;
+
+sub start {
+	my @extra = @_;
+	my $pid = fork();
+	die "Unable to fork: $!\n" unless (defined($pid));
+	if ($pid==0) {
+		chdir($dir);
+		open(STDOUT, '>', '/dev/null') unless ($opts{v});
+		exec($program, @args, @extra) or die "Unable to run $program: $!\n";
+	}
+	return $pid;
+}
+
+sub command {
+	my ($cmd) = @_;
+	my $s = IO::Socket::UNIX->new(Type => SOCK_STREAM, Peer => $socket) or return undef;
+	print $s "$cmd\n";
+	local $/;
+	my $reply = <$s>;
+	close($s);
+	return $reply;
+}
+
+# Checks, updates and failures so far and the time of the last published refresh
+sub stats {
+	my $reply = command("stats");
+	return () unless (defined($reply) && $reply =~ /(\d+) checks, (\d+) updates, (\d+) failures, last refresh (\d+) ms/);
+	return ($1, $2, $3, $4);
+}
+
+printf("%8s %10s  %s\n", "cycle", "ms", "result");
+if (!$opts{d}) {
+	for (my $c = 1; $c<=$cycles; $c++) {
+		my $begin = time();
+		my $pid = start();
+		waitpid($pid, 0);
+		my $ms = (time()-$begin)*1000;
+		my $result = $? & 127 ? "killed by signal ".($? & 127) : $? ? "exit ".($? >> 8) : "ok";
+		printf("%8d %10d  %s\n", $c, $ms, $result);
+		if ($?) {
+			$failed++;
+		} else {
+			$total += $ms;
+			$done++;
+		}
+	}
+} else {
+	my $pid = start('-d', '-f', '-u', '86400', '-c', $socket);
+	my @last;
+
+	# Wait for the check after the given number, undef if ldap2dns exits
+	my $wait = sub {
+		my ($after) = @_;
+		for (my $i = 0; ; $i++) {
+			my @s = stats();
+			return @s if (@s && $s[0]>$after);
+			return () if (waitpid($pid, WNOHANG)!=0);
+			sleep($i<100 ? 0.005 : 0.05);
+		}
+	};
+	@last = $wait->(0);
+	for (my $c = 1; @last && $c<=$cycles; $c++) {
+		my $begin = time();
+		if (@zones) {
+			command("refresh zone $_") foreach (@zones);
+		} else {
+			command("refresh");
+		}
+		my @s = $wait->($last[0]);
+		last unless (@s);
+		my $result = $s[2]>$last[2] ? "failed" : $s[1]>$last[1] ? "ok" : "unchanged";
+		printf("%8d %10d  %s\n", $c, $result eq "ok" ? $s[3] : (time()-$begin)*1000, $result);
+		if ($result eq "failed") {
+			$failed++;
+		} else {
+			$total += $result eq "ok" ? $s[3] : (time()-$begin)*1000;
+			$done++;
+		}
+		@last = @s;
+	}
+	if (waitpid($pid, WNOHANG)!=0) {
+		print "ldap2dns exited\n";
+		$status = 1;
+	} else {
+		kill('TERM', $pid);
+		waitpid($pid, 0);
+	}
+}
+printf("%d failed, %d ok, %d ms on average\n", $failed, $done, $done ? $total/$done : 0);
+kill('TERM', $proxy);
+waitpid($proxy, 0);
+exit($status);
@@ -0,0 +1,97 @@
+#!/usr/bin/perl
+# Measure how much ldap2dns compiles location codes down
+# $Id$
+#
+# usage: locbench.pl -g [-l locations] [-n members] [-6 percent] [-b basedn] > loc.ldif
+#        locbench.pl loc.ldif data
+#
+# With -g, an LDIF file of DNSloccodes entries with random, overlapping IPv4
+# and IPv6 CIDR blocks is written, to be added to the directory before running
+# ldap2dns -o tinydns.  Given that LDIF file and the resulting data file, the
+# number of "%" lines (each one a lookup key in data.cdb) is reported per
+# location: as many as writing every member on its own line would need, when
+# the blocks are split into the whole octets or nibbles tinydns matches, and
+# as many as ldap2dns actually wrote.
+
+use strict;
+use Getopt::Std;
+
+my %opts;
+getopts('gl:n:6:b:h', \%opts);
+if ($opts{h} || (!$opts{g} && @ARGV!=2)) {
+	print "usage: $0 -g [-l locations] [-n members] [-6 percent] [-b basedn] > loc.ldif\n";
+	print "       $0 loc.ldif data\n";
+	exit(1);
+}
+
+if ($opts{g}) {
+	my $locations = $opts{l} || 10;
+	my $members = $opts{n} || 2000;
+	my $v6 = defined($opts{6}) ? $opts{6} : 20;
+	my $basedn = $opts{b} || "ou=DNS,dc=example,dc=com";
+
+	srand(42);
+	for (my $l = 0; $l<$locations; $l++) {
+		my $name = sprintf("%c%c", ord('a') + $l/26, ord('a') + $l%26);
+		print "dn: dnslocation=$name,$basedn\n";
+		print "objectClass: top\nobjectClass: dnsloccodes\n";
+		print "dnslocation: $name\n";
+		# every location is clustered below a few /12s, so its blocks overlap
+		my @v4base = map { (10 + $l*4 + $_) << 24 | int(rand(16)) << 20 } (0..3);
+		for (my $i = 0; $i<$members; $i++) {
+			if (rand(100)<$v6) {
+				my $len = 32 + int(rand(33));
+				printf("dnsipaddr: 2001:db8:%x:%x::/%d\n", $l, int(rand(65536)), $len);
+			} else {
+				my $len = 20 + int(rand(9));
+				my $ip = $v4base[rand(@v4base)] | int(rand(1 << 20));
+				$ip &= ~((1 << (32-$len)) - 1);
+				printf("dnsipaddr: %d.%d.%d.%d/%d\n", $ip >> 24, $ip >> 16 & 255, $ip >> 8 & 255, $ip & 255, $len);
+			}
+		}
+		print "\n";
+	}
+	exit(0);
+}
+
+# Lines needed for one member without aggregation
+sub naive {
+	my ($member) = @_;
+	my ($addr, $len) = split('/', $member);
+	my $step = $addr =~ /:/ ? 4 : 8;
+	if (!defined($len)) {
+		return 1 if ($step==8);
+		$len = 128;
+	}
+	my $aligned = int(($len + $step - 1) / $step) * $step;
+	return 1 << ($aligned - $len);
+}
+
+my (%members, %naive, %written, $location);
+open(my $ldif, '<', $ARGV[0]) or die "Unable to open $ARGV[0]: $!\n";
+while (<$ldif>) {
+	chomp;
+	$location = substr($1, 0, 2) if (/^dnslocation:\s*(\S+)/i);
+	if (/^dnsipaddr:\s*(\S*)/i && defined($location)) {
+		$members{$location}++;
+		$naive{$location} += naive($1);
+	}
+	undef($location) if (/^$/);
+}
+close($ldif);
+open(my $data, '<', $ARGV[1]) or die "Unable to open $ARGV[1]: $!\n";
+while (<$data>) {
+	$written{$1}++ if (/^%([^:]*):/);
+}
+close($data);
+
+my ($tm, $tn, $tw) = (0, 0, 0);
+printf("%-8s %10s %12s %10s %8s\n", "location", "members", "unaggregated", "written", "ratio");
+foreach my $l (sort(keys(%members))) {
+	printf("%-8s %10d %12d %10d %7.1f%%\n", $l, $members{$l}, $naive{$l}, $written{$l},
+		$naive{$l} ? 100*$written{$l}/$naive{$l} : 0);
+	$tm += $members{$l};
+	$tn += $naive{$l};
+	$tw += $written{$l};
+}
+printf("%-8s %10d %12d %10d %7.1f%%\n", "total", $tm, $tn, $tw, $tn ? 100*$tw/$tn : 0);
@@ -0,0 +1,102 @@
+#!/usr/bin/perl
+# Print a BIND raw format zone file (ldap2dns -o bind-raw) as master file text
+# $Id$
+#
+# usage: rawzone.pl [-s] file.raw ...
+#
+# Every record is printed on a line of its own as "owner ttl IN type rdata",
+# with -s sorted, so that the output of
+#
+#	named-compilezone -s full -f raw -F text -o - zone file.raw
+#	named-compilezone -s full -f text -F text -o - zone file.db
+#
+# can also be compared where BIND is not installed, by running this script on
+# the raw file and on one written by named-compilezone -F raw.
+
+use strict;
+use Getopt::Std;
+
+my %TYPES = (1 => 'A', 2 => 'NS', 5 => 'CNAME', 6 => 'SOA', 12 => 'PTR',
+	15 => 'MX', 16 => 'TXT', 28 => 'AAAA', 33 => 'SRV');
+
+my %opts;
+getopts('sh', \%opts);
+if ($opts{h} || !@ARGV) {
+	print "usage: $0 [-s] file.raw ...\n";
+	exit(1);
+}
+
+# Uncompressed wire format name at offset, returns the name and the offset after it
+sub name {
+	my ($data, $off) = @_;
+	my @labels;
+	while ((my $len = unpack("C", substr($data, $off, 1))) > 0) {
+		push(@labels, substr($data, $off+1, $len));
+		$off += $len+1;
+	}
+	return ((@labels ? join('.', @labels) : '') . '.', $off+1);
+}
+
+sub rdata {
+	my ($type, $rd) = @_;
+	my ($n, $m, $off);
+
+	return join('.', unpack("C4", $rd)) if ($type==1);
+	return join(':', map { sprintf("%x", $_) } unpack("n8", $rd)) if ($type==28);
+	return (name($rd, 0))[0] if ($type==2 || $type==5 || $type==12);
+	if ($type==15) {
+		return unpack("n", $rd) . " " . (name($rd, 2))[0];
+	}
+	if ($type==33) {
+		return join(" ", unpack("n3", $rd)) . " " . (name($rd, 6))[0];
+	}
+	if ($type==6) {
+		($n, $off) = name($rd, 0);
+		($m, $off) = name($rd, $off);
+		return "$n $m " . join(" ", unpack("N5", substr($rd, $off)));
+	}
+	if ($type==16) {
+		my @strings;
+		for ($off = 0; $off<length($rd); $off += $n+1) {
+			$n = unpack("C", substr($rd, $off, 1));
+			my $s = substr($rd, $off+1, $n);
+			$s =~ s/(["\\])/\\$1/g;
+			$s =~ s/([^\x20-\x7e])/sprintf("\\%03d", ord($1))/ge;
+			push(@strings, "\"$s\"");
+		}
+		return join(" ", @strings);
+	}
+	return "\\# " . length($rd) . " " . unpack("H*", $rd);
+}
+
+foreach my $file (@ARGV) {
+	my $data;
+	my @lines;
+
+	open(my $fh, '<', $file) or die "Unable to open $file: $!\n";
+	binmode($fh);
+	{ local $/; $data = <$fh>; }
+	close($fh);
+
+	my ($format, $version) = unpack("N2", $data);
+	die "$file: not a raw zone file\n" unless ($format==2);
+	die "$file: unknown raw format version $version\n" if ($version>1);
+	my $off = $version==0 ? 12 : 24;
+	while ($off<length($data)) {
+		my ($total, $class, $type, $covers, $ttl, $count) = unpack("N n3 N2", substr($data, $off, 18));
+		die "$file: truncated at offset $off\n" if ($total<18 || $off+$total>length($data));
+		my $p = $off+18;
+		my $len = unpack("n", substr($data, $p, 2));
+		my ($owner) = name(substr($data, $p+2, $len), 0);
+		$p += 2+$len;
+		for (my $i = 0; $i<$count; $i++) {
+			$len = unpack("n", substr($data, $p, 2));
+			my $typename = $TYPES{$type} || "TYPE$type";
+			push(@lines, "$owner\t$ttl\tIN\t$typename\t" . rdata($type, substr($data, $p+2, $len)));
+			$p += 2+$len;
+		}
+		$off += $total;
+	}
+	@lines = sort(@lines) if ($opts{s});
+	print "$_\n" foreach (@lines);
+}
@@ -0,0 +1,141 @@
+#!/usr/bin/perl
+# Measure how long ldap2dns -K takes to sign a zone, in full and again
+# $Id$
+#
+# usage: signbench.pl -g [-n records] [-z zone] [-b basedn] > sign.ldif
+#        signbench.pl [-v] [-c cycles] [-z zone,...] ldap2dns options...
+#
+# With -g, an LDIF file of one zone with A, AAAA, MX and TXT records on as
+# many names as -n asks for (default 100000) is written, to be added to the
+# directory.  Keys for the zone are made with BIND's tools, e.g.
+#
+#	dnssec-keygen -K keys -a ECDSAP256SHA256 -f KSK example.com
+#	dnssec-keygen -K keys -a ECDSAP256SHA256 example.com
+#
+# Otherwise ldap2dns is started as a foreground daemon with a control socket
+# in a temporary directory, which it writes the zone files into, with the
+# options given, e.g.
+#
+#	signbench.pl -c 5 ./ldap2dns -o bind -K /var/lib/keys \
+#		-H ldap://localhost -b ou=DNS,dc=example,dc=com
+#
+# The first refresh signs every RRset.  Each of the -c cycles (default 3)
+# then fetches the -z zones (default example.com) again as if their
+# DNSserial had changed; unchanged RRsets keep their signatures, so these
+# refreshes show what signing costs once the cache is warm.  Change a few
+# records meanwhile to see only those signed again.  The time of every
+# refresh and the signatures made and reused are printed.
+
+use strict;
+use Getopt::Std;
+use IO::Socket::UNIX;
+use File::Spec;
+use File::Temp qw(tempdir);
+use POSIX qw(:sys_wait_h);
+use Time::HiRes qw(sleep);
+
+my %opts;
+getopts('gvn:z:b:c:h', \%opts);
+if ($opts{h} || (!$opts{g} && !@ARGV)) {
+	print "usage: $0 -g [-n records] [-z zone] [-b basedn] > sign.ldif\n";
+	print "       $0 [-v] [-c cycles] [-z zone,...] ldap2dns options...\n";
+	exit(1);
+}
+my @zones = split(/,/, $opts{z} || "example.com");
+
+if ($opts{g}) {
+	my $records = $opts{n} || 100000;
+	my $basedn = $opts{b} || "ou=DNS,dc=example,dc=com";
+	my $zone = $zones[0];
+	my $zonedn = "cn=$zone,$basedn";
+
+	srand(42);
+	print "dn: $zonedn\nobjectClass: top\nobjectClass: dnszone\n";
+	print "cn: $zone\ndnszonename: $zone\ndnsttl: 3600\n";
+	print "dnsadminmailbox: hostmaster.$zone.\ndnszonemaster: ns1.$zone.\n";
+	print "dnsserial: 1\ndnsrefresh: 7200\ndnsretry: 900\ndnsexpire: 604800\ndnsminimum: 300\n\n";
+	print "dn: cn=ns,$zonedn\nobjectClass: dnsrrset\ncn: ns\ndnstype: ns\n";
+	print "dnscname: ns1\ndnsipaddr: 10.0.0.1\n\n";
+	for (my $i = 0; $i<$records; $i++) {
+		my $name = sprintf("h%06d", $i);
+		my $type = rand(100);
+		print "dn: cn=$name,$zonedn\nobjectClass: dnsrrset\ncn: $name\n";
+		if ($type<70) {
+			printf("dnstype: a\ndnsdomainname: %s\ndnsipaddr: 10.%d.%d.%d\n",
+				$name, $i >> 16 & 255, $i >> 8 & 255, $i & 255);
+		} elsif ($type<85) {
+			printf("dnstype: aaaa\ndnsdomainname: %s\ndnsipaddr: 2001:db8::%x:%x\n",
+				$name, $i >> 16, $i & 65535);
+		} elsif ($type<95) {
+			printf("dnstype: mx\ndnsdomainname: %s\ndnscname: mail%d.%s.\ndnspreference: 10\n",
+				$name, $i%16, $zone);
+		} else {
+			printf("dnstype: txt\ndnsdomainname: %s\ndnstxt: record %d\n", $name, $i);
+		}
+		print "\n";
+	}
+	exit(0);
+}
+
+my $cycles = defined($opts{c}) ? $opts{c} : 3;
+my ($program, @args) = @ARGV;
+$program = File::Spec->rel2abs($program) if ($program =~ m{/});
+
+my $dir = tempdir(CLEANUP => 1);
+my $socket = "$dir/control";
+my $pid = fork();
+die "Unable to fork: $!\n" unless (defined($pid));
+if ($pid==0) {
+	chdir($dir);
+	open(STDOUT, '>', '/dev/null') unless ($opts{v});
+	exec($program, @args, '-d', '-f', '-u', '86400', '-c', $socket) or die "Unable to run $program: $!\n";
+}
+
+sub stop {
+	kill('TERM', $pid);
+	waitpid($pid, 0);
+}
+
+sub command {
+	my ($cmd) = @_;
+	my $s = IO::Socket::UNIX->new(Type => SOCK_STREAM, Peer => $socket) or return undef;
+	print $s "$cmd\n";
+	local $/;
+	my $reply = <$s>;
+	close($s);
+	return $reply;
+}
+
+# Refreshes done, time of the last one and signatures made and reused so far
+sub stats {
+	my $reply = command("stats");
+	return () unless (defined($reply) && $reply =~ /(\d+) checks.*last refresh (\d+) ms/);
+	my ($checks, $ms) = ($1, $2);
+	die "ldap2dns is not signing, give it -o bind and -K\n" unless ($reply =~ /signatures: (\d+) made, (\d+) reused/);
+	return ($checks, $ms, $1, $2);
+}
+
+# Wait for the refresh after the given number, or die if ldap2dns exits
+sub wait_refresh {
+	my ($after) = @_;
+	for (my $i = 0; ; $i++) {
+		my @s = stats();
+		return @s if (@s && $s[0]>$after);
+		if (waitpid($pid, WNOHANG)!=0) {
+			print "ldap2dns exited\n";
+			exit(1);
+		}
+		sleep($i<10 ? 0.01 : 0.1);
+	}
+}
+
+my ($checks, $ms, $made, $reused) = wait_refresh(0);
+printf("%8s %10s %10s %10s\n", "refresh", "ms", "made", "reused");
+printf("%8s %10d %10d %10d\n", "full", $ms, $made, $reused);
+for (my $c = 1; $c<=$cycles; $c++) {
+	command("refresh zone $_") foreach (@zones);
+	my @s = wait_refresh($checks);
+	printf("%8d %10d %10d %10d\n", $c, $s[1], $s[2]-$made, $s[3]-$reused);
+	($checks, $ms, $made, $reused) = @s;
+}
+stop();
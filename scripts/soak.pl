@@ -0,0 +1,127 @@
+#!/usr/bin/perl
+# Run ldap2dnsd through many refresh cycles and fail if its memory grows
+# $Id$
+#
+# usage: soak.pl [-v] [-n cycles] [-w warmup] [-r kB] [-a bytes] [-z zone ...] ldap2dns options...
+#
+# ldap2dns is started as a foreground daemon with a control socket, with the
+# options given, which select the directory and the outputs, e.g.
+#
+#	soak.pl -n 2000 -z example.com ./ldap2dns -o tinydns \
+#		-H ldap://localhost -b ou=DNS,dc=example,dc=com
+#
+# Every cycle asks for a refresh through the control socket and waits for it
+# to finish.  The zones given with -z (a comma separated list) are fetched
+# again each time as if their DNSserial had changed, so they are decoded and
+# written anew.  After each cycle the "memory" line of the statistics is
+# read: the resident set size and the bytes malloc() has handed out.  The
+# environment set here makes the latter exact, MALLOC_ARENA_MAX=1 has it
+# cover all threads and a tcache_count of 0 keeps freed chunks from being
+# counted while they sit in the per-thread caches.
+#
+# The first warmup cycles let caches and pools reach their size.  After
+# them, neither value may rise above the highest one seen during the warmup,
+# by more than -r kB and -a bytes, or the test fails with exit status 1.
+# "make soak SOAKARGS='...'" runs this on the freshly built ldap2dns.
+
+use strict;
+use Getopt::Std;
+use IO::Socket::UNIX;
+use File::Temp qw(tempdir);
+use POSIX qw(:sys_wait_h);
+use Time::HiRes qw(sleep);
+
+my %opts;
+getopts('vn:w:r:a:z:h', \%opts);
+if ($opts{h} || !@ARGV) {
+	print "usage: $0 [-v] [-n cycles] [-w warmup] [-r kB] [-a bytes] [-z zone,...] ldap2dns options...\n";
+	exit(1);
+}
+my $cycles = $opts{n} || 1000;
+my $warmup = defined($opts{w}) ? $opts{w} : ($cycles>50 ? 50 : int($cycles/2));
+my $rssslack = defined($opts{r}) ? $opts{r} : 256;
+my $heapslack = defined($opts{a}) ? $opts{a} : 4096;
+my @zones = $opts{z} ? split(/,/, $opts{z}) : ();
+
+my $dir = tempdir(CLEANUP => 1);
+my $socket = "$dir/control";
+my $pid = fork();
+die "Unable to fork: $!\n" unless (defined($pid));
+if ($pid==0) {
+	$ENV{MALLOC_ARENA_MAX} = 1;
+	$ENV{GLIBC_TUNABLES} = join(':', grep { $_ } ($ENV{GLIBC_TUNABLES}, 'glibc.malloc.tcache_count=0'));
+	open(STDOUT, '>', '/dev/null') unless ($opts{v});
+	exec(@ARGV, '-d', '-f', '-u', '86400', '-c', $socket) or die "Unable to run $ARGV[0]: $!\n";
+}
+
+sub stop {
+	kill('TERM', $pid);
+	waitpid($pid, 0);
+}
+
+sub command {
+	my ($cmd) = @_;
+	my $s = IO::Socket::UNIX->new(Type => SOCK_STREAM, Peer => $socket) or return undef;
+	print $s "$cmd\n";
+	local $/;
+	my $reply = <$s>;
+	close($s);
+	return $reply;
+}
+
+# Number of refreshes done so far, and the memory line, from the statistics
+sub stats {
+	my $reply = command("stats");
+	return () unless (defined($reply));
+	my $checks = 0;
+	$checks += $1 while ($reply =~ /(\d+) checks/g);
+	return () unless ($reply =~ /memory: (-?\d+) kB resident, (-?\d+) bytes allocated/);
+	return ($checks, $1, $2);
+}
+
+# the initial refresh is done once the socket answers
+my ($checks, $rss, $heap);
+for (my $i = 0; !defined($checks); $i++) {
+	if ($i==600 || waitpid($pid, WNOHANG)!=0) {
+		stop();
+		die "ldap2dns did not come up\n";
+	}
+	sleep(0.1);
+	($checks, $rss, $heap) = stats();
+}
+die "ldap2dns does not report its heap, needs glibc 2.33 or later\n" if ($heap<0);
+
+my ($maxrss, $maxheap) = ($rss, $heap);
+my $failed = 0;
+printf("%8s %12s %16s\n", "cycle", "rss kB", "heap bytes");
+for (my $c = 1; $c<=$cycles; $c++) {
+	command("refresh zone $_") foreach (@zones);
+	command("refresh") unless (@zones);
+	my $done;
+	for (my $i = 0; ; $i++) {
+		my @s = stats();
+		if (@s && $s[0]>$checks) {
+			($done, $rss, $heap) = @s;
+			last;
+		}
+		if (waitpid($pid, WNOHANG)!=0) {
+			print "ldap2dns exited in cycle $c\n";
+			exit(1);
+		}
+		sleep($i<10 ? 0.01 : 0.1);
+	}
+	$checks = $done;
+	printf("%8d %12d %16d\n", $c, $rss, $heap) if ($opts{v} || $c%100==0 || $c==$warmup);
+	if ($c<=$warmup) {
+		$maxrss = $rss if ($rss>$maxrss);
+		$maxheap = $heap if ($heap>$maxheap);
+	} elsif ($rss>$maxrss+$rssslack || $heap>$maxheap+$heapslack) {
+		printf("cycle %d: %d kB resident, %d bytes allocated, at most %d kB and %d bytes after the warmup\n",
+			$c, $rss, $heap, $maxrss, $maxheap);
+		$failed = 1;
+		last;
+	}
+}
+stop();
+print $failed ? "FAILED\n" : "ok: $cycles cycles, at most $maxrss kB resident, $maxheap bytes allocated\n";
+exit($failed);